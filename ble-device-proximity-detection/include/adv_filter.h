@@ -0,0 +1,37 @@
+/*
+ * adv_filter.h
+ *
+ * Allocation-free advertisement filter working on the raw advertising
+ * data: RSSI first, then the Complete/Shortened Local Name AD structure
+ * is compared against the name prefix in place.
+ */
+
+#ifndef ADV_FILTER_H
+#define ADV_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADV_FILTER_NAME_PREFIX_SIZE 16
+
+#define ADV_TYPE_SHORTENED_LOCAL_NAME 0x08
+#define ADV_TYPE_COMPLETE_LOCAL_NAME 0x09
+
+typedef struct
+{
+    char name_prefix[ADV_FILTER_NAME_PREFIX_SIZE];
+    size_t name_prefix_length;
+    int rssi_threshold;
+} adv_filter_t;
+
+void adv_filter_init(adv_filter_t *filter, const char *name_prefix, const int rssi_threshold);
+
+bool adv_filter_match(
+    const adv_filter_t *filter,
+    const uint8_t *payload,
+    const size_t length,
+    const int rssi);
+
+const uint8_t *adv_find_name(const uint8_t *payload, const size_t length, size_t *name_length);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * allowlist.h
+ *
+ * Registered badges by Bluetooth address: a sorted array of packed
+ * addresses (presence_key()), looked up by binary search without
+ * allocating. Lookups come from the BLE stack's task while the
+ * aggregation stage changes the list, so there are two copies: a lookup
+ * pins the copy in effect, a change is made to the other one, which
+ * then takes effect. The next change waits for lookups still pinning
+ * the old copy, a few microseconds at most.
+ *
+ * While the list is empty the scan admits badges by name prefix
+ * (adv_filter.h); once a badge is registered only registered badges
+ * are admitted, whatever their name, above the RSSI floor.
+ *
+ * Kept in flash through hal_settings_write(): a header under
+ * ALLOWLIST_SETTINGS_KEY, magic, count and CRC-32 of the addresses,
+ * then pages of ALLOWLIST_PAGE_ENTRIES addresses, 6 bytes each, under
+ * "allowlist0", "allowlist1", ...
+ */
+
+#ifndef ALLOWLIST_H
+#define ALLOWLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+
+#ifndef ALLOWLIST_SETUP_CAPACITY
+#define ALLOWLIST_SETUP_CAPACITY 1024 // badges, 16 KiB for both copies
+#endif
+#define ALLOWLIST_CAPACITY ALLOWLIST_SETUP_CAPACITY
+#define ALLOWLIST_SETTINGS_KEY "allowlist"
+#define ALLOWLIST_PAGE_ENTRIES 256 // addresses per settings blob
+#define ALLOWLIST_MAGIC 0x31574c41 // "ALW1"
+
+static_assert(ALLOWLIST_PAGE_ENTRIES * HAL_BLE_ADDRESS_LENGTH <= HAL_SETTINGS_BLOB_MAX, "an allowlist page must fit a settings blob");
+
+typedef enum
+{
+    ALLOWLIST_EMPTY = 0, // nothing registered, the name prefix decides
+    ALLOWLIST_MEMBER,
+    ALLOWLIST_STRANGER
+} allowlist_lookup_t;
+
+typedef struct
+{
+    uint64_t key; // presence_key() of the address
+    bool add;     // or remove
+    bool applied; // set by allowlist_apply()
+} allowlist_change_t;
+
+typedef struct
+{
+    uint64_t keys[2][ALLOWLIST_CAPACITY]; // ascending
+    uint32_t counts[2];
+    std::atomic<uint32_t> active;     // the copy in effect
+    std::atomic<uint32_t> readers[2]; // lookups pinning each copy
+    uint32_t changes;                 // additions and removals since power up
+    uint32_t refused;                 // additions with the list full
+} allowlist_t;
+
+void allowlist_init(allowlist_t *list);
+allowlist_lookup_t allowlist_lookup(allowlist_t *list, const uint8_t *address);
+uint32_t allowlist_size(const allowlist_t *list);
+size_t allowlist_apply(allowlist_t *list, allowlist_change_t *changes, const size_t count);
+bool allowlist_load(allowlist_t *list);
+bool allowlist_save(const allowlist_t *list);
+bool allowlist_parse_address(const char *text, uint8_t *address);
+
+#endif
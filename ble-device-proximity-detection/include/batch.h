@@ -0,0 +1,36 @@
+/*
+ * batch.h
+ *
+ * Flush policy for records collected over several scan cycles: a batch
+ * is due once it reaches a byte budget, a record count or its oldest
+ * record a maximum age, whichever comes first. The age bounds the
+ * latency added by batching.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t max_bytes;   // serialized records
+    uint32_t max_records;
+    uint32_t max_age;     // ms the oldest record may wait
+} batch_policy_t;
+
+typedef struct
+{
+    uint32_t records;
+    uint32_t bytes;
+    uint32_t first_time;  // hal_millis() of the oldest record
+} batch_t;
+
+void batch_clear(batch_t *batch);
+bool batch_fits(const batch_t *batch, const batch_policy_t *policy, const uint32_t bytes);
+void batch_add(batch_t *batch, const uint32_t bytes, const uint32_t now);
+void batch_set(batch_t *batch, const uint32_t records, const uint32_t bytes, const uint32_t now);
+bool batch_due(const batch_t *batch, const batch_policy_t *policy, const uint32_t now);
+
+#endif
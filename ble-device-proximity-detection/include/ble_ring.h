@@ -0,0 +1,44 @@
+/*
+ * ble_ring.h
+ *
+ * Single-producer/single-consumer lock-free ring buffer for compact scan
+ * records. The producer is the BLE stack's result callback, the consumer
+ * is loop(). Neither side ever blocks: a full ring drops the new record
+ * and counts it.
+ */
+
+#ifndef BLE_RING_H
+#define BLE_RING_H
+
+#include <stdint.h>
+#include <atomic>
+#include "hal.h"
+
+#define BLE_RING_CAPACITY 256 // records, must be a power of two
+
+typedef struct
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    int8_t rssi;
+    uint8_t reserved;
+    uint32_t time; // hal_millis() at reception
+} ble_scan_record_t;
+
+typedef struct
+{
+    ble_scan_record_t records[BLE_RING_CAPACITY];
+    std::atomic<uint32_t> head; // next slot to write, producer only
+    std::atomic<uint32_t> tail; // next slot to read, consumer only
+    std::atomic<uint32_t> pushed;
+    std::atomic<uint32_t> dropped;   // records lost because the ring was full
+    std::atomic<uint32_t> overflows; // times the ring ran full
+    std::atomic<uint32_t> high_water;
+    bool full; // producer only
+} ble_ring_t;
+
+void ble_ring_init(ble_ring_t *ring);
+bool ble_ring_push(ble_ring_t *ring, const ble_scan_record_t *record);
+bool ble_ring_pop(ble_ring_t *ring, ble_scan_record_t *record);
+uint32_t ble_ring_size(const ble_ring_t *ring);
+
+#endif
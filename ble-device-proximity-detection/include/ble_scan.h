@@ -5,28 +5,62 @@
 #ifndef BLE_SCAN_H
 #define BLE_SCAN_H
 
-#include <BLEScan.h>
-#include <ArduinoJson.h>
+#include <stdint.h>
+#include "allowlist.h"
+#include "presence.h"
 
 #define BLE_SCAN_SETUP_ACTIVE_SCAN true // active scan uses more power, but get results faster
 #define BLE_SCAN_SETUP_INTERVAL 100     // interval time to scann (ms)
 #define BLE_SCAN_SETUP_WINDOW 99        // window to activly scan (ms) - less or equal interval value
 #define BLE_SCAN_SETUP_DURATION 1       // seconds
+#ifndef BLE_SCAN_SETUP_CONTINUOUS
+#define BLE_SCAN_SETUP_CONTINUOUS true  // scan in the background instead of blocking for the duration
+#endif
 
-BLEScan *ble_scan_init(
+#define BLE_SCAN_ADDRESS_STRING_SIZE 18 // "aa:bb:cc:dd:ee:ff" + NUL
+
+void ble_scan_format_address(const uint8_t *address, char *id);
+
+void ble_scan_init(
     const int detect_ble_scan_interval,
     const int detect_ble_scan_window);
 
 void ble_scan_configure(
-    BLEScan *pBLEScan,
     const int detect_ble_scan_interval,
-    const int detect_ble_scan_window);
+    const int detect_ble_scan_window,
+    const bool active_scan);
+
+typedef struct
+{
+    uint32_t received; // records queued by the scan callback
+    uint32_t dropped;  // records lost because the ring buffer was full
+    uint32_t overflows;
+    uint32_t high_water;
+    uint32_t queued;
+    uint32_t drained;
+    uint32_t wait_max;   // ms a record waited in the ring, reception to drain
+    uint32_t wait_total; // ms, over the records drained
+} ble_scan_statistics_t;
+
+// The allowlist, if not NULL, is looked up from the BLE stack's task,
+// see allowlist.h. Starts with an empty ring: call with the scan stopped,
+// ble_scan_stop() returns once the BLE stack's task is done with it.
+void ble_scan_start(
+    const char *detect_name_prefix,
+    const int detect_rssi_threshold,
+    allowlist_t *allowlist);
+
+void ble_scan_stop();
+
+int ble_scan_drain(presence_table_t *presence);
+
+void ble_scan_get_statistics(ble_scan_statistics_t *statistics);
 
-void ble_scan(
-    BLEScan *pBLEScan,
+int ble_scan(
     const int detect_ble_scan_duration,
-    const String detect_name_prefix,
+    const char *detect_name_prefix,
     const int detect_rssi_threshold,
-    JsonArray *jsonArray);
+    allowlist_t *allowlist,
+    presence_table_t *presence);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,18 @@
+/*
+ * cbor.h
+ *
+ * CBOR (RFC 8949) serialization of ArduinoJson documents, which can
+ * only do JSON and MessagePack themselves. Definite lengths, shortest
+ * integer encodings, floats as single precision like serializeMsgPack.
+ */
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+size_t cbor_serialize(JsonVariantConst source, uint8_t *buffer, const size_t size);
+
+#endif
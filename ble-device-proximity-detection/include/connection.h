@@ -0,0 +1,71 @@
+/*
+ * connection.h
+ *
+ * Connection manager for Wi-Fi and AWS IoT Core, stepped from loop()
+ * without blocking: every step makes at most one connection attempt and
+ * returns. Failed attempts back off exponentially with jitter per stage,
+ * so a fleet of gateways losing the same access point does not retry in
+ * lockstep when it comes back.
+ *
+ * Stepped by the network task only; the state is an atomic, other tasks
+ * read it with connection_state() and connection_online().
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define CONNECTION_BACKOFF_BASE 1000          // ms, first retry after a failure or a lost link
+#define CONNECTION_BACKOFF_MAX 120000         // ms
+#define CONNECTION_REFUSED_BACKOFF_BASE 10000 // ms, a broker refusing the client rarely changes its mind quickly
+#define CONNECTION_WIFI_JOIN_TIMEOUT 15000    // ms
+#define CONNECTION_TLS_SPREAD 5000            // ms, random wait before the first TLS attempt after joining
+
+typedef enum
+{
+    CONNECTION_WIFI_DOWN,    // waiting to join the network
+    CONNECTION_WIFI_JOINING, // joining, waiting for an address
+    CONNECTION_TLS,          // on the network, no TLS session with the broker
+    CONNECTION_MQTT,         // TLS works, the broker refused the MQTT session
+    CONNECTION_ONLINE
+} connection_state_t;
+
+typedef struct
+{
+    const char *ssid;
+    const char *password;
+    const char *host;
+    uint16_t port;
+    void (*on_wifi)();    // joined the network, before the first TLS attempt
+    void (*on_connect)(); // MQTT session established, subscribe here
+} connection_config_t;
+
+typedef struct
+{
+    connection_state_t state; // as connection_state() when taken
+    uint32_t since;        // hal_millis() the state was entered
+    uint32_t next_attempt; // hal_millis() of the next attempt while backing off
+    uint32_t backoff;      // ms, the current wait
+    uint32_t attempts;     // failed attempts since the last stage that succeeded
+    uint32_t outages;      // times the link was lost
+    uint32_t connects;     // MQTT sessions established
+    uint32_t failures_wifi;
+    uint32_t failures_tls;
+    uint32_t failures_mqtt;
+    uint32_t handshakes;         // TLS handshakes completed
+    uint32_t handshake_ms_total; // TCP connection and handshake
+    uint32_t handshake_ms_max;
+    hal_tls_handshake_t handshake; // the last attempt
+} connection_statistics_t;
+
+void connection_setup(const connection_config_t *config, const uint32_t now);
+connection_state_t connection_step(const uint32_t now);
+connection_state_t connection_state();
+bool connection_online();
+const char *connection_state_name(const connection_state_t state);
+void connection_get_statistics(connection_statistics_t *statistics);
+uint32_t connection_backoff(const uint32_t attempts, const uint32_t base);
+
+#endif
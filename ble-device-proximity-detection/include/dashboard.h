@@ -0,0 +1,111 @@
+/*
+ * dashboard.h
+ *
+ * Occupancy dashboard on the LCD: the badges in range with their zone
+ * and their last use of the dispenser, the link to AWS IoT Core and the
+ * messages waiting for it. The aggregation stage keeps a small display
+ * model, changed only when something shown changes (the time since a
+ * dispenser use in whole minutes), and hands it over to the display
+ * stage, which redraws only the cells that differ from what is on the
+ * screen:
+ *
+ *   +-------------------+-------------------+
+ *   | 3 badges          | online            |
+ *   +------------+------+-----+-------------+
+ *   | queue 0    | unack 1    | sd 0        |
+ *   +------------+-------+----+-------------+
+ *   | 33:0a:91   | near  | rub now          |
+ *   | 7e:12:c4   | room  | rub 4m           |
+ *   | ...        |       |                  |
+ *   +------------+-------+------------------+
+ *
+ * A badge keeps its row while in range, and for DASHBOARD_AWAY_KEEP ms
+ * after it went away, so rows do not move about.
+ */
+
+#ifndef DASHBOARD_H
+#define DASHBOARD_H
+
+#include <stdint.h>
+#include "hal.h"
+#include "events.h"
+
+#ifndef DASHBOARD_SETUP_ENABLED
+#define DASHBOARD_SETUP_ENABLED true
+#endif
+#define DASHBOARD_ROWS 8              // badges shown
+#define DASHBOARD_AWAY_KEEP 60000     // ms a badge that went away keeps its row
+#define DASHBOARD_FRAME_INTERVAL 200  // ms between frames at most
+#define DASHBOARD_CPU_WINDOW 10000    // ms over which the display CPU share is measured
+#define DASHBOARD_NO_RUB 0xffff       // rub_minutes of a badge not seen at the dispenser
+#define DASHBOARD_RUB_MINUTES_MAX 999 // shown as "rub 999m" from there on
+#define DASHBOARD_COUNT_MAX 99        // status counts above are shown as this
+
+#define DASHBOARD_LINE_HEIGHT 24 // pixels
+#define DASHBOARD_STATUS_LINES 2
+
+// RGB565
+#define DASHBOARD_BLACK 0x0000
+#define DASHBOARD_WHITE 0xffff
+#define DASHBOARD_GREY 0x7bef
+#define DASHBOARD_GREEN 0x07e0
+#define DASHBOARD_YELLOW 0xffe0
+#define DASHBOARD_RED 0xf800
+#define DASHBOARD_NAVY 0x000f
+
+typedef struct
+{
+    uint64_t key;         // packed address, 0 for an empty row
+    uint8_t zone;         // proximity_zone_t
+    uint16_t rub_minutes; // since the last dispenser use, DASHBOARD_NO_RUB before one
+} dashboard_row_t;
+
+typedef struct
+{
+    uint16_t badges;         // not away
+    uint8_t link;            // connection_state_t
+    uint16_t queued;         // in the outbox
+    uint16_t unacknowledged; // QoS 1 publishes in flight
+    uint16_t stored;         // in the store-and-forward log
+} dashboard_status_t;
+
+// What the screen shows, nothing more.
+typedef struct
+{
+    uint32_t version; // changes with every change of the rest
+    dashboard_status_t status;
+    dashboard_row_t rows[DASHBOARD_ROWS];
+} dashboard_model_t;
+
+// The model and what it is made from, aggregation stage.
+typedef struct
+{
+    dashboard_model_t model;
+    bool rubbed[DASHBOARD_ROWS];
+    uint32_t rub_time[DASHBOARD_ROWS];   // hal_millis() of the last dispenser use
+    uint32_t away_since[DASHBOARD_ROWS]; // hal_millis()
+} dashboard_t;
+
+// What is on the screen, display stage.
+typedef struct
+{
+    dashboard_model_t shown;
+    bool valid; // false until the whole screen was drawn once
+    uint32_t frames;
+    uint32_t cells; // redrawn
+    uint32_t frame_us_max;
+    uint32_t frame_us_total;
+    uint32_t busy_us; // drawing, in the current CPU window
+    uint32_t window_start;
+    uint32_t cpu_permille; // of the last complete window
+} dashboard_view_t;
+
+void dashboard_init(dashboard_t *dashboard);
+void dashboard_event(dashboard_t *dashboard, const event_t *event);
+void dashboard_update(dashboard_t *dashboard, const dashboard_status_t *status, const uint32_t now);
+
+void dashboard_view_init(dashboard_view_t *view, const uint32_t now);
+void dashboard_invalidate(dashboard_view_t *view);
+int dashboard_render(dashboard_view_t *view, const dashboard_model_t *model);
+
+#endif
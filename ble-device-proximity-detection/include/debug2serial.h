@@ -1,10 +1,32 @@
 /*
  * debug2serial.h
+ *
+ * DEBUG_SERIAL_*() print text right away, when DEBUG is defined; used
+ * while setting up. DEBUG_TRACE() records a message of trace_formats.h
+ * in the binary trace log (trace.h) for the serial port, whether DEBUG
+ * is defined or not: it takes well under a microsecond and never waits
+ * for the port. Messages above TRACE_LEVEL are compiled out.
 */
 
 #ifndef DEBUG2SERIAL_H
 #define DEBUG2SERIAL_H
 
+#include "trace.h"
+
+#define DEBUG_TRACE(name, ...)                        \
+    do                                                \
+    {                                                 \
+        if (TRACE_LEVEL_OF_##name <= TRACE_LEVEL)     \
+        {                                             \
+            trace_write(TRACE_##name, ##__VA_ARGS__); \
+        }                                             \
+    } while (0)
+
+// There is no serial port on the host, the native build stays quiet.
+#if defined(DEBUG) && defined(HAL_NATIVE)
+    #undef DEBUG
+#endif
+
 #ifdef DEBUG
     #ifdef DEBUG_VERBOSE
         #define DEBUG_SERIAL_INIT(baud) \
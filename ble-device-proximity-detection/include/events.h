@@ -0,0 +1,63 @@
+/*
+ * events.h
+ *
+ * Hand hygiene event state machine on top of the proximity zones. Per
+ * badge it turns zone estimates into discrete, timestamped events:
+ * a badge entered a zone, dwelt at the dispenser (the near zone) for
+ * EVENTS_DWELL_TIME ms, or left a zone.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include "hal.h"
+#include "proximity.h"
+#include "presence.h"
+
+#define EVENTS_DWELL_TIME 5000 // ms in the near zone that count as using the dispenser
+
+// Events are published in batches, see batch.h. Each limit can be set
+// from the build flags.
+#ifndef EVENTS_SETUP_BATCH_MAX_RECORDS
+#define EVENTS_SETUP_BATCH_MAX_RECORDS 16
+#endif
+#ifndef EVENTS_SETUP_BATCH_MAX_BYTES
+#define EVENTS_SETUP_BATCH_MAX_BYTES 1024
+#endif
+#ifndef EVENTS_SETUP_BATCH_MAX_AGE
+#define EVENTS_SETUP_BATCH_MAX_AGE 5000 // ms
+#endif
+#define EVENTS_BATCH_MAX_RECORDS EVENTS_SETUP_BATCH_MAX_RECORDS
+#define EVENTS_BATCH_MAX_BYTES EVENTS_SETUP_BATCH_MAX_BYTES
+#define EVENTS_BATCH_MAX_AGE EVENTS_SETUP_BATCH_MAX_AGE
+
+typedef enum
+{
+    EVENT_ENTER = 0,
+    EVENT_DWELL,
+    EVENT_LEAVE
+} event_type_t;
+
+typedef struct
+{
+    event_type_t type;
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    proximity_zone_t zone; // zone entered, dwelt in or left
+    uint32_t time;         // hal_millis()
+    uint32_t duration;     // ms spent in the zone, dwell and leave only
+} event_t;
+
+typedef void (*event_callback_t)(const event_t *event, void *context);
+
+bool events_update(
+    presence_entry_t *entry,
+    const proximity_zone_t zone,
+    const uint32_t now,
+    const uint32_t dwell_time,
+    event_callback_t callback,
+    void *context);
+
+const char *events_type_name(const event_type_t type);
+
+#endif
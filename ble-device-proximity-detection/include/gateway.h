@@ -0,0 +1,110 @@
+/*
+ * gateway.h
+ *
+ * Board independent part of the application: scans for BLE devices in
+ * close proximity, publishes hand hygiene events for them and reports
+ * their zones via the AWS IoT device shadow.
+ */
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dashboard.h"
+
+// JSON messages: Hand hygiene events, batched on "hhcm/{thing}/events":
+// {"seq": <sequence>, "events": [[<type>, <id>, <zone>, <epoch ms>, <duration ms>], ...]}
+// The time is null for events before NTP has answered (wallclock.h).
+// An event takes at most ["enter","aa:bb:cc:dd:ee:ff","near",9999999999999,4294967295], bytes.
+#define EVENT_RECORD_SIZE \
+  (JSON_ARRAY_SIZE(1) + JSON_ARRAY_SIZE(5) + JSON_STRING_SIZE(BLE_SCAN_ADDRESS_STRING_SIZE - 1))
+#define EVENT_RECORD_BYTES 64
+#define EVENT_DOCUMENT_SIZE (JSON_OBJECT_SIZE(2) + EVENTS_BATCH_MAX_RECORDS * EVENT_RECORD_SIZE)
+#define GATEWAY_EVENT_TOPIC "hhcm/%s/events"
+
+// Telemetry on "hhcm/{thing}/telemetry/{format}" (telemetry.h), metrics
+// on "hhcm/{thing}/metrics" (metrics.h). Events and telemetry go out
+// with QoS 1 and are kept until the broker acknowledges them
+// (inflight.h), shadow updates and metrics with QoS 0.
+
+#define GATEWAY_THING_NAME_SIZE 32
+#define GATEWAY_NAME_PREFIX_SIZE 16
+#define GATEWAY_MQTT_TOPIC_SIZE 96
+
+// The gateway is a pipeline: the BLE stack queues advertisements in the
+// scan ring buffer, gateway_loop() aggregates them and queues messages
+// in the outbox, gateway_network_loop() publishes them. Each stage can
+// run in a task of its own, as can the display stage, which takes the
+// dashboard model with gateway_take_dashboard() and draws it, and the
+// feedback stage, which takes reminders with gateway_take_reminder()
+// and plays their cue.
+typedef struct
+{
+    // Aggregation stage
+    uint32_t aggregate_runs;
+    uint32_t aggregate_us_max;
+    uint32_t aggregate_us_total;
+    uint32_t events_dropped; // fit neither their batch nor the outbox
+    uint32_t telemetry_dropped;
+    // Outbox between the stages
+    uint32_t outbox_depth;
+    uint32_t outbox_high_water;
+    uint32_t outbox_queued;
+    uint32_t outbox_refused; // offered while full
+    // Network stage
+    uint32_t taken;       // messages taken from the outbox
+    uint32_t wait_ms_max; // queued to taken
+    uint32_t wait_ms_total;
+    uint32_t sent; // published live
+    uint32_t publish_us_max;
+    uint32_t publish_us_total;
+    uint32_t stored; // to the store-and-forward log
+    uint32_t replayed;
+    // QoS 1 publishes, network stage
+    uint32_t inflight; // not acknowledged yet
+    uint32_t inflight_high_water;
+    uint32_t acknowledged;
+    uint32_t retransmitted;
+    uint32_t unacknowledged; // given up after INFLIGHT_ATTEMPTS, back to the log
+    uint32_t ack_ms_max;     // first attempt to PUBACK
+    uint32_t ack_ms_total;
+    // Scan schedule, aggregation stage
+    uint32_t scan_mode; // scan_mode_t
+    uint32_t scan_mode_switches;
+    uint64_t scan_ms;        // radio time spent scanning
+    uint64_t scan_active_ms; // of it, scanning actively
+    // Detect settings from the shadow's desired state
+    uint32_t config_received; // delta and get/accepted messages with detect settings
+    uint32_t config_rejected; // settings out of range, or messages that did not parse
+    uint32_t config_applied;  // by the aggregation stage
+    // Allowlist changes from the shadow's desired state
+    uint32_t allowlist_received; // delta and get/accepted messages with allowlist changes
+    uint32_t allowlist_rejected; // members other than an address set to true or false
+    uint32_t allowlist_applied;  // changes that made a difference, aggregation stage
+    uint32_t allowlist_size;     // registered badges
+    // Shadow updates
+    uint32_t shadow_accepted;   // zone counts and detect settings, aggregation stage
+    uint32_t shadow_unanswered; // given up after SHADOW_ANSWER_TIMEOUT, aggregation stage
+    uint32_t shadow_rejected;   // zone counts and allowlist reports, network stage
+    // Clock for timestamps, aggregation stage
+    bool clock_synced;
+    uint32_t clock_syncs;
+    uint32_t clock_steps;
+    int32_t clock_error_ms; // NTP minus the clock at the last sync
+    int32_t clock_drift_ppm;
+    // Compliance reminders, aggregation stage
+    uint32_t reminders;
+    uint32_t reminders_merged; // raised before the feedback stage took the one before
+} gateway_statistics_t;
+
+void gateway_setup(const char *thing);
+void gateway_on_connect();
+void gateway_loop();
+void gateway_network_loop();
+void gateway_message_received(const char *topic, size_t length);
+void gateway_get_statistics(gateway_statistics_t *statistics);
+bool gateway_take_dashboard(dashboard_model_t *model);
+bool gateway_take_reminder(uint32_t *time);
+
+#endif
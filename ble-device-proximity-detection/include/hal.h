@@ -0,0 +1,186 @@
+/*
+ * hal.h
+ *
+ * Thin hardware abstraction layer between the gateway logic and the
+ * board. The Core2 implementation is in hal_esp32.cpp, the Linux
+ * stand-ins used by the native benchmark are in native/hal_native.cpp.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HAL_BLE_ADDRESS_LENGTH 6
+#define HAL_BLE_PAYLOAD_MAX_LENGTH 62 // advertising data + scan response
+
+#define HAL_DISPLAY_WIDTH 320 // pixels, the Core2's LCD in landscape
+#define HAL_DISPLAY_HEIGHT 240
+#define HAL_DISPLAY_CHAR_WIDTH 12 // pixels, the built-in font at size 2
+#define HAL_DISPLAY_CHAR_HEIGHT 16
+
+#define HAL_LEDS 10 // the side bars, five a side
+#define HAL_AUDIO_SAMPLE_RATE 16000 // Hz, 16 bit mono
+#define HAL_AUDIO_DMA_BUFFERS 2
+#define HAL_AUDIO_DMA_SAMPLES 256 // per buffer, 16 ms
+
+// A single advertisement as reported by the BLE stack.
+typedef struct
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH]; // most significant byte first
+    int rssi;
+    const uint8_t *payload; // advertising data followed by the scan response
+    size_t payload_length;
+} hal_ble_advertisement_t;
+
+typedef void (*hal_ble_advertisement_callback_t)(
+    const hal_ble_advertisement_t *advertisement,
+    void *context);
+
+typedef void (*hal_mqtt_message_callback_t)(
+    const char *topic,
+    size_t length);
+
+typedef void (*hal_mqtt_ack_callback_t)(
+    const uint16_t packet_id);
+
+typedef enum
+{
+    HAL_MQTT_CONNECTED,
+    HAL_MQTT_TRANSPORT_FAILED, // no TCP connection or TLS handshake
+    HAL_MQTT_REFUSED           // the broker refused or did not answer CONNECT
+} hal_mqtt_connect_result_t;
+
+// The TLS connection of the last hal_mqtt_connect(). BearSSLClient
+// connects and does the handshake in one call, timed as a whole, and
+// starts every handshake over: a full one, with the signature on the
+// secure element.
+typedef struct
+{
+    bool done;   // the TCP connection and the handshake succeeded
+    uint32_t us; // TCP connection and handshake
+} hal_tls_handshake_t;
+
+typedef void (*hal_task_function_t)(void *context);
+
+typedef void (*hal_storage_list_callback_t)(
+    const char *name,
+    void *context);
+
+// Clock
+uint32_t hal_millis();
+uint32_t hal_micros(); // for measuring durations
+bool hal_ntp_time(uint64_t *epoch_ms); // the system time SNTP sets, false until it has
+bool hal_time_synced(); // without waiting for the first NTP response
+void hal_delay(uint32_t ms);
+uint32_t hal_random(const uint32_t bound); // 0 to bound - 1
+
+// Tasks: runs the function, which does not return, in a task of its
+// own pinned to a core.
+bool hal_task_start(
+    const char *name,
+    hal_task_function_t function,
+    void *context,
+    const uint32_t stack_size,
+    const unsigned priority,
+    const int core);
+
+// Memory: free heap in bytes, and the largest block of it a single
+// allocation can get, which fragmentation shrinks.
+void hal_heap(uint32_t *free, uint32_t *largest_block);
+
+// Secure element
+void hal_se_initialize();
+void hal_se_get_id(char *id, size_t size);
+
+// WiFi: hal_wifi_begin() starts joining the network and returns right
+// away, hal_wifi_connected() tells when the station got its address.
+void hal_wifi_begin(const char *ssid, const char *password);
+void hal_wifi_disconnect();
+bool hal_wifi_connected();
+
+// BLE: scan interval and window in ms. New parameters apply to a
+// continuous scan right away, it is restarted with them.
+void hal_ble_init(const bool active_scan);
+void hal_ble_configure(const int interval, const int window, const bool active_scan);
+int hal_ble_scan(
+    const int duration,
+    hal_ble_advertisement_callback_t callback,
+    void *context);
+// Continuous scanning: the callback runs in the context of the BLE stack
+// for every advertisement received, repeats of the same device included.
+// hal_ble_scan_stop() returns once no callback runs any more. Maintain
+// from the task that started the scan.
+void hal_ble_scan_start(hal_ble_advertisement_callback_t callback, void *context);
+void hal_ble_scan_stop();
+void hal_ble_scan_maintain();
+
+// Storage: files on the SD card, paths are absolute. Files are opened
+// per call, which is fine for the store-and-forward log it serves.
+bool hal_storage_init(const char *directory);
+bool hal_storage_append(const char *path, const uint8_t *data, const size_t length);
+size_t hal_storage_read(const char *path, const uint32_t offset, uint8_t *data, const size_t length);
+long hal_storage_size(const char *path); // -1 if there is no such file
+bool hal_storage_remove(const char *path);
+void hal_storage_list(const char *directory, hal_storage_list_callback_t callback, void *context);
+uint64_t hal_storage_free();
+
+// Display: the LCD, colors in RGB565. A cell is a rectangle filled with
+// its background and a line of text in it, clipped to the cell. The LCD
+// shares the SPI bus with the SD card; a cell is written in one go, the
+// storage calls wait for it and it waits for them.
+void hal_display_init();
+void hal_display_cell(
+    const int x,
+    const int y,
+    const int width,
+    const int height,
+    const char *text,
+    const uint16_t foreground,
+    const uint16_t background);
+
+// LEDs: the side bars, colors 0xRRGGBB, shown all at once.
+void hal_leds_init();
+void hal_leds_show(const uint32_t *colors);
+
+// Speaker: samples go out through I2S from HAL_AUDIO_DMA_BUFFERS DMA
+// buffers in turn, the speaker hears silence while none is filled.
+// hal_audio_write() takes what fits into the free buffer without
+// waiting, returns the number of samples it took; they are heard once
+// the buffer playing now is through. Without a speaker it takes all.
+bool hal_audio_init();
+size_t hal_audio_write(const int16_t *samples, const size_t count);
+
+// Settings: small blobs kept in flash (NVS on the Core2) across
+// restarts, written whole. Keys take at most 15 characters, a blob at
+// most HAL_SETTINGS_BLOB_MAX bytes.
+#define HAL_SETTINGS_BLOB_MAX 1984
+size_t hal_settings_read(const char *key, uint8_t *data, const size_t size); // 0 if there is no such blob or it is larger
+bool hal_settings_write(const char *key, const uint8_t *data, const size_t length);
+
+// MQTT
+void hal_mqtt_init(
+    const char *client_id,
+    const char *certificate,
+    hal_mqtt_message_callback_t callback);
+// Blocks for the TLS handshake and the CONNECT round trip.
+hal_mqtt_connect_result_t hal_mqtt_connect(const char *host, const uint16_t port);
+void hal_tls_get_handshake(hal_tls_handshake_t *handshake);
+bool hal_mqtt_connected();
+void hal_mqtt_poll();
+bool hal_mqtt_subscribe(const char *topic);
+// Publishes a serialized message, as the outbox, the in-flight window
+// and the log hold them.
+bool hal_mqtt_publish(const char *topic, const uint8_t *payload, const size_t length);
+// QoS 1: a publish the broker acknowledges. Returns the packet ID the
+// PUBACK will carry, 0 if it failed. A retransmission passes the packet
+// ID of the attempt before and goes out under it marked as duplicate;
+// the Core2 ignores it, the retransmission is a new message under a new
+// packet ID, and consumers drop the repeat by its "seq". Does not wait
+// for the PUBACK, the callback gets it from hal_mqtt_poll().
+uint16_t hal_mqtt_publish_acknowledged(const char *topic, const uint8_t *payload, const size_t length, const uint16_t retransmit);
+void hal_mqtt_set_ack_callback(hal_mqtt_ack_callback_t callback);
+int hal_mqtt_read();
+
+#endif
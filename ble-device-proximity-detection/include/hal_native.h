@@ -0,0 +1,121 @@
+/*
+ * hal_native.h
+ *
+ * Controls for the Linux stand-ins of the hardware abstraction layer:
+ * a fake clock and NTP server, a fixed heap, a fake ATECC608 serial
+ * number, an advertisement source replaying recorded scans, a
+ * directory standing in for the SD card, settings kept in memory instead
+ * of flash, an LCD that keeps the text of its cells, LEDs and a speaker
+ * played out on the clock, and an in-process MQTT broker behind a link
+ * that loses messages on demand.
+ */
+
+#ifndef HAL_NATIVE_H
+#define HAL_NATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+
+#define HAL_NATIVE_SE_ID "0123c0ffee2b94a1ee"
+#define HAL_NATIVE_EPOCH_BASE 1633046400UL // 2021-10-01T00:00:00Z
+#define HAL_NATIVE_NTP_POLL 3600000         // ms between SNTP answers
+#define HAL_NATIVE_STORAGE_ROOT "/tmp/hhcm-native-sd"
+#define HAL_NATIVE_STORAGE_CAPACITY (16UL * 1024 * 1024)
+#define HAL_NATIVE_HEAP_FREE 160000 // bytes, a Core2 with Wi-Fi, BLE and TLS up
+#define HAL_NATIVE_HEAP_LARGEST 110000
+
+typedef void (*hal_native_delivery_hook_t)(
+    const hal_ble_advertisement_t *advertisement);
+
+typedef void (*hal_native_publish_hook_t)(
+    const char *topic,
+    const uint8_t *payload,
+    const size_t length);
+
+// Fake clock: only moves when told to (or while a replayed scan runs).
+void hal_native_clock_set(const uint32_t ms);
+void hal_native_clock_advance(const uint32_t ms);
+
+// NTP: whether the server answers and how many ppm true time runs
+// faster than the clock (both forget the last answer), corrections of
+// the server's time. The system time hal_ntp_time() reads is set to
+// true time on every answer, HAL_NATIVE_NTP_POLL ms apart, and runs on
+// the clock in between.
+void hal_native_ntp_set(const bool available, const int32_t drift_ppm);
+void hal_native_ntp_adjust(const int32_t ms);
+uint64_t hal_native_ntp_true_time(); // ms since Unix Epoch
+
+// Heap: what hal_heap() reports, the host's is of no interest.
+void hal_native_heap_set(const uint32_t free, const uint32_t largest_block);
+
+// Advertisement source: loads a recording, see bench/README.md for the
+// line format. Recorded times are relative to the clock at load time.
+// Only advertisements sent during a scan window are received, as
+// configured by hal_ble_configure().
+bool hal_native_ble_load_recording(const char *path);
+bool hal_native_ble_replay_done();
+size_t hal_native_ble_replayed();
+void hal_native_ble_set_delivery_hook(hal_native_delivery_hook_t hook);
+void hal_native_ble_get_configuration(int *interval, int *window, bool *active);
+
+// Network: whether the access point is up, and what the broker makes
+// of the next connection attempts. Taking the access point down drops
+// the MQTT connection as well, bringing it back completes a join that
+// was begun meanwhile.
+void hal_native_wifi_set_available(const bool available);
+size_t hal_native_wifi_joins();
+void hal_native_mqtt_set_connect_result(const hal_mqtt_connect_result_t result);
+size_t hal_native_mqtt_connects();
+
+// SD card: paths are relative to the root directory, the capacity is
+// what hal_storage_free() counts down from.
+void hal_native_storage_set_root(const char *root);
+void hal_native_storage_set_capacity(const uint64_t bytes);
+
+// LCD: pixels and cells written so far, and what the screen shows. A
+// pixel takes 16 bits on the SPI bus, at HAL_NATIVE_DISPLAY_SPI_HZ on
+// the Core2.
+#define HAL_NATIVE_DISPLAY_SPI_HZ 40000000
+size_t hal_native_display_pixels();
+size_t hal_native_display_cells();
+size_t hal_native_display_dump(char *buffer, const size_t size);
+
+// LEDs: frames shown so far, when the last one was and its colors.
+size_t hal_native_leds_frames();
+uint32_t hal_native_leds_shown_at();
+void hal_native_leds_get(uint32_t *colors);
+
+// Speaker: the DMA buffers play in turn on the clock from
+// hal_audio_init() on, HAL_AUDIO_DMA_SAMPLES samples each. A burst is
+// what was written without the buffers running dry in between: a sound
+// written in time comes out as a single one, every gap starts another.
+size_t hal_native_audio_samples();
+size_t hal_native_audio_bursts();
+uint32_t hal_native_audio_burst_start(); // when the last burst is heard
+
+// Flash: settings are kept in memory, for as long as the process runs.
+// Erasing them is a board out of the box.
+void hal_native_settings_erase();
+size_t hal_native_settings_writes();
+
+// In-process broker: every publish is handed to the hook, messages on
+// subscribed topics are looped back to the client on the next poll.
+// Shadow updates are accepted as they come, answered on update/accepted
+// with their client token.
+void hal_native_mqtt_set_publish_hook(hal_native_publish_hook_t hook);
+void hal_native_mqtt_set_connected(const bool connected);
+void hal_native_mqtt_inject(const char *topic, const uint8_t *payload, const size_t length);
+size_t hal_native_mqtt_published_messages();
+size_t hal_native_mqtt_published_bytes();
+
+// Link to the broker: the share of publishes lost on the way and of
+// PUBACKs lost on the way back, in percent, and the round trip until a
+// QoS 1 publish is acknowledged. Lost publishes are not counted as
+// published, duplicates (retransmissions the broker took) are.
+void hal_native_mqtt_set_loss(const unsigned publish_percent, const unsigned ack_percent);
+void hal_native_mqtt_set_ack_delay(const uint32_t ms);
+size_t hal_native_mqtt_lost();
+size_t hal_native_mqtt_duplicates();
+
+#endif
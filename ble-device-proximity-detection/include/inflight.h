@@ -0,0 +1,63 @@
+/*
+ * inflight.h
+ *
+ * Window of QoS 1 publishes the broker has not acknowledged yet, by
+ * packet ID, network stage only. Up to INFLIGHT_WINDOW messages go out
+ * without waiting for each PUBACK in turn, so a link with a long round
+ * trip still carries them at the rate they come. Each keeps a copy of
+ * its payload until acknowledged: one not acknowledged in time goes out
+ * again, after a reconnect every one does; after INFLIGHT_ATTEMPTS the
+ * message is given up, for the caller to keep in the log.
+ */
+
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "store.h"
+
+#ifndef INFLIGHT_SETUP_WINDOW
+#define INFLIGHT_SETUP_WINDOW 4 // messages, 2 KiB each
+#endif
+#define INFLIGHT_WINDOW INFLIGHT_SETUP_WINDOW
+#define INFLIGHT_TIMEOUT 5000      // ms until the first retransmission
+#define INFLIGHT_TIMEOUT_MAX 40000 // ms, the timeout doubles with every retransmission up to this
+#define INFLIGHT_ATTEMPTS 8
+
+typedef struct
+{
+    bool used;
+    uint8_t kind; // store_kind_t
+    uint16_t length;
+    uint16_t packet_id; // of the last attempt
+    uint8_t attempts;
+    uint32_t order; // of the first attempt among the messages in flight
+    uint32_t sent;  // hal_millis() of the first attempt
+    uint32_t due;   // hal_millis() of the next retransmission
+    uint8_t payload[STORE_RECORD_MAX];
+} inflight_message_t;
+
+typedef struct
+{
+    inflight_message_t messages[INFLIGHT_WINDOW];
+    uint32_t count;
+    uint32_t next_order;
+    uint32_t high_water;
+    uint32_t acknowledged;
+    uint32_t retransmitted;
+    uint32_t given_up;
+    uint32_t unknown; // PUBACKs for no message in flight, of an earlier attempt
+    uint32_t ack_ms_max; // first attempt to PUBACK
+    uint32_t ack_ms_total;
+} inflight_t;
+
+void inflight_init(inflight_t *window);
+inflight_message_t *inflight_reserve(inflight_t *window);
+void inflight_sent(inflight_t *window, inflight_message_t *message, const uint16_t packet_id, const uint32_t now);
+bool inflight_acknowledge(inflight_t *window, const uint16_t packet_id, const uint32_t now);
+inflight_message_t *inflight_due(inflight_t *window, const uint32_t now);
+void inflight_give_up(inflight_t *window, inflight_message_t *message);
+void inflight_resend_all(inflight_t *window, const uint32_t now);
+
+#endif
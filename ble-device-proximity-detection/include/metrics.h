@@ -0,0 +1,155 @@
+/*
+ * metrics.h
+ *
+ * Counters, gauges and fixed-bucket histograms of how the gateway fares
+ * in the field, recorded from any task without a lock: every value is a
+ * relaxed atomic, histograms only add to their bucket. Published every
+ * METRICS_INTERVAL ms on "hhcm/{thing}/metrics":
+ *
+ *   {"seq": <sequence>, "uptime": <ms>, "time": <epoch ms>,
+ *    "counters": {"adv_seen": <count>, ...},
+ *    "gauges": {"presence": [<value>, <min>, <max>, <limit>], ...},
+ *    "histograms": {"scan_us": [[<count per bucket>, ...], <sum>, <max>], ...}}
+ *
+ * Everything counts from power up: take differences between messages,
+ * counters and sums modulo 2^32, so lost messages lose no counts.
+ * Gauges hold the last value and the extremes since power up, those
+ * with a capacity (presence table, outbox, JSON documents, allowlist,
+ * in-flight window) add it as limit, shares in per mille add 1000.
+ * Bucket i of a histogram counts the values up to its i-th bound
+ * (metrics_histogram_bounds()), the last one everything beyond. time is
+ * null until NTP has answered (wallclock.h).
+ *
+ * Every METRICS_SHADOW_INTERVAL ms they are mirrored into the reported
+ * state of the device shadow as "metrics", histograms as
+ * [<count>, <sum>, <max>], so a fleet query finds the gateways that
+ * drop data or fragment their heap.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+#ifndef METRICS_SETUP_INTERVAL
+#define METRICS_SETUP_INTERVAL 60000 // ms between metrics messages
+#endif
+#define METRICS_INTERVAL METRICS_SETUP_INTERVAL
+#define METRICS_SHADOW_INTERVAL 600000 // ms between mirrors in the shadow
+#define METRICS_TOPIC "hhcm/%s/metrics"
+#define METRICS_BUCKETS 10 // per histogram, the last one unbounded
+
+// Counters, any task.
+typedef enum
+{
+    METRIC_ADV_SEEN = 0,      // advertisements the filter looked at
+    METRIC_ADV_MATCHED,       // of them, registered badges or badges of the name prefix above the RSSI floor
+    METRIC_ADV_DROPPED,       // matches lost to a full scan ring
+    METRIC_PRESENCE_REJECTED, // advertisements of new badges, presence table full
+    METRIC_EVENTS_DROPPED,    // hand hygiene events, outbox full
+    METRIC_TELEMETRY_DROPPED, // telemetry pages, outbox full or too large
+    METRIC_MESSAGES_STORED,   // kept on the SD card while offline
+    METRIC_MESSAGES_LOST,     // neither published nor stored
+    METRIC_PUBLISHED,         // live and replayed
+    METRIC_PUBLISH_FAILED,
+    METRIC_CONNECTS,          // MQTT sessions established
+    METRIC_CONNECT_FAILURES,  // Wi-Fi joins, TLS handshakes and MQTT sessions
+    METRIC_LINK_LOST,
+    METRIC_ACKNOWLEDGED,      // QoS 1 publishes, events and telemetry
+    METRIC_RETRANSMITTED,     // QoS 1 publishes not acknowledged in time or before a reconnect
+    METRIC_FRAMES,            // dashboard frames drawn
+    METRIC_REMINDERS,         // compliance reminders raised, merged ones included
+    METRIC_SHADOW_REJECTED,   // shadow updates answered on update/rejected
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+// Gauges, each set by a single task. The JSON documents report the
+// memory pool they take (memoryUsage()), their capacity is the limit.
+typedef enum
+{
+    METRIC_PRESENCE = 0, // badges in the presence table
+    METRIC_OUTBOX,       // messages queued for the network stage
+    METRIC_HEAP_FREE,    // bytes
+    METRIC_HEAP_LARGEST, // bytes in the largest free block
+    METRIC_JSON_EVENTS,  // bytes
+    METRIC_JSON_SHADOW,
+    METRIC_JSON_TELEMETRY,
+    METRIC_JSON_DESIRED,
+    METRIC_ALLOWLIST,    // registered badges
+    METRIC_INFLIGHT,     // QoS 1 publishes not acknowledged yet
+    METRIC_DISPLAY_CPU,  // per mille of the time spent drawing the dashboard
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+// Histograms, any task. Times are bucketed from 100 us to 3 s, sizes
+// from 16 B to 4 KiB.
+typedef enum
+{
+    METRIC_SCAN_US = 0,   // a blocking scan, or draining the continuous scan
+    METRIC_LOOP_US,       // gateway_loop()
+    METRIC_PUBLISH_US,    // a publish, TLS included
+    METRIC_MESSAGE_BYTES, // serialized messages queued
+    METRIC_HANDSHAKE_US,  // TCP connection and TLS handshake
+    METRIC_FRAME_US,      // dashboard frames, the changed cells only
+    METRIC_REMINDER_US,   // a zone event to the start of its reminder cue, in whole ms
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+typedef struct
+{
+    uint32_t value;
+    uint32_t min;
+    uint32_t max;
+    uint32_t limit; // capacity, 0 for none
+    bool set;       // at least once since power up
+} metrics_gauge_t;
+
+typedef struct
+{
+    uint32_t counts[METRICS_BUCKETS];
+    uint32_t sum;
+    uint32_t max;
+} metrics_histogram_t;
+
+typedef struct
+{
+    uint32_t counters[METRIC_COUNTER_COUNT];
+    metrics_gauge_t gauges[METRIC_GAUGE_COUNT];
+    metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+} metrics_snapshot_t;
+
+// Memory pool of the message: the root's members, one per counter, a
+// four element array per gauge, the buckets, sum and max per histogram.
+// Names are literals stored by pointer. The shadow mirror takes less.
+#define METRICS_DOCUMENT_SIZE                                                       \
+    (JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(METRIC_COUNTER_COUNT) +                 \
+     JSON_OBJECT_SIZE(METRIC_GAUGE_COUNT) + METRIC_GAUGE_COUNT * JSON_ARRAY_SIZE(4) + \
+     JSON_OBJECT_SIZE(METRIC_HISTOGRAM_COUNT) +                                     \
+     METRIC_HISTOGRAM_COUNT * (JSON_ARRAY_SIZE(3) + JSON_ARRAY_SIZE(METRICS_BUCKETS)))
+
+void metrics_init();
+void metrics_count(const metric_counter_t counter);
+void metrics_add(const metric_counter_t counter, const uint32_t count);
+void metrics_set(const metric_gauge_t gauge, const uint32_t value);
+void metrics_set_limit(const metric_gauge_t gauge, const uint32_t limit);
+void metrics_record(const metric_histogram_t histogram, const uint32_t value);
+
+void metrics_snapshot(metrics_snapshot_t *snapshot);
+const char *metrics_counter_name(const metric_counter_t counter);
+const char *metrics_gauge_name(const metric_gauge_t gauge);
+const char *metrics_histogram_name(const metric_histogram_t histogram);
+const uint32_t *metrics_histogram_bounds(const metric_histogram_t histogram);
+
+void metrics_build(
+    const metrics_snapshot_t *snapshot,
+    const uint32_t sequence,
+    const uint32_t uptime,
+    const uint64_t time,
+    JsonDocument *document);
+void metrics_build_shadow(
+    const metrics_snapshot_t *snapshot,
+    const uint32_t uptime,
+    JsonDocument *document);
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * outbox.h
+ *
+ * Single-producer/single-consumer lock-free queue of serialized MQTT
+ * messages between the aggregation stage, which builds them, and the
+ * network stage, which encrypts and publishes them or keeps them in the
+ * store-and-forward log. Messages are built in place in their slot. A
+ * full outbox refuses the message and counts it, the producer decides
+ * what to do about it; neither side ever blocks.
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <atomic>
+#include "store.h"
+
+#define OUTBOX_CAPACITY 8                  // messages, must be a power of two
+#define OUTBOX_MESSAGE_MAX STORE_RECORD_MAX // payload bytes, every message can be stored
+
+typedef struct
+{
+    uint8_t kind;  // store_kind_t, tells the topic
+    uint16_t length;
+    uint32_t time; // hal_millis() when queued
+    uint8_t payload[OUTBOX_MESSAGE_MAX];
+} outbox_message_t;
+
+typedef struct
+{
+    outbox_message_t messages[OUTBOX_CAPACITY];
+    std::atomic<uint32_t> head; // next slot to fill, producer only
+    std::atomic<uint32_t> tail; // next slot to send, consumer only
+    std::atomic<uint32_t> queued;
+    std::atomic<uint32_t> refused; // messages offered while the outbox was full
+    std::atomic<uint32_t> high_water;
+} outbox_t;
+
+void outbox_init(outbox_t *outbox);
+outbox_message_t *outbox_reserve(outbox_t *outbox);
+void outbox_commit(outbox_t *outbox, const uint32_t now);
+outbox_message_t *outbox_peek(outbox_t *outbox);
+void outbox_release(outbox_t *outbox);
+uint32_t outbox_size(const outbox_t *outbox);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * presence.h
+ *
+ * Fixed-capacity table of the badges in range, keyed by the 48-bit BLE
+ * address packed into a uint64_t. Open addressing with linear probing
+ * over a statically allocated slot array: updates are O(1) and nothing
+ * is allocated after setup().
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+#include "proximity.h"
+
+#define PRESENCE_TABLE_CAPACITY 1024 // slots, must be a power of two
+#define PRESENCE_TABLE_MAX_ENTRIES (PRESENCE_TABLE_CAPACITY * 3 / 4)
+#define PRESENCE_STALE_AFTER 10000  // ms without an advertisement before a badge ages out
+
+typedef struct
+{
+    uint64_t key; // packed address, 0 marks an empty slot
+    uint32_t first_seen; // hal_millis()
+    uint32_t last_seen;
+    uint32_t hits;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    int8_t rssi_last;
+    uint8_t zone;          // proximity_zone_t, maintained by the caller
+    int16_t rssi_smoothed; // see proximity_smooth()
+    uint8_t dwell_reported;
+    uint32_t zone_since;
+} presence_entry_t;
+
+typedef struct
+{
+    presence_entry_t entries[PRESENCE_TABLE_CAPACITY];
+    uint32_t count;
+    uint32_t high_water;
+    uint32_t rejected; // advertisements of new badges turned away, table full
+    uint32_t expired;
+} presence_table_t;
+
+uint64_t presence_key(const uint8_t *address);
+void presence_address(const uint64_t key, uint8_t *address);
+
+void presence_init(presence_table_t *table);
+presence_entry_t *presence_update(
+    presence_table_t *table,
+    const uint8_t *address,
+    const int rssi,
+    const uint32_t time);
+presence_entry_t *presence_find(presence_table_t *table, const uint8_t *address);
+uint32_t presence_expire(presence_table_t *table, const uint32_t now, const uint32_t max_age);
+presence_entry_t *presence_next(presence_table_t *table, size_t *cursor);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * proximity.h
+ *
+ * Per-badge RSSI smoothing and proximity zone estimation. RSSI is kept
+ * as a fixed-point exponential moving average with
+ * PROXIMITY_RSSI_FRACTION_BITS fractional bits, zones are classified
+ * with hysteresis so a badge on a zone boundary does not flicker.
+ */
+
+#ifndef PROXIMITY_H
+#define PROXIMITY_H
+
+#include <stdint.h>
+
+#define PROXIMITY_RSSI_FRACTION_BITS 4
+#define PROXIMITY_EMA_SHIFT 2 // smoothing factor 1/4 per advertisement
+
+// Zone thresholds (dBm) on the smoothed RSSI: a badge enters a zone at
+// the enter threshold and leaves it only below the exit threshold.
+#define PROXIMITY_NEAR_ENTER -50
+#define PROXIMITY_NEAR_EXIT -55
+#define PROXIMITY_ROOM_ENTER -70
+#define PROXIMITY_ROOM_EXIT -75
+
+// Weaker advertisements are not even considered by the scan filter.
+#define PROXIMITY_RSSI_FLOOR -90
+
+typedef enum
+{
+    PROXIMITY_AWAY = 0,
+    PROXIMITY_IN_ROOM,
+    PROXIMITY_NEAR
+} proximity_zone_t;
+
+typedef struct
+{
+    int near_enter;
+    int near_exit;
+    int room_enter;
+    int room_exit;
+} proximity_config_t;
+
+void proximity_config_init(proximity_config_t *config);
+
+int16_t proximity_smooth(const int16_t smoothed, const int rssi, const bool first);
+int proximity_rssi(const int16_t smoothed);
+
+proximity_zone_t proximity_classify(
+    const proximity_config_t *config,
+    const proximity_zone_t zone,
+    const int16_t smoothed);
+
+const char *proximity_zone_name(const proximity_zone_t zone);
+
+#endif
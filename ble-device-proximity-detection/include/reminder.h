@@ -0,0 +1,106 @@
+/*
+ * reminder.h
+ *
+ * Local compliance reminder: a visit, from a badge entering
+ * REMINDER_ZONE (or nearer) until it leaves the room, has to include a
+ * dwell at the dispenser, or one in the REMINDER_RUB_VALID ms before
+ * it. A visit without one calls for a reminder once the badge leaves,
+ * or once it has been in the room for REMINDER_GRACE ms, whichever
+ * comes first: the LED side bars pulsing and a short chime from the
+ * speaker, right at the gateway, whether AWS IoT Core is reachable or
+ * not. Entering alone does not, nobody could have used the dispenser
+ * yet. The aggregation stage follows the events of each badge, looks
+ * for visits due a reminder after each batch of them and hands the
+ * reminder over in a single slot; the feedback stage, a task stepping
+ * every REMINDER_TICK ms, starts the cue: the first LED frame and the
+ * first DMA buffer of the chime in the same step, the chime heard once
+ * the buffer playing then is through. After that each step draws the
+ * LED frame that is due, at the time since the start, and tops up the
+ * free DMA buffer, never waiting for either.
+ *
+ * The chime is a list of notes and a quarter sine table in flash,
+ * rendered a DMA buffer at a time; a recording of it would take 12.8 kB.
+ */
+
+#ifndef REMINDER_H
+#define REMINDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+#include "events.h"
+
+#ifndef REMINDER_SETUP_ENABLED
+#define REMINDER_SETUP_ENABLED true
+#endif
+#ifndef REMINDER_SETUP_GRACE
+#define REMINDER_SETUP_GRACE 30000 // ms
+#endif
+#define REMINDER_ZONE PROXIMITY_IN_ROOM // the patient zone around the gateway
+#define REMINDER_GRACE REMINDER_SETUP_GRACE // ms in the room to get to the dispenser
+#define REMINDER_RUB_VALID 120000       // ms a dispenser use covers entering the zone
+#define REMINDER_REPEAT_AFTER 30000     // ms before the same badge is reminded again
+#define REMINDER_BADGES 32              // badges whose dispenser use is remembered
+
+#define REMINDER_TICK 5              // ms between feedback steps
+#define REMINDER_FRAME_INTERVAL 20   // ms between LED frames
+#define REMINDER_LED_DURATION 2000   // ms the side bars pulse
+#define REMINDER_PULSE 500           // ms from bright to dark and back
+#define REMINDER_COLOR 0xff6000      // amber
+#define REMINDER_VOLUME 8000         // peak of the chime, of 32767
+#define REMINDER_RAMP 80             // samples fading each note in and out, 5 ms
+
+typedef struct
+{
+    uint64_t key;         // packed address, 0 for a free entry
+    uint32_t seen;        // hal_millis() of its last event
+    bool rubbed;
+    uint32_t rub_time;    // hal_millis() of its last dispenser use
+    bool reminded;
+    uint32_t reminded_at; // hal_millis()
+    bool visiting;        // in REMINDER_ZONE or nearer
+    uint32_t entered;     // hal_millis() the visit started
+    bool covered;         // the dispenser was used, or a reminder is out
+    bool leaving;         // left a zone, no other entered since
+} reminder_badge_t;
+
+// Aggregation stage.
+typedef struct
+{
+    reminder_badge_t badges[REMINDER_BADGES];
+} reminder_t;
+
+// Feedback stage.
+typedef struct
+{
+    bool playing;
+    uint32_t started;    // hal_millis() of the first frame
+    uint32_t next_frame; // hal_millis()
+    bool lit;            // the side bars are not dark yet
+    // The chime: the note rendering, the DMA buffer's worth rendered and
+    // how much of it the speaker took.
+    int note;
+    uint32_t note_sample;
+    uint32_t phase;
+    uint32_t increment; // of the phase per sample
+    int16_t block[HAL_AUDIO_DMA_SAMPLES];
+    size_t block_length;
+    size_t block_offset;
+    // Statistics
+    uint32_t cues;
+    uint32_t merged; // reminders while a cue played, none of their own
+    uint32_t frames;
+    uint32_t latency_ms_max; // event to the start of the cue
+    uint32_t latency_ms_total;
+} reminder_player_t;
+
+void reminder_init(reminder_t *reminder);
+void reminder_event(reminder_t *reminder, const event_t *event);
+bool reminder_due(reminder_t *reminder, const uint32_t now, uint8_t *address, uint32_t *time);
+
+void reminder_player_init(reminder_player_t *player);
+void reminder_play(reminder_player_t *player, const uint32_t time, const uint32_t now);
+bool reminder_step(reminder_player_t *player, const uint32_t now);
+uint32_t reminder_cue_samples();
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * scan_schedule.h
+ *
+ * Picks the BLE scan mode from what the badges in range do. With
+ * badges arriving, moving or dwelling the scan runs the detect settings
+ * at full duty, actively. Once they have settled it listens passively
+ * at a lower duty: no scan requests add to the airtime of a dense ward,
+ * and a zone change still brings back full duty. In an empty room it
+ * backs off to a short window every few hundred ms, and the first
+ * advertisement of a badge heard brings back full duty right away.
+ *
+ * Passive scans see the advertising data only, which is where the
+ * filter looks for the name (adv_filter.h).
+ */
+
+#ifndef SCAN_SCHEDULE_H
+#define SCAN_SCHEDULE_H
+
+#include <stdint.h>
+
+#ifndef BLE_SCAN_SETUP_ADAPTIVE
+#define BLE_SCAN_SETUP_ADAPTIVE true // false: the detect settings around the clock
+#endif
+
+#define SCAN_SCHEDULE_STEADY_AFTER 20000 // ms without arrivals or zone changes
+#define SCAN_SCHEDULE_STEADY_DUTY 50     // % of the detect settings' window
+#define SCAN_SCHEDULE_IDLE_AFTER 30000   // ms without a badge in range
+#define SCAN_SCHEDULE_IDLE_INTERVAL 400  // ms
+#define SCAN_SCHEDULE_IDLE_WINDOW 100    // ms
+
+typedef enum
+{
+    SCAN_MODE_FULL = 0, // the detect settings, active scan
+    SCAN_MODE_STEADY,   // badges in range, nothing changing: passive, lower duty
+    SCAN_MODE_IDLE      // nobody in range: passive, short windows
+} scan_mode_t;
+
+typedef struct
+{
+    int interval; // ms
+    int window;   // ms
+    bool active;
+} scan_parameters_t;
+
+typedef struct
+{
+    bool adaptive;                // false: stays at full duty, still accounted
+    scan_mode_t mode;
+    scan_parameters_t full;       // the detect settings
+    scan_parameters_t parameters; // of the current mode
+    uint32_t last_update;         // hal_millis()
+    uint32_t last_activity;       // arrival or zone change
+    uint32_t last_occupied;       // a badge in range
+    uint32_t switches;            // mode changes
+    uint64_t scan_us;             // radio time spent scanning, window / interval of the time
+    uint64_t active_us;           // of it, scanning actively
+} scan_schedule_t;
+
+void scan_schedule_init(
+    scan_schedule_t *schedule,
+    const int interval,
+    const int window,
+    const bool adaptive,
+    const uint32_t now);
+void scan_schedule_configure(scan_schedule_t *schedule, const int interval, const int window);
+bool scan_schedule_update(
+    scan_schedule_t *schedule,
+    const bool occupied,
+    const bool activity,
+    const uint32_t now);
+
+const char *scan_mode_name(const scan_mode_t mode);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * shadow.h
+ *
+ * The reported state of the AWS IoT device shadow as last published:
+ * the detect settings and how many badges are in each zone,
+ * {"zones": {"room": <badges>, "near": <badges>}}. Which badge is where
+ * goes out with the telemetry (telemetry.h) and the events: AWS IoT
+ * keeps at most 8 KB of shadow state and rejects any update beyond it,
+ * a member per badge would pass that at about 300 badges. An update
+ * takes the same few hundred bytes whatever the number of badges.
+ *
+ * Updates carry only what differs from the reported state: the detect
+ * settings when they change, the zone counts when they do. A full
+ * resync every resync_interval ms repairs updates that got lost, and
+ * sets "detected" to null, which drops the badges earlier versions of
+ * the gateway kept in the shadow. Every update carries a clientToken,
+ * the sequence of updates published, which AWS IoT echoes in its
+ * responses. One update is out at a time: it becomes the reported state
+ * once update/accepted answers with its token. One rejected, or not
+ * answered within SHADOW_ANSWER_TIMEOUT ms online, leaves the reported
+ * state as it was, the next update carries the same changes again.
+ * Rejections are counted and traced.
+ *
+ * The detect settings can be changed through the desired state: from
+ * shadow/update/delta, {"state": {"detect": {...}}}, and from
+ * shadow/get/accepted, {"state": {"desired": {"detect": {...}}}}. These
+ * are parsed through a filter, whatever else the document holds is
+ * skipped while it is read, so the shadow can be any size.
+ *
+ * Badges are registered the same way, a member of the desired
+ * "allowlist" per badge, {"aa:bb:cc:dd:ee:ff": true}, false to remove
+ * it (allowlist.h). Only what differs from the reported state is taken,
+ * the delta: {"state": {"allowlist": {...}}} from shadow/update/delta,
+ * {"state": {"delta": {"allowlist": {...}}}} from shadow/get/accepted.
+ * The changes applied are reported back as they were desired, at most
+ * SHADOW_ALLOWLIST_CHANGES_MAX per message; with more than that the
+ * rest comes with the next get/accepted, requested once the report is
+ * out.
+ */
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include "presence.h"
+#include "proximity.h"
+#include "ble_scan.h"
+#include "allowlist.h"
+
+#define SHADOW_DOCUMENT_SIZE 2048
+#define SHADOW_RESYNC_INTERVAL 300000 // ms between full resyncs
+#define SHADOW_NAME_PREFIX_SIZE 16
+#define SHADOW_CLIENT_TOKEN_SIZE 12
+#define SHADOW_ZONES (PROXIMITY_NEAR + 1) // counted by proximity_zone_t, away is not
+#define SHADOW_STATE_MAX 8192             // bytes AWS IoT keeps of a shadow's state
+#define SHADOW_ANSWER_TIMEOUT 30000       // ms online an update waits for update/accepted or rejected
+
+// {clientToken, state: {reported: {detect: {5 members}, zones: {room,
+// near}, detected}}}, the name prefix and client token copied.
+#define SHADOW_UPDATE_SIZE                                     \
+    (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(1) +               \
+     JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(5) +               \
+     JSON_OBJECT_SIZE(SHADOW_ZONES - 1) +                      \
+     JSON_STRING_SIZE(SHADOW_NAME_PREFIX_SIZE - 1) +           \
+     JSON_STRING_SIZE(SHADOW_CLIENT_TOKEN_SIZE - 1))
+// Serialized, at most {"clientToken":"4294967295","state":{"reported":
+// {"detect":{...},"zones":{"room":65535,"near":65535},"detected":null}}}
+// with the longest settings.
+#define SHADOW_UPDATE_BYTES 256
+
+// Zone changes are batched, see batch.h: published once as many badges
+// changed zone as SHADOW_BATCH_MAX_RECORDS, or the oldest change is
+// SHADOW_BATCH_MAX_AGE ms old. Both can be set from the build flags.
+#ifndef SHADOW_SETUP_BATCH_MAX_RECORDS
+#define SHADOW_SETUP_BATCH_MAX_RECORDS 32
+#endif
+#ifndef SHADOW_SETUP_BATCH_MAX_AGE
+#define SHADOW_SETUP_BATCH_MAX_AGE 10000 // ms
+#endif
+#define SHADOW_BATCH_MAX_RECORDS SHADOW_SETUP_BATCH_MAX_RECORDS
+#define SHADOW_BATCH_MAX_BYTES UINT32_MAX // an update takes the same bytes however many changed
+#define SHADOW_BATCH_MAX_AGE SHADOW_SETUP_BATCH_MAX_AGE
+
+// The filter, its keys stored by pointer, and what passes it: the keys
+// (SHADOW_DESIRED_KEYS_SIZE bytes), the name prefix and the badge
+// addresses are copied from the stream. A longer name prefix does not
+// fit, the message is rejected; an allowlist with more changes than fit
+// is cut short, the rest is taken later.
+#define SHADOW_ALLOWLIST_CHANGES_MAX 32
+#define SHADOW_DESIRED_FILTER_SIZE (3 * JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(4))
+#define SHADOW_DESIRED_KEYS_SIZE 96
+#define SHADOW_DESIRED_DOCUMENT_SIZE                                              \
+    (3 * JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(5) +         \
+     SHADOW_DESIRED_KEYS_SIZE + JSON_STRING_SIZE(SHADOW_NAME_PREFIX_SIZE - 1) +     \
+     JSON_OBJECT_SIZE(SHADOW_ALLOWLIST_CHANGES_MAX) +                              \
+     SHADOW_ALLOWLIST_CHANGES_MAX * JSON_STRING_SIZE(BLE_SCAN_ADDRESS_STRING_SIZE - 1))
+
+// {"state": {"reported": {"allowlist": {...}}}}, the addresses copied.
+#define SHADOW_ALLOWLIST_REPORT_SIZE                 \
+    (3 * JSON_OBJECT_SIZE(1) +                       \
+     JSON_OBJECT_SIZE(SHADOW_ALLOWLIST_CHANGES_MAX) + \
+     SHADOW_ALLOWLIST_CHANGES_MAX * JSON_STRING_SIZE(BLE_SCAN_ADDRESS_STRING_SIZE - 1))
+
+// The response to an update, from update/accepted or update/rejected:
+// {"code", "message", "clientToken"} as the filter keeps them, the keys
+// and strings copied from the stream. A longer message is cut short.
+#define SHADOW_RESPONSE_MESSAGE_SIZE 64
+#define SHADOW_RESPONSE_FILTER_SIZE JSON_OBJECT_SIZE(3)
+#define SHADOW_RESPONSE_DOCUMENT_SIZE                                    \
+    (JSON_OBJECT_SIZE(3) + JSON_STRING_SIZE(sizeof("clientToken") - 1) +  \
+     JSON_STRING_SIZE(sizeof("code") - 1) +                              \
+     JSON_STRING_SIZE(sizeof("message") - 1) +                           \
+     JSON_STRING_SIZE(SHADOW_CLIENT_TOKEN_SIZE - 1) +                    \
+     JSON_STRING_SIZE(SHADOW_RESPONSE_MESSAGE_SIZE - 1))
+
+// Valid desired detect settings. Interval and window are the BLE scan
+// parameters in ms, the window at most the interval; a badge has to be
+// in the room before it can be near.
+#define SHADOW_DETECT_INTERVAL_MIN 3
+#define SHADOW_DETECT_INTERVAL_MAX 10240
+#define SHADOW_DETECT_DURATION_MIN 1 // s
+#define SHADOW_DETECT_DURATION_MAX 60
+#define SHADOW_DETECT_RSSI_MIN (PROXIMITY_ROOM_ENTER + 1)
+#define SHADOW_DETECT_RSSI_MAX 0
+
+// The detect member of the reported state.
+typedef struct
+{
+    int interval;
+    int window;
+    int duration;
+    char name_prefix[SHADOW_NAME_PREFIX_SIZE];
+    int rssi_threshold;
+} shadow_detect_t;
+
+// Allowlist changes taken from the desired state.
+typedef struct
+{
+    allowlist_change_t changes[SHADOW_ALLOWLIST_CHANGES_MAX];
+    size_t count;
+    bool more; // the desired state has more changes than were taken
+} shadow_allowlist_t;
+
+// A response to an update.
+typedef struct
+{
+    bool tokened;    // carries a client token; allowlist reports do not
+    uint32_t token;  // the sequence of the update answered
+    int code;        // rejections: the HTTP status, 400 for a bad document
+    char message[SHADOW_RESPONSE_MESSAGE_SIZE];
+} shadow_response_t;
+
+// Badges per zone, indexed by proximity_zone_t.
+typedef struct
+{
+    uint16_t badges[SHADOW_ZONES];
+} shadow_zones_t;
+
+// The update out, waiting for its answer.
+typedef struct
+{
+    bool waiting;
+    bool rejected;          // retried once SHADOW_ANSWER_TIMEOUT has passed
+    bool all_detect;        // carries all detect settings
+    uint32_t token;         // its sequence
+    uint32_t since;         // hal_millis(), queued or last seen offline
+    shadow_detect_t detect;
+    shadow_zones_t zones;
+    bool reset;
+} shadow_pending_t;
+
+typedef struct
+{
+    shadow_detect_t detect; // as last accepted
+    shadow_zones_t zones;   // as last accepted
+    bool synced;            // a full resync has been accepted
+    bool detect_stale;      // report all detect settings with the next update
+    uint32_t resync_interval;
+    uint32_t last_resync;   // hal_millis()
+    uint32_t sequence;      // the next client token, from 1
+    shadow_pending_t pending;
+    uint32_t accepted;
+    uint32_t unanswered;    // given up after SHADOW_ANSWER_TIMEOUT
+} shadow_state_t;
+
+void shadow_init(shadow_state_t *shadow, const uint32_t resync_interval);
+bool shadow_resync_due(const shadow_state_t *shadow, const uint32_t now);
+
+void shadow_count_zones(presence_table_t *presence, shadow_zones_t *zones);
+bool shadow_detect_changed(const shadow_state_t *shadow, const shadow_detect_t *detect);
+void shadow_report_detect(shadow_state_t *shadow);
+int shadow_changes(const shadow_state_t *shadow, const shadow_zones_t *zones);
+void shadow_build_update(
+    const shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    JsonDocument *document);
+void shadow_commit_update(
+    shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    const uint32_t now);
+void shadow_expect(
+    shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    const uint32_t now);
+bool shadow_waiting(shadow_state_t *shadow, const bool online, const uint32_t now);
+int shadow_answer(shadow_state_t *shadow, const uint32_t token, const bool accepted);
+
+void shadow_desired_filter(JsonDocument *filter);
+int shadow_desired_detect(const JsonDocument *document, shadow_detect_t *detect);
+int shadow_desired_allowlist(const JsonDocument *document, const bool truncated, shadow_allowlist_t *allowlist);
+void shadow_build_allowlist(const shadow_allowlist_t *allowlist, JsonDocument *document);
+
+void shadow_response_filter(JsonDocument *filter);
+void shadow_response(const JsonDocument *document, shadow_response_t *response);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * store.h
+ *
+ * Store-and-forward log on the SD card for messages that could not be
+ * published while offline. Append-only segment files, every record
+ * carries a CRC; replay is in the order the records were appended and
+ * at least once (a record is only dropped after the broker took it).
+ *
+ * Record: 0xa5, kind, payload length (uint16 LE), CRC-32 over kind,
+ * length and payload (uint32 LE), payload.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STORE_DIRECTORY "/hhcm"
+#define STORE_SEGMENT_SIZE 65536 // bytes a segment grows to before the next is started
+#define STORE_MAX_SEGMENTS 64    // the oldest segment is evicted beyond this
+#define STORE_RECORD_MAX 2048    // payload bytes
+#define STORE_HEADER_SIZE 8
+#define STORE_PATH_SIZE 32
+#define STORE_REPLAY_INTERVAL 200 // ms per replayed record, on average
+#define STORE_REPLAY_BURST 8      // records replayed at once at most
+
+typedef enum
+{
+    STORE_KIND_EVENTS = 1,
+    STORE_KIND_SHADOW = 2,
+    STORE_KIND_METRICS = 3,
+    STORE_KIND_TELEMETRY = 16 // + telemetry_format_t
+} store_kind_t;
+
+typedef struct
+{
+    bool ready;
+    uint32_t first;        // oldest segment, read from
+    uint32_t last;         // newest segment, appended to
+    uint32_t read_offset;  // next record in the oldest segment
+    uint32_t write_offset; // size of the newest segment
+    uint32_t appended;     // records
+    uint32_t replayed;     // records
+    uint32_t evicted;      // segments, with the records not yet replayed
+    uint32_t corrupt;      // torn or damaged records, the rest of their segment is skipped
+} store_t;
+
+bool store_init(store_t *store);
+bool store_append(store_t *store, const uint8_t kind, const uint8_t *data, const size_t length);
+bool store_pending(const store_t *store);
+size_t store_peek(store_t *store, uint8_t *kind, uint8_t *data, const size_t size);
+void store_advance(store_t *store, const size_t length);
+uint32_t store_crc32(uint32_t crc, const uint8_t *data, const size_t length);
+
+#endif
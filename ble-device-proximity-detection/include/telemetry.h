@@ -0,0 +1,84 @@
+/*
+ * telemetry.h
+ *
+ * Detection data for the backend, per badge; the device shadow only
+ * carries how many badges are in each zone (shadow.h). Published every TELEMETRY_INTERVAL ms on
+ * "hhcm/{thing}/telemetry/{format}" in the selected wire format:
+ *
+ *   {"seq": <sequence>, "page": <page>, "pages": <pages>, "time": <epoch ms>,
+ *    "badges": [[<id>, <zone>, <rssi>, <hits>, <age ms>], ...]}
+ *
+ * zone is proximity_zone_t, rssi the smoothed RSSI in dBm, age the time
+ * since the badge was last seen, time null until NTP has answered (see
+ * wallclock.h). Badges that are away are left out.
+ * More badges than TELEMETRY_RECORDS_PER_PAGE are split over several
+ * messages, seq counts every message built so gaps show lost ones.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include "presence.h"
+#include "ble_scan.h"
+
+#define TELEMETRY_INTERVAL 10000
+#define TELEMETRY_DOCUMENT_SIZE 4096
+#define TELEMETRY_BUFFER_SIZE 2048
+#define TELEMETRY_TOPIC "hhcm/%s/telemetry/%s"
+
+// Memory pool taken per badge: its element of badges, the five values
+// and the address copy. The envelope is the five members of the root.
+#define TELEMETRY_RECORD_SIZE \
+    (JSON_ARRAY_SIZE(1) + JSON_ARRAY_SIZE(5) + JSON_STRING_SIZE(BLE_SCAN_ADDRESS_STRING_SIZE - 1))
+#define TELEMETRY_ENVELOPE_SIZE JSON_OBJECT_SIZE(5)
+// Serialized as JSON, the largest of the formats, at most
+// ["aa:bb:cc:dd:ee:ff",2,-128,4294967295,4294967295], and the envelope.
+#define TELEMETRY_RECORD_BYTES 52
+#define TELEMETRY_ENVELOPE_BYTES 80
+#define TELEMETRY_RECORDS_PER_DOCUMENT \
+    ((TELEMETRY_DOCUMENT_SIZE - TELEMETRY_ENVELOPE_SIZE) / TELEMETRY_RECORD_SIZE)
+#define TELEMETRY_RECORDS_PER_BUFFER \
+    ((TELEMETRY_BUFFER_SIZE - TELEMETRY_ENVELOPE_BYTES) / TELEMETRY_RECORD_BYTES)
+#define TELEMETRY_RECORDS_PER_PAGE                                       \
+    (TELEMETRY_RECORDS_PER_DOCUMENT < TELEMETRY_RECORDS_PER_BUFFER      \
+         ? TELEMETRY_RECORDS_PER_DOCUMENT                                \
+         : TELEMETRY_RECORDS_PER_BUFFER)
+
+typedef enum
+{
+    TELEMETRY_FORMAT_JSON = 0,
+    TELEMETRY_FORMAT_MSGPACK,
+    TELEMETRY_FORMAT_CBOR
+} telemetry_format_t;
+
+#ifndef TELEMETRY_SETUP_FORMAT
+#define TELEMETRY_SETUP_FORMAT TELEMETRY_FORMAT_MSGPACK
+#endif
+
+typedef struct
+{
+    uint32_t sequence; // messages built
+    uint32_t dropped;  // badges that did not fit a page or its buffer
+} telemetry_state_t;
+
+int telemetry_pages(presence_table_t *presence);
+int telemetry_build(
+    telemetry_state_t *telemetry,
+    presence_table_t *presence,
+    const uint64_t time,
+    const uint32_t now,
+    size_t *cursor,
+    const int page,
+    const int pages,
+    JsonDocument *document);
+size_t telemetry_serialize(
+    const JsonDocument *document,
+    const telemetry_format_t format,
+    uint8_t *buffer,
+    const size_t size);
+const char *telemetry_format_name(const telemetry_format_t format);
+
+#endif
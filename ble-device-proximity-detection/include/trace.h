@@ -0,0 +1,137 @@
+/*
+ * trace.h
+ *
+ * Binary trace log: a trace record is the number of its message (see
+ * trace_formats.h) and the raw arguments, queued in a RAM ring by any
+ * task without formatting anything or waiting for the serial port. A
+ * task of idle priority drains the ring to the port; the host decodes
+ * what it captured (bench/README.md, "decode"). Messages are recorded
+ * with DEBUG_TRACE() (debug2serial.h).
+ *
+ * On the wire a record is framed as 0xa5, length, id (uint16 LE), time
+ * (hal_millis(), uint32 LE), flags, the arguments, and the XOR of the
+ * bytes from id on. Each argument is a type byte and its value, in
+ * little endian; strings are their length and bytes. 0xa5 never starts
+ * a line of text, the decoder passes text around the frames through.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_WARNING 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_RING_SLOTS 128 // power of two
+#define TRACE_RECORD_SIZE 80 // bytes per slot, the arguments get all but 8
+#define TRACE_FRAME_START 0xa5
+#define TRACE_FRAME_HEADER 9 // start, length, id, time, flags
+#define TRACE_FRAME_MAX (TRACE_FRAME_HEADER + TRACE_RECORD_SIZE)
+#define TRACE_DRAIN_BUDGET 16 // records per trace_drain() call
+
+#define TRACE_FLAG_TRUNCATED 0x01 // arguments left out or strings cut
+
+typedef enum
+{
+#define TRACE_FORMAT(name, level, format) TRACE_##name,
+#include "trace_formats.h"
+#undef TRACE_FORMAT
+    TRACE_FORMAT_COUNT
+} trace_id_t;
+
+// Level of each message, for the compile time filter.
+enum
+{
+#define TRACE_FORMAT(name, level, format) TRACE_LEVEL_OF_##name = level,
+#include "trace_formats.h"
+#undef TRACE_FORMAT
+};
+
+typedef enum
+{
+    TRACE_ARG_INT32 = 1,
+    TRACE_ARG_UINT32,
+    TRACE_ARG_INT64,
+    TRACE_ARG_UINT64,
+    TRACE_ARG_STRING,
+    TRACE_ARG_ADDRESS
+} trace_arg_type_t;
+
+typedef struct
+{
+    uint16_t id;
+    uint8_t length; // of args
+    uint8_t flags;
+    uint32_t time;
+    uint8_t args[TRACE_RECORD_SIZE - 8];
+} trace_record_t;
+
+typedef struct
+{
+    const uint8_t *address; // HAL_BLE_ADDRESS_LENGTH bytes
+} trace_address_t;
+
+typedef struct
+{
+    uint32_t written;
+    uint32_t dropped; // ring full
+    uint32_t high_water;
+} trace_statistics_t;
+
+typedef void (*trace_sink_t)(
+    const uint8_t *data,
+    size_t length,
+    void *context);
+
+void trace_init();
+void trace_begin(trace_record_t *record, const trace_id_t id);
+void trace_add(trace_record_t *record, const int value);
+void trace_add(trace_record_t *record, const unsigned value);
+void trace_add(trace_record_t *record, const long value);
+void trace_add(trace_record_t *record, const unsigned long value);
+void trace_add(trace_record_t *record, const long long value);
+void trace_add(trace_record_t *record, const unsigned long long value);
+void trace_add(trace_record_t *record, const char *value);
+void trace_add(trace_record_t *record, const trace_address_t value);
+bool trace_commit(const trace_record_t *record);
+size_t trace_drain(trace_sink_t sink, void *context, const size_t budget);
+size_t trace_frame(const trace_record_t *record, uint8_t *frame);
+void trace_get_statistics(trace_statistics_t *statistics);
+
+static inline trace_address_t trace_address(const uint8_t *address)
+{
+    trace_address_t value = {address};
+    return value;
+}
+
+static inline void trace_add_all(trace_record_t *record)
+{
+}
+
+template <typename T, typename... A>
+static inline void trace_add_all(trace_record_t *record, const T &value, const A &...rest)
+{
+    trace_add(record, value);
+    trace_add_all(record, rest...);
+}
+
+// Queues a record of the message with the arguments, in the order of
+// the conversions of its format. Returns false if the ring was full.
+template <typename... A>
+static inline bool trace_write(const trace_id_t id, const A &...args)
+{
+    trace_record_t record;
+    trace_begin(&record, id);
+    trace_add_all(&record, args...);
+    return trace_commit(&record);
+}
+
+#endif
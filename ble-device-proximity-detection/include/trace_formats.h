@@ -0,0 +1,64 @@
+/*
+ * trace_formats.h
+ *
+ * The trace messages: TRACE_FORMAT(name, level, format), included
+ * wherever a table of them is built. The gateway only sends the number
+ * of a message and its arguments, the decoder on the host has the
+ * formats. Append new messages at the end, removing or reordering them
+ * renumbers the ones after; decode with the build the capture was
+ * taken from.
+ *
+ * Conversions: %d %u %x take 32 bit integers, %lld %llu 64 bit ones,
+ * %s strings (cut to what fits the record), %A a BLE address
+ * (trace_address()).
+ */
+
+TRACE_FORMAT(STARTED, TRACE_LEVEL_INFO, "TRACE: Started, %u formats")
+TRACE_FORMAT(DROPPED, TRACE_LEVEL_WARNING, "TRACE: WARNING - %u records dropped, ring full")
+TRACE_FORMAT(BLE_SETUP, TRACE_LEVEL_INFO, "BLE: Setup BLE scanning ...")
+TRACE_FORMAT(BLE_CONFIGURE, TRACE_LEVEL_INFO, "BLE: Configure BLE scanning, %d/%d ms, active %d")
+TRACE_FORMAT(BLE_DEVICE_FOUND, TRACE_LEVEL_DEBUG, "APP: Found BLE device with matching name and appropriate RSSI: %A RSSI = %d")
+TRACE_FORMAT(BLE_PRESENCE_FULL, TRACE_LEVEL_WARNING, "APP: WARNING - Presence table full, device ignored: %A")
+TRACE_FORMAT(BLE_SCAN_STARTING, TRACE_LEVEL_DEBUG, "BLE: Starting BLE scan ...")
+TRACE_FORMAT(BLE_SCAN_RETURNED, TRACE_LEVEL_DEBUG, "BLE: Scan returned %d results.")
+TRACE_FORMAT(BLE_CONTINUOUS_START, TRACE_LEVEL_INFO, "BLE: Starting continuous BLE scan ...")
+TRACE_FORMAT(BLE_CONTINUOUS_STOP, TRACE_LEVEL_INFO, "BLE: Stopping continuous BLE scan ...")
+TRACE_FORMAT(BLE_SCAN_MODE, TRACE_LEVEL_INFO, "BLE: Scan mode %s")
+TRACE_FORMAT(MQTT_SUBSCRIBED, TRACE_LEVEL_INFO, "MQTT: Subscribed to %s")
+TRACE_FORMAT(MQTT_SUBSCRIBE_FAILED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Subscription failed: %s")
+TRACE_FORMAT(MQTT_PUBLISHING, TRACE_LEVEL_DEBUG, "MQTT: Publishing %u bytes to '%s'")
+TRACE_FORMAT(MQTT_TOO_LARGE, TRACE_LEVEL_WARNING, "MQTT: WARNING - Message too large, not queued.")
+TRACE_FORMAT(MQTT_RECEIVED, TRACE_LEVEL_DEBUG, "MQTT: Received a message with topic '%s', length %u bytes")
+TRACE_FORMAT(MQTT_SHADOW_NOT_PARSED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Shadow not parsed: %s")
+TRACE_FORMAT(MQTT_DETECT_REJECTED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Desired detect settings rejected: %d")
+TRACE_FORMAT(MQTT_SHADOW_RESYNC, TRACE_LEVEL_INFO, "MQTT: Shadow resync ...")
+TRACE_FORMAT(MQTT_EVENT_DROPPED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Outbox full, event dropped.")
+TRACE_FORMAT(MQTT_TELEMETRY_DROPPED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Outbox full, telemetry page dropped.")
+TRACE_FORMAT(MQTT_TELEMETRY_TOO_LARGE, TRACE_LEVEL_WARNING, "MQTT: WARNING - Telemetry page too large, not published.")
+TRACE_FORMAT(MQTT_CONNECTED, TRACE_LEVEL_INFO, "MQTT: Connected to AWS IoT Core!")
+TRACE_FORMAT(STORE_NO_CARD, TRACE_LEVEL_WARNING, "STORE: WARNING - No SD card, messages are not kept while offline.")
+TRACE_FORMAT(STORE_RECOVERED, TRACE_LEVEL_INFO, "STORE: %u segment(s) to replay, newest holds %u records%s")
+TRACE_FORMAT(STORE_EVICTED, TRACE_LEVEL_WARNING, "STORE: WARNING - Storage full, oldest segment evicted.")
+TRACE_FORMAT(STORE_DROPPED, TRACE_LEVEL_WARNING, "STORE: WARNING - Message not stored, dropped.")
+TRACE_FORMAT(LINK_STATE, TRACE_LEVEL_INFO, "LINK: %s")
+TRACE_FORMAT(LINK_LOST, TRACE_LEVEL_WARNING, "LINK: WARNING - Connection lost.")
+TRACE_FORMAT(WIFI_CONNECTED, TRACE_LEVEL_INFO, "WiFi: Successfully connected to network %s")
+TRACE_FORMAT(TIME_NOT_SET, TRACE_LEVEL_WARNING, "Failed to retrieve stored time.")
+TRACE_FORMAT(PIPELINE_SCAN, TRACE_LEVEL_INFO, "PIPELINE: scan ring %u queued (high water %u), %u dropped, wait max %u ms")
+TRACE_FORMAT(PIPELINE_AGGREGATE, TRACE_LEVEL_INFO, "PIPELINE: aggregate %u runs, mean %u us, max %u us, %u events dropped")
+TRACE_FORMAT(PIPELINE_OUTBOX, TRACE_LEVEL_INFO, "PIPELINE: outbox %u queued (high water %u), %u refused, wait max %u ms")
+TRACE_FORMAT(PIPELINE_NETWORK, TRACE_LEVEL_INFO, "PIPELINE: network %u sent, publish mean %u us, max %u us, %u stored, %u replayed")
+TRACE_FORMAT(PIPELINE_SCAN_MODE, TRACE_LEVEL_INFO, "PIPELINE: scan mode %s, %u switches, scanning %u%% of the time, %u%% actively")
+TRACE_FORMAT(PIPELINE_CLOCK, TRACE_LEVEL_INFO, "PIPELINE: clock %s, %u syncs, %u steps, last error %d ms, drift %d ppm")
+TRACE_FORMAT(PIPELINE_TRACE, TRACE_LEVEL_INFO, "PIPELINE: trace %u written, %u dropped, ring high water %u")
+TRACE_FORMAT(MQTT_ALLOWLIST_REJECTED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Allowlist changes rejected: %d")
+TRACE_FORMAT(ALLOWLIST_LOADED, TRACE_LEVEL_INFO, "ALLOWLIST: %u registered badges")
+TRACE_FORMAT(ALLOWLIST_NOT_LOADED, TRACE_LEVEL_WARNING, "ALLOWLIST: WARNING - Saved list damaged, to be sent again.")
+TRACE_FORMAT(ALLOWLIST_CHANGED, TRACE_LEVEL_INFO, "ALLOWLIST: %u changes, %u registered badges%s")
+TRACE_FORMAT(ALLOWLIST_FULL, TRACE_LEVEL_WARNING, "ALLOWLIST: WARNING - Full, %u badges not registered.")
+TRACE_FORMAT(ALLOWLIST_NOT_SAVED, TRACE_LEVEL_WARNING, "ALLOWLIST: WARNING - Not saved, lost on restart.")
+TRACE_FORMAT(MQTT_RETRANSMITTING, TRACE_LEVEL_INFO, "MQTT: Not acknowledged, retransmitting packet %u, attempt %u")
+TRACE_FORMAT(MQTT_NOT_ACKNOWLEDGED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Message not acknowledged after %u attempts, kept in the log.")
+TRACE_FORMAT(TLS_HANDSHAKE, TRACE_LEVEL_INFO, "TLS: Connected in %u ms, TCP connection and handshake.")
+TRACE_FORMAT(REMINDER, TRACE_LEVEL_INFO, "APP: Reminder for %A, no dispenser use during the visit")
+TRACE_FORMAT(MQTT_SHADOW_UPDATE_REJECTED, TRACE_LEVEL_WARNING, "MQTT: WARNING - Shadow update %d rejected: %d %s")
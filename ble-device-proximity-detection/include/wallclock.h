@@ -0,0 +1,48 @@
+/*
+ * wallclock.h
+ *
+ * Time of day for timestamps, in ms since Unix Epoch. Anchored to the
+ * system time SNTP sets, then carried on hal_millis(): converting a
+ * timestamp is one add, nothing waits for NTP. The system time is
+ * sampled again every WALLCLOCK_SYNC_INTERVAL ms; the error found is
+ * slewed in, the clock running at most WALLCLOCK_SLEW_PPM faster or
+ * slower, so timestamps never go backwards. Only errors beyond
+ * WALLCLOCK_STEP_THRESHOLD are stepped. The drift of the crystal
+ * against NTP is measured from the errors and corrected between
+ * samples.
+ *
+ * Until NTP has answered the time is not known: timestamps are
+ * WALLCLOCK_UNSYNCED, which messages carry as null.
+ */
+
+#ifndef WALLCLOCK_H
+#define WALLCLOCK_H
+
+#include <stdint.h>
+
+#define WALLCLOCK_UNSYNCED 0
+#define WALLCLOCK_SYNC_INTERVAL 3600000 // ms, as often as SNTP polls in the ESP32 core
+#define WALLCLOCK_RETRY_INTERVAL 1000   // ms while NTP has not answered
+#define WALLCLOCK_SLEW_PPM 500          // 0.5 ms per second
+#define WALLCLOCK_STEP_THRESHOLD 1000   // ms
+#define WALLCLOCK_DRIFT_MAX 200         // ppm, beyond any crystal
+
+typedef struct
+{
+    bool synced;
+    uint64_t epoch;      // ms since Unix Epoch at updated
+    uint32_t updated;    // hal_millis()
+    int64_t fraction;    // ns not yet in epoch
+    int64_t slew;        // ns still to be slewed in
+    int32_t drift;       // ppm the clock is corrected by
+    uint32_t last_sync;  // hal_millis() of the last sample, or attempt
+    int32_t error;       // ms, NTP minus the clock at the last sample
+    uint32_t syncs;      // samples of the system time
+    uint32_t steps;      // errors stepped instead of slewed
+} wallclock_t;
+
+void wallclock_init(wallclock_t *clock, const uint32_t now);
+void wallclock_update(wallclock_t *clock, const uint32_t now);
+uint64_t wallclock_time(const wallclock_t *clock, const uint32_t millis);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * adv_filter.cpp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "adv_filter.h"
+
+void adv_filter_init(adv_filter_t *filter, const char *name_prefix, const int rssi_threshold)
+{
+    snprintf(filter->name_prefix, sizeof(filter->name_prefix), "%s", name_prefix);
+    filter->name_prefix_length = strlen(filter->name_prefix);
+    filter->rssi_threshold = rssi_threshold;
+}
+
+// Walks the AD structures (length, type, data) and returns the local
+// name, preferring the complete over the shortened one. The name is not
+// NUL terminated. Returns NULL if there is none or the data is malformed.
+const uint8_t *adv_find_name(const uint8_t *payload, const size_t length, size_t *name_length)
+{
+    const uint8_t *name = NULL;
+    size_t offset = 0;
+
+    while (offset + 1 < length)
+    {
+        const size_t structure_length = payload[offset];
+        if (structure_length == 0 || offset + 1 + structure_length > length)
+        {
+            break;
+        }
+
+        const uint8_t type = payload[offset + 1];
+        if (type == ADV_TYPE_COMPLETE_LOCAL_NAME ||
+            (type == ADV_TYPE_SHORTENED_LOCAL_NAME && name == NULL))
+        {
+            name = &payload[offset + 2];
+            *name_length = structure_length - 1;
+            if (type == ADV_TYPE_COMPLETE_LOCAL_NAME)
+            {
+                break;
+            }
+        }
+        offset += 1 + structure_length;
+    }
+
+    return name;
+}
+
+bool adv_filter_match(
+    const adv_filter_t *filter,
+    const uint8_t *payload,
+    const size_t length,
+    const int rssi)
+{
+    if (rssi < filter->rssi_threshold)
+    {
+        return false;
+    }
+
+    size_t name_length;
+    const uint8_t *name = adv_find_name(payload, length, &name_length);
+    if (name == NULL)
+    {
+        return filter->name_prefix_length == 0;
+    }
+
+    return name_length >= filter->name_prefix_length &&
+           memcmp(name, filter->name_prefix, filter->name_prefix_length) == 0;
+}
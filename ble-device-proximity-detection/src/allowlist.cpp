@@ -0,0 +1,265 @@
+/*
+ * allowlist.cpp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "presence.h"
+#include "store.h"
+#include "allowlist.h"
+
+#define ALLOWLIST_PAGE_KEY_SIZE 16 // a settings key of at most 15 characters + NUL
+
+// Page keys are the settings key and the page number, 3 digits at most.
+static_assert((ALLOWLIST_CAPACITY + ALLOWLIST_PAGE_ENTRIES - 1) / ALLOWLIST_PAGE_ENTRIES <= UINT8_MAX + 1, "page numbers must fit a uint8_t");
+static_assert(sizeof(ALLOWLIST_SETTINGS_KEY) + 3 <= ALLOWLIST_PAGE_KEY_SIZE, "page keys must fit a settings key");
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t crc;
+} allowlist_header_t;
+
+// Aggregation stage only, a page in flash as it is read or written.
+static uint8_t page_buffer[ALLOWLIST_PAGE_ENTRIES * HAL_BLE_ADDRESS_LENGTH];
+
+void allowlist_init(allowlist_t *list)
+{
+    list->counts[0] = 0;
+    list->counts[1] = 0;
+    list->active.store(0);
+    list->readers[0].store(0);
+    list->readers[1].store(0);
+    list->changes = 0;
+    list->refused = 0;
+}
+
+// Index of the first key not less than key.
+static size_t lower_bound(const uint64_t *keys, const size_t count, const uint64_t key)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (keys[middle] < key)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Any task. The copy in effect is pinned before it is read; if another
+// took effect meanwhile the pin may be on the copy being rewritten, it
+// is let go and the new one pinned instead.
+allowlist_lookup_t allowlist_lookup(allowlist_t *list, const uint8_t *address)
+{
+    uint32_t copy = list->active.load();
+    for (;;)
+    {
+        list->readers[copy].fetch_add(1);
+        const uint32_t active = list->active.load();
+        if (active == copy)
+        {
+            break;
+        }
+        list->readers[copy].fetch_sub(1);
+        copy = active;
+    }
+
+    allowlist_lookup_t result = ALLOWLIST_EMPTY;
+    const size_t count = list->counts[copy];
+    if (count > 0)
+    {
+        const uint64_t key = presence_key(address);
+        const size_t index = lower_bound(list->keys[copy], count, key);
+        result = index < count && list->keys[copy][index] == key ? ALLOWLIST_MEMBER : ALLOWLIST_STRANGER;
+    }
+    list->readers[copy].fetch_sub(1);
+    return result;
+}
+
+// Badges registered, aggregation stage.
+uint32_t allowlist_size(const allowlist_t *list)
+{
+    return list->counts[list->active.load()];
+}
+
+// Aggregation stage: applies the changes in order to the copy not in
+// effect, then makes it the one in effect. A change is applied unless
+// it adds a badge to a full list; adding a badge already registered or
+// removing one that is not changes nothing but counts as applied.
+// Returns the number of changes that made a difference.
+size_t allowlist_apply(allowlist_t *list, allowlist_change_t *changes, const size_t count)
+{
+    const uint32_t current = list->active.load();
+    const uint32_t next = current ^ 1;
+
+    // Lookups that pinned the next copy before the previous change took
+    // effect are done in microseconds.
+    while (list->readers[next].load() != 0)
+    {
+    }
+
+    uint64_t *keys = list->keys[next];
+    size_t size = list->counts[current];
+    memcpy(keys, list->keys[current], size * sizeof(keys[0]));
+
+    size_t changed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        allowlist_change_t *change = &changes[i];
+        const size_t index = lower_bound(keys, size, change->key);
+        const bool member = index < size && keys[index] == change->key;
+
+        change->applied = true;
+        if (change->add && !member)
+        {
+            if (size >= ALLOWLIST_CAPACITY)
+            {
+                change->applied = false;
+                list->refused++;
+                continue;
+            }
+            memmove(&keys[index + 1], &keys[index], (size - index) * sizeof(keys[0]));
+            keys[index] = change->key;
+            size++;
+            changed++;
+        }
+        else if (!change->add && member)
+        {
+            memmove(&keys[index], &keys[index + 1], (size - index - 1) * sizeof(keys[0]));
+            size--;
+            changed++;
+        }
+    }
+
+    list->counts[next] = (uint32_t)size;
+    list->active.store(next);
+    list->changes += changed;
+    return changed;
+}
+
+static void page_key(char *key, const uint8_t page)
+{
+    snprintf(key, ALLOWLIST_PAGE_KEY_SIZE, "%s%u", ALLOWLIST_SETTINGS_KEY, (unsigned)page);
+}
+
+// Aggregation stage, before the scan starts. An empty list if nothing
+// was ever saved; false, and an empty list, if what was saved does not
+// check out.
+bool allowlist_load(allowlist_t *list)
+{
+    allowlist_init(list);
+
+    allowlist_header_t header;
+    const size_t length = hal_settings_read(ALLOWLIST_SETTINGS_KEY, (uint8_t *)&header, sizeof(header));
+    if (length == 0)
+    {
+        return true;
+    }
+    if (length != sizeof(header) || header.magic != ALLOWLIST_MAGIC || header.count > ALLOWLIST_CAPACITY)
+    {
+        return false;
+    }
+
+    uint64_t *keys = list->keys[0];
+    uint32_t crc = 0;
+    for (size_t first = 0; first < header.count; first += ALLOWLIST_PAGE_ENTRIES)
+    {
+        const size_t entries = header.count - first < ALLOWLIST_PAGE_ENTRIES ? header.count - first : ALLOWLIST_PAGE_ENTRIES;
+        char key[ALLOWLIST_PAGE_KEY_SIZE];
+        page_key(key, (uint8_t)(first / ALLOWLIST_PAGE_ENTRIES));
+        if (hal_settings_read(key, page_buffer, sizeof(page_buffer)) != entries * HAL_BLE_ADDRESS_LENGTH)
+        {
+            return false;
+        }
+        crc = store_crc32(crc, page_buffer, entries * HAL_BLE_ADDRESS_LENGTH);
+        for (size_t i = 0; i < entries; i++)
+        {
+            keys[first + i] = presence_key(&page_buffer[i * HAL_BLE_ADDRESS_LENGTH]);
+            if (first + i > 0 && keys[first + i] <= keys[first + i - 1])
+            {
+                return false;
+            }
+        }
+    }
+    if (crc != header.crc)
+    {
+        return false;
+    }
+    list->counts[0] = header.count;
+    return true;
+}
+
+// Aggregation stage: the pages, then the header that makes them valid.
+// Pages beyond the count are left as they are.
+bool allowlist_save(const allowlist_t *list)
+{
+    const uint32_t copy = list->active.load();
+    const uint64_t *keys = list->keys[copy];
+    allowlist_header_t header = {ALLOWLIST_MAGIC, list->counts[copy], 0};
+
+    for (size_t first = 0; first < header.count; first += ALLOWLIST_PAGE_ENTRIES)
+    {
+        const size_t entries = header.count - first < ALLOWLIST_PAGE_ENTRIES ? header.count - first : ALLOWLIST_PAGE_ENTRIES;
+        for (size_t i = 0; i < entries; i++)
+        {
+            presence_address(keys[first + i], &page_buffer[i * HAL_BLE_ADDRESS_LENGTH]);
+        }
+        char key[ALLOWLIST_PAGE_KEY_SIZE];
+        page_key(key, (uint8_t)(first / ALLOWLIST_PAGE_ENTRIES));
+        if (!hal_settings_write(key, page_buffer, entries * HAL_BLE_ADDRESS_LENGTH))
+        {
+            return false;
+        }
+        header.crc = store_crc32(header.crc, page_buffer, entries * HAL_BLE_ADDRESS_LENGTH);
+    }
+    return hal_settings_write(ALLOWLIST_SETTINGS_KEY, (const uint8_t *)&header, sizeof(header));
+}
+
+static int hex_digit(const char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parses "aa:bb:cc:dd:ee:ff", either case, as ble_scan_format_address()
+// writes it. 00:00:00:00:00:00 is no address.
+bool allowlist_parse_address(const char *text, uint8_t *address)
+{
+    if (text == NULL)
+    {
+        return false;
+    }
+    for (int i = 0; i < HAL_BLE_ADDRESS_LENGTH; i++)
+    {
+        const int high = hex_digit(text[0]);
+        const int low = high < 0 ? -1 : hex_digit(text[1]);
+        const char separator = i < HAL_BLE_ADDRESS_LENGTH - 1 ? ':' : '\0';
+        if (low < 0 || text[2] != separator)
+        {
+            return false;
+        }
+        address[i] = (uint8_t)(high << 4 | low);
+        text += 3;
+    }
+    return presence_key(address) != 0;
+}
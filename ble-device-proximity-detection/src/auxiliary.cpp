@@ -18,18 +18,16 @@ void retrieve_and_store_NTP_time(const char *ntp_server, const int tz_gmt_offset
 }
 
 // Retrieves stored time_t object and returns seconds since
-// Unix Epoch time.
+// Unix Epoch time, 0 until NTP has answered. Unlike getLocalTime(),
+// which waits up to 5 s for the answer, this returns right away.
 unsigned long get_stored_time()
 {
-  time_t seconds_since_epoch;
-  struct tm time_info;
+  const time_t seconds_since_epoch = time(NULL);
 
-  if (!getLocalTime(&time_info))
+  if (seconds_since_epoch <= 1600000000L)
   {
-    DEBUG_SERIAL_PRINTLN("Failed to retrieve stored time.");
+    DEBUG_TRACE(TIME_NOT_SET);
     return (0);
   }
-
-  time(&seconds_since_epoch);
   return seconds_since_epoch;
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+/*
+ * batch.cpp
+ */
+
+#include "batch.h"
+
+void batch_clear(batch_t *batch)
+{
+    batch->records = 0;
+    batch->bytes = 0;
+    batch->first_time = 0;
+}
+
+// Whether a record of the given size can still be added.
+bool batch_fits(const batch_t *batch, const batch_policy_t *policy, const uint32_t bytes)
+{
+    return batch->records < policy->max_records && batch->bytes + bytes <= policy->max_bytes;
+}
+
+void batch_add(batch_t *batch, const uint32_t bytes, const uint32_t now)
+{
+    if (batch->records == 0)
+    {
+        batch->first_time = now;
+    }
+    batch->records++;
+    batch->bytes += bytes;
+}
+
+// For records that are state rather than a stream (a badge changing
+// zone twice is still one record): replaces the totals, the age runs
+// from the time the batch last became non-empty.
+void batch_set(batch_t *batch, const uint32_t records, const uint32_t bytes, const uint32_t now)
+{
+    if (records == 0)
+    {
+        batch_clear(batch);
+        return;
+    }
+    if (batch->records == 0)
+    {
+        batch->first_time = now;
+    }
+    batch->records = records;
+    batch->bytes = bytes;
+}
+
+bool batch_due(const batch_t *batch, const batch_policy_t *policy, const uint32_t now)
+{
+    if (batch->records == 0)
+    {
+        return false;
+    }
+    return batch->records >= policy->max_records ||
+           batch->bytes >= policy->max_bytes ||
+           now - batch->first_time >= policy->max_age;
+}
@@ -0,0 +1,70 @@
+/*
+ * ble_ring.cpp
+ */
+
+#include "ble_ring.h"
+
+static_assert((BLE_RING_CAPACITY & (BLE_RING_CAPACITY - 1)) == 0, "BLE_RING_CAPACITY must be a power of two");
+
+// Head and tail run freely and wrap at 2^32, the slot index is taken
+// modulo the capacity. Each index is written by one side only, the
+// release/acquire pairs publish the record contents to the other side.
+
+void ble_ring_init(ble_ring_t *ring)
+{
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->pushed.store(0);
+    ring->dropped.store(0);
+    ring->overflows.store(0);
+    ring->high_water.store(0);
+    ring->full = false;
+}
+
+bool ble_ring_push(ble_ring_t *ring, const ble_scan_record_t *record)
+{
+    const uint32_t head = ring->head.load(std::memory_order_relaxed);
+    const uint32_t tail = ring->tail.load(std::memory_order_acquire);
+    const uint32_t size = head - tail;
+
+    if (size >= BLE_RING_CAPACITY)
+    {
+        if (!ring->full)
+        {
+            ring->full = true;
+            ring->overflows.fetch_add(1, std::memory_order_relaxed);
+        }
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    ring->full = false;
+    ring->records[head & (BLE_RING_CAPACITY - 1)] = *record;
+    ring->head.store(head + 1, std::memory_order_release);
+    ring->pushed.fetch_add(1, std::memory_order_relaxed);
+    if (size + 1 > ring->high_water.load(std::memory_order_relaxed))
+    {
+        ring->high_water.store(size + 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool ble_ring_pop(ble_ring_t *ring, ble_scan_record_t *record)
+{
+    const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    const uint32_t head = ring->head.load(std::memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    *record = ring->records[tail & (BLE_RING_CAPACITY - 1)];
+    ring->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+uint32_t ble_ring_size(const ble_ring_t *ring)
+{
+    return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+}
@@ -2,118 +2,198 @@
  * ble_scan.cpp
  */
 
-#include <Arduino.h>
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEScan.h>
-#include <BLEAdvertisedDevice.h>
-#include <ArduinoJson.h>
+#include <string.h>
 #include "debug2serial.h"
-#include "auxiliary.h"
+#include "hal.h"
+#include "adv_filter.h"
+#include "allowlist.h"
+#include "ble_ring.h"
+#include "metrics.h"
+#include "presence.h"
 #include "ble_scan.h"
 
-BLEScan *ble_scan_init(
+typedef struct
+{
+    adv_filter_t filter;
+    allowlist_t *allowlist;
+    presence_table_t *presence;
+} ble_scan_context_t;
+
+// Continuous scan: filter and allowlist used by the producer and the
+// ring buffer between the BLE stack and loop().
+static adv_filter_t continuous_filter;
+static allowlist_t *continuous_allowlist = NULL;
+static ble_ring_t ring;
+static uint32_t ring_drained = 0;
+static uint32_t ring_wait_max = 0;
+static uint32_t ring_wait_total = 0;
+
+void ble_scan_init(
     const int detect_ble_scan_interval,
     const int detect_ble_scan_window)
 {
-    DEBUG_SERIAL_PRINTLN("BLE: Setup BLE scanning ...");
-    BLEDevice::init("");
-    BLEScan *pBLEScan = BLEDevice::getScan(); //create new scan
-    pBLEScan->setActiveScan(BLE_SCAN_SETUP_ACTIVE_SCAN);
-    ble_scan_configure(pBLEScan, detect_ble_scan_interval, detect_ble_scan_window);
-
-    return pBLEScan;
+    DEBUG_TRACE(BLE_SETUP);
+    hal_ble_init(BLE_SCAN_SETUP_ACTIVE_SCAN);
+    ble_scan_configure(detect_ble_scan_interval, detect_ble_scan_window, BLE_SCAN_SETUP_ACTIVE_SCAN);
 }
 
+// Takes effect right away, a continuous scan is restarted with the new
+// parameters.
 void ble_scan_configure(
-    BLEScan *pBLEScan,
     const int detect_ble_scan_interval,
-    const int detect_ble_scan_window)
+    const int detect_ble_scan_window,
+    const bool active_scan)
+{
+    DEBUG_TRACE(BLE_CONFIGURE, detect_ble_scan_interval, detect_ble_scan_window, active_scan);
+    hal_ble_configure(detect_ble_scan_interval, detect_ble_scan_window, active_scan);
+}
+
+// Formats the address like BLEAddress::toString(), "aa:bb:cc:dd:ee:ff".
+void ble_scan_format_address(const uint8_t *address, char *id)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < HAL_BLE_ADDRESS_LENGTH; i++)
+    {
+        *id++ = hex[address[i] >> 4];
+        *id++ = hex[address[i] & 0x0f];
+        *id++ = i < HAL_BLE_ADDRESS_LENGTH - 1 ? ':' : '\0';
+    }
+}
+
+// Registered badges by address before anything else, if there are
+// any, badges by name prefix otherwise. Either above the RSSI floor.
+static bool ble_scan_match(
+    const adv_filter_t *filter,
+    allowlist_t *allowlist,
+    const hal_ble_advertisement_t *advertisement)
+{
+    const allowlist_lookup_t lookup = allowlist ? allowlist_lookup(allowlist, advertisement->address) : ALLOWLIST_EMPTY;
+    if (lookup == ALLOWLIST_EMPTY)
+    {
+        return adv_filter_match(filter, advertisement->payload, advertisement->payload_length, advertisement->rssi);
+    }
+    return lookup == ALLOWLIST_MEMBER && advertisement->rssi >= filter->rssi_threshold;
+}
+
+// Advertisements failing the filter cost a binary search or a
+// comparison or two and a count, only matches are traced and recorded.
+static void ble_scan_result(const hal_ble_advertisement_t *advertisement, void *context)
 {
-    DEBUG_SERIAL_PRINTLN("BLE: Configure BLE scanning ...");
-    pBLEScan->setInterval(detect_ble_scan_interval);
-    pBLEScan->setWindow(detect_ble_scan_window);
+    ble_scan_context_t *scan = (ble_scan_context_t *)context;
+    const int rssi = advertisement->rssi;
+
+    metrics_count(METRIC_ADV_SEEN);
+    if (!ble_scan_match(&scan->filter, scan->allowlist, advertisement))
+    {
+        return;
+    }
+
+    metrics_count(METRIC_ADV_MATCHED);
+    DEBUG_TRACE(BLE_DEVICE_FOUND, trace_address(advertisement->address), rssi);
+    if (!presence_update(scan->presence, advertisement->address, rssi, hal_millis()))
+    {
+        DEBUG_TRACE(BLE_PRESENCE_FULL, trace_address(advertisement->address));
+    }
 }
 
-void ble_scan(
-    BLEScan *pBLEScan,
+int ble_scan(
     const int detect_ble_scan_duration,
-    const String detect_name_prefix,
+    const char *detect_name_prefix,
     const int detect_rssi_threshold,
-    JsonArray *jsonArray)
+    allowlist_t *allowlist,
+    presence_table_t *presence)
 {
-    DEBUG_SERIAL_PRINTLN("BLE: Starting BLE scan ...");
-    BLEScanResults bleScanResult = pBLEScan->start(BLE_SCAN_SETUP_DURATION);
-    int ble_scan_result_size = bleScanResult.getCount();
-    DEBUG_SERIAL_PRINT("BLE: Scan returned ");
-    DEBUG_SERIAL_PRINT(ble_scan_result_size);
-    DEBUG_SERIAL_PRINTLN(" results.");
-
-    while (ble_scan_result_size-- > 0)
+    ble_scan_context_t scan;
+    adv_filter_init(&scan.filter, detect_name_prefix, detect_rssi_threshold);
+    scan.allowlist = allowlist;
+    scan.presence = presence;
+
+    DEBUG_TRACE(BLE_SCAN_STARTING);
+    const uint32_t start = hal_micros();
+    int ble_scan_result_size = hal_ble_scan(detect_ble_scan_duration, ble_scan_result, &scan);
+    metrics_record(METRIC_SCAN_US, hal_micros() - start);
+    DEBUG_TRACE(BLE_SCAN_RETURNED, ble_scan_result_size);
+
+    return ble_scan_result_size;
+}
+
+// Producer side of the continuous scan, runs in the BLE stack's task:
+// filters and queues a compact record, nothing else.
+static void ble_scan_continuous_result(const hal_ble_advertisement_t *advertisement, void *context)
+{
+    metrics_count(METRIC_ADV_SEEN);
+    if (!ble_scan_match(&continuous_filter, continuous_allowlist, advertisement))
+    {
+        return;
+    }
+    metrics_count(METRIC_ADV_MATCHED);
+
+    ble_scan_record_t record;
+    memcpy(record.address, advertisement->address, HAL_BLE_ADDRESS_LENGTH);
+    record.rssi = (int8_t)advertisement->rssi;
+    record.reserved = 0;
+    record.time = hal_millis();
+    if (!ble_ring_push(&ring, &record))
+    {
+        metrics_count(METRIC_ADV_DROPPED);
+    }
+}
+
+void ble_scan_start(
+    const char *detect_name_prefix,
+    const int detect_rssi_threshold,
+    allowlist_t *allowlist)
+{
+    DEBUG_TRACE(BLE_CONTINUOUS_START);
+    adv_filter_init(&continuous_filter, detect_name_prefix, detect_rssi_threshold);
+    continuous_allowlist = allowlist;
+    // No callback runs: the scan was never started or hal_ble_scan_stop()
+    // waited for the last one.
+    ble_ring_init(&ring);
+    ring_drained = 0;
+    ring_wait_max = 0;
+    ring_wait_total = 0;
+    hal_ble_scan_start(ble_scan_continuous_result, NULL);
+}
+
+void ble_scan_stop()
+{
+    DEBUG_TRACE(BLE_CONTINUOUS_STOP);
+    hal_ble_scan_stop();
+}
+
+// Consumer side of the continuous scan: moves every queued record into
+// the presence table. Returns the number of records drained.
+int ble_scan_drain(presence_table_t *presence)
+{
+    ble_scan_record_t record;
+    int count = 0;
+    const uint32_t start = hal_micros();
+
+    hal_ble_scan_maintain();
+
+    while (ble_ring_pop(&ring, &record))
     {
-        BLEAdvertisedDevice bleDevice = bleScanResult.getDevice(ble_scan_result_size);
-        String id = bleDevice.getAddress().toString().c_str();
-        String name = bleDevice.getName().c_str();
-        int rssi = bleDevice.getRSSI();
-
-        DEBUG_SERIAL_PRINT("BLE: Scan result #");
-        DEBUG_SERIAL_PRINT(ble_scan_result_size);
-        DEBUG_SERIAL_PRINT(": " + name + " (" + id + ") RSSI = ");
-        DEBUG_SERIAL_PRINTLN(rssi);
-
-        if (name.startsWith(detect_name_prefix) && rssi >= detect_rssi_threshold)
-        {
-            DEBUG_SERIAL_PRINT("APP: Found BLE device with matching name and appropriate RSSI: ");
-            DEBUG_SERIAL_PRINT(name + " (" + id + ") RSSI = ");
-            DEBUG_SERIAL_PRINTLN(rssi);
-            /*
-      int counter = 0;
-      for (JsonVariant v : *jsonArray)
-      {
-        JsonObject o = v.as<JsonObject>();
-        String o_id = o["id"];
-        if (o_id && o_id.compareTo(id) == 0)
-        {
-          counter = o["counter"];
-          o["rssi"] = rssi;
-          o["counter"] = ++counter;
-          o["time"] = get_stored_time();
-#ifdef DEBUG
-          DEBUG_SERIAL_PRINTLN("APP: Updated data for device '" + name + "':");
-          serializeJsonPretty(o, Serial);
-          DEBUG_SERIAL_PRINTLN();
-#endif
-          break;
-        }
-      }
-      if (counter < 1)
-      {
-        JsonObject jsonObject = jsonArray->createNestedObject();
-        jsonObject["id"] = id;
-        jsonObject["name"] = name;
-        jsonObject["rssi"] = rssi;
-        jsonObject["counter"] = 1;
-        jsonObject["time"] = get_stored_time(); 
-#ifdef DEBUG
-        DEBUG_SERIAL_PRINTLN("Scan result:");
-        serializeJsonPretty(jsonObject, Serial);
-        DEBUG_SERIAL_PRINTLN();
-#endif
-        DEBUG_SERIAL_PRINTLN("BLE scan: added device.");
-      }
-      */
-            JsonObject jsonObject = jsonArray->createNestedObject();
-            jsonObject["id"] = id;
-            jsonObject["rssi"] = rssi;
-            jsonObject["time"] = get_stored_time();
-        }
+        presence_update(presence, record.address, record.rssi, record.time);
+        const uint32_t wait = hal_millis() - record.time;
+        ring_wait_max = wait > ring_wait_max ? wait : ring_wait_max;
+        ring_wait_total += wait;
+        count++;
     }
+    ring_drained += count;
+    metrics_record(METRIC_SCAN_US, hal_micros() - start);
 
-#ifdef DEBUG
-    DEBUG_SERIAL_PRINTLN("APP: Found BLE devices:");
-    serializeJsonPretty(*jsonArray, Serial);
-    DEBUG_SERIAL_PRINTLN();
-#endif
+    return count;
+}
 
-    pBLEScan->clearResults();
+void ble_scan_get_statistics(ble_scan_statistics_t *statistics)
+{
+    statistics->received = ring.pushed.load();
+    statistics->dropped = ring.dropped.load();
+    statistics->overflows = ring.overflows.load();
+    statistics->high_water = ring.high_water.load();
+    statistics->queued = ble_ring_size(&ring);
+    statistics->drained = ring_drained;
+    statistics->wait_max = ring_wait_max;
+    statistics->wait_total = ring_wait_total;
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+/*
+ * cbor.cpp
+ */
+
+#include <string.h>
+#include "cbor.h"
+
+#define CBOR_UNSIGNED 0x00
+#define CBOR_NEGATIVE 0x20
+#define CBOR_TEXT 0x60
+#define CBOR_ARRAY 0x80
+#define CBOR_MAP 0xa0
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT32 0xfa
+
+typedef struct
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t length;
+    bool overflowed;
+} cbor_writer_t;
+
+static void cbor_write(cbor_writer_t *writer, const uint8_t *data, const size_t length)
+{
+    if (writer->overflowed || writer->length + length > writer->size)
+    {
+        writer->overflowed = true;
+        return;
+    }
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+// Initial byte and argument of a data item, in as few bytes as possible.
+static void cbor_write_head(cbor_writer_t *writer, const uint8_t major, const uint64_t value)
+{
+    uint8_t head[9];
+    size_t length;
+
+    if (value < 24)
+    {
+        head[0] = major | (uint8_t)value;
+        length = 1;
+    }
+    else
+    {
+        const int bytes = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffULL ? 4 : 8;
+        head[0] = major | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+        for (int i = 0; i < bytes; i++)
+        {
+            head[bytes - i] = (uint8_t)(value >> (8 * i));
+        }
+        length = 1 + bytes;
+    }
+
+    cbor_write(writer, head, length);
+}
+
+static void cbor_write_byte(cbor_writer_t *writer, const uint8_t value)
+{
+    cbor_write(writer, &value, 1);
+}
+
+static void cbor_write_text(cbor_writer_t *writer, const char *text)
+{
+    const size_t length = strlen(text);
+    cbor_write_head(writer, CBOR_TEXT, length);
+    cbor_write(writer, (const uint8_t *)text, length);
+}
+
+static void cbor_write_variant(cbor_writer_t *writer, JsonVariantConst variant)
+{
+    if (variant.isNull())
+    {
+        cbor_write_byte(writer, CBOR_NULL);
+    }
+    else if (variant.is<bool>())
+    {
+        cbor_write_byte(writer, variant.as<bool>() ? CBOR_TRUE : CBOR_FALSE);
+    }
+    else if (variant.is<long long>())
+    {
+        const long long value = variant.as<long long>();
+        if (value < 0)
+        {
+            cbor_write_head(writer, CBOR_NEGATIVE, (uint64_t)(-1 - value));
+        }
+        else
+        {
+            cbor_write_head(writer, CBOR_UNSIGNED, (uint64_t)value);
+        }
+    }
+    else if (variant.is<unsigned long long>())
+    {
+        cbor_write_head(writer, CBOR_UNSIGNED, variant.as<unsigned long long>());
+    }
+    else if (variant.is<float>())
+    {
+        const float value = variant.as<float>();
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        cbor_write_byte(writer, CBOR_FLOAT32);
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            cbor_write_byte(writer, (uint8_t)(bits >> shift));
+        }
+    }
+    else if (variant.is<const char *>())
+    {
+        cbor_write_text(writer, variant.as<const char *>());
+    }
+    else if (variant.is<JsonArrayConst>())
+    {
+        JsonArrayConst array = variant.as<JsonArrayConst>();
+        cbor_write_head(writer, CBOR_ARRAY, array.size());
+        for (JsonVariantConst item : array)
+        {
+            cbor_write_variant(writer, item);
+        }
+    }
+    else if (variant.is<JsonObjectConst>())
+    {
+        JsonObjectConst object = variant.as<JsonObjectConst>();
+        cbor_write_head(writer, CBOR_MAP, object.size());
+        for (JsonPairConst pair : object)
+        {
+            cbor_write_text(writer, pair.key().c_str());
+            cbor_write_variant(writer, pair.value());
+        }
+    }
+    else
+    {
+        cbor_write_byte(writer, CBOR_NULL);
+    }
+}
+
+// Returns the number of bytes written, 0 if the buffer is too small.
+size_t cbor_serialize(JsonVariantConst source, uint8_t *buffer, const size_t size)
+{
+    cbor_writer_t writer = {buffer, size, 0, false};
+    cbor_write_variant(&writer, source);
+    return writer.overflowed ? 0 : writer.length;
+}
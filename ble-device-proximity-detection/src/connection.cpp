@@ -0,0 +1,210 @@
+/*
+ * connection.cpp
+ */
+
+#include <string.h>
+#include <atomic>
+#include "debug2serial.h"
+#include "hal.h"
+#include "metrics.h"
+#include "connection.h"
+
+static const connection_config_t *config;
+static connection_statistics_t status; // state aside, network task only
+static std::atomic<connection_state_t> state(CONNECTION_WIFI_DOWN);
+
+static const char *const state_names[] = {"wifi-down", "wifi-joining", "tls", "mqtt", "online"};
+
+const char *connection_state_name(const connection_state_t state)
+{
+    return state_names[state];
+}
+
+// "Equal jitter": half of the exponential delay is fixed, the other half
+// random, so retries never bunch up at zero but still spread over a
+// window that doubles with every failure. With no failure yet (a lost
+// link) the wait is random within the base delay.
+uint32_t connection_backoff(const uint32_t attempts, const uint32_t base)
+{
+    if (attempts == 0)
+    {
+        return hal_random(base);
+    }
+    uint32_t delay = CONNECTION_BACKOFF_MAX;
+    if (attempts <= 16 && (base << (attempts - 1)) < CONNECTION_BACKOFF_MAX)
+    {
+        delay = base << (attempts - 1);
+    }
+    return delay / 2 + hal_random(delay / 2);
+}
+
+static void enter(const connection_state_t next, const uint32_t now)
+{
+    if (next != state.load(std::memory_order_relaxed))
+    {
+        DEBUG_TRACE(LINK_STATE, connection_state_name(next));
+    }
+    state.store(next, std::memory_order_release);
+    status.since = now;
+}
+
+// Waits before the next attempt at the current stage.
+static void back_off(const uint32_t base, const uint32_t now)
+{
+    status.backoff = connection_backoff(status.attempts, base);
+    status.next_attempt = now + status.backoff;
+}
+
+// Failures count up across the stages until one succeeds.
+static void fail(const connection_state_t next, uint32_t *failures, const uint32_t base, const uint32_t now)
+{
+    enter(next, now);
+    status.attempts++;
+    (*failures)++;
+    metrics_count(METRIC_CONNECT_FAILURES);
+    back_off(base, now);
+}
+
+// The link went away: every stage from the one that failed on is redone,
+// the first retry after a random wait.
+static void lost(const uint32_t now)
+{
+    status.outages++;
+    metrics_count(METRIC_LINK_LOST);
+    status.attempts = 0;
+    enter(hal_wifi_connected() ? CONNECTION_TLS : CONNECTION_WIFI_DOWN, now);
+    back_off(CONNECTION_BACKOFF_BASE, now);
+}
+
+void connection_setup(const connection_config_t *connection_config, const uint32_t now)
+{
+    config = connection_config;
+    memset(&status, 0, sizeof(status));
+    state.store(CONNECTION_WIFI_DOWN, std::memory_order_release);
+    status.since = now;
+    status.next_attempt = now;
+}
+
+// Every completed handshake: how much of a reconnect it takes.
+static void handshake_done()
+{
+    hal_tls_get_handshake(&status.handshake);
+    if (!status.handshake.done)
+    {
+        return;
+    }
+    const uint32_t us = status.handshake.us;
+    status.handshakes++;
+    status.handshake_ms_total += us / 1000;
+    status.handshake_ms_max = us / 1000 > status.handshake_ms_max ? us / 1000 : status.handshake_ms_max;
+    metrics_record(METRIC_HANDSHAKE_US, us);
+    DEBUG_TRACE(TLS_HANDSHAKE, us / 1000);
+}
+
+static hal_mqtt_connect_result_t connect_broker()
+{
+    const hal_mqtt_connect_result_t result = hal_mqtt_connect(config->host, config->port);
+    handshake_done();
+    return result;
+}
+
+static bool due(const uint32_t now)
+{
+    return (int32_t)(now - status.next_attempt) >= 0;
+}
+
+connection_state_t connection_step(const uint32_t now)
+{
+    switch (state.load(std::memory_order_relaxed))
+    {
+    case CONNECTION_WIFI_DOWN:
+        if (due(now))
+        {
+            hal_wifi_begin(config->ssid, config->password);
+            enter(CONNECTION_WIFI_JOINING, now);
+        }
+        break;
+
+    case CONNECTION_WIFI_JOINING:
+        if (hal_wifi_connected())
+        {
+            // Gateways rejoining an access point that came back all get
+            // there at once, their TLS handshakes should not.
+            enter(CONNECTION_TLS, now);
+            status.attempts = 0;
+            status.backoff = hal_random(CONNECTION_TLS_SPREAD);
+            status.next_attempt = now + status.backoff;
+            if (config->on_wifi)
+            {
+                config->on_wifi();
+            }
+        }
+        else if (now - status.since >= CONNECTION_WIFI_JOIN_TIMEOUT)
+        {
+            hal_wifi_disconnect();
+            fail(CONNECTION_WIFI_DOWN, &status.failures_wifi, CONNECTION_BACKOFF_BASE, now);
+        }
+        break;
+
+    case CONNECTION_TLS:
+    case CONNECTION_MQTT:
+        if (!hal_wifi_connected())
+        {
+            lost(now);
+            break;
+        }
+        // The server certificate cannot be validated before NTP answered.
+        if (!due(now) || !hal_time_synced())
+        {
+            break;
+        }
+        // The attempt blocks, for up to 30 s with a broker that does not
+        // answer; the backoff runs from when it ended.
+        switch (connect_broker())
+        {
+        case HAL_MQTT_CONNECTED:
+            enter(CONNECTION_ONLINE, hal_millis());
+            status.attempts = 0;
+            status.connects++;
+            metrics_count(METRIC_CONNECTS);
+            if (config->on_connect)
+            {
+                config->on_connect();
+            }
+            break;
+        case HAL_MQTT_TRANSPORT_FAILED:
+            fail(CONNECTION_TLS, &status.failures_tls, CONNECTION_BACKOFF_BASE, hal_millis());
+            break;
+        case HAL_MQTT_REFUSED:
+            fail(CONNECTION_MQTT, &status.failures_mqtt, CONNECTION_REFUSED_BACKOFF_BASE, hal_millis());
+            break;
+        }
+        break;
+
+    case CONNECTION_ONLINE:
+        if (!hal_mqtt_connected() || !hal_wifi_connected())
+        {
+            DEBUG_TRACE(LINK_LOST);
+            lost(now);
+        }
+        break;
+    }
+    return state.load(std::memory_order_relaxed);
+}
+
+connection_state_t connection_state()
+{
+    return state.load(std::memory_order_acquire);
+}
+
+bool connection_online()
+{
+    return state.load(std::memory_order_acquire) == CONNECTION_ONLINE;
+}
+
+// From the task that steps the connection.
+void connection_get_statistics(connection_statistics_t *statistics)
+{
+    *statistics = status;
+    statistics->state = state.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,316 @@
+/*
+ * dashboard.cpp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "ble_scan.h"
+#include "connection.h"
+#include "metrics.h"
+#include "presence.h"
+#include "dashboard.h"
+
+#define DASHBOARD_ROWS_TOP (DASHBOARD_STATUS_LINES * DASHBOARD_LINE_HEIGHT)
+
+// Columns, every line is covered from edge to edge.
+#define DASHBOARD_BADGES_WIDTH 160
+#define DASHBOARD_LINK_WIDTH (HAL_DISPLAY_WIDTH - DASHBOARD_BADGES_WIDTH)
+#define DASHBOARD_COUNT_WIDTH 106
+#define DASHBOARD_STORED_WIDTH (HAL_DISPLAY_WIDTH - 2 * DASHBOARD_COUNT_WIDTH)
+#define DASHBOARD_ID_WIDTH 120
+#define DASHBOARD_ZONE_WIDTH 80
+#define DASHBOARD_RUB_WIDTH (HAL_DISPLAY_WIDTH - DASHBOARD_ID_WIDTH - DASHBOARD_ZONE_WIDTH)
+
+static_assert(DASHBOARD_ROWS_TOP + DASHBOARD_ROWS * DASHBOARD_LINE_HEIGHT <= HAL_DISPLAY_HEIGHT, "rows below the screen");
+
+void dashboard_init(dashboard_t *dashboard)
+{
+    memset(dashboard, 0, sizeof(*dashboard));
+    for (int i = 0; i < DASHBOARD_ROWS; i++)
+    {
+        dashboard->model.rows[i].rub_minutes = DASHBOARD_NO_RUB;
+    }
+}
+
+static void set_row(dashboard_t *dashboard, const int row, const uint64_t key, const uint8_t zone, const uint16_t rub_minutes)
+{
+    dashboard_row_t *shown = &dashboard->model.rows[row];
+    if (shown->key != key || shown->zone != zone || shown->rub_minutes != rub_minutes)
+    {
+        shown->key = key;
+        shown->zone = zone;
+        shown->rub_minutes = rub_minutes;
+        dashboard->model.version++;
+    }
+}
+
+// The row of the badge; for one not shown, a free row or the row of the
+// badge away the longest, -1 if every row has a badge in range.
+static int find_row(dashboard_t *dashboard, const uint64_t key, const bool claim)
+{
+    int away = -1;
+    for (int i = 0; i < DASHBOARD_ROWS; i++)
+    {
+        if (dashboard->model.rows[i].key == key)
+        {
+            return i;
+        }
+    }
+    if (!claim)
+    {
+        return -1;
+    }
+    for (int i = 0; i < DASHBOARD_ROWS; i++)
+    {
+        const dashboard_row_t *row = &dashboard->model.rows[i];
+        if (row->key == 0)
+        {
+            return i;
+        }
+        if (row->zone == PROXIMITY_AWAY &&
+            (away < 0 || (int32_t)(dashboard->away_since[i] - dashboard->away_since[away]) < 0))
+        {
+            away = i;
+        }
+    }
+    return away;
+}
+
+// A badge entering a zone gets a row, leaving one leaves it away until
+// it enters the next; a dwell in the near zone is a dispenser use.
+// Aggregation stage.
+void dashboard_event(dashboard_t *dashboard, const event_t *event)
+{
+    const uint64_t key = presence_key(event->address);
+    const int row = find_row(dashboard, key, event->type == EVENT_ENTER);
+    if (row < 0)
+    {
+        return;
+    }
+    const dashboard_row_t *shown = &dashboard->model.rows[row];
+    switch (event->type)
+    {
+    case EVENT_ENTER:
+        if (shown->key != key)
+        {
+            dashboard->rubbed[row] = false;
+            set_row(dashboard, row, key, event->zone, DASHBOARD_NO_RUB);
+        }
+        else
+        {
+            set_row(dashboard, row, key, event->zone, shown->rub_minutes);
+        }
+        break;
+    case EVENT_DWELL:
+        dashboard->rubbed[row] = true;
+        dashboard->rub_time[row] = event->time;
+        set_row(dashboard, row, key, shown->zone, 0);
+        break;
+    case EVENT_LEAVE:
+        dashboard->away_since[row] = event->time;
+        set_row(dashboard, row, key, PROXIMITY_AWAY, shown->rub_minutes);
+        break;
+    }
+}
+
+static uint16_t clamp_count(const uint16_t count)
+{
+    return count < DASHBOARD_COUNT_MAX ? count : DASHBOARD_COUNT_MAX;
+}
+
+// The status, the minutes since each dispenser use, and rows freed of
+// badges away for DASHBOARD_AWAY_KEEP. Aggregation stage.
+void dashboard_update(dashboard_t *dashboard, const dashboard_status_t *status, const uint32_t now)
+{
+    dashboard_status_t clamped = *status;
+    clamped.queued = clamp_count(status->queued);
+    clamped.unacknowledged = clamp_count(status->unacknowledged);
+    clamped.stored = clamp_count(status->stored);
+    if (memcmp(&clamped, &dashboard->model.status, sizeof(clamped)) != 0)
+    {
+        dashboard->model.status = clamped;
+        dashboard->model.version++;
+    }
+
+    for (int i = 0; i < DASHBOARD_ROWS; i++)
+    {
+        const dashboard_row_t *row = &dashboard->model.rows[i];
+        if (row->key == 0)
+        {
+            continue;
+        }
+        if (row->zone == PROXIMITY_AWAY && now - dashboard->away_since[i] >= DASHBOARD_AWAY_KEEP)
+        {
+            set_row(dashboard, i, 0, PROXIMITY_AWAY, DASHBOARD_NO_RUB);
+            continue;
+        }
+        if (dashboard->rubbed[i])
+        {
+            const uint32_t minutes = (now - dashboard->rub_time[i]) / 60000;
+            set_row(dashboard, i, row->key, row->zone, minutes < DASHBOARD_RUB_MINUTES_MAX ? minutes : DASHBOARD_RUB_MINUTES_MAX);
+        }
+    }
+}
+
+void dashboard_view_init(dashboard_view_t *view, const uint32_t now)
+{
+    memset(view, 0, sizeof(*view));
+    view->window_start = now;
+}
+
+// The next frame draws every cell.
+void dashboard_invalidate(dashboard_view_t *view)
+{
+    view->valid = false;
+}
+
+static void draw(const int x, const int line, const int width, const char *text, const uint16_t foreground, const uint16_t background)
+{
+    hal_display_cell(x, line * DASHBOARD_LINE_HEIGHT, width, DASHBOARD_LINE_HEIGHT, text, foreground, background);
+}
+
+static uint16_t zone_color(const uint8_t zone)
+{
+    switch (zone)
+    {
+    case PROXIMITY_NEAR:
+        return DASHBOARD_GREEN;
+    case PROXIMITY_IN_ROOM:
+        return DASHBOARD_YELLOW;
+    default:
+        return DASHBOARD_GREY;
+    }
+}
+
+static int draw_status(const dashboard_status_t *status, const dashboard_status_t *shown)
+{
+    char text[HAL_DISPLAY_WIDTH / HAL_DISPLAY_CHAR_WIDTH + 1];
+    int cells = 0;
+
+    if (shown == NULL || status->badges != shown->badges)
+    {
+        snprintf(text, sizeof(text), "%u badge%s", status->badges, status->badges == 1 ? "" : "s");
+        draw(0, 0, DASHBOARD_BADGES_WIDTH, text, DASHBOARD_WHITE, DASHBOARD_NAVY);
+        cells++;
+    }
+    if (shown == NULL || status->link != shown->link)
+    {
+        const bool online = status->link == CONNECTION_ONLINE;
+        draw(DASHBOARD_BADGES_WIDTH, 0, DASHBOARD_LINK_WIDTH, connection_state_name((connection_state_t)status->link),
+             online ? DASHBOARD_BLACK : DASHBOARD_WHITE, online ? DASHBOARD_GREEN : DASHBOARD_RED);
+        cells++;
+    }
+    if (shown == NULL || status->queued != shown->queued)
+    {
+        snprintf(text, sizeof(text), "queue %u", status->queued);
+        draw(0, 1, DASHBOARD_COUNT_WIDTH, text, DASHBOARD_WHITE, DASHBOARD_BLACK);
+        cells++;
+    }
+    if (shown == NULL || status->unacknowledged != shown->unacknowledged)
+    {
+        snprintf(text, sizeof(text), "unack %u", status->unacknowledged);
+        draw(DASHBOARD_COUNT_WIDTH, 1, DASHBOARD_COUNT_WIDTH, text, DASHBOARD_WHITE, DASHBOARD_BLACK);
+        cells++;
+    }
+    if (shown == NULL || status->stored != shown->stored)
+    {
+        snprintf(text, sizeof(text), "sd %u", status->stored);
+        draw(2 * DASHBOARD_COUNT_WIDTH, 1, DASHBOARD_STORED_WIDTH, text,
+             status->stored ? DASHBOARD_YELLOW : DASHBOARD_WHITE, DASHBOARD_BLACK);
+        cells++;
+    }
+    return cells;
+}
+
+static int draw_row(const int index, const dashboard_row_t *row, const dashboard_row_t *shown)
+{
+    const int line = DASHBOARD_STATUS_LINES + index;
+    const bool empty = row->key == 0;
+    const bool moved = shown == NULL || row->key != shown->key;
+    char text[HAL_DISPLAY_WIDTH / HAL_DISPLAY_CHAR_WIDTH + 1];
+    int cells = 0;
+
+    if (moved)
+    {
+        // The last three bytes of the address, as on the badge's label.
+        char id[BLE_SCAN_ADDRESS_STRING_SIZE] = "";
+        if (!empty)
+        {
+            uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+            presence_address(row->key, address);
+            ble_scan_format_address(address, id);
+        }
+        draw(0, line, DASHBOARD_ID_WIDTH, empty ? "" : id + 9, DASHBOARD_WHITE, DASHBOARD_BLACK);
+        cells++;
+    }
+    if (moved || row->zone != shown->zone)
+    {
+        draw(DASHBOARD_ID_WIDTH, line, DASHBOARD_ZONE_WIDTH, empty ? "" : proximity_zone_name((proximity_zone_t)row->zone),
+             DASHBOARD_BLACK, empty ? DASHBOARD_BLACK : zone_color(row->zone));
+        cells++;
+    }
+    if (moved || row->rub_minutes != shown->rub_minutes)
+    {
+        if (empty)
+        {
+            text[0] = '\0';
+        }
+        else if (row->rub_minutes == DASHBOARD_NO_RUB)
+        {
+            snprintf(text, sizeof(text), "no rub");
+        }
+        else if (row->rub_minutes == 0)
+        {
+            snprintf(text, sizeof(text), "rub now");
+        }
+        else
+        {
+            snprintf(text, sizeof(text), "rub %um", row->rub_minutes);
+        }
+        draw(DASHBOARD_ID_WIDTH + DASHBOARD_ZONE_WIDTH, line, DASHBOARD_RUB_WIDTH, text,
+             !empty && row->rub_minutes == DASHBOARD_NO_RUB ? DASHBOARD_RED : DASHBOARD_WHITE, DASHBOARD_BLACK);
+        cells++;
+    }
+    return cells;
+}
+
+// Redraws the cells that differ from the screen, nothing if the model is
+// the one shown. Returns the cells drawn. Frames are timed for the
+// frame_us histogram, the time spent drawing over DASHBOARD_CPU_WINDOW
+// is the display_cpu gauge in per mille. Display stage.
+int dashboard_render(dashboard_view_t *view, const dashboard_model_t *model)
+{
+    int cells = 0;
+    if (!view->valid || model->version != view->shown.version)
+    {
+        const uint32_t start = hal_micros();
+        const dashboard_model_t *shown = view->valid ? &view->shown : NULL;
+        cells += draw_status(&model->status, shown ? &shown->status : NULL);
+        for (int i = 0; i < DASHBOARD_ROWS; i++)
+        {
+            cells += draw_row(i, &model->rows[i], shown ? &shown->rows[i] : NULL);
+        }
+        view->shown = *model;
+        view->valid = true;
+
+        const uint32_t elapsed = hal_micros() - start;
+        view->frames++;
+        view->cells += cells;
+        view->frame_us_total += elapsed;
+        view->frame_us_max = elapsed > view->frame_us_max ? elapsed : view->frame_us_max;
+        view->busy_us += elapsed;
+        metrics_count(METRIC_FRAMES);
+        metrics_record(METRIC_FRAME_US, elapsed);
+    }
+
+    const uint32_t now = hal_millis();
+    const uint32_t window = now - view->window_start;
+    if (window >= DASHBOARD_CPU_WINDOW)
+    {
+        view->cpu_permille = view->busy_us / window;
+        metrics_set(METRIC_DISPLAY_CPU, view->cpu_permille);
+        view->busy_us = 0;
+        view->window_start = now;
+    }
+    return cells;
+}
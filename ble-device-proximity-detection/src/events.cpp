@@ -0,0 +1,76 @@
+/*
+ * events.cpp
+ */
+
+#include "events.h"
+
+static void events_emit(
+    const event_type_t type,
+    const presence_entry_t *entry,
+    const proximity_zone_t zone,
+    const uint32_t time,
+    const uint32_t duration,
+    event_callback_t callback,
+    void *context)
+{
+    event_t event;
+    event.type = type;
+    presence_address(entry->key, event.address);
+    event.zone = zone;
+    event.time = time;
+    event.duration = duration;
+    callback(&event, context);
+}
+
+// Feeds the current zone estimate of a badge to its state machine and
+// emits the resulting events. A zone change leaves the old zone and
+// enters the new one (away is never entered or left), staying in the
+// near zone for dwell_time emits a single dwell event.
+// Returns true if the zone changed.
+bool events_update(
+    presence_entry_t *entry,
+    const proximity_zone_t zone,
+    const uint32_t now,
+    const uint32_t dwell_time,
+    event_callback_t callback,
+    void *context)
+{
+    const proximity_zone_t previous = (proximity_zone_t)entry->zone;
+
+    if (zone == previous)
+    {
+        if (zone == PROXIMITY_NEAR && !entry->dwell_reported && now - entry->zone_since >= dwell_time)
+        {
+            entry->dwell_reported = true;
+            events_emit(EVENT_DWELL, entry, zone, now, now - entry->zone_since, callback, context);
+        }
+        return false;
+    }
+
+    if (previous != PROXIMITY_AWAY)
+    {
+        events_emit(EVENT_LEAVE, entry, previous, now, now - entry->zone_since, callback, context);
+    }
+    if (zone != PROXIMITY_AWAY)
+    {
+        events_emit(EVENT_ENTER, entry, zone, now, 0, callback, context);
+    }
+
+    entry->zone = zone;
+    entry->zone_since = now;
+    entry->dwell_reported = false;
+    return true;
+}
+
+const char *events_type_name(const event_type_t type)
+{
+    switch (type)
+    {
+    case EVENT_ENTER:
+        return "enter";
+    case EVENT_DWELL:
+        return "dwell";
+    default:
+        return "leave";
+    }
+}
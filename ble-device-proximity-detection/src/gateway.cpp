@@ -0,0 +1,1388 @@
+/*
+ * gateway.cpp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <ArduinoJson.h>
+
+#define DEBUG
+#include "debug2serial.h"
+
+#include "hal.h"
+#include "proximity.h"
+#include "presence.h"
+#include "events.h"
+#include "batch.h"
+#include "shadow.h"
+#include "telemetry.h"
+#include "store.h"
+#include "outbox.h"
+#include "inflight.h"
+#include "connection.h"
+#include "ble_scan.h"
+#include "scan_schedule.h"
+#include "wallclock.h"
+#include "metrics.h"
+#include "allowlist.h"
+#include "dashboard.h"
+#include "reminder.h"
+#include "gateway.h"
+
+/* GLOBALS
+*/
+
+// Start of the current detection window when scanning continuously.
+unsigned long last_scan_millis = 0;
+
+// Keeping track of time elapsed since the last telemetry message.
+unsigned long last_telemetry_millis = 0;
+
+// BLE scan settings
+int detect_ble_scan_duration = BLE_SCAN_SETUP_DURATION;
+int detect_ble_scan_interval = BLE_SCAN_SETUP_INTERVAL;
+int detect_ble_scan_window = BLE_SCAN_SETUP_WINDOW;
+char detect_name_prefix[GATEWAY_NAME_PREFIX_SIZE] = "RHS";
+int detect_rssi_threshold = -50;
+
+// Badges in range, fed by the BLE scan, and their proximity zones.
+presence_table_t presence;
+proximity_config_t proximity_config;
+
+// Time of day for events and telemetry, carried on hal_millis().
+wallclock_t wallclock;
+
+// Scan mode picked from the badges in range and their zone changes.
+scan_schedule_t scan_schedule;
+bool occupied = false;
+uint16_t badges_in_range = 0;
+
+// Occupancy dashboard: the aggregation stage keeps the model and hands
+// it over in a single slot whenever it changed and the display stage
+// has taken the one before.
+dashboard_t dashboard;
+dashboard_model_t dashboard_handover;
+std::atomic<bool> dashboard_handover_full(false);
+uint32_t dashboard_handed_version = 0;
+
+// Compliance reminders: the aggregation stage follows the visits of the
+// badges through their events, raises a reminder for a visit that
+// became due and hands the time it did over in a single slot, the
+// feedback stage plays the cue.
+reminder_t reminder;
+uint32_t reminder_handover = 0;
+std::atomic<bool> reminder_handover_full(false);
+
+// JSON messages: Device shadow, and its reported state as last published
+StaticJsonDocument<SHADOW_DOCUMENT_SIZE> shadowDocument;
+// DynamicJsonDocument shadowDocument(SHADOW_DOCUMENT_SIZE);
+shadow_state_t shadow;
+
+// Detect settings from the desired state. The network stage reads them
+// off incoming messages, through a filter, and hands them over in a
+// single slot; the aggregation stage applies them before its next run.
+StaticJsonDocument<SHADOW_DESIRED_FILTER_SIZE> desiredFilter;
+StaticJsonDocument<SHADOW_DESIRED_DOCUMENT_SIZE> desiredDocument;
+shadow_detect_t desired_detect;
+bool desired_detect_pending = false;
+// Responses to shadow updates. The network stage reads the client
+// token off update/accepted and update/rejected and hands it over, 0
+// for none; the aggregation stage takes it before its next update.
+StaticJsonDocument<SHADOW_RESPONSE_FILTER_SIZE> responseFilter;
+StaticJsonDocument<SHADOW_RESPONSE_DOCUMENT_SIZE> responseDocument;
+std::atomic<uint32_t> shadow_accepted_token(0);
+std::atomic<uint32_t> shadow_rejected_token(0);
+shadow_detect_t detect_handover;
+std::atomic<bool> detect_handover_full(false);
+
+// Registered badges, looked up by the scan. Changes from the desired
+// state are handed over the same way, the aggregation stage applies and
+// reports them; the network stage gets the shadow again for the rest
+// when there were more than a message takes.
+allowlist_t allowlist;
+shadow_allowlist_t desired_allowlist;
+bool desired_allowlist_pending = false;
+shadow_allowlist_t allowlist_handover;
+std::atomic<bool> allowlist_handover_full(false);
+shadow_allowlist_t allowlist_applied;   // to be reported, aggregation stage
+bool allowlist_report_pending = false;
+bool allowlist_lost = false;            // the saved list did not load
+std::atomic<bool> allowlist_get_requested(false);
+bool allowlist_get_pending = false;     // network stage
+
+// Zone changes wait in the presence table until their batch is due.
+batch_policy_t shadow_batch_policy = {SHADOW_BATCH_MAX_BYTES, SHADOW_BATCH_MAX_RECORDS, SHADOW_BATCH_MAX_AGE};
+batch_t shadow_batch;
+
+// JSON messages: Hand hygiene events, collected until their batch is due
+StaticJsonDocument<EVENT_DOCUMENT_SIZE> eventDocument;
+JsonArray event_records;
+batch_policy_t events_batch_policy = {EVENTS_BATCH_MAX_BYTES, EVENTS_BATCH_MAX_RECORDS, EVENTS_BATCH_MAX_AGE};
+batch_t events_batch;
+uint32_t events_sequence = 0;
+// {"seq":4294967295,"events":[...]} takes 30 bytes around the records.
+static_assert(EVENTS_BATCH_MAX_BYTES + 30 <= OUTBOX_MESSAGE_MAX, "an events batch must fit an outbox message");
+
+// MQTT topics of the thing, built once by gateway_setup()
+char thing_name[GATEWAY_THING_NAME_SIZE];
+char mqtt_topic_shadow_get[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_shadow_get_accepted[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_shadow_update[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_shadow_update_delta[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_shadow_update_accepted[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_shadow_update_rejected[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_events[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_telemetry[GATEWAY_MQTT_TOPIC_SIZE];
+char mqtt_topic_metrics[GATEWAY_MQTT_TOPIC_SIZE];
+
+// Telemetry messages: detection data in the selected wire format
+telemetry_format_t telemetry_format = TELEMETRY_SETUP_FORMAT;
+telemetry_state_t telemetry;
+StaticJsonDocument<TELEMETRY_DOCUMENT_SIZE> telemetryDocument;
+static_assert(OUTBOX_MESSAGE_MAX >= TELEMETRY_BUFFER_SIZE, "a telemetry page must fit an outbox message");
+
+// Metrics messages, and their mirror in the shadow now and then.
+StaticJsonDocument<METRICS_DOCUMENT_SIZE> metricsDocument;
+metrics_snapshot_t metrics_values;
+uint32_t metrics_sequence = 0;
+unsigned long last_metrics_millis = 0;
+unsigned long last_metrics_shadow_millis = 0;
+bool metrics_mirrored = false;
+
+// Messages built by the aggregation stage (gateway_loop()) for the
+// network stage (gateway_network_loop()), which may run on another core.
+outbox_t outbox;
+
+// Statistics: each stage counts into its own copy and publishes it at
+// the end of every run under a sequence counter, odd while it writes.
+// gateway_get_statistics() takes the members of each stage from a
+// consistent copy, from any task.
+typedef struct
+{
+  std::atomic<uint32_t> sequence;
+  gateway_statistics_t values;
+} statistics_snapshot_t;
+gateway_statistics_t aggregate_statistics;
+gateway_statistics_t network_statistics;
+statistics_snapshot_t aggregate_snapshot;
+statistics_snapshot_t network_snapshot;
+
+// Messages kept on the SD card while offline, replayed at a limited
+// rate once connected again, next to live ones. Network stage only.
+store_t store;
+uint8_t store_buffer[STORE_RECORD_MAX];
+unsigned long last_replay_millis = 0;
+
+// Shadow updates in the log, not replayed yet: live ones wait behind
+// them, so an older update does not set the reported state back. A log
+// recovered at start may hold any number of them, SHADOW_STORED_UNKNOWN
+// counts as many as there are until the log is empty.
+#define SHADOW_STORED_UNKNOWN UINT32_MAX
+uint32_t shadow_stored = 0;
+
+// Events and telemetry published with QoS 1 that the broker has not
+// acknowledged yet. Network stage only.
+inflight_t inflight;
+
+// The replayed record in flight, it stays first in the log until its
+// PUBACK. NULL if none is. Dropped without the PUBACK should the log
+// evict its segment meanwhile.
+const inflight_message_t *replay_message = NULL;
+size_t replay_length = 0;
+uint32_t replay_evicted = 0;
+
+/* FUNCTIONS
+*/
+
+// ArduinoJson reads the message straight from the MQTT client.
+struct MqttReader
+{
+  int read()
+  {
+    return hal_mqtt_read();
+  }
+
+  size_t readBytes(char *buffer, size_t length)
+  {
+    size_t count = 0;
+    int c;
+    while (count < length && (c = hal_mqtt_read()) >= 0)
+    {
+      buffer[count++] = (char)c;
+    }
+    return count;
+  }
+};
+
+// Subscribe to the given MQTT topic.
+void subscribe_MQTT_topic(const char *topic)
+{
+  // Subscribe to an MQTT topic.
+  if (hal_mqtt_subscribe(topic))
+  {
+    DEBUG_TRACE(MQTT_SUBSCRIBED, topic);
+  }
+  else
+  {
+    DEBUG_TRACE(MQTT_SUBSCRIBE_FAILED, topic);
+  }
+}
+
+// Publishes a binary MQTT message to the MQTT broker. The thing must
+// have authorization to publish to the topic, otherwise the connection
+// to AWS IoT Core will disconnect.
+bool publish_MQTT_message(const char *topic, const uint8_t *payload, const size_t length)
+{
+  DEBUG_TRACE(MQTT_PUBLISHING, length, topic);
+  const uint32_t start = hal_micros();
+  const bool published = hal_mqtt_publish(topic, payload, length);
+  metrics_record(METRIC_PUBLISH_US, hal_micros() - start);
+  metrics_count(published ? METRIC_PUBLISHED : METRIC_PUBLISH_FAILED);
+  return published;
+}
+
+// Publishes the MQTT message string to the MQTT broker.
+bool publish_MQTT_message(const char *topic, const char *message)
+{
+  return publish_MQTT_message(topic, (const uint8_t *)message, strlen(message));
+}
+
+// Publishes a binary MQTT message the broker acknowledges (QoS 1), and
+// returns the packet ID of the PUBACK to expect, 0 if the publish
+// failed. retransmit is the packet ID of the attempt before, 0 the
+// first time.
+uint16_t publish_MQTT_acknowledged(const char *topic, const uint8_t *payload, const size_t length, const uint16_t retransmit)
+{
+  DEBUG_TRACE(MQTT_PUBLISHING, length, topic);
+  const uint32_t start = hal_micros();
+  const uint16_t packet_id = hal_mqtt_publish_acknowledged(topic, payload, length, retransmit);
+  metrics_record(METRIC_PUBLISH_US, hal_micros() - start);
+  metrics_count(packet_id != 0 ? METRIC_PUBLISHED : METRIC_PUBLISH_FAILED);
+  return packet_id;
+}
+
+// Builds "$aws/things/{thing}/shadow/{action}" into topic.
+static void shadow_topic(char *topic, size_t size, const char *thing, const char *action)
+{
+  snprintf(topic, size, "$aws/things/%s/shadow/%s", thing, action);
+}
+
+// Builds the MQTT topics of the thing.
+static void build_topics(const char *thing)
+{
+  shadow_topic(mqtt_topic_shadow_get, sizeof(mqtt_topic_shadow_get), thing, "get");
+  shadow_topic(mqtt_topic_shadow_get_accepted, sizeof(mqtt_topic_shadow_get_accepted), thing, "get/accepted");
+  shadow_topic(mqtt_topic_shadow_update, sizeof(mqtt_topic_shadow_update), thing, "update");
+  shadow_topic(mqtt_topic_shadow_update_delta, sizeof(mqtt_topic_shadow_update_delta), thing, "update/delta");
+  shadow_topic(mqtt_topic_shadow_update_accepted, sizeof(mqtt_topic_shadow_update_accepted), thing, "update/accepted");
+  shadow_topic(mqtt_topic_shadow_update_rejected, sizeof(mqtt_topic_shadow_update_rejected), thing, "update/rejected");
+  snprintf(mqtt_topic_events, sizeof(mqtt_topic_events), GATEWAY_EVENT_TOPIC, thing);
+  snprintf(mqtt_topic_telemetry, sizeof(mqtt_topic_telemetry), TELEMETRY_TOPIC, thing, telemetry_format_name(telemetry_format));
+  snprintf(mqtt_topic_metrics, sizeof(mqtt_topic_metrics), METRICS_TOPIC, thing);
+}
+
+// Writer of the snapshot, its stage.
+static void publish_statistics(statistics_snapshot_t *snapshot, const gateway_statistics_t *values)
+{
+  const uint32_t sequence = snapshot->sequence.load(std::memory_order_relaxed);
+  snapshot->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  snapshot->values = *values;
+  snapshot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Any task: copies the snapshot again until no write overlapped.
+static void read_statistics(const statistics_snapshot_t *snapshot, gateway_statistics_t *values)
+{
+  uint32_t before;
+  uint32_t after;
+  do
+  {
+    before = snapshot->sequence.load(std::memory_order_acquire);
+    *values = snapshot->values;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = snapshot->sequence.load(std::memory_order_relaxed);
+  } while ((before & 1) != 0 || before != after);
+}
+
+// Serializes the JSON document, compact, into the next outbox slot and
+// hands it to the network stage. Nothing is queued if the outbox is
+// full or the document too large for a message.
+static bool queue_message(const uint8_t kind, JsonDocument *jsonDocument)
+{
+  outbox_message_t *message = outbox_reserve(&outbox);
+  if (message == NULL)
+  {
+    return false;
+  }
+  const size_t length = measureJson(*jsonDocument);
+  if (length >= sizeof(message->payload))
+  {
+    DEBUG_TRACE(MQTT_TOO_LARGE);
+    metrics_count(METRIC_MESSAGES_LOST);
+    return false;
+  }
+  message->kind = kind;
+  message->length = serializeJson(*jsonDocument, (char *)message->payload, sizeof(message->payload));
+  metrics_record(METRIC_MESSAGE_BYTES, message->length);
+  outbox_commit(&outbox, hal_millis());
+  return true;
+}
+
+// Network stage: hands the desired detect settings over unless the
+// aggregation stage has yet to take the previous ones, then they go
+// with the next call.
+static void hand_over_desired_detect()
+{
+  if (!desired_detect_pending || detect_handover_full.load(std::memory_order_acquire))
+  {
+    return;
+  }
+  detect_handover = desired_detect;
+  detect_handover_full.store(true, std::memory_order_release);
+  desired_detect_pending = false;
+}
+
+// Network stage: the same for allowlist changes. Every delta holds all
+// that differs from the reported state, the latest message supersedes
+// the ones before.
+static void hand_over_desired_allowlist()
+{
+  if (!desired_allowlist_pending || allowlist_handover_full.load(std::memory_order_acquire))
+  {
+    return;
+  }
+  allowlist_handover = desired_allowlist;
+  allowlist_handover_full.store(true, std::memory_order_release);
+  desired_allowlist_pending = false;
+}
+
+// Callback for messages received on the subscribed MQTT topics, in the
+// network stage. Shadow deltas and get/accepted documents are parsed as
+// they are read, keeping only the desired detect settings and allowlist
+// changes; the valid ones go to the aggregation stage. A document cut
+// short for lack of memory still has allowlist changes to take, the
+// detect settings come again with the rest. Answers to updates go to
+// the aggregation stage by their client token, rejections are counted
+// and traced. Reads until all contents are consumed.
+void gateway_message_received(const char *topic, size_t length)
+{
+  DEBUG_TRACE(MQTT_RECEIVED, topic, length);
+
+  if (strcmp(topic, mqtt_topic_shadow_update_delta) == 0 || strcmp(topic, mqtt_topic_shadow_get_accepted) == 0)
+  {
+    MqttReader reader;
+    const DeserializationError error = deserializeJson(desiredDocument, reader, DeserializationOption::Filter(desiredFilter));
+    metrics_set(METRIC_JSON_DESIRED, desiredDocument.memoryUsage());
+    const bool truncated = error == DeserializationError::NoMemory;
+    const int allowlist_rejected = error && !truncated ? -1 : shadow_desired_allowlist(&desiredDocument, truncated, &desired_allowlist);
+    if (allowlist_rejected >= 0)
+    {
+      network_statistics.allowlist_received++;
+      network_statistics.allowlist_rejected += allowlist_rejected;
+      desired_allowlist_pending = true;
+      hand_over_desired_allowlist();
+    }
+    if (allowlist_rejected > 0)
+    {
+      DEBUG_TRACE(MQTT_ALLOWLIST_REJECTED, allowlist_rejected);
+    }
+
+    if (error && allowlist_rejected < 0)
+    {
+      DEBUG_TRACE(MQTT_SHADOW_NOT_PARSED, error.c_str());
+      network_statistics.config_rejected++;
+    }
+    else if (!error)
+    {
+      const int rejected = shadow_desired_detect(&desiredDocument, &desired_detect);
+      if (rejected >= 0)
+      {
+        network_statistics.config_received++;
+        network_statistics.config_rejected += rejected;
+        desired_detect_pending = true;
+        hand_over_desired_detect();
+      }
+      if (rejected > 0)
+      {
+        DEBUG_TRACE(MQTT_DETECT_REJECTED, rejected);
+      }
+    }
+  }
+  else if (strcmp(topic, mqtt_topic_shadow_update_accepted) == 0 || strcmp(topic, mqtt_topic_shadow_update_rejected) == 0)
+  {
+    const bool accepted = strcmp(topic, mqtt_topic_shadow_update_accepted) == 0;
+    MqttReader reader;
+    const DeserializationError error = deserializeJson(responseDocument, reader, DeserializationOption::Filter(responseFilter));
+    shadow_response_t response;
+    shadow_response(&responseDocument, &response);
+    if (response.tokened)
+    {
+      (accepted ? shadow_accepted_token : shadow_rejected_token).store(response.token, std::memory_order_release);
+    }
+    if (!accepted)
+    {
+      network_statistics.shadow_rejected++;
+      metrics_count(METRIC_SHADOW_REJECTED);
+      DEBUG_TRACE(MQTT_SHADOW_UPDATE_REJECTED, response.tokened ? (int)response.token : -1, response.code,
+                  error && error != DeserializationError::NoMemory ? error.c_str() : response.message);
+    }
+  }
+
+  while (hal_mqtt_read() >= 0)
+  {
+  }
+}
+
+// The detect settings as they go into the shadow.
+static void current_detect(shadow_detect_t *detect)
+{
+  detect->interval = detect_ble_scan_interval;
+  detect->window = detect_ble_scan_window;
+  detect->duration = detect_ble_scan_duration;
+  snprintf(detect->name_prefix, sizeof(detect->name_prefix), "%s", detect_name_prefix);
+  detect->rssi_threshold = detect_rssi_threshold;
+}
+
+// Queues what changed since the last accepted shadow update once the
+// batch of zone changes is due, right away for a resync or new detect
+// settings, and not while an update waits for its answer. The reported
+// state only changes with update/accepted for the update's client
+// token; one rejected or unanswered goes out again with what changed
+// since. While the outbox is full the update goes out next time.
+void publish_shadow(const uint32_t now)
+{
+  const uint32_t accepted = shadow_accepted_token.exchange(0, std::memory_order_acquire);
+  if (accepted != 0)
+  {
+    shadow_answer(&shadow, accepted, true);
+  }
+  const uint32_t rejected = shadow_rejected_token.exchange(0, std::memory_order_acquire);
+  if (rejected != 0)
+  {
+    shadow_answer(&shadow, rejected, false);
+  }
+
+  shadow_detect_t detect;
+  current_detect(&detect);
+  shadow_zones_t zones;
+  shadow_count_zones(&presence, &zones);
+
+  const bool reset = shadow_resync_due(&shadow, now);
+  const int changes = shadow_changes(&shadow, &zones);
+  batch_set(&shadow_batch, changes, 0, now);
+  const bool waiting = shadow_waiting(&shadow, connection_online(), now);
+  aggregate_statistics.shadow_accepted = shadow.accepted;
+  aggregate_statistics.shadow_unanswered = shadow.unanswered;
+  if (waiting || (!reset && !shadow_detect_changed(&shadow, &detect) && !batch_due(&shadow_batch, &shadow_batch_policy, now)))
+  {
+    return;
+  }
+
+  if (reset)
+  {
+    DEBUG_TRACE(MQTT_SHADOW_RESYNC);
+  }
+  shadow_build_update(&shadow, &detect, &zones, reset, &shadowDocument);
+  metrics_set(METRIC_JSON_SHADOW, shadowDocument.memoryUsage());
+  if (!queue_message(STORE_KIND_SHADOW, &shadowDocument))
+  {
+    return;
+  }
+  shadow_expect(&shadow, &detect, &zones, reset, now);
+  batch_clear(&shadow_batch);
+}
+
+// Whether shadow updates wait in the log.
+static bool shadow_in_log()
+{
+  if (!store_pending(&store))
+  {
+    shadow_stored = 0;
+  }
+  return shadow_stored != 0;
+}
+
+// Whether a message can be published right away. Events, telemetry and
+// metrics carry their sequence number and time, the consumer orders
+// them: they go out while older ones are still in the log, which is
+// replayed on its own budget. Shadow updates go out once none wait in
+// the log.
+static bool forward_live(const uint8_t kind)
+{
+  return connection_online() && (kind != STORE_KIND_SHADOW || !shadow_in_log());
+}
+
+// Keeps a message that was not published in the log.
+static void forward_later(const uint8_t kind, const uint8_t *payload, const size_t length)
+{
+  if (!store_append(&store, kind, payload, length))
+  {
+    DEBUG_TRACE(STORE_DROPPED);
+    metrics_count(METRIC_MESSAGES_LOST);
+    return;
+  }
+  if (kind == STORE_KIND_SHADOW && shadow_stored != SHADOW_STORED_UNKNOWN)
+  {
+    shadow_stored++;
+  }
+  metrics_count(METRIC_MESSAGES_STORED);
+}
+
+// The topic a message of the kind goes to.
+static const char *message_topic(const uint8_t kind, char *topic, size_t size)
+{
+  if (kind == STORE_KIND_EVENTS)
+  {
+    return mqtt_topic_events;
+  }
+  if (kind == STORE_KIND_SHADOW)
+  {
+    return mqtt_topic_shadow_update;
+  }
+  if (kind == STORE_KIND_METRICS)
+  {
+    return mqtt_topic_metrics;
+  }
+  if (kind == STORE_KIND_TELEMETRY + telemetry_format)
+  {
+    return mqtt_topic_telemetry;
+  }
+  if (kind >= STORE_KIND_TELEMETRY && kind <= STORE_KIND_TELEMETRY + TELEMETRY_FORMAT_CBOR)
+  {
+    snprintf(topic, size, TELEMETRY_TOPIC, thing_name, telemetry_format_name((telemetry_format_t)(kind - STORE_KIND_TELEMETRY)));
+    return topic;
+  }
+  return NULL;
+}
+
+// Events and telemetry are the compliance records, the broker
+// acknowledges them. Shadow updates and metrics are superseded by the
+// next ones.
+static bool acknowledged_kind(const uint8_t kind)
+{
+  return kind == STORE_KIND_EVENTS || kind >= STORE_KIND_TELEMETRY;
+}
+
+// Publishes a message of the kind, events and telemetry into the
+// in-flight window, which keeps a copy until the PUBACK. False if the
+// publish failed or the window is full.
+static bool forward(const uint8_t kind, const char *topic, const uint8_t *payload, const size_t length, inflight_message_t **sent = NULL)
+{
+  if (!acknowledged_kind(kind))
+  {
+    return publish_MQTT_message(topic, payload, length);
+  }
+  inflight_message_t *message = inflight_reserve(&inflight);
+  if (message == NULL)
+  {
+    return false;
+  }
+  if (sent)
+  {
+    *sent = message;
+  }
+  const uint16_t packet_id = publish_MQTT_acknowledged(topic, payload, length, 0);
+  if (packet_id == 0)
+  {
+    return false;
+  }
+  message->kind = kind;
+  message->length = length;
+  memcpy(message->payload, payload, length);
+  inflight_sent(&inflight, message, packet_id, hal_millis());
+  metrics_set(METRIC_INFLIGHT, inflight.count);
+  return true;
+}
+
+// Network stage, from hal_mqtt_poll(): the broker has the message. A
+// replayed one is dropped from the log now.
+static void message_acknowledged(const uint16_t packet_id)
+{
+  if (inflight_acknowledge(&inflight, packet_id, hal_millis()))
+  {
+    metrics_count(METRIC_ACKNOWLEDGED);
+  }
+  if (replay_message && !replay_message->used)
+  {
+    if (store.evicted == replay_evicted)
+    {
+      store_advance(&store, replay_length);
+    }
+    replay_message = NULL;
+  }
+  metrics_set(METRIC_INFLIGHT, inflight.count);
+}
+
+// Publishes again what the broker did not acknowledge in time, or over
+// a connection since lost, oldest first. After INFLIGHT_ATTEMPTS a
+// message is given up and kept in the log, a replayed one is still
+// there and goes out again with the replay. Stops at the first failed
+// publish.
+static void retransmit_unacknowledged(const uint32_t now)
+{
+  char topic[GATEWAY_MQTT_TOPIC_SIZE];
+  inflight_message_t *message;
+
+  while (connection_online() && (message = inflight_due(&inflight, now)) != NULL)
+  {
+    if (message->attempts >= INFLIGHT_ATTEMPTS)
+    {
+      DEBUG_TRACE(MQTT_NOT_ACKNOWLEDGED, message->attempts);
+      inflight_give_up(&inflight, message);
+      if (message == replay_message)
+      {
+        replay_message = NULL;
+      }
+      else
+      {
+        forward_later(message->kind, message->payload, message->length);
+      }
+      continue;
+    }
+    DEBUG_TRACE(MQTT_RETRANSMITTING, message->packet_id, message->attempts + 1);
+    const char *destination = message_topic(message->kind, topic, sizeof(topic));
+    const uint16_t packet_id = publish_MQTT_acknowledged(destination, message->payload, message->length, message->packet_id);
+    if (packet_id == 0)
+    {
+      break;
+    }
+    inflight_sent(&inflight, message, packet_id, now);
+    metrics_count(METRIC_RETRANSMITTED);
+  }
+  metrics_set(METRIC_INFLIGHT, inflight.count);
+}
+
+// Replays stored messages, oldest first: one per STORE_REPLAY_INTERVAL
+// on average, at most STORE_REPLAY_BURST at a time, so a long outage
+// does not flood the broker. Live messages do not take from this
+// budget, nor wait for it. Events and telemetry stay in the log until
+// the PUBACK, the replay waits for it. Stops at the first failed
+// publish or a full in-flight window, the record is tried again next
+// time.
+void replay_stored(const uint32_t now)
+{
+  if (replay_message)
+  {
+    return;
+  }
+  if (!store_pending(&store) || !connection_online())
+  {
+    last_replay_millis = now;
+    return;
+  }
+  unsigned long budget = (now - last_replay_millis) / STORE_REPLAY_INTERVAL;
+  if (budget == 0)
+  {
+    return;
+  }
+  budget = budget < STORE_REPLAY_BURST ? budget : STORE_REPLAY_BURST;
+  last_replay_millis = now;
+
+  char topic[GATEWAY_MQTT_TOPIC_SIZE];
+  uint8_t kind;
+  size_t length;
+  while (budget-- > 0 && (length = store_peek(&store, &kind, store_buffer, sizeof(store_buffer))) > 0)
+  {
+    const char *destination = message_topic(kind, topic, sizeof(topic));
+    inflight_message_t *message = NULL;
+    if (destination && !forward(kind, destination, store_buffer, length, &message))
+    {
+      return;
+    }
+    if (message)
+    {
+      replay_message = message;
+      replay_length = length;
+      replay_evicted = store.evicted;
+      return;
+    }
+    store_advance(&store, length);
+    if (kind == STORE_KIND_SHADOW && shadow_stored != SHADOW_STORED_UNKNOWN && shadow_stored > 0)
+    {
+      shadow_stored--;
+    }
+  }
+}
+
+// Adds a hal_millis() timestamp to the record in ms since Unix Epoch,
+// null while the time is not known.
+static void add_time(JsonArray record, const uint32_t millis)
+{
+  const uint64_t time = wallclock_time(&wallclock, millis);
+  if (time != WALLCLOCK_UNSYNCED)
+  {
+    record.add(time);
+  }
+  else
+  {
+    record.add((const char *)NULL);
+  }
+}
+
+// Queues the batch of hand hygiene events for "hhcm/{thing}/events".
+// While the outbox is full the batch is kept and tried again.
+bool publish_events()
+{
+  if (events_batch.records == 0)
+  {
+    return true;
+  }
+  metrics_set(METRIC_JSON_EVENTS, eventDocument.memoryUsage());
+  if (!queue_message(STORE_KIND_EVENTS, &eventDocument))
+  {
+    return false;
+  }
+  batch_clear(&events_batch);
+  return true;
+}
+
+// Adds a hand hygiene event to the batch, publishing the batch first if
+// the event might not fit. An event that fits neither the batch nor the
+// outbox is dropped and counted.
+static void batch_event(const event_t *event, void *context)
+{
+  if (!batch_fits(&events_batch, &events_batch_policy, EVENT_RECORD_BYTES) && !publish_events())
+  {
+    DEBUG_TRACE(MQTT_EVENT_DROPPED);
+    aggregate_statistics.events_dropped++;
+    metrics_count(METRIC_EVENTS_DROPPED);
+    return;
+  }
+  if (events_batch.records == 0)
+  {
+    eventDocument.clear();
+    eventDocument["seq"] = events_sequence++;
+    event_records = eventDocument.createNestedArray("events");
+  }
+
+  char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+  ble_scan_format_address(event->address, id);
+
+  JsonArray record = event_records.createNestedArray();
+  record.add(events_type_name(event->type));
+  record.add(id);
+  record.add(proximity_zone_name(event->zone));
+  add_time(record, event->time);
+  record.add(event->duration);
+  batch_add(&events_batch, measureJson(record) + 1, hal_millis());
+}
+
+// Raises a reminder for every visit due one. A reminder raised while
+// the slot is full is merged into the cue about to start.
+static void raise_reminders(const uint32_t now)
+{
+  uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+  uint32_t time;
+  while (reminder_due(&reminder, now, address, &time))
+  {
+    DEBUG_TRACE(REMINDER, trace_address(address));
+    metrics_count(METRIC_REMINDERS);
+    aggregate_statistics.reminders++;
+    if (reminder_handover_full.load(std::memory_order_acquire))
+    {
+      aggregate_statistics.reminders_merged++;
+      continue;
+    }
+    reminder_handover = time;
+    reminder_handover_full.store(true, std::memory_order_release);
+  }
+}
+
+// Every event goes to the reminders, the dashboard and its batch.
+static void zone_event(const event_t *event, void *context)
+{
+  reminder_event(&reminder, event);
+  dashboard_event(&dashboard, event);
+  batch_event(event, context);
+}
+
+// Queues the detection data of the badges in range, if any, for
+// "hhcm/{thing}/telemetry/{format}", a page at a time. Telemetry is a
+// sample the next one supersedes: pages the outbox has no room for are
+// dropped and counted.
+void publish_telemetry(const uint32_t now)
+{
+  const int pages = telemetry_pages(&presence);
+  const uint64_t time = wallclock_time(&wallclock, now);
+  size_t cursor = 0;
+
+  for (int page = 1; page <= pages; page++)
+  {
+    const int count = telemetry_build(&telemetry, &presence, time, now, &cursor, page, pages, &telemetryDocument);
+    metrics_set(METRIC_JSON_TELEMETRY, telemetryDocument.memoryUsage());
+    outbox_message_t *message = outbox_reserve(&outbox);
+    if (message == NULL)
+    {
+      DEBUG_TRACE(MQTT_TELEMETRY_DROPPED);
+      telemetry.dropped += count;
+      metrics_count(METRIC_TELEMETRY_DROPPED);
+      continue;
+    }
+    const size_t length = telemetry_serialize(&telemetryDocument, telemetry_format, message->payload, sizeof(message->payload));
+    if (length == 0)
+    {
+      DEBUG_TRACE(MQTT_TELEMETRY_TOO_LARGE);
+      telemetry.dropped += count;
+      metrics_count(METRIC_TELEMETRY_DROPPED);
+      continue;
+    }
+    message->kind = STORE_KIND_TELEMETRY + telemetry_format;
+    message->length = length;
+    metrics_record(METRIC_MESSAGE_BYTES, length);
+    outbox_commit(&outbox, hal_millis());
+  }
+}
+
+// Queues the metrics for "hhcm/{thing}/metrics", and with the first
+// and every METRICS_SHADOW_INTERVAL after their mirror in the shadow. The heap is
+// sampled here, the other gauges where they change. Like telemetry a
+// sample the next one supersedes: while the outbox is full it is
+// skipped, the counts go with the next one.
+void publish_metrics(const uint32_t now)
+{
+  uint32_t heap_free;
+  uint32_t heap_largest;
+  hal_heap(&heap_free, &heap_largest);
+  metrics_set(METRIC_HEAP_FREE, heap_free);
+  metrics_set(METRIC_HEAP_LARGEST, heap_largest);
+  metrics_snapshot(&metrics_values);
+
+  metrics_build(&metrics_values, metrics_sequence++, now, wallclock_time(&wallclock, now), &metricsDocument);
+  queue_message(STORE_KIND_METRICS, &metricsDocument);
+
+  if (!metrics_mirrored || now - last_metrics_shadow_millis >= METRICS_SHADOW_INTERVAL)
+  {
+    metrics_build_shadow(&metrics_values, now, &metricsDocument);
+    if (queue_message(STORE_KIND_SHADOW, &metricsDocument))
+    {
+      last_metrics_shadow_millis = now;
+      metrics_mirrored = true;
+    }
+  }
+}
+
+// Zone thresholds from the RSSI threshold: a badge is near above it.
+static void configure_proximity()
+{
+  proximity_config_init(&proximity_config);
+  proximity_config.near_enter = detect_rssi_threshold;
+  proximity_config.near_exit = detect_rssi_threshold - (PROXIMITY_NEAR_ENTER - PROXIMITY_NEAR_EXIT);
+}
+
+// Configures the scan for the current mode of the schedule.
+static void configure_scan()
+{
+  const scan_parameters_t *parameters = &scan_schedule.parameters;
+  ble_scan_configure(parameters->interval, parameters->window, parameters->active);
+}
+
+// Moves the scan to the mode the badges call for, see scan_schedule.h.
+// Activity is a badge arriving or changing zone.
+static void schedule_scan(const bool activity, const uint32_t now)
+{
+  if (scan_schedule_update(&scan_schedule, occupied, activity, now))
+  {
+    DEBUG_TRACE(BLE_SCAN_MODE, scan_mode_name(scan_schedule.mode));
+    configure_scan();
+  }
+}
+
+// Aggregation stage: applies detect settings the network stage took
+// from the shadow, all of them reported back with the next update.
+// A continuous scan is restarted for a new name prefix. It is stopped
+// before the ring is drained, so nothing it finds is lost to the reset
+// the restart makes.
+static void apply_desired_detect()
+{
+  if (!detect_handover_full.load(std::memory_order_acquire))
+  {
+    return;
+  }
+  const shadow_detect_t detect = detect_handover;
+  detect_handover_full.store(false, std::memory_order_release);
+
+  const bool parameters = detect.interval != detect_ble_scan_interval || detect.window != detect_ble_scan_window;
+  const bool restart = BLE_SCAN_SETUP_CONTINUOUS && strcmp(detect.name_prefix, detect_name_prefix) != 0;
+
+  if (restart)
+  {
+    ble_scan_stop();
+    ble_scan_drain(&presence);
+  }
+  detect_ble_scan_interval = detect.interval;
+  detect_ble_scan_window = detect.window;
+  detect_ble_scan_duration = detect.duration;
+  snprintf(detect_name_prefix, sizeof(detect_name_prefix), "%s", detect.name_prefix);
+  detect_rssi_threshold = detect.rssi_threshold;
+  if (parameters)
+  {
+    scan_schedule_configure(&scan_schedule, detect_ble_scan_interval, detect_ble_scan_window);
+    configure_scan();
+  }
+  if (restart)
+  {
+    ble_scan_start(detect_name_prefix, PROXIMITY_RSSI_FLOOR, &allowlist);
+  }
+  configure_proximity();
+
+  shadow_report_detect(&shadow);
+  aggregate_statistics.config_applied++;
+}
+
+// Aggregation stage: applies the allowlist changes the network stage
+// took from the shadow, saves the list and reports the changes applied.
+// While the outbox is full the report waits, and further changes with
+// it. A list that did not load is reported gone instead. Either way the
+// network stage gets the shadow again if the desired state has more.
+static void apply_desired_allowlist()
+{
+  if (!allowlist_report_pending)
+  {
+    if (!allowlist_handover_full.load(std::memory_order_acquire))
+    {
+      return;
+    }
+    allowlist_applied = allowlist_handover;
+    allowlist_handover_full.store(false, std::memory_order_release);
+    if (allowlist_applied.count == 0)
+    {
+      return;
+    }
+
+    const uint32_t refused = allowlist.refused;
+    const size_t changed = allowlist_apply(&allowlist, allowlist_applied.changes, allowlist_applied.count);
+    const uint32_t full = allowlist.refused - refused;
+    if (full > 0)
+    {
+      DEBUG_TRACE(ALLOWLIST_FULL, full);
+    }
+    if (changed > 0 && !allowlist_save(&allowlist))
+    {
+      DEBUG_TRACE(ALLOWLIST_NOT_SAVED);
+    }
+    DEBUG_TRACE(ALLOWLIST_CHANGED, changed, allowlist_size(&allowlist), allowlist_applied.more ? ", more to come" : "");
+    metrics_set(METRIC_ALLOWLIST, allowlist_size(&allowlist));
+    aggregate_statistics.allowlist_applied += changed;
+    allowlist_report_pending = allowlist_applied.count > full;
+    if (!allowlist_report_pending)
+    {
+      return;
+    }
+  }
+
+  shadow_build_allowlist(allowlist_lost ? NULL : &allowlist_applied, &shadowDocument);
+  metrics_set(METRIC_JSON_SHADOW, shadowDocument.memoryUsage());
+  if (!queue_message(STORE_KIND_SHADOW, &shadowDocument))
+  {
+    return;
+  }
+  if (allowlist_lost || allowlist_applied.more)
+  {
+    allowlist_get_requested.store(true, std::memory_order_release);
+  }
+  allowlist_lost = false;
+  allowlist_report_pending = false;
+}
+
+// Moves every badge to the zone its smoothed RSSI indicates, badges
+// that went quiet are away as of their last advertisement. Events go to
+// their batch as they happen. Returns the number of zone changes, the
+// room is occupied while any badge is not away.
+int update_zones(const uint32_t now)
+{
+  size_t cursor = 0;
+  presence_entry_t *entry;
+  int changes = 0;
+
+  occupied = false;
+  badges_in_range = 0;
+  while ((entry = presence_next(&presence, &cursor)) != NULL)
+  {
+    proximity_zone_t zone = PROXIMITY_AWAY;
+    uint32_t time = entry->last_seen;
+    if (now - entry->last_seen <= PRESENCE_STALE_AFTER)
+    {
+      zone = proximity_classify(&proximity_config, (proximity_zone_t)entry->zone, entry->rssi_smoothed);
+      time = now;
+    }
+    if (events_update(entry, zone, time, EVENTS_DWELL_TIME, zone_event, NULL))
+    {
+      changes++;
+    }
+    occupied = occupied || zone != PROXIMITY_AWAY;
+    badges_in_range += zone != PROXIMITY_AWAY;
+  }
+
+  return changes;
+}
+
+void gateway_setup(const char *thing)
+{
+  // The thing name is the serial number of the ATECC608, the topics
+  // built from it do not change.
+  snprintf(thing_name, sizeof(thing_name), "%s", thing);
+  build_topics(thing);
+
+  // Intitialize the presence table and the BLE scan. The RSSI threshold
+  // is where a badge counts as near, the scan itself passes everything
+  // above the floor so the zone estimator sees badges moving away.
+  metrics_init();
+  metrics_set_limit(METRIC_PRESENCE, PRESENCE_TABLE_MAX_ENTRIES);
+  metrics_set_limit(METRIC_OUTBOX, OUTBOX_CAPACITY);
+  metrics_set_limit(METRIC_JSON_EVENTS, eventDocument.capacity());
+  metrics_set_limit(METRIC_JSON_SHADOW, shadowDocument.capacity());
+  metrics_set_limit(METRIC_JSON_TELEMETRY, telemetryDocument.capacity());
+  metrics_set_limit(METRIC_JSON_DESIRED, desiredDocument.capacity());
+  metrics_set_limit(METRIC_ALLOWLIST, ALLOWLIST_CAPACITY);
+  metrics_set_limit(METRIC_INFLIGHT, INFLIGHT_WINDOW);
+  metrics_set_limit(METRIC_DISPLAY_CPU, 1000);
+  presence_init(&presence);
+  configure_proximity();
+  wallclock_init(&wallclock, hal_millis());
+  scan_schedule_init(&scan_schedule, detect_ble_scan_interval, detect_ble_scan_window, BLE_SCAN_SETUP_ADAPTIVE, hal_millis());
+
+  // Registered badges from flash, before the scan looks them up. A list
+  // that does not load is reported gone, the shadow sends it again.
+  allowlist_lost = !allowlist_load(&allowlist);
+  if (allowlist_lost)
+  {
+    DEBUG_TRACE(ALLOWLIST_NOT_LOADED);
+  }
+  else
+  {
+    DEBUG_TRACE(ALLOWLIST_LOADED, allowlist_size(&allowlist));
+  }
+  metrics_set(METRIC_ALLOWLIST, allowlist_size(&allowlist));
+  allowlist_report_pending = allowlist_lost;
+
+  ble_scan_init(detect_ble_scan_interval, detect_ble_scan_window);
+  if (BLE_SCAN_SETUP_CONTINUOUS)
+  {
+    ble_scan_start(detect_name_prefix, PROXIMITY_RSSI_FLOOR, &allowlist);
+    last_scan_millis = hal_millis();
+  }
+
+  // Nothing has been reported yet, the first update is a full resync.
+  shadow_init(&shadow, SHADOW_RESYNC_INTERVAL);
+  shadow_accepted_token.store(0, std::memory_order_relaxed);
+  shadow_rejected_token.store(0, std::memory_order_relaxed);
+  batch_clear(&shadow_batch);
+
+  // The desired state changes the detect settings from here on.
+  shadow_desired_filter(&desiredFilter);
+  shadow_response_filter(&responseFilter);
+  current_detect(&desired_detect);
+  desired_detect_pending = false;
+  detect_handover_full.store(false);
+  desired_allowlist_pending = false;
+  allowlist_handover_full.store(false);
+  allowlist_get_requested.store(false);
+  allowlist_get_pending = false;
+  batch_clear(&events_batch);
+  // The empty dashboard goes out with the first loop.
+  dashboard_init(&dashboard);
+  dashboard_handover_full.store(false);
+  dashboard_handed_version = dashboard.model.version - 1;
+  badges_in_range = 0;
+  reminder_init(&reminder);
+  reminder_handover_full.store(false);
+
+  // Metrics go out from a minute after the start, mirrored right away.
+  last_metrics_millis = hal_millis();
+  metrics_mirrored = false;
+
+  // Messages kept while offline before the restart are replayed first.
+  outbox_init(&outbox);
+  memset(&aggregate_statistics, 0, sizeof(aggregate_statistics));
+  memset(&network_statistics, 0, sizeof(network_statistics));
+  publish_statistics(&aggregate_snapshot, &aggregate_statistics);
+  publish_statistics(&network_snapshot, &network_statistics);
+  store_init(&store);
+  shadow_stored = store_pending(&store) ? SHADOW_STORED_UNKNOWN : 0;
+  inflight_init(&inflight);
+  replay_message = NULL;
+  hal_mqtt_set_ack_callback(message_acknowledged);
+}
+
+// Subscribes to the shadow topics of the thing and requests the
+// current shadow document, its desired state applies on arrival.
+// Called after every (re)connect.
+void gateway_on_connect()
+{
+  // Nothing sent over the old connection will be acknowledged.
+  inflight_resend_all(&inflight, hal_millis());
+
+  // Subscribe to "$aws/things/{thing}/shadow/get/accepted"
+  subscribe_MQTT_topic(mqtt_topic_shadow_get_accepted);
+
+  // Subscribe to "$aws/things/{thing}/shadow/update/delta"
+  subscribe_MQTT_topic(mqtt_topic_shadow_update_delta);
+
+  // Subscribe to "$aws/things/{thing}/shadow/update/accepted" and
+  // "$aws/things/{thing}/shadow/update/rejected"
+  subscribe_MQTT_topic(mqtt_topic_shadow_update_accepted);
+  subscribe_MQTT_topic(mqtt_topic_shadow_update_rejected);
+
+  // Send empty message to $aws/things/{ThingName}/shadow/get
+  publish_MQTT_message(mqtt_topic_shadow_get, "{}");
+}
+
+// Drains the scan into the presence table, detects events and zone
+// changes and queues the messages that are due.
+static void aggregate()
+{
+  apply_desired_detect();
+  apply_desired_allowlist();
+
+  if (BLE_SCAN_SETUP_CONTINUOUS)
+  {
+    // Collect what the background scan found, zones are re-evaluated
+    // once per scan duration as with blocking scans. A badge turning up
+    // brings the scan to full duty right away; in an empty room any
+    // badge heard is one.
+    const uint32_t known = presence.count;
+    const int drained = ble_scan_drain(&presence);
+    schedule_scan(presence.count > known || (drained > 0 && !occupied), hal_millis());
+    if (hal_millis() - last_scan_millis < (unsigned long)detect_ble_scan_duration * 1000)
+    {
+      return;
+    }
+    last_scan_millis = hal_millis();
+  }
+  else
+  {
+    // Scan for BLE devices in close proximity.
+    ble_scan(detect_ble_scan_duration, detect_name_prefix, PROXIMITY_RSSI_FLOOR, &allowlist, &presence);
+  }
+
+  // Classify the badges and collect their events, publish what is due,
+  // then let the badges that went quiet age out.
+  const uint32_t start = hal_micros();
+  wallclock_update(&wallclock, hal_millis());
+  schedule_scan(update_zones(hal_millis()) > 0, hal_millis());
+  if (batch_due(&events_batch, &events_batch_policy, hal_millis()))
+  {
+    publish_events();
+  }
+  publish_shadow(hal_millis());
+  if (hal_millis() - last_telemetry_millis >= TELEMETRY_INTERVAL)
+  {
+    last_telemetry_millis = hal_millis();
+    publish_telemetry(hal_millis());
+  }
+  if (hal_millis() - last_metrics_millis >= METRICS_INTERVAL)
+  {
+    last_metrics_millis = hal_millis();
+    publish_metrics(hal_millis());
+  }
+  // A badge that went away stays until its zone change had time to be
+  // published with a batch.
+  presence_expire(&presence, hal_millis(), PRESENCE_STALE_AFTER + shadow_batch_policy.max_age + detect_ble_scan_duration * 1000);
+  metrics_set(METRIC_PRESENCE, presence.count);
+  metrics_set(METRIC_OUTBOX, outbox_size(&outbox));
+
+  const uint32_t elapsed = hal_micros() - start;
+  aggregate_statistics.aggregate_runs++;
+  aggregate_statistics.aggregate_us_total += elapsed;
+  aggregate_statistics.aggregate_us_max = elapsed > aggregate_statistics.aggregate_us_max ? elapsed : aggregate_statistics.aggregate_us_max;
+}
+
+// Aggregation stage: its statistics, with those of the modules it owns.
+static void publish_aggregate_statistics()
+{
+  gateway_statistics_t *values = &aggregate_statistics;
+  values->telemetry_dropped = telemetry.dropped;
+  values->scan_mode = scan_schedule.mode;
+  values->scan_mode_switches = scan_schedule.switches;
+  values->scan_ms = scan_schedule.scan_us / 1000;
+  values->scan_active_ms = scan_schedule.active_us / 1000;
+  values->clock_synced = wallclock.synced;
+  values->clock_syncs = wallclock.syncs;
+  values->clock_steps = wallclock.steps;
+  values->clock_error_ms = wallclock.error;
+  values->clock_drift_ppm = wallclock.drift;
+  values->allowlist_size = allowlist_size(&allowlist);
+  publish_statistics(&aggregate_snapshot, values);
+}
+
+// Aggregation stage: the link and the messages waiting for it, those of
+// the network stage from its statistics snapshot, go into the dashboard
+// model; a changed model is handed over once the display stage took the
+// one before.
+static void update_dashboard(const uint32_t now)
+{
+  gateway_statistics_t network;
+  read_statistics(&network_snapshot, &network);
+
+  // Zeroed, padding included: the dashboard compares the bytes.
+  dashboard_status_t status;
+  memset(&status, 0, sizeof(status));
+  status.badges = badges_in_range;
+  status.link = connection_state();
+  status.queued = outbox_size(&outbox);
+  status.unacknowledged = network.inflight;
+  status.stored = network.stored > network.replayed ? network.stored - network.replayed : 0;
+  dashboard_update(&dashboard, &status, now);
+
+  if (dashboard.model.version == dashboard_handed_version || dashboard_handover_full.load(std::memory_order_acquire))
+  {
+    return;
+  }
+  dashboard_handover = dashboard.model;
+  dashboard_handover_full.store(true, std::memory_order_release);
+  dashboard_handed_version = dashboard.model.version;
+}
+
+// Aggregation stage, every call timed for the loop iteration metric.
+void gateway_loop()
+{
+  const uint32_t start = hal_micros();
+  aggregate();
+  raise_reminders(hal_millis());
+  update_dashboard(hal_millis());
+  publish_aggregate_statistics();
+  metrics_record(METRIC_LOOP_US, hal_micros() - start);
+}
+
+// Display stage: the dashboard model, if it changed since the last call.
+bool gateway_take_dashboard(dashboard_model_t *model)
+{
+  if (!dashboard_handover_full.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  *model = dashboard_handover;
+  dashboard_handover_full.store(false, std::memory_order_release);
+  return true;
+}
+
+// Feedback stage: the time of the event of a reminder raised since the
+// last call, if any.
+bool gateway_take_reminder(uint32_t *time)
+{
+  if (!reminder_handover_full.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  *time = reminder_handover;
+  reminder_handover_full.store(false, std::memory_order_release);
+  return true;
+}
+
+// Network stage: its statistics, with those of the modules it owns.
+static void publish_network_statistics()
+{
+  gateway_statistics_t *values = &network_statistics;
+  values->stored = store.appended;
+  values->replayed = store.replayed;
+  values->inflight = inflight.count;
+  values->inflight_high_water = inflight.high_water;
+  values->acknowledged = inflight.acknowledged;
+  values->retransmitted = inflight.retransmitted;
+  values->unacknowledged = inflight.given_up;
+  values->ack_ms_max = inflight.ack_ms_max;
+  values->ack_ms_total = inflight.ack_ms_total;
+  publish_statistics(&network_snapshot, values);
+}
+
+// Network stage: gets the shadow for the allowlist changes a message
+// did not take, once the report of those it did is out. Held while the
+// report waits in the log.
+static void get_allowlist_rest()
+{
+  if (!allowlist_get_pending || !connection_online() || shadow_in_log())
+  {
+    return;
+  }
+  if (publish_MQTT_message(mqtt_topic_shadow_get, "{}"))
+  {
+    allowlist_get_pending = false;
+  }
+}
+
+// Network stage: retransmits what the broker did not acknowledge,
+// publishes what the aggregation stage queued, oldest first, then
+// replays stored messages. A message goes to the log instead while
+// offline, when the publish fails or the in-flight window is full, or,
+// for a shadow update, when older ones are still in the log. A backlog
+// in the log does not hold up live messages. A stalled publish holds up this stage only, the outbox absorbs it
+// meanwhile.
+void gateway_network_loop()
+{
+  char topic[GATEWAY_MQTT_TOPIC_SIZE];
+  outbox_message_t *message;
+
+  // Requested after the report was queued, which goes out below.
+  if (allowlist_get_requested.exchange(false, std::memory_order_acquire))
+  {
+    allowlist_get_pending = true;
+  }
+
+  retransmit_unacknowledged(hal_millis());
+  while ((message = outbox_peek(&outbox)) != NULL)
+  {
+    const uint32_t wait = hal_millis() - message->time;
+    network_statistics.wait_ms_total += wait;
+    network_statistics.wait_ms_max = wait > network_statistics.wait_ms_max ? wait : network_statistics.wait_ms_max;
+
+    const char *destination = message_topic(message->kind, topic, sizeof(topic));
+    const uint32_t start = hal_micros();
+    if (forward_live(message->kind) && forward(message->kind, destination, message->payload, message->length))
+    {
+      const uint32_t elapsed = hal_micros() - start;
+      network_statistics.sent++;
+      network_statistics.publish_us_total += elapsed;
+      network_statistics.publish_us_max = elapsed > network_statistics.publish_us_max ? elapsed : network_statistics.publish_us_max;
+    }
+    else
+    {
+      forward_later(message->kind, message->payload, message->length);
+    }
+    outbox_release(&outbox);
+    network_statistics.taken++;
+  }
+  replay_stored(hal_millis());
+  get_allowlist_rest();
+  hand_over_desired_detect();
+  hand_over_desired_allowlist();
+  publish_network_statistics();
+}
+
+// Counters of the stages, each written by its own stage only.
+// Any task: the network stage's members and the aggregation stage's as
+// of their last runs, the outbox as it is.
+void gateway_get_statistics(gateway_statistics_t *current)
+{
+  gateway_statistics_t aggregate;
+  read_statistics(&network_snapshot, current);
+  read_statistics(&aggregate_snapshot, &aggregate);
+
+  current->aggregate_runs = aggregate.aggregate_runs;
+  current->aggregate_us_max = aggregate.aggregate_us_max;
+  current->aggregate_us_total = aggregate.aggregate_us_total;
+  current->events_dropped = aggregate.events_dropped;
+  current->telemetry_dropped = aggregate.telemetry_dropped;
+  current->scan_mode = aggregate.scan_mode;
+  current->scan_mode_switches = aggregate.scan_mode_switches;
+  current->scan_ms = aggregate.scan_ms;
+  current->scan_active_ms = aggregate.scan_active_ms;
+  current->config_applied = aggregate.config_applied;
+  current->allowlist_applied = aggregate.allowlist_applied;
+  current->allowlist_size = aggregate.allowlist_size;
+  current->shadow_accepted = aggregate.shadow_accepted;
+  current->shadow_unanswered = aggregate.shadow_unanswered;
+  current->clock_synced = aggregate.clock_synced;
+  current->clock_syncs = aggregate.clock_syncs;
+  current->clock_steps = aggregate.clock_steps;
+  current->clock_error_ms = aggregate.clock_error_ms;
+  current->clock_drift_ppm = aggregate.clock_drift_ppm;
+  current->reminders = aggregate.reminders;
+  current->reminders_merged = aggregate.reminders_merged;
+
+  current->outbox_depth = outbox_size(&outbox);
+  current->outbox_high_water = outbox.high_water.load();
+  current->outbox_queued = outbox.queued.load();
+  current->outbox_refused = outbox.refused.load();
+}
@@ -0,0 +1,851 @@
+/*
+ * hal_esp32.cpp
+ *
+ * Hardware abstraction layer for the M5Stack Core2 for AWS IoT EduKit.
+ */
+
+#include <Arduino.h>
+#include <M5Core2.h>
+#include <time.h>
+#include <sys/time.h>
+#include <atomic>
+#include <WiFi.h>
+#include <ArduinoBearSSL.h>
+#include <ArduinoMqttClient.h>
+#include <BLEDevice.h>
+#include <BLEScan.h>
+#include <BLEAdvertisedDevice.h>
+#include <SD.h>
+#include <Preferences.h>
+#include <esp_heap_caps.h>
+#include <driver/i2s.h>
+#include <FastLED.h>
+#include "debug2serial.h"
+#include "auxiliary.h"
+#include "secure_element.h"
+#include "hal.h"
+
+// The BLE stack still keeps one BLEAdvertisedDevice per address in its
+// result map while scanning continuously, the scan callback releases them
+// every HAL_BLE_CLEAR_INTERVAL ms.
+#define HAL_BLE_CLEAR_INTERVAL 1000
+
+// MQTT control packet types, the upper half of the first byte.
+#define HAL_MQTT_PUBLISH 3
+#define HAL_MQTT_PUBACK 4
+
+// Follows the MQTT packets in one direction of the connection, a byte
+// at a time, for the packet ID of PUBLISH (QoS 1 and up) and PUBACK.
+typedef struct
+{
+    uint8_t header;     // first byte of the packet, 0 before it came
+    bool length_known;
+    uint32_t remaining; // bytes of the packet still to come
+    uint8_t shift;      // of the next remaining length byte
+    uint32_t offset;    // into the packet after the remaining length
+    uint16_t topic_length;
+    uint16_t packet_id;
+} mqtt_watch_t;
+
+static hal_mqtt_ack_callback_t mqtt_ack_callback;
+
+static void mqtt_watch_reset(mqtt_watch_t *watch)
+{
+    watch->header = 0;
+    watch->length_known = false;
+    watch->remaining = 0;
+    watch->shift = 0;
+}
+
+// The type of the packet once the packet ID of a PUBLISH or PUBACK is
+// complete, 0 for any other byte.
+static uint8_t mqtt_watch(mqtt_watch_t *watch, const uint8_t byte)
+{
+    if (watch->header == 0)
+    {
+        watch->header = byte;
+        return 0;
+    }
+    if (!watch->length_known)
+    {
+        watch->remaining |= (uint32_t)(byte & 0x7f) << watch->shift;
+        watch->shift += 7;
+        watch->length_known = (byte & 0x80) == 0;
+        watch->offset = 0;
+        if (watch->length_known && watch->remaining == 0)
+        {
+            mqtt_watch_reset(watch);
+        }
+        return 0;
+    }
+
+    const uint8_t type = watch->header >> 4;
+    const uint32_t offset = watch->offset++;
+    bool complete = false;
+    if (type == HAL_MQTT_PUBACK && offset < 2)
+    {
+        watch->packet_id = offset == 0 ? byte << 8 : watch->packet_id | byte;
+        complete = offset == 1;
+    }
+    else if (type == HAL_MQTT_PUBLISH && (watch->header & 0x06) != 0)
+    {
+        if (offset < 2)
+        {
+            watch->topic_length = offset == 0 ? byte << 8 : watch->topic_length | byte;
+        }
+        else if (offset == 2u + watch->topic_length)
+        {
+            watch->packet_id = byte << 8;
+        }
+        else if (offset == 3u + watch->topic_length)
+        {
+            watch->packet_id |= byte;
+            complete = true;
+        }
+    }
+    if (--watch->remaining == 0)
+    {
+        mqtt_watch_reset(watch);
+    }
+    return complete ? type : 0;
+}
+
+// Passes the TLS connection through to the MQTT client and watches the
+// packets on it. The client waits for a PUBACK in endMessage() without
+// telling which publish it acknowledged; QoS 1 publishes skip that wait
+// and learn their packet ID as the client writes it, PUBACKs are
+// handed to the callback as the client reads them in poll(). Times the
+// TCP connection and TLS handshake of each connect.
+class MqttWatchClient : public Client
+{
+public:
+    uint16_t published; // packet ID of the last QoS 1 PUBLISH written
+    hal_tls_handshake_t handshake; // of the last connect
+
+    MqttWatchClient(Client &client) : published(0), client(client)
+    {
+        mqtt_watch_reset(&sent);
+        mqtt_watch_reset(&received);
+        memset(&handshake, 0, sizeof(handshake));
+    }
+
+    int connect(IPAddress ip, uint16_t port)
+    {
+        const uint32_t start = micros();
+        mqtt_watch_reset(&sent);
+        mqtt_watch_reset(&received);
+        const int connected = client.connect(ip, port);
+        handshake_done(connected, start);
+        return connected;
+    }
+
+    int connect(const char *host, uint16_t port)
+    {
+        const uint32_t start = micros();
+        mqtt_watch_reset(&sent);
+        mqtt_watch_reset(&received);
+        const int connected = client.connect(host, port);
+        handshake_done(connected, start);
+        return connected;
+    }
+
+    size_t write(uint8_t byte)
+    {
+        return write(&byte, 1);
+    }
+
+    size_t write(const uint8_t *data, size_t size)
+    {
+        const size_t written = client.write(data, size);
+        for (size_t i = 0; i < written; i++)
+        {
+            if (mqtt_watch(&sent, data[i]) == HAL_MQTT_PUBLISH)
+            {
+                published = sent.packet_id;
+            }
+        }
+        return written;
+    }
+
+    int available()
+    {
+        return client.available();
+    }
+
+    int read()
+    {
+        const int byte = client.read();
+        if (byte >= 0)
+        {
+            watch_received((uint8_t)byte);
+        }
+        return byte;
+    }
+
+    int read(uint8_t *data, size_t size)
+    {
+        const int count = client.read(data, size);
+        for (int i = 0; i < count; i++)
+        {
+            watch_received(data[i]);
+        }
+        return count;
+    }
+
+    int peek()
+    {
+        return client.peek();
+    }
+
+    void flush()
+    {
+        client.flush();
+    }
+
+    void stop()
+    {
+        client.stop();
+    }
+
+    uint8_t connected()
+    {
+        return client.connected();
+    }
+
+    operator bool()
+    {
+        return (bool)client;
+    }
+
+private:
+    Client &client;
+    mqtt_watch_t sent;
+    mqtt_watch_t received;
+
+    void handshake_done(const int connected, const uint32_t start)
+    {
+        handshake.done = connected == 1;
+        handshake.us = handshake.done ? micros() - start : 0;
+    }
+
+    void watch_received(const uint8_t byte)
+    {
+        if (mqtt_watch(&received, byte) == HAL_MQTT_PUBACK && mqtt_ack_callback)
+        {
+            mqtt_ack_callback(received.packet_id);
+        }
+    }
+};
+
+// Clients for Wi-Fi, SSL, and MQTT libraries:
+WiFiClient wifi_client;
+BearSSLClient ssl_client(wifi_client);
+MqttWatchClient mqtt_watch_client(ssl_client);
+MqttClient mqtt_client(mqtt_watch_client);
+
+static BLEScan *pBLEScan;
+static std::atomic<hal_ble_advertisement_callback_t> ble_scan_callback(NULL);
+static std::atomic<int> ble_scan_in_callback(0); // results being handed to the callback
+static void *ble_scan_context;
+static volatile bool ble_scan_stopped = true;
+static uint32_t ble_scan_cleared_millis = 0; // BLE stack task while scanning
+static hal_mqtt_message_callback_t mqtt_message_callback;
+
+// The LCD and the SD card are on the same SPI bus, written to from the
+// display task and the network task.
+static SemaphoreHandle_t spi_bus = xSemaphoreCreateMutex();
+
+class SpiBusLock
+{
+public:
+    SpiBusLock()
+    {
+        xSemaphoreTake(spi_bus, portMAX_DELAY);
+    }
+
+    ~SpiBusLock()
+    {
+        xSemaphoreGive(spi_bus);
+    }
+};
+
+/* Clock
+*/
+
+uint32_t hal_millis()
+{
+    return millis();
+}
+
+uint32_t hal_micros()
+{
+    return micros();
+}
+
+// NTP has answered at least once. Unlike getLocalTime() this does not
+// wait for it.
+bool hal_time_synced()
+{
+    return time(NULL) > 1600000000L;
+}
+
+// In ms, SNTP steps it on every answer and it runs on the same timer as
+// millis() between them.
+bool hal_ntp_time(uint64_t *epoch_ms)
+{
+    struct timeval now;
+
+    if (!hal_time_synced() || gettimeofday(&now, NULL) != 0)
+    {
+        return false;
+    }
+    *epoch_ms = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    return true;
+}
+
+void hal_delay(uint32_t ms)
+{
+    delay(ms);
+}
+
+// The hardware RNG, different on every gateway from power up.
+uint32_t hal_random(const uint32_t bound)
+{
+    return bound ? esp_random() % bound : 0;
+}
+
+/* Tasks
+*/
+
+bool hal_task_start(
+    const char *name,
+    hal_task_function_t function,
+    void *context,
+    const uint32_t stack_size,
+    const unsigned priority,
+    const int core)
+{
+    return xTaskCreatePinnedToCore(function, name, stack_size, context, priority, NULL, core) == pdPASS;
+}
+
+/* Memory
+*/
+
+// Byte addressable heap, where ArduinoJson, BearSSL and the BLE stack
+// allocate from.
+void hal_heap(uint32_t *free, uint32_t *largest_block)
+{
+    *free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    *largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+/* Secure element
+*/
+
+void hal_se_initialize()
+{
+    se_initialize();
+}
+
+void hal_se_get_id(char *id, size_t size)
+{
+    String serialNumber = se_get_id();
+    snprintf(id, size, "%s", serialNumber.c_str());
+}
+
+/* WiFi
+*/
+
+void hal_wifi_begin(const char *ssid, const char *password)
+{
+    WiFi.begin(ssid, password);
+}
+
+void hal_wifi_disconnect()
+{
+    WiFi.disconnect();
+}
+
+bool hal_wifi_connected()
+{
+    return WiFi.status() == WL_CONNECTED;
+}
+
+/* BLE
+*/
+
+void hal_ble_init(const bool active_scan)
+{
+    BLEDevice::init("");
+    pBLEScan = BLEDevice::getScan(); //create new scan
+    pBLEScan->setActiveScan(active_scan);
+}
+
+static void ble_scan_complete(BLEScanResults results);
+
+// The controller takes the scan parameters when a scan starts.
+void hal_ble_configure(const int interval, const int window, const bool active_scan)
+{
+    pBLEScan->setInterval(interval);
+    pBLEScan->setWindow(window);
+    pBLEScan->setActiveScan(active_scan);
+    if (ble_scan_callback.load() && !ble_scan_stopped)
+    {
+        pBLEScan->stop();
+        pBLEScan->start(0, ble_scan_complete, true);
+    }
+}
+
+// Runs a blocking scan for the given number of seconds and hands every
+// result to the callback before the results are released again.
+int hal_ble_scan(
+    const int duration,
+    hal_ble_advertisement_callback_t callback,
+    void *context)
+{
+    BLEScanResults bleScanResult = pBLEScan->start(duration);
+    int ble_scan_result_size = bleScanResult.getCount();
+    int index = ble_scan_result_size;
+
+    while (index-- > 0)
+    {
+        BLEAdvertisedDevice bleDevice = bleScanResult.getDevice(index);
+        BLEAddress address = bleDevice.getAddress();
+
+        hal_ble_advertisement_t advertisement;
+        memcpy(advertisement.address, *address.getNative(), HAL_BLE_ADDRESS_LENGTH);
+        advertisement.rssi = bleDevice.getRSSI();
+        advertisement.payload = bleDevice.getPayload();
+        advertisement.payload_length = bleDevice.getPayloadLength();
+        callback(&advertisement, context);
+    }
+
+    pBLEScan->clearResults();
+    return ble_scan_result_size;
+}
+
+// Runs in the BLE stack task, which also fills the result map: the map
+// is cleared here, before the stack adds the result to it. A callback in
+// progress is counted before the callback is read, so that
+// hal_ble_scan_stop() either sees the count or this sees NULL.
+class ContinuousScanCallbacks : public BLEAdvertisedDeviceCallbacks
+{
+    void onResult(BLEAdvertisedDevice bleDevice)
+    {
+        ble_scan_in_callback.fetch_add(1);
+        hal_ble_advertisement_callback_t callback = ble_scan_callback.load();
+        if (callback)
+        {
+            BLEAddress address = bleDevice.getAddress();
+
+            hal_ble_advertisement_t advertisement;
+            memcpy(advertisement.address, *address.getNative(), HAL_BLE_ADDRESS_LENGTH);
+            advertisement.rssi = bleDevice.getRSSI();
+            advertisement.payload = bleDevice.getPayload();
+            advertisement.payload_length = bleDevice.getPayloadLength();
+            callback(&advertisement, ble_scan_context);
+
+            if (millis() - ble_scan_cleared_millis >= HAL_BLE_CLEAR_INTERVAL)
+            {
+                pBLEScan->clearResults();
+                ble_scan_cleared_millis = millis();
+            }
+        }
+        ble_scan_in_callback.fetch_sub(1);
+    }
+};
+
+static ContinuousScanCallbacks continuous_scan_callbacks;
+
+static void ble_scan_complete(BLEScanResults results)
+{
+    ble_scan_stopped = true;
+}
+
+// Starts an endless, non-blocking scan with duplicate reporting. The
+// stack does not parse the advertisements, the callback gets the raw
+// payload only.
+void hal_ble_scan_start(hal_ble_advertisement_callback_t callback, void *context)
+{
+    ble_scan_context = context;
+    ble_scan_cleared_millis = millis();
+    ble_scan_callback.store(callback);
+    pBLEScan->setAdvertisedDeviceCallbacks(&continuous_scan_callbacks, true, false);
+    ble_scan_stopped = false;
+    pBLEScan->start(0, ble_scan_complete, false);
+}
+
+// Returns once a callback in progress has returned, none runs after: the
+// caller may reset what the callback writes to.
+void hal_ble_scan_stop()
+{
+    ble_scan_callback.store(NULL);
+    pBLEScan->stop();
+    while (ble_scan_in_callback.load() != 0)
+    {
+        delay(1);
+    }
+    pBLEScan->setAdvertisedDeviceCallbacks(NULL, false);
+    pBLEScan->clearResults();
+    ble_scan_stopped = true;
+}
+
+// Called from loop(): restarts the scan should the stack have ended it.
+void hal_ble_scan_maintain()
+{
+    if (ble_scan_stopped && ble_scan_callback.load())
+    {
+        ble_scan_stopped = false;
+        pBLEScan->start(0, ble_scan_complete, true);
+    }
+}
+
+/* Storage
+*/
+
+// The card itself is mounted by M5.begin().
+bool hal_storage_init(const char *directory)
+{
+    SpiBusLock lock;
+    if (SD.cardType() == CARD_NONE)
+    {
+        return false;
+    }
+    return SD.exists(directory) || SD.mkdir(directory);
+}
+
+bool hal_storage_append(const char *path, const uint8_t *data, const size_t length)
+{
+    SpiBusLock lock;
+    File file = SD.open(path, FILE_APPEND);
+    if (!file)
+    {
+        return false;
+    }
+    const size_t written = file.write(data, length);
+    file.close();
+    return written == length;
+}
+
+size_t hal_storage_read(const char *path, const uint32_t offset, uint8_t *data, const size_t length)
+{
+    SpiBusLock lock;
+    File file = SD.open(path, FILE_READ);
+    if (!file)
+    {
+        return 0;
+    }
+    size_t read = 0;
+    if (file.seek(offset))
+    {
+        read = file.read(data, length);
+    }
+    file.close();
+    return read;
+}
+
+long hal_storage_size(const char *path)
+{
+    SpiBusLock lock;
+    File file = SD.open(path, FILE_READ);
+    if (!file)
+    {
+        return -1;
+    }
+    const long size = file.size();
+    file.close();
+    return size;
+}
+
+bool hal_storage_remove(const char *path)
+{
+    SpiBusLock lock;
+    return SD.remove(path);
+}
+
+// Hands the name of every file in the directory, without the path, to
+// the callback.
+void hal_storage_list(const char *directory, hal_storage_list_callback_t callback, void *context)
+{
+    SpiBusLock lock;
+    File root = SD.open(directory);
+    if (!root || !root.isDirectory())
+    {
+        return;
+    }
+    File file;
+    while ((file = root.openNextFile()))
+    {
+        const char *name = file.name();
+        const char *base = strrchr(name, '/');
+        callback(base ? base + 1 : name, context);
+        file.close();
+    }
+    root.close();
+}
+
+uint64_t hal_storage_free()
+{
+    SpiBusLock lock;
+    return SD.totalBytes() - SD.usedBytes();
+}
+
+/* Display
+*/
+
+// Landscape, as M5.begin() leaves it, text at its left edge and
+// vertically centered in its cell.
+void hal_display_init()
+{
+    SpiBusLock lock;
+    M5.Lcd.fillScreen(BLACK);
+    M5.Lcd.setTextSize(2);
+    M5.Lcd.setTextDatum(ML_DATUM);
+}
+
+// One SPI transaction for the fill and the text.
+void hal_display_cell(
+    const int x,
+    const int y,
+    const int width,
+    const int height,
+    const char *text,
+    const uint16_t foreground,
+    const uint16_t background)
+{
+    const int margin = HAL_DISPLAY_CHAR_WIDTH / 2;
+    const int fits = (width - margin) / HAL_DISPLAY_CHAR_WIDTH;
+    char clipped[HAL_DISPLAY_WIDTH / HAL_DISPLAY_CHAR_WIDTH + 1];
+    snprintf(clipped, sizeof(clipped), "%.*s", fits > 0 ? fits : 0, text);
+
+    SpiBusLock lock;
+    M5.Lcd.startWrite();
+    M5.Lcd.fillRect(x, y, width, height, background);
+    M5.Lcd.setTextColor(foreground, background);
+    M5.Lcd.drawString(clipped, x + margin, y + height / 2);
+    M5.Lcd.endWrite();
+}
+
+/* LEDs
+*/
+
+// The SK6812 side bars of the Core2 for AWS IoT EduKit, on the RMT.
+#define HAL_LEDS_PIN 25
+#define HAL_LEDS_BRIGHTNESS 64 // of 255, enough indoors
+
+static CRGB leds[HAL_LEDS];
+
+void hal_leds_init()
+{
+    FastLED.addLeds<SK6812, HAL_LEDS_PIN, GRB>(leds, HAL_LEDS);
+    FastLED.setBrightness(HAL_LEDS_BRIGHTNESS);
+    FastLED.clear(true);
+}
+
+// Sends the ten LEDs, about 0.3 ms.
+void hal_leds_show(const uint32_t *colors)
+{
+    for (int i = 0; i < HAL_LEDS; i++)
+    {
+        leds[i] = CRGB(colors[i]);
+    }
+    FastLED.show();
+}
+
+/* Speaker
+*/
+
+// The NS4168 amplifier on I2S, powered through the AXP192. The DMA
+// buffers are cleared once played, silence between writes.
+#define HAL_AUDIO_PORT I2S_NUM_0
+#define HAL_AUDIO_PIN_BCK 12
+#define HAL_AUDIO_PIN_LRCK 0
+#define HAL_AUDIO_PIN_DATA 2
+
+static bool audio_installed = false;
+
+bool hal_audio_init()
+{
+    i2s_config_t config = {};
+    config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX);
+    config.sample_rate = HAL_AUDIO_SAMPLE_RATE;
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_ONLY_RIGHT;
+    config.communication_format = (i2s_comm_format_t)(I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB);
+    config.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1;
+    config.dma_buf_count = HAL_AUDIO_DMA_BUFFERS;
+    config.dma_buf_len = HAL_AUDIO_DMA_SAMPLES;
+    config.use_apll = false;
+    config.tx_desc_auto_clear = true;
+
+    i2s_pin_config_t pins = {};
+    pins.bck_io_num = HAL_AUDIO_PIN_BCK;
+    pins.ws_io_num = HAL_AUDIO_PIN_LRCK;
+    pins.data_out_num = HAL_AUDIO_PIN_DATA;
+    pins.data_in_num = I2S_PIN_NO_CHANGE;
+
+    M5.Axp.SetSpkEnable(true);
+    audio_installed = i2s_driver_install(HAL_AUDIO_PORT, &config, 0, NULL) == ESP_OK &&
+                      i2s_set_pin(HAL_AUDIO_PORT, &pins) == ESP_OK &&
+                      i2s_zero_dma_buffer(HAL_AUDIO_PORT) == ESP_OK;
+    return audio_installed;
+}
+
+// Copies into the free DMA buffer, no ticks to wait. Without the driver,
+// or when it fails, the samples are gone at once.
+size_t hal_audio_write(const int16_t *samples, const size_t count)
+{
+    size_t written = 0;
+    if (!audio_installed)
+    {
+        return count;
+    }
+    if (i2s_write(HAL_AUDIO_PORT, samples, count * sizeof(int16_t), &written, 0) != ESP_OK)
+    {
+        return count;
+    }
+    return written / sizeof(int16_t);
+}
+
+/* Settings
+*/
+
+// The "hhcm" namespace of the NVS partition, opened on first use.
+static Preferences settings;
+static bool settings_open = false;
+
+static bool settings_begin()
+{
+    if (!settings_open)
+    {
+        settings_open = settings.begin("hhcm", false);
+    }
+    return settings_open;
+}
+
+size_t hal_settings_read(const char *key, uint8_t *data, const size_t size)
+{
+    if (!settings_begin())
+    {
+        return 0;
+    }
+    const size_t length = settings.getBytesLength(key);
+    if (length == 0 || length > size)
+    {
+        return 0;
+    }
+    return settings.getBytes(key, data, length);
+}
+
+bool hal_settings_write(const char *key, const uint8_t *data, const size_t length)
+{
+    return settings_begin() && settings.putBytes(key, data, length) == length;
+}
+
+/* MQTT
+*/
+
+static void mqtt_message_received(int messageSize)
+{
+    String topic = mqtt_client.messageTopic();
+    mqtt_message_callback(topic.c_str(), messageSize);
+}
+
+// Uses the private key slot from the secure element and the given
+// certificate for TLS, and the time stored by NTP to validate the
+// server certificate.
+void hal_mqtt_init(
+    const char *client_id,
+    const char *certificate,
+    hal_mqtt_message_callback_t callback)
+{
+    ArduinoBearSSL.onGetTime(get_stored_time);
+    ssl_client.setEccSlot(ACTA_SLOT_PRIVATE_KEY, certificate);
+    mqtt_client.setId(client_id);
+    mqtt_message_callback = callback;
+    mqtt_client.onMessage(mqtt_message_received);
+}
+
+// The client reports a failed TCP connection or TLS handshake as
+// MQTT_CONNECTION_REFUSED, a refusal by the broker as the CONNACK code.
+hal_mqtt_connect_result_t hal_mqtt_connect(const char *host, const uint16_t port)
+{
+    memset(&mqtt_watch_client.handshake, 0, sizeof(mqtt_watch_client.handshake));
+    if (mqtt_client.connect(host, port))
+    {
+        return HAL_MQTT_CONNECTED;
+    }
+    return mqtt_client.connectError() == MQTT_CONNECTION_REFUSED ? HAL_MQTT_TRANSPORT_FAILED : HAL_MQTT_REFUSED;
+}
+
+void hal_tls_get_handshake(hal_tls_handshake_t *handshake)
+{
+    *handshake = mqtt_watch_client.handshake;
+}
+
+bool hal_mqtt_connected()
+{
+    return mqtt_client.connected();
+}
+
+void hal_mqtt_poll()
+{
+    mqtt_client.poll();
+}
+
+bool hal_mqtt_subscribe(const char *topic)
+{
+    return mqtt_client.subscribe(topic) == 1;
+}
+
+// With the size known up front the client writes the payload through to
+// the TLS connection instead of buffering another copy of it.
+bool hal_mqtt_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    if (mqtt_client.beginMessage(topic, length, false, 0, false) != 1)
+    {
+        return false;
+    }
+    mqtt_client.write(payload, length);
+    return mqtt_client.endMessage() == 1;
+}
+
+// Leans on ArduinoMqttClient 0.1.5 internals, hence the exact version
+// in platformio.ini:
+// - beginMessage() with the size known writes the PUBLISH header,
+//   packet ID included, straight through to the connection; the watch
+//   picks the packet ID up there, the client has no call that returns
+//   it.
+// - endMessage() is skipped: for QoS 1 it would block in poll() until
+//   the PUBACK, and the message is complete once the payload is
+//   written. The next beginMessage() starts over.
+// - poll() reads a PUBACK it does not wait for and drops it, the watch
+//   hands it to the callback.
+// retransmit is ignored here: the client cannot repeat a packet ID, a
+// retransmission goes out under a new one as a new message, DUP clear
+// (the flag is for a packet ID sent before, MQTT 3.1.1 3.3.1.1). The
+// broker may so pass on both copies; consumers drop the repeat by the
+// "seq" every QoS 1 message carries.
+uint16_t hal_mqtt_publish_acknowledged(const char *topic, const uint8_t *payload, const size_t length, const uint16_t retransmit)
+{
+    mqtt_watch_client.published = 0;
+    if (mqtt_client.beginMessage(topic, length, false, 1, false) != 1)
+    {
+        return 0;
+    }
+    if (mqtt_client.write(payload, length) != length || !mqtt_client.connected())
+    {
+        return 0;
+    }
+    return mqtt_watch_client.published;
+}
+
+void hal_mqtt_set_ack_callback(hal_mqtt_ack_callback_t callback)
+{
+    mqtt_ack_callback = callback;
+}
+
+int hal_mqtt_read()
+{
+    return mqtt_client.read();
+}
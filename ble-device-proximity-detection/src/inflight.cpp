@@ -0,0 +1,124 @@
+/*
+ * inflight.cpp
+ */
+
+#include "inflight.h"
+
+void inflight_init(inflight_t *window)
+{
+    for (int i = 0; i < INFLIGHT_WINDOW; i++)
+    {
+        window->messages[i].used = false;
+    }
+    window->count = 0;
+    window->next_order = 0;
+    window->high_water = 0;
+    window->acknowledged = 0;
+    window->retransmitted = 0;
+    window->given_up = 0;
+    window->unknown = 0;
+    window->ack_ms_max = 0;
+    window->ack_ms_total = 0;
+}
+
+// A free slot to build the message in, NULL while the window is full.
+// It stays free until inflight_sent().
+inflight_message_t *inflight_reserve(inflight_t *window)
+{
+    if (window->count >= INFLIGHT_WINDOW)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < INFLIGHT_WINDOW; i++)
+    {
+        if (!window->messages[i].used)
+        {
+            return &window->messages[i];
+        }
+    }
+    return NULL;
+}
+
+// The message went out under the packet ID, the first time or again.
+// The timeout doubles with every attempt.
+void inflight_sent(inflight_t *window, inflight_message_t *message, const uint16_t packet_id, const uint32_t now)
+{
+    if (!message->used)
+    {
+        message->used = true;
+        message->attempts = 0;
+        message->order = window->next_order++;
+        message->sent = now;
+        window->count++;
+        window->high_water = window->count > window->high_water ? window->count : window->high_water;
+    }
+    else
+    {
+        window->retransmitted++;
+    }
+    message->attempts++;
+    message->packet_id = packet_id;
+
+    uint32_t timeout = INFLIGHT_TIMEOUT;
+    for (uint8_t attempt = 1; attempt < message->attempts && timeout < INFLIGHT_TIMEOUT_MAX; attempt++)
+    {
+        timeout *= 2;
+    }
+    message->due = now + (timeout < INFLIGHT_TIMEOUT_MAX ? timeout : INFLIGHT_TIMEOUT_MAX);
+}
+
+// Releases the message the PUBACK is for. False if none is, the PUBACK
+// of an attempt that was retransmitted under another packet ID.
+bool inflight_acknowledge(inflight_t *window, const uint16_t packet_id, const uint32_t now)
+{
+    for (int i = 0; i < INFLIGHT_WINDOW; i++)
+    {
+        inflight_message_t *message = &window->messages[i];
+        if (!message->used || message->packet_id != packet_id)
+        {
+            continue;
+        }
+        const uint32_t elapsed = now - message->sent;
+        message->used = false;
+        window->count--;
+        window->acknowledged++;
+        window->ack_ms_total += elapsed;
+        window->ack_ms_max = elapsed > window->ack_ms_max ? elapsed : window->ack_ms_max;
+        return true;
+    }
+    window->unknown++;
+    return false;
+}
+
+// The message to retransmit first, the oldest of those past their
+// timeout; NULL if none is.
+inflight_message_t *inflight_due(inflight_t *window, const uint32_t now)
+{
+    inflight_message_t *oldest = NULL;
+    for (int i = 0; i < INFLIGHT_WINDOW; i++)
+    {
+        inflight_message_t *message = &window->messages[i];
+        if (message->used && (int32_t)(now - message->due) >= 0 && (oldest == NULL || message->order < oldest->order))
+        {
+            oldest = message;
+        }
+    }
+    return oldest;
+}
+
+void inflight_give_up(inflight_t *window, inflight_message_t *message)
+{
+    message->used = false;
+    window->count--;
+    window->given_up++;
+}
+
+// After a reconnect: the broker will not acknowledge what was sent over
+// the old connection, everything goes out again.
+void inflight_resend_all(inflight_t *window, const uint32_t now)
+{
+    for (int i = 0; i < INFLIGHT_WINDOW; i++)
+    {
+        window->messages[i].due = now;
+    }
+}
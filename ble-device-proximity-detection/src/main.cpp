@@ -42,22 +42,19 @@
 #include <FastLED.h>
 #include <time.h>
 
-#include <WiFi.h>
-
-#include <ArduinoBearSSL.h>
-
-#include <ArduinoMqttClient.h>
-#include <ArduinoJson.h>
-#include <BLEScan.h>
-
 #include "arduino_secrets.h"
 
 #define DEBUG
 #include "debug2serial.h"
 
 #include "auxiliary.h"
-#include "secure_element.h"
+#include "hal.h"
+#include "connection.h"
 #include "ble_scan.h"
+#include "scan_schedule.h"
+#include "gateway.h"
+#include "dashboard.h"
+#include "reminder.h"
 
 /* GLOBALS
 */
@@ -71,106 +68,68 @@ const char wifi_password[] = WIFI_PASS;
 const char endpoint_address[] = AWS_IOT_ENDPOINT_ADDRESS;
 const char *certificate = THING_CERTIFICATE;
 
-// Clients for Wi-Fi, SSL, and MQTT libraries:
-WiFiClient wifi_client;
-BearSSLClient ssl_client(wifi_client);
-MqttClient mqtt_client(ssl_client);
-
 // MQTT: Client ID and topics to publish subscribe to.
 // Note: AWS IoT Core expects a unique client Id
 // and the policy restricts which client Id's can connect
 // to your broker endpoint address.
 //
-// NOTE: client_Id is set after the ATECC608 is initialized
+// NOTE: client_id is set after the ATECC608 is initialized
 // to the value of the unique chip serial number.
-String client_id = "";
-
-// Keeping track of time elapsed since last MQTT message published.
-unsigned long last_publish_millis = 0;
-
-// BLE scan settings & handle
-int detect_ble_scan_duration = BLE_SCAN_SETUP_DURATION;
-int detect_ble_scan_interval = BLE_SCAN_SETUP_INTERVAL;
-int detect_ble_scan_window = BLE_SCAN_SETUP_WINDOW;
-String detect_name_prefix = "RHS";
-int detect_rssi_threshold = -50;
-BLEScan *pBLEScan;
-
-// Application setup
-#define PUBLISH_INTERVAL 10000
-
-// JSON messages: Device shadow
-#define SHADOW_DOCUMENT_SIZE 1024
-StaticJsonDocument<SHADOW_DOCUMENT_SIZE> shadowDocument;
-// DynamicJsonDocument shadowDocument(SHADOW_DOCUMENT_SIZE);
-JsonArray detected;
-JsonArray accept;
+char client_id[GATEWAY_THING_NAME_SIZE] = "";
+
+// Pipeline: the BLE stack queues advertisements, loop() aggregates them
+// on the application core (1), the network task encrypts and publishes
+// on the protocol core (0) next to the Wi-Fi and TCP/IP tasks, so a
+// stalled TLS connection does not hold up detection.
+#define NETWORK_TASK_CORE 0
+#define NETWORK_TASK_PRIORITY 1
+#define NETWORK_TASK_STACK 12288 // bytes, BearSSL handshakes run on it
+#define PIPELINE_REPORT_INTERVAL 60000
+bool network_task_running = false;
+unsigned long last_report_millis = 0;
+
+// Trace log: records are written to the serial port by a task of idle
+// priority, whenever the application core has nothing else to do.
+#define TRACE_TASK_CORE 1
+#define TRACE_TASK_PRIORITY 0
+#define TRACE_TASK_STACK 2048
+#define TRACE_TASK_IDLE_DELAY 10 // ms with the ring empty
+bool trace_task_running = false;
+
+// Dashboard: drawn by a task of idle priority on the application core,
+// away from the BLE stack and the TLS handshakes on the protocol core.
+// The LCD takes the SPI bus from the SD card a cell at a time.
+#define DISPLAY_TASK_CORE 1
+#define DISPLAY_TASK_PRIORITY 0
+#define DISPLAY_TASK_STACK 3072
+bool display_task_running = false;
+dashboard_model_t dashboard_model;
+dashboard_view_t dashboard_view;
+unsigned long last_frame_millis = 0;
+
+// Reminders: cued by a task above loop() on the application core, woken
+// every few ms; a step draws an LED frame at most and tops up the DMA
+// buffer of the speaker, it never waits for either.
+#define FEEDBACK_TASK_CORE 1
+#define FEEDBACK_TASK_PRIORITY 2
+#define FEEDBACK_TASK_STACK 2048
+bool feedback_task_running = false;
+reminder_player_t reminder_player;
+unsigned long last_feedback_millis = 0;
 
 /* FUNCTIONS
 */
 
-// WiFi: Connects to the specified WiFi network using the defined
-// settings & credentials, retries every 5 seconds on
-// failure.
-void connect_wifi(const char *ssid, const char *password)
-{
-  DEBUG_SERIAL_PRINT("WiFi: Attempting to connect to SSID: ");
-  DEBUG_SERIAL_PRINTLN(ssid);
-
-  while (WiFi.begin(ssid, password) != WL_CONNECTED)
-  {
-    DEBUG_SERIAL_PRINTLN("WiFi: Failed to connect. Retrying...");
-    delay(5000);
-  }
-  DEBUG_SERIAL_PRINT("WiFi: Successfully connected to network ");
-  DEBUG_SERIAL_PRINTLN(ssid);
-}
-
-// Subscribe to the given MQTT topic.
-void subscribe_MQTT_topic(String topic)
-{
-  // Subscribe to an MQTT topic.
-  DEBUG_SERIAL_PRINT("MQTT: Subscribe to ");
-  DEBUG_SERIAL_PRINTLN(topic);
-  int rc = mqtt_client.subscribe(topic);
-  if (1 == rc)
-  {
-    DEBUG_SERIAL_PRINT("MQTT: Subscribed to ");
-    DEBUG_SERIAL_PRINTLN(topic);
-  }
-  else
-  {
-    DEBUG_SERIAL_PRINT("MQTT: WARNING - Subscription failed: ");
-    DEBUG_SERIAL_PRINTLN(rc);
-  }
-}
-
-// Publishes the MQTT message string to the MQTT broker. The thing must
-// have authorization to publish to the topic, otherwise the connection
-// to AWS IoT Core will disconnect.
-//
-// NOTE: Use the "print" interface to send messages.
-void publish_MQTT_message(String topic, const char *message)
+// WiFi: Joined the network, (re)starts the NTP sync the TLS connection
+// needs to validate the server certificate.
+void on_wifi()
 {
-  DEBUG_SERIAL_PRINTLN("MQTT Publishing message to '" + topic + "':");
-  DEBUG_SERIAL_PRINTLN(message);
-  DEBUG_SERIAL_PRINTLN("<<<");
-  mqtt_client.beginMessage(topic, strlen(message), false, 0, false);
-  mqtt_client.print(message);
-  mqtt_client.endMessage();
-}
-
-// Publishes the MQTT JSON message to the MQTT broker.
-void publish_MQTT_message(String topic, JsonDocument *jsonDocument)
-{
-  char buffer[SHADOW_DOCUMENT_SIZE];
-  serializeJsonPretty(*jsonDocument, buffer);
-  publish_MQTT_message(topic, buffer);
+  DEBUG_TRACE(WIFI_CONNECTED, wifi_ssid);
+  retrieve_and_store_NTP_time(DEFAULT_NTP_SERVER, DEFAULT_TZ_GMT_OFFSET, DEFAULT_TZ_DST);
 }
 
-// Connects to the MQTT message broker, AWS IoT Core using
+// Connected to the MQTT message broker, AWS IoT Core using
 // the defined endpoint address at the default port 8883.
-// A failed connection retries every 5 seconds.
 // On a successful connection, it will then subscribe to a
 // default MQTT topic, that is listening to everything
 // on starting with a topic filter of the device name/.
@@ -179,91 +138,135 @@ void publish_MQTT_message(String topic, JsonDocument *jsonDocument)
 // doesn't have sufficient authorization.
 //
 // NOTE: You must use the ATS endpoint address.
-void connect_AWS_IoT(const char *endpoint_address, const String thing)
+void on_connect()
 {
-  const unsigned port = 8883;
-  const String mqtt_topic_shadow_get = "$aws/things/" + thing + "/shadow/get/accepted/";
-  const String mqtt_topic_shadow_sent_get = "$aws/things/" + thing + "/shadow/get/";
-  const String mqtt_topic_shadow_update = "$aws/things/" + thing + "/shadow/update/";
+  DEBUG_TRACE(MQTT_CONNECTED);
+  gateway_on_connect();
+}
 
-  DEBUG_SERIAL_PRINT("MQTT: Attempting to AWS IoT Core message broker at mqtt:\\\\");
-  DEBUG_SERIAL_PRINT(endpoint_address);
-  DEBUG_SERIAL_PRINT(":");
-  DEBUG_SERIAL_PRINTLN(port);
+// Wi-Fi and AWS IoT Core, (re)connected by the network task without
+// blocking it: the gateway keeps scanning and keeps its messages on the
+// SD card while offline.
+const connection_config_t connection_config = {
+    wifi_ssid,
+    wifi_password,
+    endpoint_address,
+    AWS_MQTT_PORT,
+    on_wifi,
+    on_connect};
+
+// Traces queue depths, per-stage latencies, the scan duty cycle, the
+// state of the clock and of the trace log itself.
+void report_pipeline()
+{
+  gateway_statistics_t gateway;
+  ble_scan_statistics_t scan;
+  trace_statistics_t trace;
+  gateway_get_statistics(&gateway);
+  ble_scan_get_statistics(&scan);
+  trace_get_statistics(&trace);
+
+  DEBUG_TRACE(PIPELINE_SCAN, scan.queued, scan.high_water, scan.dropped, scan.wait_max);
+  DEBUG_TRACE(PIPELINE_AGGREGATE, gateway.aggregate_runs,
+              gateway.aggregate_runs ? gateway.aggregate_us_total / gateway.aggregate_runs : 0,
+              gateway.aggregate_us_max, gateway.events_dropped);
+  DEBUG_TRACE(PIPELINE_OUTBOX, gateway.outbox_depth, gateway.outbox_high_water, gateway.outbox_refused, gateway.wait_ms_max);
+  DEBUG_TRACE(PIPELINE_NETWORK, gateway.sent, gateway.sent ? gateway.publish_us_total / gateway.sent : 0,
+              gateway.publish_us_max, gateway.stored, gateway.replayed);
+  DEBUG_TRACE(PIPELINE_SCAN_MODE, scan_mode_name((scan_mode_t)gateway.scan_mode), gateway.scan_mode_switches,
+              (unsigned)(gateway.scan_ms * 100 / millis()), (unsigned)(gateway.scan_active_ms * 100 / millis()));
+  DEBUG_TRACE(PIPELINE_CLOCK, gateway.clock_synced ? "synced" : "not synced", gateway.clock_syncs, gateway.clock_steps,
+              gateway.clock_error_ms, gateway.clock_drift_ppm);
+  DEBUG_TRACE(PIPELINE_TRACE, trace.written, trace.dropped, trace.high_water);
+}
 
-  while (!mqtt_client.connect(endpoint_address, port))
+// Network stage: (re)connects a step at a time, polls for incoming
+// messages and sends keep alive pings, publishes what loop() queued.
+void network_step()
+{
+  connection_step(millis());
+  if (connection_online())
   {
-    DEBUG_SERIAL_PRINTLN("MQTT: Failed to connect to AWS IoT Core. Retrying...");
-    delay(5000);
+    hal_mqtt_poll();
   }
-  DEBUG_SERIAL_PRINTLN("MQTT: Connected to AWS IoT Core!");
+  gateway_network_loop();
 
-  // Subscribe to "$aws/things/{thing}/shadow/get/accepted/"
-  subscribe_MQTT_topic(mqtt_topic_shadow_get);
+  if (millis() - last_report_millis >= PIPELINE_REPORT_INTERVAL)
+  {
+    last_report_millis = millis();
+    report_pipeline();
+  }
+}
 
-  // Subscribe to "$aws/things/{thing}/shadow/update/"
-  subscribe_MQTT_topic(mqtt_topic_shadow_update);
+void network_task(void *context)
+{
+  for (;;)
+  {
+    network_step();
+    hal_delay(1);
+  }
+}
 
-  // Send empty message to $aws/things/{ThingName}/shadow/get
-  publish_MQTT_message(mqtt_topic_shadow_sent_get, "{}");
+// The serial port takes the trace frames as they are, the host decodes
+// them (bench/README.md, "decode").
+void write_serial(const uint8_t *data, size_t length, void *context)
+{
+  Serial.write(data, length);
 }
 
-void shadow_update_AWS_IoT(const String thing, JsonDocument *jsonShadow) {
-  const String mqtt_topic_shadow_update = "$aws/things/" + thing + "/shadow/update/";
-  publish_MQTT_message(mqtt_topic_shadow_update,jsonShadow);
+void trace_task(void *context)
+{
+  for (;;)
+  {
+    if (trace_drain(write_serial, NULL, TRACE_DRAIN_BUDGET) == 0)
+    {
+      hal_delay(TRACE_TASK_IDLE_DELAY);
+    }
+  }
 }
 
+// Draws what changed since the last frame, if anything.
+void display_step()
+{
+  gateway_take_dashboard(&dashboard_model);
+  dashboard_render(&dashboard_view, &dashboard_model);
+}
 
-// Callback for messages received on the subscribed MQTT
-// topics. Use the Stream interface to loop until all contents
-// are read.
-void message_received_callback(int messageSize)
+void display_task(void *context)
 {
-  // we received a message, print out the topic and contents
-  DEBUG_SERIAL_PRINT("Received a message with topic '");
-  DEBUG_SERIAL_PRINT(mqtt_client.messageTopic());
-  DEBUG_SERIAL_PRINT("', length ");
-  DEBUG_SERIAL_PRINT(messageSize);
-  DEBUG_SERIAL_PRINTLN(" bytes:");
-
-  while (mqtt_client.available())
+  for (;;)
   {
-    DEBUG_SERIAL_PRINT((char)mqtt_client.read());
+    display_step();
+    hal_delay(DASHBOARD_FRAME_INTERVAL);
   }
-  DEBUG_SERIAL_PRINTLN("\n");
 }
 
-void intitialize_shadow()
+// Starts the cue of a reminder raised since the last step, if not
+// playing one, and plays on.
+void feedback_step()
 {
-  shadowDocument.clear();
-  JsonObject state = shadowDocument.createNestedObject("state");
-  JsonObject state_reported = state.createNestedObject("reported");
-  JsonObject state_reported_detect = state_reported.createNestedObject("detect");
-  state_reported_detect["interval"] = detect_ble_scan_interval;
-  state_reported_detect["window"] = detect_ble_scan_window;
-  state_reported_detect["duration"] = detect_ble_scan_duration;
-  state_reported_detect["name_prefix"] = detect_name_prefix;
-  state_reported_detect["rssi_threshold"] = detect_rssi_threshold;
-  detected = state_reported.createNestedArray("detected");
+  uint32_t time;
+  if (gateway_take_reminder(&time))
+  {
+    reminder_play(&reminder_player, time, millis());
+  }
+  reminder_step(&reminder_player, millis());
 }
 
-void update_shadow()
+void feedback_task(void *context)
 {
-  shadowDocument.clear();
-  JsonObject state = shadowDocument.createNestedObject("state");
-  JsonObject state_reported = state.createNestedObject("reported");
-  JsonObject state_reported_detect = state_reported.createNestedObject("detect");
-  state_reported_detect["interval"] = detect_ble_scan_interval;
-  state_reported_detect["window"] = detect_ble_scan_window;
-  state_reported_detect["duration"] = detect_ble_scan_duration;
-  state_reported_detect["name_prefix"] = detect_name_prefix;
-  state_reported_detect["rssi_threshold"] = detect_rssi_threshold;
-  detected = state_reported.createNestedArray("detected");
+  for (;;)
+  {
+    feedback_step();
+    hal_delay(REMINDER_TICK);
+  }
 }
 
-
 void setup()
 {
+  // Traces are queued from here on, written once the serial port is up.
+  trace_init();
+
   // DEBUG_SERIAL_INIT(115200);
   DEBUG_SERIAL_PRINTLN("APP: Initializing ...");
 
@@ -274,71 +277,80 @@ void setup()
   bool I2CEnable = true;
   mbus_mode_t MBUSmode = kMBusModeOutput;
   M5.begin(LCDEnable, SDEnable, SerialEnable, I2CEnable, MBUSmode);
+  trace_task_running = hal_task_start(
+      "trace", trace_task, NULL, TRACE_TASK_STACK, TRACE_TASK_PRIORITY, TRACE_TASK_CORE);
 
-  // Initialize the secure element, connect to Wi-Fi, sync time
-  se_initialize();
-  connect_wifi(wifi_ssid, wifi_password);
-  retrieve_and_store_NTP_time(DEFAULT_NTP_SERVER, DEFAULT_TZ_GMT_OFFSET, DEFAULT_TZ_DST);
-
-  // Set a callback to get the current time
-  // used to validate the servers certificate
-  ArduinoBearSSL.onGetTime(get_stored_time);
-
-  // Uses the private key slot from the secure element and the
-  // certificate you pasted into arduino_secrets.h,
-  ssl_client.setEccSlot(ACTA_SLOT_PRIVATE_KEY, certificate);
+  // Initialize the secure element
+  hal_se_initialize();
 
   // The client Id for the MQTT client. Uses the ATECC608 serial number
   // as the unique client Id, as registered in AWS IoT, and set in the
-  // thing policy.
-  mqtt_client.setId(se_get_id());
-
-  // The MQTT message callback, this function is called when
-  // the MQTT client receives a message on the subscribed topic
-  mqtt_client.onMessage(message_received_callback);
+  // thing policy. TLS uses the private key slot from the secure element
+  // and the certificate you pasted into arduino_secrets.h.
+  // The MQTT message callback is called when the MQTT client receives
+  // a message on the subscribed topic.
+  hal_se_get_id(client_id, sizeof(client_id));
+  hal_mqtt_init(client_id, certificate, gateway_message_received);
+
+  // Intitialize the BLE scan and the device shadow JSON structure, the
+  // client Id is the thing name.
+  gateway_setup(client_id);
+
+  // The dashboard shows what the gateway sees from here on.
+  if (DASHBOARD_SETUP_ENABLED)
+  {
+    hal_display_init();
+    dashboard_view_init(&dashboard_view, millis());
+    display_task_running = hal_task_start(
+        "display", display_task, NULL, DISPLAY_TASK_STACK, DISPLAY_TASK_PRIORITY, DISPLAY_TASK_CORE);
+  }
 
-  // Intitialize the BLE scan
-  pBLEScan = ble_scan_init(detect_ble_scan_interval, detect_ble_scan_window);
+  // Reminders are cued at the gateway, online or not.
+  if (REMINDER_SETUP_ENABLED)
+  {
+    hal_leds_init();
+    if (!hal_audio_init())
+    {
+      DEBUG_SERIAL_PRINTLN("APP: WARNING - No speaker, reminders are silent.");
+    }
+    reminder_player_init(&reminder_player);
+    feedback_task_running = hal_task_start(
+        "feedback", feedback_task, NULL, FEEDBACK_TASK_STACK, FEEDBACK_TASK_PRIORITY, FEEDBACK_TASK_CORE);
+  }
 
-  // Initialize the device shadow JSON structure
-  intitialize_shadow();
+  // Wi-Fi, time sync and AWS IoT Core follow in the network task.
+  connection_setup(&connection_config, millis());
+  network_task_running = hal_task_start(
+      "network", network_task, NULL, NETWORK_TASK_STACK, NETWORK_TASK_PRIORITY, NETWORK_TASK_CORE);
+  if (!network_task_running)
+  {
+    DEBUG_SERIAL_PRINTLN("APP: WARNING - No network task, loop() publishes.");
+  }
 }
 
 void loop()
 {
-  DEBUG_SERIAL_PRINTLN("WiFi: Checking connection ...");
-  // Attempt to reconnect to Wi-Fi if disconnected.
-  if (WiFi.status() != WL_CONNECTED)
+  // Without the network task its stage runs here, in turn.
+  if (!network_task_running)
   {
-    connect_wifi(wifi_ssid, wifi_password);
+    network_step();
   }
 
-  DEBUG_SERIAL_PRINTLN("MQTT: Checking AWS IoT Core connection ...");
-  // Attempt to reconnect to AWS IoT Core if disconnected.
-  if (!mqtt_client.connected())
+  // Scan for BLE devices and queue the device shadow and events.
+  gateway_loop();
+  if (!trace_task_running)
   {
-    connect_AWS_IoT(endpoint_address,se_get_id());
+    trace_drain(write_serial, NULL, TRACE_DRAIN_BUDGET);
   }
-
-  DEBUG_SERIAL_PRINTLN("MQTT: Polling for incoming messages ...");
-  // Poll for new MQTT messages and send keep alive pings.
-  mqtt_client.poll();
-
-  intitialize_shadow();
-
-  DEBUG_SERIAL_PRINTLN("BLE: Scanning ...");
-  // Scan for BLE devices in close proximity.
-  ble_scan(pBLEScan, detect_ble_scan_duration, detect_name_prefix, detect_rssi_threshold, &detected);
-
-  // Publish a message every PUBLISH_INTERVAL seconds or more.
-  if (millis() - last_publish_millis > PUBLISH_INTERVAL || detected.size() > 0)
+  if (REMINDER_SETUP_ENABLED && !feedback_task_running && millis() - last_feedback_millis >= REMINDER_TICK)
   {
-    if (!mqtt_client.connected())
-    {
-      DEBUG_SERIAL_PRINTLN("MQTT: WARNING - CONNECTION LOST!");
-    }
-    DEBUG_SERIAL_PRINTLN("MQTT: Publishing ...");
-    last_publish_millis = millis();
-    shadow_update_AWS_IoT(se_get_id(), &shadowDocument);
+    last_feedback_millis = millis();
+    feedback_step();
+  }
+  if (DASHBOARD_SETUP_ENABLED && !display_task_running && millis() - last_frame_millis >= DASHBOARD_FRAME_INTERVAL)
+  {
+    last_frame_millis = millis();
+    display_step();
   }
+  hal_delay(1);
 }
\ No newline at end of file
@@ -0,0 +1,264 @@
+/*
+ * metrics.cpp
+ */
+
+#include <atomic>
+#include "wallclock.h"
+#include "metrics.h"
+
+#define METRICS_BOUNDS (METRICS_BUCKETS - 1)
+
+typedef struct
+{
+    std::atomic<uint32_t> value;
+    std::atomic<uint32_t> min;
+    std::atomic<uint32_t> max;
+    std::atomic<uint32_t> limit;
+    std::atomic<bool> set;
+} gauge_t;
+
+typedef struct
+{
+    std::atomic<uint32_t> counts[METRICS_BUCKETS];
+    std::atomic<uint32_t> sum;
+    std::atomic<uint32_t> max;
+} histogram_t;
+
+static const char *const counter_names[] = {
+    "adv_seen", "adv_matched", "adv_dropped", "presence_rejected", "events_dropped",
+    "telemetry_dropped", "messages_stored", "messages_lost", "published", "publish_failed",
+    "connects", "connect_failures", "link_lost", "acknowledged", "retransmitted", "frames",
+    "reminders", "shadow_rejected"};
+static const char *const gauge_names[] = {
+    "presence", "outbox", "heap_free", "heap_largest",
+    "json_events", "json_shadow", "json_telemetry", "json_desired", "allowlist", "inflight", "display_cpu"};
+static const char *const histogram_names[] = {"scan_us", "loop_us", "publish_us", "message_bytes", "handshake_us", "frame_us", "reminder_us"};
+
+static_assert(sizeof(counter_names) / sizeof(counter_names[0]) == METRIC_COUNTER_COUNT, "a counter without a name");
+static_assert(sizeof(gauge_names) / sizeof(gauge_names[0]) == METRIC_GAUGE_COUNT, "a gauge without a name");
+static_assert(sizeof(histogram_names) / sizeof(histogram_names[0]) == METRIC_HISTOGRAM_COUNT, "a histogram without a name");
+
+// Two buckets per decade for times, the last bound above a blocking
+// scan of a few seconds; powers of two for sizes.
+static const uint32_t bounds_us[METRICS_BOUNDS] = {100, 300, 1000, 3000, 10000, 30000, 100000, 300000, 3000000};
+static const uint32_t bounds_bytes[METRICS_BOUNDS] = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
+
+static std::atomic<uint32_t> counters[METRIC_COUNTER_COUNT];
+static gauge_t gauges[METRIC_GAUGE_COUNT];
+static histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+
+void metrics_init()
+{
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        gauges[i].value.store(0, std::memory_order_relaxed);
+        gauges[i].min.store(UINT32_MAX, std::memory_order_relaxed);
+        gauges[i].max.store(0, std::memory_order_relaxed);
+        gauges[i].limit.store(0, std::memory_order_relaxed);
+        gauges[i].set.store(false, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+        {
+            histograms[i].counts[bucket].store(0, std::memory_order_relaxed);
+        }
+        histograms[i].sum.store(0, std::memory_order_relaxed);
+        histograms[i].max.store(0, std::memory_order_relaxed);
+    }
+}
+
+void metrics_count(const metric_counter_t counter)
+{
+    counters[counter].fetch_add(1, std::memory_order_relaxed);
+}
+
+void metrics_add(const metric_counter_t counter, const uint32_t count)
+{
+    counters[counter].fetch_add(count, std::memory_order_relaxed);
+}
+
+// Single writer: the extremes need no compare-and-swap.
+void metrics_set(const metric_gauge_t gauge, const uint32_t value)
+{
+    gauge_t *entry = &gauges[gauge];
+    entry->value.store(value, std::memory_order_relaxed);
+    if (value < entry->min.load(std::memory_order_relaxed))
+    {
+        entry->min.store(value, std::memory_order_relaxed);
+    }
+    if (value > entry->max.load(std::memory_order_relaxed))
+    {
+        entry->max.store(value, std::memory_order_relaxed);
+    }
+    entry->set.store(true, std::memory_order_relaxed);
+}
+
+void metrics_set_limit(const metric_gauge_t gauge, const uint32_t limit)
+{
+    gauges[gauge].limit.store(limit, std::memory_order_relaxed);
+}
+
+const uint32_t *metrics_histogram_bounds(const metric_histogram_t histogram)
+{
+    return histogram == METRIC_MESSAGE_BYTES ? bounds_bytes : bounds_us;
+}
+
+void metrics_record(const metric_histogram_t histogram, const uint32_t value)
+{
+    const uint32_t *bounds = metrics_histogram_bounds(histogram);
+    histogram_t *entry = &histograms[histogram];
+    int bucket = 0;
+
+    while (bucket < METRICS_BOUNDS && value > bounds[bucket])
+    {
+        bucket++;
+    }
+    entry->counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    entry->sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint32_t max = entry->max.load(std::memory_order_relaxed);
+    while (value > max && !entry->max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Each value is read on its own, a histogram recorded meanwhile may
+// show up in its bucket but not yet in its sum.
+void metrics_snapshot(metrics_snapshot_t *snapshot)
+{
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        snapshot->counters[i] = counters[i].load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        snapshot->gauges[i].value = gauges[i].value.load(std::memory_order_relaxed);
+        snapshot->gauges[i].min = gauges[i].min.load(std::memory_order_relaxed);
+        snapshot->gauges[i].max = gauges[i].max.load(std::memory_order_relaxed);
+        snapshot->gauges[i].limit = gauges[i].limit.load(std::memory_order_relaxed);
+        snapshot->gauges[i].set = gauges[i].set.load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+        {
+            snapshot->histograms[i].counts[bucket] = histograms[i].counts[bucket].load(std::memory_order_relaxed);
+        }
+        snapshot->histograms[i].sum = histograms[i].sum.load(std::memory_order_relaxed);
+        snapshot->histograms[i].max = histograms[i].max.load(std::memory_order_relaxed);
+    }
+}
+
+const char *metrics_counter_name(const metric_counter_t counter)
+{
+    return counter_names[counter];
+}
+
+const char *metrics_gauge_name(const metric_gauge_t gauge)
+{
+    return gauge_names[gauge];
+}
+
+const char *metrics_histogram_name(const metric_histogram_t histogram)
+{
+    return histogram_names[histogram];
+}
+
+// Counters and gauges, shared by the message and the shadow mirror.
+// Gauges never set are left out.
+static void build_values(const metrics_snapshot_t *snapshot, JsonObject metrics)
+{
+    JsonObject counters = metrics.createNestedObject("counters");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        counters[counter_names[i]] = snapshot->counters[i];
+    }
+
+    JsonObject gauges = metrics.createNestedObject("gauges");
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        const metrics_gauge_t *gauge = &snapshot->gauges[i];
+        if (!gauge->set)
+        {
+            continue;
+        }
+        JsonArray values = gauges.createNestedArray(gauge_names[i]);
+        values.add(gauge->value);
+        values.add(gauge->min);
+        values.add(gauge->max);
+        if (gauge->limit)
+        {
+            values.add(gauge->limit);
+        }
+    }
+}
+
+// The message for "hhcm/{thing}/metrics", see metrics.h. time is the
+// epoch time in ms, WALLCLOCK_UNSYNCED while not known.
+void metrics_build(
+    const metrics_snapshot_t *snapshot,
+    const uint32_t sequence,
+    const uint32_t uptime,
+    const uint64_t time,
+    JsonDocument *document)
+{
+    document->clear();
+    (*document)["seq"] = sequence;
+    (*document)["uptime"] = uptime;
+    if (time != WALLCLOCK_UNSYNCED)
+    {
+        (*document)["time"] = time;
+    }
+    else
+    {
+        (*document)["time"] = (const char *)NULL;
+    }
+    build_values(snapshot, document->as<JsonObject>());
+
+    JsonObject histograms = document->createNestedObject("histograms");
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const metrics_histogram_t *histogram = &snapshot->histograms[i];
+        JsonArray values = histograms.createNestedArray(histogram_names[i]);
+        JsonArray counts = values.createNestedArray();
+        for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+        {
+            counts.add(histogram->counts[bucket]);
+        }
+        values.add(histogram->sum);
+        values.add(histogram->max);
+    }
+}
+
+// {"state": {"reported": {"metrics": {...}}}}, histograms without their
+// buckets.
+void metrics_build_shadow(
+    const metrics_snapshot_t *snapshot,
+    const uint32_t uptime,
+    JsonDocument *document)
+{
+    document->clear();
+    JsonObject metrics = document->createNestedObject("state").createNestedObject("reported").createNestedObject("metrics");
+    metrics["uptime"] = uptime;
+    build_values(snapshot, metrics);
+
+    JsonObject histograms = metrics.createNestedObject("histograms");
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const metrics_histogram_t *histogram = &snapshot->histograms[i];
+        uint32_t count = 0;
+        for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+        {
+            count += histogram->counts[bucket];
+        }
+        JsonArray values = histograms.createNestedArray(histogram_names[i]);
+        values.add(count);
+        values.add(histogram->sum);
+        values.add(histogram->max);
+    }
+}
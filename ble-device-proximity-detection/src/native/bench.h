@@ -0,0 +1,41 @@
+/*
+ * bench.h
+ *
+ * Native benchmark harness. Every benchmark is a sub-command of the
+ * program built by the [env:native] environment.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <vector>
+#include "presence.h"
+
+#define BENCH_DEFAULT_RECORDING "bench/recordings/ward_sample.scan"
+#define BENCH_DEFAULT_TICK 10 // ms
+
+uint64_t bench_now_ns();
+void bench_report_distribution(const char *label, std::vector<double> &samples, const char *unit);
+void bench_fill_presence(presence_table_t *presence, const int count, const uint32_t now);
+
+int bench_loop(int argc, char **argv);
+int bench_filter(int argc, char **argv);
+int bench_format(int argc, char **argv);
+int bench_paging(int argc, char **argv);
+int bench_store(int argc, char **argv);
+int bench_outage(int argc, char **argv);
+int bench_pipeline(int argc, char **argv);
+int bench_reconfigure(int argc, char **argv);
+int bench_schedule(int argc, char **argv);
+int bench_clock(int argc, char **argv);
+int bench_trace(int argc, char **argv);
+int bench_decode(int argc, char **argv);
+int bench_metrics(int argc, char **argv);
+int bench_allowlist(int argc, char **argv);
+int bench_ward(int argc, char **argv);
+int bench_qos(int argc, char **argv);
+int bench_dashboard(int argc, char **argv);
+int bench_reminder(int argc, char **argv);
+
+#endif
@@ -0,0 +1,520 @@
+/*
+ * bench_allowlist.cpp
+ *
+ * The allowlist of registered badges, first on its own: what a lookup
+ * costs against the name prefix filter it goes before, whether a lookup
+ * running while the list changes ever gets a wrong answer, and a save
+ * and load through flash. Then the gateway with a small shadow service
+ * in the broker: badges registered and removed through the desired
+ * state, more at once than a message takes, a restart, and a restart
+ * with the saved list damaged. Only registered badges may get through
+ * the scan once there are any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "adv_filter.h"
+#include "allowlist.h"
+#include "ble_scan.h"
+#include "connection.h"
+#include "gateway.h"
+#include "metrics.h"
+#include "presence.h"
+#include "proximity.h"
+#include "shadow.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_ALLOWLIST_LOOKUPS 4000000
+#define BENCH_ALLOWLIST_STABLE 64  // badges registered throughout the concurrent run
+#define BENCH_ALLOWLIST_CHURN 32   // badges added and removed meanwhile
+#define BENCH_ALLOWLIST_ROUNDS 20000
+#define BENCH_ALLOWLIST_FAKES 160 // registered badges that are not on air
+#define BENCH_ALLOWLIST_SETTLE 3000
+#define BENCH_ALLOWLIST_ROOT "/tmp/hhcm-bench-allowlist"
+
+static allowlist_t list;
+
+// The shadow service: desired and reported allowlist, a get answered
+// with both and the delta, as AWS IoT does.
+static char topic_update[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_get[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_get_accepted[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_delta[GATEWAY_MQTT_TOPIC_SIZE];
+static std::map<std::string, bool> desired;
+static std::map<std::string, bool> reported;
+static size_t reports = 0;
+static size_t shadow_gets = 0;
+
+// What went through the radio while counting: advertisements the scan
+// should admit.
+static std::set<std::string> on_air;
+static std::set<std::string> on_air_prefix;
+static std::set<std::string> registered;
+static bool counting = false;
+static bool by_prefix = true;
+static uint32_t expected = 0;
+
+static uint64_t random_key()
+{
+    uint64_t key = 0;
+    while (key == 0)
+    {
+        key = ((uint64_t)rand() << 32 ^ (uint64_t)rand() << 16 ^ (uint64_t)rand()) & 0xffffffffffffULL;
+    }
+    return key;
+}
+
+// Lookups against the name prefix filter, per advertisement.
+static int lookup_cost()
+{
+    static const uint8_t badge[] = {0x02, 0x01, 0x06, 0x09, 0x09, 'R', 'H', 'S', '-', '0', '0', '0', '1'};
+    static const uint8_t phone[] = {0x02, 0x01, 0x1a, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15, 0x39, 0xb9, 0xc3, 0x30,
+                                    0xa2, 0x5a, 0xf4, 0xdb, 0x30, 0xd3, 0x4c, 0xd3, 0xf6, 0x58, 0xf5, 0x11, 0x00,
+                                    0x01, 0x00, 0x02, 0xc5};
+    adv_filter_t filter;
+    adv_filter_init(&filter, "RHS", PROXIMITY_RSSI_FLOOR);
+    std::vector<uint64_t> probes(1024);
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    volatile uint32_t sink = 0;
+
+    printf("lookup, per advertisement\n");
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_ALLOWLIST_LOOKUPS; i++)
+    {
+        sink += adv_filter_match(&filter, i & 1 ? badge : phone, i & 1 ? sizeof(badge) : sizeof(phone), -60);
+    }
+    printf("  name prefix filter         %.1f ns\n", (double)(bench_now_ns() - start) / BENCH_ALLOWLIST_LOOKUPS);
+
+    static const int sizes[] = {16, 256, ALLOWLIST_CAPACITY};
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        std::vector<allowlist_change_t> changes(sizes[s]);
+        srand(sizes[s]);
+        for (int i = 0; i < sizes[s]; i++)
+        {
+            changes[i].key = random_key();
+            changes[i].add = true;
+        }
+        allowlist_init(&list);
+        allowlist_apply(&list, changes.data(), changes.size());
+
+        // Half of the probes registered, half strangers.
+        for (size_t i = 0; i < probes.size(); i++)
+        {
+            probes[i] = i & 1 ? changes[i % changes.size()].key : random_key();
+        }
+        uint32_t members = 0;
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_ALLOWLIST_LOOKUPS; i++)
+        {
+            presence_address(probes[i & 1023], address);
+            members += allowlist_lookup(&list, address) == ALLOWLIST_MEMBER;
+        }
+        const double ns = (double)(bench_now_ns() - start) / BENCH_ALLOWLIST_LOOKUPS;
+        const bool ok = allowlist_size(&list) == (uint32_t)sizes[s] && members == BENCH_ALLOWLIST_LOOKUPS / 2;
+        printf("  allowlist of %-4d badges    %.1f ns, %u%% members%s\n",
+               sizes[s], ns, members * 100 / BENCH_ALLOWLIST_LOOKUPS, ok ? "" : " (FAILED)");
+        failures += !ok;
+    }
+    return failures;
+}
+
+static void look_up(const std::vector<uint64_t> *stable, const std::vector<uint64_t> *strangers,
+                    std::atomic<bool> *done, uint32_t *lookups, uint32_t *wrong)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    size_t i = 0;
+    while (!done->load())
+    {
+        presence_address((*stable)[i % stable->size()], address);
+        *wrong += allowlist_lookup(&list, address) != ALLOWLIST_MEMBER;
+        presence_address((*strangers)[i % strangers->size()], address);
+        *wrong += allowlist_lookup(&list, address) != ALLOWLIST_STRANGER;
+        *lookups += 2;
+        i++;
+    }
+}
+
+// A thread looks up badges that stay registered and strangers that
+// never are while the list changes underneath.
+static int concurrent()
+{
+    std::vector<uint64_t> stable(BENCH_ALLOWLIST_STABLE);
+    std::vector<uint64_t> strangers(BENCH_ALLOWLIST_STABLE);
+    std::vector<allowlist_change_t> changes(BENCH_ALLOWLIST_STABLE);
+    std::vector<allowlist_change_t> churn(BENCH_ALLOWLIST_CHURN);
+
+    srand(1);
+    allowlist_init(&list);
+    for (int i = 0; i < BENCH_ALLOWLIST_STABLE; i++)
+    {
+        stable[i] = random_key();
+        strangers[i] = random_key();
+        changes[i].key = stable[i];
+        changes[i].add = true;
+    }
+    allowlist_apply(&list, changes.data(), changes.size());
+    for (int i = 0; i < BENCH_ALLOWLIST_CHURN; i++)
+    {
+        churn[i].key = random_key();
+    }
+
+    std::atomic<bool> done(false);
+    uint32_t lookups = 0;
+    uint32_t wrong = 0;
+    std::thread reader(look_up, &stable, &strangers, &done, &lookups, &wrong);
+    uint64_t apply_max = 0;
+    const uint64_t start = bench_now_ns();
+    for (int round = 0; round < BENCH_ALLOWLIST_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < churn.size(); i++)
+        {
+            churn[i].add = round % 2 == 0;
+        }
+        const uint64_t apply = bench_now_ns();
+        allowlist_apply(&list, churn.data(), churn.size());
+        const uint64_t took = bench_now_ns() - apply;
+        apply_max = took > apply_max ? took : apply_max;
+    }
+    const double elapsed = (double)(bench_now_ns() - start) / BENCH_ALLOWLIST_ROUNDS / 1000;
+    done.store(true);
+    reader.join();
+
+    const bool ok = wrong == 0 && allowlist_size(&list) == BENCH_ALLOWLIST_STABLE && list.changes == (uint32_t)BENCH_ALLOWLIST_STABLE + BENCH_ALLOWLIST_ROUNDS * BENCH_ALLOWLIST_CHURN;
+    printf("changes while looked up\n");
+    printf("  %d batches of %d           mean %.1f us, max %.1f us\n", BENCH_ALLOWLIST_ROUNDS, BENCH_ALLOWLIST_CHURN, elapsed, apply_max / 1000.0);
+    printf("  lookups meanwhile          %u, %u wrong%s\n", lookups, wrong, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+// Saved, loaded into another list, then loaded from a damaged page.
+static int persistence()
+{
+    static allowlist_t loaded;
+    std::vector<allowlist_change_t> changes(ALLOWLIST_CAPACITY - 24);
+
+    hal_native_settings_erase();
+    const bool empty = allowlist_load(&loaded) && allowlist_size(&loaded) == 0;
+
+    srand(2);
+    allowlist_init(&list);
+    for (size_t i = 0; i < changes.size(); i++)
+    {
+        changes[i].key = random_key();
+        changes[i].add = true;
+    }
+    allowlist_apply(&list, changes.data(), changes.size());
+    const size_t writes = hal_native_settings_writes();
+    const uint64_t start = bench_now_ns();
+    const bool saved = allowlist_save(&list);
+    const double save_us = (bench_now_ns() - start) / 1000.0;
+
+    bool same = allowlist_load(&loaded) && allowlist_size(&loaded) == allowlist_size(&list);
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    for (size_t i = 0; same && i < changes.size(); i++)
+    {
+        presence_address(changes[i].key, address);
+        same = allowlist_lookup(&loaded, address) == ALLOWLIST_MEMBER;
+    }
+
+    uint8_t page[HAL_BLE_ADDRESS_LENGTH * ALLOWLIST_PAGE_ENTRIES];
+    const size_t length = hal_settings_read("allowlist1", page, sizeof(page));
+    page[length / 2] ^= 0x40;
+    hal_settings_write("allowlist1", page, length);
+    const bool damaged = !allowlist_load(&loaded) && allowlist_size(&loaded) == 0;
+
+    const bool ok = empty && saved && same && damaged;
+    printf("flash\n");
+    printf("  %u badges saved            %zu blobs, %.1f us, loaded %s, damaged page %s%s\n",
+           allowlist_size(&list), hal_native_settings_writes() - writes, save_us, same ? "the same" : "different",
+           damaged ? "refused" : "taken", ok ? "" : " (FAILED)");
+    hal_native_settings_erase();
+    return ok ? 0 : 1;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+// {"aa:bb:cc:dd:ee:ff":true,...}, what comes first in front.
+static std::string members(const std::map<std::string, bool> &values, const std::string &first = "")
+{
+    std::string json = "{" + first;
+    for (std::map<std::string, bool>::const_iterator value = values.begin(); value != values.end(); ++value)
+    {
+        json += (json.size() > 1 ? ",\"" : "\"") + value->first + "\":" + (value->second ? "true" : "false");
+    }
+    return json + "}";
+}
+
+static std::map<std::string, bool> delta()
+{
+    std::map<std::string, bool> differences;
+    for (std::map<std::string, bool>::const_iterator value = desired.begin(); value != desired.end(); ++value)
+    {
+        std::map<std::string, bool>::const_iterator current = reported.find(value->first);
+        if (current == reported.end() || current->second != value->second)
+        {
+            differences[value->first] = value->second;
+        }
+    }
+    return differences;
+}
+
+// The operator changes the desired state, the service sends the delta.
+// invalid goes in front of it as it is.
+static void desire(const std::map<std::string, bool> &changes, const std::string &invalid)
+{
+    for (std::map<std::string, bool>::const_iterator change = changes.begin(); change != changes.end(); ++change)
+    {
+        desired[change->first] = change->second;
+    }
+    const std::string message = "{\"version\":7,\"timestamp\":1633046400,\"state\":{\"allowlist\":" + members(delta(), invalid) + "}}";
+    hal_native_mqtt_inject(topic_delta, (const uint8_t *)message.data(), message.size());
+}
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    if (strcmp(topic, topic_get) == 0)
+    {
+        const std::string message = "{\"state\":{\"desired\":{\"allowlist\":" + members(desired) +
+                                    "},\"reported\":{\"allowlist\":" + members(reported) +
+                                    "},\"delta\":{\"allowlist\":" + members(delta()) + "}},\"version\":7}";
+        hal_native_mqtt_inject(topic_get_accepted, (const uint8_t *)message.data(), message.size());
+        shadow_gets++;
+        return;
+    }
+    if (strcmp(topic, topic_update) != 0)
+    {
+        return;
+    }
+
+    StaticJsonDocument<64> filter;
+    DynamicJsonDocument document(16384);
+    filter["state"]["reported"]["allowlist"] = true;
+    if (deserializeJson(document, (const char *)payload, length, DeserializationOption::Filter(filter)))
+    {
+        return;
+    }
+    JsonVariant allowlist = document["state"]["reported"]["allowlist"];
+    if (!document["state"]["reported"].containsKey("allowlist"))
+    {
+        return;
+    }
+    if (allowlist.isNull())
+    {
+        reported.clear();
+    }
+    for (JsonPair member : allowlist.as<JsonObject>())
+    {
+        reported[member.key().c_str()] = member.value().as<bool>();
+    }
+    reports++;
+}
+
+static void on_delivery(const hal_ble_advertisement_t *advertisement)
+{
+    char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+    ble_scan_format_address(advertisement->address, id);
+    size_t name_length = 0;
+    const uint8_t *name = adv_find_name(advertisement->payload, advertisement->payload_length, &name_length);
+    const bool prefix = name && name_length >= 3 && memcmp(name, "RHS", 3) == 0;
+
+    on_air.insert(id);
+    if (prefix)
+    {
+        on_air_prefix.insert(id);
+    }
+    if (counting && advertisement->rssi >= PROXIMITY_RSSI_FLOOR && (by_prefix ? prefix : registered.count(id) > 0))
+    {
+        expected++;
+    }
+}
+
+static void run(const uint32_t duration)
+{
+    const uint32_t until = hal_millis() + duration;
+    while (hal_millis() < until)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+    }
+}
+
+// Runs the recording, counting what the scan admits against what it
+// should.
+static int admitted(const char *label, const bool prefix)
+{
+    metrics_snapshot_t before;
+    metrics_snapshot_t after;
+
+    hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING);
+    by_prefix = prefix;
+    expected = 0;
+    counting = true;
+    metrics_snapshot(&before);
+    run(20000);
+    metrics_snapshot(&after);
+    counting = false;
+
+    const uint32_t matched = after.counters[METRIC_ADV_MATCHED] - before.counters[METRIC_ADV_MATCHED];
+    const uint32_t seen = after.counters[METRIC_ADV_SEEN] - before.counters[METRIC_ADV_SEEN];
+    const bool ok = matched == expected && matched > 0;
+    printf("  %-26s %u of %u advertisements admitted, %u expected%s\n", label, matched, seen, expected, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+// Whether the gateway has the list the shadow desires, and reported it.
+static int converged(const char *label)
+{
+    gateway_statistics_t statistics;
+    gateway_get_statistics(&statistics);
+    size_t registrations = 0;
+    for (std::map<std::string, bool>::const_iterator value = desired.begin(); value != desired.end(); ++value)
+    {
+        registrations += value->second;
+    }
+    const bool ok = delta().empty() && statistics.allowlist_size == registrations;
+    printf("  %-26s %u registered of %zu desired, delta %zu, %zu reports, %zu gets%s\n",
+           label, statistics.allowlist_size, registrations, delta().size(), reports, shadow_gets, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+static int gateway()
+{
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    char root[64];
+    int failures = 0;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_ALLOWLIST_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_settings_erase();
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    snprintf(topic_update, sizeof(topic_update), "$aws/things/%s/shadow/update", client_id);
+    snprintf(topic_get, sizeof(topic_get), "$aws/things/%s/shadow/get", client_id);
+    snprintf(topic_get_accepted, sizeof(topic_get_accepted), "$aws/things/%s/shadow/get/accepted", client_id);
+    snprintf(topic_delta, sizeof(topic_delta), "$aws/things/%s/shadow/update/delta", client_id);
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    hal_native_ble_set_delivery_hook(on_delivery);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+
+    printf("gateway, shadow changes of at most %d badges a message\n", SHADOW_ALLOWLIST_CHANGES_MAX);
+    failures += admitted("nothing registered", true);
+
+    // Four of the badges on air, a phone, and badges elsewhere in the
+    // hospital; two members that are no registration.
+    std::map<std::string, bool> changes;
+    std::set<std::string>::const_iterator badge = on_air_prefix.begin();
+    for (int i = 0; i < 4 && badge != on_air_prefix.end(); i++, ++badge)
+    {
+        changes[*badge] = true;
+    }
+    std::string phone;
+    for (std::set<std::string>::const_iterator device = on_air.begin(); device != on_air.end() && phone.empty(); ++device)
+    {
+        if (!on_air_prefix.count(*device))
+        {
+            phone = *device;
+        }
+    }
+    changes[phone] = true;
+    srand(3);
+    for (int i = 0; i < BENCH_ALLOWLIST_FAKES; i++)
+    {
+        uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+        char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+        presence_address(random_key(), address);
+        ble_scan_format_address(address, id);
+        changes[id] = true;
+    }
+    desire(changes, "\"not a badge\":true,\"c4:4f:33:00:00:01\":1");
+    run(BENCH_ALLOWLIST_SETTLE);
+    failures += converged("registered");
+    gateway_statistics_t statistics;
+    gateway_get_statistics(&statistics);
+    printf("  %-26s %u messages, %u members rejected, %u changes applied\n", "from the shadow",
+           statistics.allowlist_received, statistics.allowlist_rejected, statistics.allowlist_applied);
+    failures += statistics.allowlist_rejected < 2 || statistics.allowlist_received < 2;
+
+    registered.clear();
+    for (std::map<std::string, bool>::const_iterator value = desired.begin(); value != desired.end(); ++value)
+    {
+        if (value->second)
+        {
+            registered.insert(value->first);
+        }
+    }
+    failures += admitted("registered badges only", false);
+
+    // The phone and one badge taken off.
+    changes.clear();
+    changes[phone] = false;
+    changes[*on_air_prefix.begin()] = false;
+    registered.erase(phone);
+    registered.erase(*on_air_prefix.begin());
+    desire(changes, "");
+    run(BENCH_ALLOWLIST_SETTLE);
+    failures += converged("two removed");
+    failures += admitted("after the removal", false);
+
+    // Restarts: the list comes from flash; damaged, the shadow sends it
+    // again.
+    const size_t sent = reports;
+    gateway_setup(client_id);
+    gateway_on_connect();
+    run(BENCH_ALLOWLIST_SETTLE);
+    failures += converged("restarted") + (reports != sent);
+
+    uint8_t page[HAL_SETTINGS_BLOB_MAX];
+    const size_t length = hal_settings_read("allowlist0", page, sizeof(page));
+    page[0] ^= 0x01;
+    hal_settings_write("allowlist0", page, length);
+    gateway_setup(client_id);
+    gateway_on_connect();
+    run(BENCH_ALLOWLIST_SETTLE);
+    failures += converged("restarted, flash damaged") + (reports == sent);
+    failures += admitted("after the restarts", false);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    hal_native_settings_erase();
+    return failures;
+}
+
+int bench_allowlist(int argc, char **argv)
+{
+    int failures = lookup_cost();
+    failures += concurrent();
+    failures += persistence();
+    failures += gateway();
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * bench_clock.cpp
+ *
+ * A day of timestamps on a gateway whose crystal runs slow against
+ * true time. NTP does not answer for the first half minute; later the
+ * server corrects its own time twice, by a few seconds and by less
+ * than one. Compares the system time SNTP sets, which jumps on every
+ * answer, with the wall clock carried on hal_millis(): error against
+ * true time, whether timestamps go backwards, and the cost of one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "wallclock.h"
+#include "bench.h"
+
+#define BENCH_CLOCK_LENGTH 86400000U    // ms
+#define BENCH_CLOCK_DRIFT 40            // ppm true time runs faster, a typical crystal
+#define BENCH_CLOCK_OFFLINE 30000       // ms before NTP answers
+#define BENCH_CLOCK_STEP_AT 21600000U   // ms, the server's correction
+#define BENCH_CLOCK_STEP 3000           // ms
+#define BENCH_CLOCK_SLEW_AT 50400000U   // ms, and a smaller one
+#define BENCH_CLOCK_SLEW (-400)         // ms
+#define BENCH_CLOCK_SAMPLE 1000         // ms between error samples
+#define BENCH_CLOCK_CALLS 10000000
+
+typedef struct
+{
+    uint64_t last;
+    size_t unsynced;  // samples without a time
+    size_t backwards; // times earlier than the one before
+    double back_max;  // ms
+    std::vector<double> error;
+} bench_clock_series_t;
+
+static void sample(bench_clock_series_t *series, const bool synced, const uint64_t time, const bool record)
+{
+    if (!synced)
+    {
+        series->unsynced++;
+        return;
+    }
+    if (series->last > time)
+    {
+        series->backwards++;
+        series->back_max = series->last - time > series->back_max ? series->last - time : series->back_max;
+    }
+    series->last = time;
+    if (record)
+    {
+        series->error.push_back(llabs((long long)(time - hal_native_ntp_true_time())));
+    }
+}
+
+static void report(const char *label, bench_clock_series_t *series)
+{
+    printf("%s\n", label);
+    printf("  before the first sync      %zu samples without a time\n", series->unsynced);
+    printf("  backwards                  %zu times, at most %.0f ms\n", series->backwards, series->back_max);
+    bench_report_distribution("  error against true time", series->error, "ms");
+}
+
+int bench_clock(int argc, char **argv)
+{
+    const int32_t drift = argc > 0 ? atoi(argv[0]) : BENCH_CLOCK_DRIFT;
+    bench_clock_series_t system = {};
+    bench_clock_series_t clock = {};
+    wallclock_t wallclock;
+
+    hal_native_clock_set(0);
+    hal_native_ntp_set(false, drift);
+    wallclock_init(&wallclock, hal_millis());
+    while (hal_millis() < BENCH_CLOCK_LENGTH)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        const uint32_t now = hal_millis();
+        if (now == BENCH_CLOCK_OFFLINE)
+        {
+            hal_native_ntp_set(true, drift);
+        }
+        if (now == BENCH_CLOCK_STEP_AT)
+        {
+            hal_native_ntp_adjust(BENCH_CLOCK_STEP);
+        }
+        if (now == BENCH_CLOCK_SLEW_AT)
+        {
+            hal_native_ntp_adjust(BENCH_CLOCK_SLEW);
+        }
+
+        const bool record = now % BENCH_CLOCK_SAMPLE == 0;
+        uint64_t ntp = 0;
+        const bool synced = hal_ntp_time(&ntp);
+        sample(&system, synced, ntp, record);
+        wallclock_update(&wallclock, now);
+        const uint64_t time = wallclock_time(&wallclock, now);
+        sample(&clock, time != WALLCLOCK_UNSYNCED, time, record);
+    }
+
+    printf("%u h, true time %+d ppm against the clock, corrections of %+d and %+d ms\n",
+           BENCH_CLOCK_LENGTH / 3600000, (int)drift, BENCH_CLOCK_STEP, BENCH_CLOCK_SLEW);
+    report("system time (SNTP)", &system);
+    report("wall clock", &clock);
+    printf("  %u syncs, %u stepped, last error %d ms, drift %d ppm\n",
+           wallclock.syncs, wallclock.steps, (int)wallclock.error, (int)wallclock.drift);
+
+    // What converting a timestamp costs, the loop kept from folding away.
+    uint64_t sum = 0;
+    const uint64_t start = bench_now_ns();
+    for (uint32_t call = 0; call < BENCH_CLOCK_CALLS; call++)
+    {
+        sum += wallclock_time(&wallclock, hal_millis() - call % 1000);
+    }
+    const double cost = (double)(bench_now_ns() - start) / BENCH_CLOCK_CALLS;
+    printf("  timestamp                  %.2f ns (%llu)\n", cost, (unsigned long long)(sum & 1));
+
+    // Only the correction of several seconds may set the clock back.
+    const bool failed = clock.backwards > 1 || wallclock.steps != 1 || clock.error.empty() ||
+                        clock.unsynced * BENCH_DEFAULT_TICK > BENCH_CLOCK_OFFLINE + WALLCLOCK_RETRY_INTERVAL;
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * bench_dashboard.cpp
+ *
+ * Runs the gateway over a recording with the access point down for a
+ * while and the display stage drawing the dashboard every
+ * DASHBOARD_FRAME_INTERVAL ms, three times: redrawing only the cells
+ * that changed, redrawing the whole screen whenever the model changed,
+ * and redrawing the whole screen every frame as a display loop without
+ * a model would. Reports the frames and cells drawn, the pixels sent to
+ * the LCD and their time on the Core2's SPI bus, the share of the bus
+ * that takes from the SD card, and the host time per frame. All three
+ * have to show the same screen at the end of the recording and at the
+ * end of the run, once the badges aged out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "dashboard.h"
+#include "gateway.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_DASHBOARD_DOWN 6000     // ms into the recording
+#define BENCH_DASHBOARD_BACK 14000
+#define BENCH_DASHBOARD_AFTER 180000  // ms after the recording, rows age out and rub times count up
+#define BENCH_DASHBOARD_SCREEN 4096   // bytes of a screen dump
+#define BENCH_DASHBOARD_ROOT "/tmp/hhcm-bench-dashboard"
+
+typedef enum
+{
+    REDRAW_CHANGED_CELLS = 0,
+    REDRAW_SCREEN_ON_CHANGE,
+    REDRAW_SCREEN_EVERY_FRAME,
+    REDRAW_MODES
+} redraw_mode_t;
+
+typedef struct
+{
+    uint32_t duration; // ms on the clock
+    uint32_t frames;   // with anything drawn
+    uint32_t cells;
+    uint64_t pixels;
+    std::vector<double> frame_us; // host
+    std::vector<double> frame_spi_ms; // Core2
+    char screen_busy[BENCH_DASHBOARD_SCREEN]; // at the end of the recording
+    char screen[BENCH_DASHBOARD_SCREEN];
+} bench_dashboard_run_t;
+
+static const char *const mode_names[] = {"changed cells", "screen on change", "screen every frame"};
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static double spi_ms(const uint64_t pixels)
+{
+    return pixels * 16 * 1000.0 / HAL_NATIVE_DISPLAY_SPI_HZ;
+}
+
+static bool run(const char *path, const redraw_mode_t mode, bench_dashboard_run_t *result)
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    dashboard_model_t model;
+    dashboard_view_t view;
+
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(true);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    hal_display_init();
+    dashboard_view_init(&view, hal_millis());
+    memset(&model, 0, sizeof(model));
+    if (!hal_native_ble_load_recording(path))
+    {
+        return false;
+    }
+
+    uint32_t end = 0;
+    uint32_t last_frame = 0;
+    while (end == 0 || hal_millis() < end)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        const uint32_t now = hal_millis();
+        hal_native_wifi_set_available(now < BENCH_DASHBOARD_DOWN || now >= BENCH_DASHBOARD_BACK);
+        if (connection_step(now) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        if (now - last_frame < DASHBOARD_FRAME_INTERVAL)
+        {
+            continue;
+        }
+
+        // The display stage.
+        last_frame = now;
+        const bool changed = gateway_take_dashboard(&model);
+        if (mode == REDRAW_SCREEN_EVERY_FRAME || (mode == REDRAW_SCREEN_ON_CHANGE && changed))
+        {
+            dashboard_invalidate(&view);
+        }
+        const size_t pixels = hal_native_display_pixels();
+        const uint64_t start = bench_now_ns();
+        const int cells = dashboard_render(&view, &model);
+        const uint64_t elapsed = bench_now_ns() - start;
+        if (cells > 0)
+        {
+            const size_t drawn = hal_native_display_pixels() - pixels;
+            result->frames++;
+            result->cells += cells;
+            result->pixels += drawn;
+            result->frame_us.push_back(elapsed / 1000.0);
+            result->frame_spi_ms.push_back(spi_ms(drawn));
+        }
+        if (end == 0 && hal_native_ble_replay_done())
+        {
+            end = now + BENCH_DASHBOARD_AFTER;
+            hal_native_display_dump(result->screen_busy, sizeof(result->screen_busy));
+        }
+    }
+    result->duration = hal_millis();
+    hal_native_display_dump(result->screen, sizeof(result->screen));
+    return true;
+}
+
+int bench_dashboard(int argc, char **argv)
+{
+    const char *path = argc > 0 ? argv[0] : BENCH_DEFAULT_RECORDING;
+    static bench_dashboard_run_t runs[REDRAW_MODES];
+    char root[64];
+    bool ok = true;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_DASHBOARD_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    printf("recording %s, access point down from %.1f s to %.1f s, frames every %u ms\n",
+           path, BENCH_DASHBOARD_DOWN / 1000.0, BENCH_DASHBOARD_BACK / 1000.0, DASHBOARD_FRAME_INTERVAL);
+    for (int mode = 0; mode < REDRAW_MODES; mode++)
+    {
+        bench_dashboard_run_t *result = &runs[mode];
+        if (!run(path, (redraw_mode_t)mode, result))
+        {
+            return 1;
+        }
+        hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+
+        const double busy = spi_ms(result->pixels);
+        printf("%s\n", mode_names[mode]);
+        printf("  frames drawn               %u, %.1f cells and %.0f pixels each\n", result->frames,
+               result->frames ? (double)result->cells / result->frames : 0.0,
+               result->frames ? (double)result->pixels / result->frames : 0.0);
+        printf("  SPI bus on the Core2       %.1f ms of %.1f s, %.3f %%\n",
+               busy, result->duration / 1000.0, busy * 100 / result->duration);
+        bench_report_distribution("  frame on the bus", result->frame_spi_ms, "ms");
+        bench_report_distribution("  frame (host)", result->frame_us, "us");
+    }
+
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+
+    printf("\nscreen at the end of the recording\n%s", runs[REDRAW_CHANGED_CELLS].screen_busy);
+    for (int mode = 1; mode < REDRAW_MODES; mode++)
+    {
+        if (strcmp(runs[mode].screen_busy, runs[REDRAW_CHANGED_CELLS].screen_busy) != 0 ||
+            strcmp(runs[mode].screen, runs[REDRAW_CHANGED_CELLS].screen) != 0)
+        {
+            printf("screen of \"%s\" differs\n", mode_names[mode]);
+            ok = false;
+        }
+    }
+    ok &= runs[REDRAW_CHANGED_CELLS].frames > 0;
+    ok &= runs[REDRAW_CHANGED_CELLS].pixels < runs[REDRAW_SCREEN_ON_CHANGE].pixels;
+    ok &= runs[REDRAW_SCREEN_ON_CHANGE].pixels < runs[REDRAW_SCREEN_EVERY_FRAME].pixels;
+
+    printf("\n%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
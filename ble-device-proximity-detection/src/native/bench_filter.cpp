@@ -0,0 +1,170 @@
+/*
+ * bench_filter.cpp
+ *
+ * Per-advertisement cost of the scan filter on matching and non-matching
+ * traffic from a recording. "legacy" reproduces what ble_scan() used to
+ * do per result (address and name strings built first, prefix and RSSI
+ * checked last; std::string stands in for Arduino String), "raw" is
+ * adv_filter_match() on the advertising data with the address formatted
+ * for matches only. Heap allocations are counted through operator new.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "adv_filter.h"
+#include "ble_scan.h"
+#include "bench.h"
+
+#define BENCH_FILTER_PASSES 200
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+typedef struct
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    int rssi;
+    std::vector<uint8_t> payload;
+} captured_advertisement_t;
+
+static std::vector<captured_advertisement_t> captured;
+
+static void capture(const hal_ble_advertisement_t *advertisement, void *context)
+{
+    captured_advertisement_t c;
+    memcpy(c.address, advertisement->address, HAL_BLE_ADDRESS_LENGTH);
+    c.rssi = advertisement->rssi;
+    c.payload.assign(advertisement->payload, advertisement->payload + advertisement->payload_length);
+    captured.push_back(c);
+}
+
+static bool legacy_match(const captured_advertisement_t &a, const char *prefix, const int threshold)
+{
+    const uint8_t *b = a.address;
+    char buffer[BLE_SCAN_ADDRESS_STRING_SIZE];
+    snprintf(buffer, sizeof(buffer), "%02x:%02x:%02x:%02x:%02x:%02x", b[0], b[1], b[2], b[3], b[4], b[5]);
+    std::string id = buffer;
+    size_t name_length = 0;
+    const uint8_t *name_data = adv_find_name(a.payload.data(), a.payload.size(), &name_length);
+    std::string name = name_data ? std::string((const char *)name_data, name_length) : std::string();
+    int rssi = a.rssi;
+    return name.compare(0, strlen(prefix), prefix) == 0 && rssi >= threshold && !id.empty();
+}
+
+static bool raw_match(const captured_advertisement_t &a, const adv_filter_t *filter)
+{
+    if (!adv_filter_match(filter, a.payload.data(), a.payload.size(), a.rssi))
+    {
+        return false;
+    }
+    char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+    ble_scan_format_address(a.address, id);
+    return id[0] != 0;
+}
+
+static void report(const char *label, const std::vector<const captured_advertisement_t *> &set,
+                   const char *prefix, const int threshold, const adv_filter_t *filter)
+{
+    if (set.empty())
+    {
+        printf("%-12s n=0\n", label);
+        return;
+    }
+
+    volatile size_t sink = 0;
+    size_t before = allocations;
+    uint64_t start = bench_now_ns();
+    for (int pass = 0; pass < BENCH_FILTER_PASSES; pass++)
+    {
+        for (size_t i = 0; i < set.size(); i++)
+        {
+            sink += legacy_match(*set[i], prefix, threshold);
+        }
+    }
+    const double runs = (double)set.size() * BENCH_FILTER_PASSES;
+    const double legacy_ns = (bench_now_ns() - start) / runs;
+    const double legacy_allocations = (allocations - before) / runs;
+
+    before = allocations;
+    start = bench_now_ns();
+    for (int pass = 0; pass < BENCH_FILTER_PASSES; pass++)
+    {
+        for (size_t i = 0; i < set.size(); i++)
+        {
+            sink += raw_match(*set[i], filter);
+        }
+    }
+    const double raw_ns = (bench_now_ns() - start) / runs;
+    const double raw_allocations = (allocations - before) / runs;
+
+    printf("%-12s n=%-6zu legacy %7.1f ns %4.2f allocs   raw %7.1f ns %4.2f allocs   %5.1fx\n",
+           label, set.size(), legacy_ns, legacy_allocations, raw_ns, raw_allocations,
+           raw_ns > 0 ? legacy_ns / raw_ns : 0.0);
+}
+
+int bench_filter(int argc, char **argv)
+{
+    const char *path = argc > 0 ? argv[0] : BENCH_DEFAULT_RECORDING;
+    const char *prefix = "RHS";
+    const int threshold = -50;
+
+    if (!hal_native_ble_load_recording(path))
+    {
+        return 1;
+    }
+    hal_ble_scan_start(capture, NULL);
+    while (!hal_native_ble_replay_done())
+    {
+        hal_native_clock_advance(1000);
+    }
+    hal_ble_scan_stop();
+
+    adv_filter_t filter;
+    adv_filter_init(&filter, prefix, threshold);
+
+    std::vector<const captured_advertisement_t *> all, matching, non_matching;
+    for (size_t i = 0; i < captured.size(); i++)
+    {
+        all.push_back(&captured[i]);
+        if (adv_filter_match(&filter, captured[i].payload.data(), captured[i].payload.size(), captured[i].rssi))
+        {
+            matching.push_back(&captured[i]);
+        }
+        else
+        {
+            non_matching.push_back(&captured[i]);
+        }
+    }
+
+    printf("recording    %s, prefix \"%s\", RSSI >= %d\n", path, prefix, threshold);
+    report("matching", matching, prefix, threshold, &filter);
+    report("non-matching", non_matching, prefix, threshold, &filter);
+    report("all", all, prefix, threshold, &filter);
+    return 0;
+}
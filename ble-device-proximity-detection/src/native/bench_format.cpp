@@ -0,0 +1,97 @@
+/*
+ * bench_format.cpp
+ *
+ * Size and encode time of the telemetry wire formats over synthetic
+ * detection sets of increasing size. "json-pretty" is the indented
+ * JSON the shadow used to be sent as, for reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "presence.h"
+#include "telemetry.h"
+#include "bench.h"
+
+#define BENCH_FORMAT_ITERATIONS 2000
+
+static const int badge_counts[] = {1, 4, 8, 16, 24};
+
+static StaticJsonDocument<TELEMETRY_DOCUMENT_SIZE> document;
+static uint8_t buffer[TELEMETRY_BUFFER_SIZE * 2];
+static presence_table_t presence;
+
+typedef size_t (*bench_encoder_t)(uint8_t *buffer, size_t size);
+
+static size_t encode_pretty(uint8_t *buffer, size_t size)
+{
+    return serializeJsonPretty(document, (char *)buffer, size);
+}
+
+static size_t encode_json(uint8_t *buffer, size_t size)
+{
+    return telemetry_serialize(&document, TELEMETRY_FORMAT_JSON, buffer, size);
+}
+
+static size_t encode_msgpack(uint8_t *buffer, size_t size)
+{
+    return telemetry_serialize(&document, TELEMETRY_FORMAT_MSGPACK, buffer, size);
+}
+
+static size_t encode_cbor(uint8_t *buffer, size_t size)
+{
+    return telemetry_serialize(&document, TELEMETRY_FORMAT_CBOR, buffer, size);
+}
+
+static const struct
+{
+    const char *name;
+    bench_encoder_t encode;
+} encoders[] = {
+    {"json-pretty", encode_pretty},
+    {"json", encode_json},
+    {"msgpack", encode_msgpack},
+    {"cbor", encode_cbor},
+};
+
+int bench_format(int argc, char **argv)
+{
+    const int iterations = argc > 0 ? atoi(argv[0]) : BENCH_FORMAT_ITERATIONS;
+    const uint32_t now = 600000;
+
+    printf("%-8s %-12s %8s %10s %12s\n", "badges", "format", "bytes", "vs json", "encode us");
+    for (size_t c = 0; c < sizeof(badge_counts) / sizeof(badge_counts[0]); c++)
+    {
+        telemetry_state_t telemetry = {};
+        size_t cursor = 0;
+        bench_fill_presence(&presence, badge_counts[c], now);
+        telemetry_build(&telemetry, &presence, HAL_NATIVE_EPOCH_BASE * 1000ULL, now, &cursor, 1, 1, &document);
+        const size_t json_length = measureJson(document);
+
+        for (size_t e = 0; e < sizeof(encoders) / sizeof(encoders[0]); e++)
+        {
+            const size_t length = encoders[e].encode(buffer, sizeof(buffer));
+            if (length == 0)
+            {
+                printf("%-8d %-12s %8s\n", badge_counts[c], encoders[e].name, "overflow");
+                continue;
+            }
+
+            const uint64_t start = bench_now_ns();
+            for (int i = 0; i < iterations; i++)
+            {
+                encoders[e].encode(buffer, sizeof(buffer));
+            }
+            const double mean_us = (bench_now_ns() - start) / 1000.0 / iterations;
+
+            printf("%-8d %-12s %8zu %9.0f%% %12.3f\n",
+                   badge_counts[c], encoders[e].name, length,
+                   100.0 * length / json_length, mean_us);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * bench_loop.cpp
+ *
+ * Runs the unmodified gateway loop against a replayed recording and
+ * reports scan-to-publish latency and advertisements processed per
+ * second. Latency is measured on the fake clock (time an advertisement
+ * waits for the next publish, dominated by the scan duration) and on
+ * the wall clock (host processing time between delivery and publish).
+ * Every loop iteration advances the fake clock by the tick, standing in
+ * for the time loop() spends outside the scan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "ble_ring.h"
+#include "ble_scan.h"
+#include "bench.h"
+
+typedef struct
+{
+    uint32_t delivered_millis;
+    uint64_t delivered_ns;
+} pending_advertisement_t;
+
+static std::vector<pending_advertisement_t> pending;
+static std::vector<double> latency_virtual_ms;
+static std::vector<double> latency_wall_us;
+static size_t delivered = 0;
+static size_t shadow_updates = 0;
+
+static void on_delivery(const hal_ble_advertisement_t *advertisement)
+{
+    pending_advertisement_t p;
+    p.delivered_millis = hal_millis();
+    p.delivered_ns = bench_now_ns();
+    pending.push_back(p);
+    delivered++;
+}
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    if (!strstr(topic, "/shadow/update"))
+    {
+        return;
+    }
+
+    const uint32_t now_millis = hal_millis();
+    const uint64_t now_ns = bench_now_ns();
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        latency_virtual_ms.push_back(now_millis - pending[i].delivered_millis);
+        latency_wall_us.push_back((now_ns - pending[i].delivered_ns) / 1000.0);
+    }
+    pending.clear();
+    shadow_updates++;
+}
+
+int bench_loop(int argc, char **argv)
+{
+    const char *path = argc > 0 ? argv[0] : BENCH_DEFAULT_RECORDING;
+    const uint32_t tick = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_TICK;
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t connection_config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+
+    hal_se_initialize();
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    hal_native_ble_set_delivery_hook(on_delivery);
+
+    gateway_setup(client_id);
+    connection_setup(&connection_config, hal_millis());
+
+    if (!hal_native_ble_load_recording(path))
+    {
+        return 1;
+    }
+
+    std::vector<double> loop_us;
+    uint64_t busy_ns = 0;
+    while (!hal_native_ble_replay_done())
+    {
+        hal_native_clock_advance(tick);
+        const uint64_t start = bench_now_ns();
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        const uint64_t elapsed = bench_now_ns() - start;
+        busy_ns += elapsed;
+        loop_us.push_back(elapsed / 1000.0);
+    }
+
+    ble_scan_statistics_t statistics;
+    ble_scan_get_statistics(&statistics);
+
+    printf("recording                    %s\n", path);
+    printf("scan mode                    %s, tick %u ms\n",
+           BLE_SCAN_SETUP_CONTINUOUS ? "continuous" : "blocking", tick);
+    printf("advertisements replayed      %zu\n", hal_native_ble_replayed());
+    printf("advertisements processed     %zu\n", delivered);
+    printf("advertisements unpublished   %zu\n", pending.size());
+    printf("ring received/dropped        %u / %u (%u overflows, high water %u of %u)\n",
+           statistics.received, statistics.dropped, statistics.overflows,
+           statistics.high_water, BLE_RING_CAPACITY);
+    printf("shadow updates               %zu\n", shadow_updates);
+    printf("messages published           %zu (%zu bytes)\n",
+           hal_native_mqtt_published_messages(), hal_native_mqtt_published_bytes());
+    printf("advertisements per second    %.0f\n", busy_ns ? delivered * 1e9 / busy_ns : 0.0);
+    bench_report_distribution("loop iteration (wall)", loop_us, "us");
+    bench_report_distribution("scan-to-publish (clock)", latency_virtual_ms, "ms");
+    bench_report_distribution("scan-to-publish (wall)", latency_wall_us, "us");
+    return 0;
+}
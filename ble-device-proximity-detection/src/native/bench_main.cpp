@@ -0,0 +1,136 @@
+/*
+ * bench_main.cpp
+ *
+ * Entry point of the native benchmark: program <command> [arguments]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "proximity.h"
+#include "trace.h"
+#include "bench.h"
+
+typedef struct
+{
+    const char *name;
+    int (*run)(int argc, char **argv);
+    const char *usage;
+} bench_command_t;
+
+static const bench_command_t bench_commands[] = {
+    {"loop", bench_loop, "loop [recording] [tick ms]  scan-to-publish latency and throughput of the gateway loop"},
+    {"filter", bench_filter, "filter [recording]  per-advertisement cost of the scan filter"},
+    {"format", bench_format, "format [iterations]  size and encode time of the telemetry wire formats"},
+    {"paging", bench_paging, "paging [badges]  shadow and telemetry pages for a crowded ward"},
+    {"store", bench_store, "store [records]  store-and-forward log: append and replay time, torn tail, eviction"},
+    {"outage", bench_outage, "outage [gateways] [seconds]  reconnect spread after an access point outage, gateway loop through it"},
+    {"pipeline", bench_pipeline, "pipeline [stall ms] [recording]  queue depths and stage latencies with a stalling network stage"},
+    {"reconfigure", bench_reconfigure, "reconfigure [badges]  detect settings from a large shadow document and from deltas"},
+    {"schedule", bench_schedule, "schedule  radio time and detection latency of the adaptive scan schedule"},
+    {"clock", bench_clock, "clock [drift ppm]  timestamps against true time over a day, SNTP system time and wall clock"},
+    {"trace", bench_trace, "trace  cost of the trace log in the scan, decoding, ring overflow, concurrent producers"},
+    {"decode", bench_decode, "decode <capture | ->  renders a trace log captured from the serial port"},
+    {"metrics", bench_metrics, "metrics  cost of recording metrics, their messages through an outage and a shrinking heap"},
+    {"allowlist", bench_allowlist, "allowlist  badge allowlist lookups, changes while scanning, flash, registration through the shadow"},
+    {"ward", bench_ward, "ward [trace directory]  synthesized ward of 10 to 1000 moving devices: throughput, high water, drops, bytes"},
+    {"qos", bench_qos, "qos [round trip ms] [loss percent]  QoS 1 in-flight window against stop-and-wait, gateway delivery over a lossy link"},
+    {"dashboard", bench_dashboard, "dashboard [recording]  LCD dashboard redrawing changed cells against whole screens, SPI bus time"},
+    {"reminder", bench_reminder, "reminder [recording]  compliance reminder latency on LEDs and speaker, online and offline, DMA underruns"},
+};
+
+uint64_t bench_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Prints count, mean and percentiles of the samples (sorts them).
+void bench_report_distribution(const char *label, std::vector<double> &samples, const char *unit)
+{
+    if (samples.empty())
+    {
+        printf("%-28s n=0\n", label);
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        sum += samples[i];
+    }
+    const size_t n = samples.size();
+    printf("%-28s n=%zu mean=%.3f p50=%.3f p95=%.3f p99=%.3f max=%.3f %s\n",
+           label, n, sum / n,
+           samples[n / 2], samples[n * 95 / 100], samples[n * 99 / 100], samples[n - 1],
+           unit);
+}
+
+// A ward snapshot: count badges with distinct addresses spread over the
+// zones, a few seconds of advertisements each.
+void bench_fill_presence(presence_table_t *presence, const int count, const uint32_t now)
+{
+    proximity_config_t config;
+    proximity_config_init(&config);
+    presence_init(presence);
+    srand(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t address[HAL_BLE_ADDRESS_LENGTH] = {0xc4, 0x4f, 0x33, (uint8_t)rand(), (uint8_t)(i >> 8), (uint8_t)i};
+        const int rssi = -45 - rand() % 40;
+        const int hits = 5 + rand() % 50;
+        presence_entry_t *entry = NULL;
+        for (int hit = 0; hit < hits; hit++)
+        {
+            entry = presence_update(presence, address, rssi + rand() % 5 - 2, now - (hits - hit) * 100);
+        }
+        if (entry == NULL)
+        {
+            continue;
+        }
+        entry->zone = proximity_classify(&config, PROXIMITY_AWAY, entry->rssi_smoothed);
+        if (entry->zone == PROXIMITY_AWAY)
+        {
+            entry->zone = PROXIMITY_IN_ROOM;
+        }
+    }
+}
+
+// The unit tests (pio test -e native) build the gateway logic and these
+// helpers with a main() of their own.
+#ifndef PIO_UNIT_TESTING
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s <command> [arguments]\n", program);
+    for (size_t i = 0; i < sizeof(bench_commands) / sizeof(bench_commands[0]); i++)
+    {
+        fprintf(stderr, "  %s\n", bench_commands[i].usage);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    trace_init();
+    for (size_t i = 0; i < sizeof(bench_commands) / sizeof(bench_commands[0]); i++)
+    {
+        if (strcmp(argv[1], bench_commands[i].name) == 0)
+        {
+            return bench_commands[i].run(argc - 2, argv + 2);
+        }
+    }
+
+    usage(argv[0]);
+    return 2;
+}
+#endif
@@ -0,0 +1,270 @@
+/*
+ * bench_metrics.cpp
+ *
+ * The metrics registry, first on its own: what recording a count or a
+ * histogram value costs, and whether threads recording at once lose
+ * any. Then the gateway through the ward recording and an access point
+ * outage, with the heap shrinking half way: every metrics message has
+ * to reach the broker, the one queued while offline replayed, and the
+ * counters have to agree with what the stand-ins saw.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "metrics.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_METRICS_CALLS 10000000
+#define BENCH_METRICS_THREADS 4
+#define BENCH_METRICS_PER_THREAD 1000000
+#define BENCH_METRICS_LENGTH 365000 // ms the gateway runs
+#define BENCH_METRICS_DOWN 110000   // ms, the access point goes away
+#define BENCH_METRICS_BACK 170000
+#define BENCH_METRICS_HEAP_AT 200000 // ms, the heap shrinks
+#define BENCH_METRICS_HEAP_FREE 90000
+#define BENCH_METRICS_HEAP_LARGEST 24000
+#define BENCH_METRICS_ROOT "/tmp/hhcm-bench-metrics"
+
+static char topic_metrics[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_update[GATEWAY_MQTT_TOPIC_SIZE];
+static DynamicJsonDocument last_metrics(8192);
+static std::vector<uint32_t> sequences;
+static size_t metrics_bytes_max = 0;
+static size_t mirrors = 0;
+static size_t published_before = 0; // broker messages before the last metrics message
+static size_t delivered = 0;        // advertisements the radio heard
+static size_t sessions = 0;
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    if (strcmp(topic, topic_metrics) == 0)
+    {
+        if (deserializeJson(last_metrics, (const char *)payload, length))
+        {
+            return;
+        }
+        sequences.push_back(last_metrics["seq"].as<uint32_t>());
+        metrics_bytes_max = length > metrics_bytes_max ? length : metrics_bytes_max;
+        published_before = hal_native_mqtt_published_messages() - 1;
+    }
+    else if (strcmp(topic, topic_update) == 0 && strstr((const char *)payload, "\"metrics\""))
+    {
+        mirrors++;
+    }
+}
+
+static void on_delivery(const hal_ble_advertisement_t *advertisement)
+{
+    delivered++;
+}
+
+static void on_connect()
+{
+    sessions++;
+    gateway_on_connect();
+}
+
+static void record_concurrently(const int thread)
+{
+    for (uint32_t i = 0; i < BENCH_METRICS_PER_THREAD; i++)
+    {
+        metrics_count(METRIC_ADV_SEEN);
+        metrics_record(METRIC_PUBLISH_US, thread * 1000 + i % 1000);
+    }
+}
+
+// Cost per call, and BENCH_METRICS_THREADS threads recording at once.
+static int registry()
+{
+    metrics_init();
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_METRICS_CALLS; i++)
+    {
+        metrics_count(METRIC_ADV_SEEN);
+    }
+    const double count_ns = (double)(bench_now_ns() - start) / BENCH_METRICS_CALLS;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_METRICS_CALLS; i++)
+    {
+        metrics_record(METRIC_SCAN_US, i & 0xfffff);
+    }
+    const double record_ns = (double)(bench_now_ns() - start) / BENCH_METRICS_CALLS;
+    printf("registry\n");
+    printf("  count                      %.1f ns\n", count_ns);
+    printf("  histogram value            %.1f ns\n", record_ns);
+
+    metrics_init();
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < BENCH_METRICS_THREADS; thread++)
+    {
+        threads.push_back(std::thread(record_concurrently, thread));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    metrics_snapshot_t snapshot;
+    metrics_snapshot(&snapshot);
+    const metrics_histogram_t *histogram = &snapshot.histograms[METRIC_PUBLISH_US];
+    uint32_t count = 0;
+    for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+    {
+        count += histogram->counts[bucket];
+    }
+    uint32_t sum = 0;
+    for (int thread = 0; thread < BENCH_METRICS_THREADS; thread++)
+    {
+        sum += thread * 1000U * BENCH_METRICS_PER_THREAD + 999U * 1000 / 2 * (BENCH_METRICS_PER_THREAD / 1000);
+    }
+    const uint32_t expected = BENCH_METRICS_THREADS * BENCH_METRICS_PER_THREAD;
+    const bool ok = snapshot.counters[METRIC_ADV_SEEN] == expected && count == expected && histogram->sum == sum &&
+                    histogram->max == (BENCH_METRICS_THREADS - 1) * 1000 + 999;
+    printf("  %d threads at once          %u counted, %u recorded, sum and max %s\n",
+           BENCH_METRICS_THREADS, snapshot.counters[METRIC_ADV_SEEN], count, ok ? "exact" : "off (FAILED)");
+    return ok ? 0 : 1;
+}
+
+static uint32_t counter(const char *name)
+{
+    return last_metrics["counters"][name].as<uint32_t>();
+}
+
+// A gauge as [value, min, max, limit], 0 where not reported.
+static uint32_t gauge(const char *name, const int index)
+{
+    return last_metrics["gauges"][name][index].as<uint32_t>();
+}
+
+static uint32_t histogram_count(const char *name)
+{
+    uint32_t count = 0;
+    JsonArray buckets = last_metrics["histograms"][name][0];
+    for (JsonVariant bucket : buckets)
+    {
+        count += bucket.as<uint32_t>();
+    }
+    return count;
+}
+
+static int gateway()
+{
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, on_connect};
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    char root[64];
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_METRICS_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    snprintf(topic_metrics, sizeof(topic_metrics), METRICS_TOPIC, client_id);
+    snprintf(topic_update, sizeof(topic_update), "$aws/things/%s/shadow/update", client_id);
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    hal_native_ble_set_delivery_hook(on_delivery);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING))
+    {
+        return 1;
+    }
+
+    size_t loops = 0;
+    while (hal_millis() < BENCH_METRICS_LENGTH)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        hal_native_wifi_set_available(hal_millis() < BENCH_METRICS_DOWN || hal_millis() >= BENCH_METRICS_BACK);
+        if (hal_millis() >= BENCH_METRICS_HEAP_AT)
+        {
+            hal_native_heap_set(BENCH_METRICS_HEAP_FREE, BENCH_METRICS_HEAP_LARGEST);
+        }
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        loops++;
+    }
+
+    int failures = 0;
+    const size_t expected = BENCH_METRICS_LENGTH / METRICS_INTERVAL;
+    bool in_order = sequences.size() == expected;
+    for (size_t i = 0; in_order && i < sequences.size(); i++)
+    {
+        in_order = sequences[i] == i;
+    }
+    printf("gateway, %u s with an outage of %u s\n", BENCH_METRICS_LENGTH / 1000, (BENCH_METRICS_BACK - BENCH_METRICS_DOWN) / 1000);
+    printf("  metrics messages           %zu of %zu, %s, at most %zu bytes, %zu mirrored in the shadow%s\n",
+           sequences.size(), expected, in_order ? "in order" : "out of order", metrics_bytes_max, mirrors,
+           in_order && mirrors > 0 ? "" : " (FAILED)");
+    failures += !in_order || mirrors == 0;
+
+    // The last message was built before the broker saw it and the
+    // messages queued with it.
+    const uint32_t seen = counter("adv_seen");
+    const uint32_t matched = counter("adv_matched");
+    printf("  advertisements             %u seen (%zu heard), %u matched, %u dropped\n",
+           seen, delivered, matched, counter("adv_dropped"));
+    failures += seen != delivered || matched == 0 || matched > seen;
+
+    const uint32_t connects = counter("connects");
+    printf("  connection                 %u connects (%zu sessions), %u lost, %u failures\n",
+           connects, sessions, counter("link_lost"), counter("connect_failures"));
+    failures += connects != sessions || counter("link_lost") == 0;
+
+    printf("  messages                   %u published (broker %zu before), %u failed, %u stored, %u lost\n",
+           counter("published"), published_before, counter("publish_failed"), counter("messages_stored"), counter("messages_lost"));
+    failures += counter("published") > published_before || counter("messages_stored") == 0;
+
+    printf("  heap                       free %u (min %u), largest block %u (min %u)\n",
+           gauge("heap_free", 0), gauge("heap_free", 1), gauge("heap_largest", 0), gauge("heap_largest", 1));
+    failures += gauge("heap_free", 1) != BENCH_METRICS_HEAP_FREE || gauge("heap_largest", 1) != BENCH_METRICS_HEAP_LARGEST ||
+                gauge("heap_free", 2) != HAL_NATIVE_HEAP_FREE;
+
+    static const char *const documents[] = {"json_events", "json_shadow", "json_telemetry"};
+    for (size_t i = 0; i < sizeof(documents) / sizeof(documents[0]); i++)
+    {
+        const uint32_t max = gauge(documents[i], 2);
+        const uint32_t limit = gauge(documents[i], 3);
+        printf("  %-26s max %u of %u bytes\n", documents[i], max, limit);
+        failures += max == 0 || max > limit;
+    }
+    printf("  presence                   max %u of %u badges\n", gauge("presence", 2), gauge("presence", 3));
+
+    const uint32_t loop_count = histogram_count("loop_us");
+    printf("  histograms                 %u loops (%zu run), %u scans, %u publishes, %u messages queued\n",
+           loop_count, loops, histogram_count("scan_us"), histogram_count("publish_us"), histogram_count("message_bytes"));
+    failures += loop_count == 0 || loop_count > loops;
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    return failures;
+}
+
+int bench_metrics(int argc, char **argv)
+{
+    int failures = registry();
+    failures += gateway();
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
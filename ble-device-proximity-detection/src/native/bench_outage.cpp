@@ -0,0 +1,368 @@
+/*
+ * bench_outage.cpp
+ *
+ * An access point outage, twice. First for a fleet of gateways losing
+ * the same access point at once: when their TLS handshakes land after
+ * it comes back, with the connection manager and with the old 5 s retry
+ * loops, which ran in lockstep. Then the gateway loop through an outage
+ * in the middle of the recording: scanning goes on, messages are kept
+ * on the file-backed SD card and replayed once the link is back. Last,
+ * the gateway starts with a backlog of BENCH_OUTAGE_BACKLOG records in
+ * the log: live messages have to go out while it is replayed, not after.
+ * And once more with a broker that never acknowledges: what the log
+ * held has to be there still, what was given up has to be back in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "metrics.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_OUTAGE_GATEWAYS 200
+#define BENCH_OUTAGE_SECONDS 60
+#define BENCH_OUTAGE_LOCKSTEP_RETRY 5000 // ms, the delay(5000) loops before
+#define BENCH_OUTAGE_DOWN 5000           // ms into the recording
+#define BENCH_OUTAGE_BACK 12000
+#define BENCH_OUTAGE_DRAIN 60000         // ms after the recording to replay the log
+#define BENCH_OUTAGE_BACKLOG 1000           // records, 200 s of replay
+#define BENCH_OUTAGE_BACKLOG_MARK "backlog" // payload of a record in it
+#define BENCH_OUTAGE_UNACKNOWLEDGED 10      // records in the log
+#define BENCH_OUTAGE_WITHHELD 300000        // ms without a PUBACK, past INFLIGHT_ATTEMPTS
+#define BENCH_OUTAGE_ROOT "/tmp/hhcm-bench-outage"
+
+static size_t published = 0;
+static size_t published_backlog = 0;
+static uint32_t first_live = 0; // ms live events or telemetry went out
+static uint8_t log_record[STORE_RECORD_MAX];
+
+// Steps the connection manager of a single gateway from the loss of the
+// access point at 0 until it is online again, the access point coming
+// back at the given time. Returns that time; the broker connection
+// attempts made after the access point came back go to handshakes.
+static uint32_t reconnect(const uint32_t back, std::vector<uint32_t> &handshakes)
+{
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, NULL};
+
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(true);
+    connection_setup(&config, 0);
+    while (connection_step(hal_millis()) != CONNECTION_ONLINE)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+    }
+
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(false);
+    size_t seen = hal_native_mqtt_connects();
+    for (uint32_t now = 0;; now += BENCH_DEFAULT_TICK)
+    {
+        hal_native_clock_set(now);
+        hal_native_wifi_set_available(now >= back);
+        const connection_state_t state = connection_step(now);
+        if (hal_native_mqtt_connects() != seen)
+        {
+            seen = hal_native_mqtt_connects();
+            if (now >= back)
+            {
+                handshakes.push_back(now);
+            }
+        }
+        if (state == CONNECTION_ONLINE)
+        {
+            return now;
+        }
+    }
+}
+
+// Most of the times in any one second window.
+static size_t peak_per_second(std::vector<uint32_t> &times)
+{
+    std::sort(times.begin(), times.end());
+    size_t peak = 0;
+    for (size_t first = 0, last = 0; last < times.size(); last++)
+    {
+        while (times[last] - times[first] >= 1000)
+        {
+            first++;
+        }
+        peak = std::max(peak, last - first + 1);
+    }
+    return peak;
+}
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    published++;
+    if (length == sizeof(BENCH_OUTAGE_BACKLOG_MARK) - 1 && memcmp(payload, BENCH_OUTAGE_BACKLOG_MARK, length) == 0)
+    {
+        published_backlog++;
+    }
+    else if (first_live == 0 && (strstr(topic, "/events") != NULL || strstr(topic, "/telemetry/") != NULL))
+    {
+        first_live = hal_millis();
+    }
+}
+
+static void count_file(const char *name, void *context)
+{
+    (*(int *)context)++;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+// Runs the gateway loop over the recording and a while after, with the
+// access point down from BENCH_OUTAGE_DOWN to BENCH_OUTAGE_BACK.
+static int loop_through_outage()
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char root[64];
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_OUTAGE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(true);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING))
+    {
+        return 1;
+    }
+
+    size_t iterations_offline = 0;
+    size_t published_offline = 0;
+    uint32_t online_again = 0;
+    uint32_t drain_until = 0;
+    while (drain_until == 0 || hal_millis() < drain_until)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        const uint32_t now = hal_millis();
+        hal_native_wifi_set_available(now < BENCH_OUTAGE_DOWN || now >= BENCH_OUTAGE_BACK);
+        if (connection_step(now) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+            if (now >= BENCH_OUTAGE_BACK && online_again == 0)
+            {
+                online_again = now;
+            }
+        }
+        else if (now >= BENCH_OUTAGE_DOWN)
+        {
+            iterations_offline++;
+            published_offline = published;
+        }
+        gateway_loop();
+        gateway_network_loop();
+        if (drain_until == 0 && hal_native_ble_replay_done())
+        {
+            drain_until = now + BENCH_OUTAGE_DRAIN;
+        }
+    }
+
+    connection_statistics_t statistics;
+    connection_get_statistics(&statistics);
+    int leftover = 0;
+    hal_storage_list(STORE_DIRECTORY, count_file, &leftover);
+
+    printf("gateway loop, access point down from %.1f s to %.1f s of the recording\n",
+           BENCH_OUTAGE_DOWN / 1000.0, BENCH_OUTAGE_BACK / 1000.0);
+    printf("  loop iterations offline    %zu (scanning went on)\n", iterations_offline);
+    printf("  online again after         %u ms\n", online_again - BENCH_OUTAGE_BACK);
+    printf("  messages published         %zu, %zu of them after the outage\n", published, published - published_offline);
+    printf("  segments left in the log   %d\n", leftover);
+    printf("  outages / connects         %u / %u, failures wifi %u tls %u mqtt %u\n",
+           statistics.outages, statistics.connects,
+           statistics.failures_wifi, statistics.failures_tls, statistics.failures_mqtt);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    return online_again == 0 || iterations_offline == 0 || leftover > 0;
+}
+
+// Starts the gateway on a log holding a backlog of event records and
+// runs it over the recording: when the first live message went out and
+// how much of the backlog was replayed by then.
+static int live_behind_backlog()
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char root[64];
+    store_t backlog;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_OUTAGE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    store_init(&backlog);
+    for (int i = 0; i < BENCH_OUTAGE_BACKLOG; i++)
+    {
+        store_append(&backlog, STORE_KIND_EVENTS, (const uint8_t *)BENCH_OUTAGE_BACKLOG_MARK, sizeof(BENCH_OUTAGE_BACKLOG_MARK) - 1);
+    }
+
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(true);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    published_backlog = 0;
+    first_live = 0;
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING))
+    {
+        return 1;
+    }
+    size_t replayed_by_then = 0;
+    while (!hal_native_ble_replay_done() || first_live == 0)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        if (first_live == 0)
+        {
+            replayed_by_then = published_backlog;
+        }
+        if (hal_millis() > (uint32_t)BENCH_OUTAGE_BACKLOG * STORE_REPLAY_INTERVAL)
+        {
+            break;
+        }
+    }
+
+    printf("gateway started with %d records in the log, replayed at one per %u ms\n", BENCH_OUTAGE_BACKLOG, STORE_REPLAY_INTERVAL);
+    printf("  first live message         at %u ms, %zu of the backlog replayed by then\n", first_live, replayed_by_then);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    return first_live == 0 || replayed_by_then >= BENCH_OUTAGE_BACKLOG;
+}
+
+// Runs the gateway with a few records in the log and a broker that
+// drops every PUBACK until the messages are given up, then reads the
+// log as the gateway would after a restart.
+static int acks_withheld()
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char root[64];
+    store_t log;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_OUTAGE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    store_init(&log);
+    for (int i = 0; i < BENCH_OUTAGE_UNACKNOWLEDGED; i++)
+    {
+        store_append(&log, STORE_KIND_EVENTS, (const uint8_t *)BENCH_OUTAGE_BACKLOG_MARK, sizeof(BENCH_OUTAGE_BACKLOG_MARK) - 1);
+    }
+
+    metrics_snapshot_t before;
+    metrics_snapshot(&before);
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(true);
+    hal_native_mqtt_set_loss(0, 100);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(NULL);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING))
+    {
+        hal_native_mqtt_set_loss(0, 0);
+        return 1;
+    }
+    while (hal_millis() < BENCH_OUTAGE_WITHHELD)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+    }
+    hal_native_mqtt_set_loss(0, 0);
+
+    gateway_statistics_t statistics;
+    gateway_get_statistics(&statistics);
+    metrics_snapshot_t after;
+    metrics_snapshot(&after);
+    const uint32_t lost = after.counters[METRIC_MESSAGES_LOST] - before.counters[METRIC_MESSAGES_LOST];
+
+    size_t kept = 0;
+    size_t records = 0;
+    uint8_t kind;
+    size_t length;
+    store_init(&log);
+    while ((length = store_peek(&log, &kind, log_record, sizeof(log_record))) > 0)
+    {
+        kept += length == sizeof(BENCH_OUTAGE_BACKLOG_MARK) - 1 && memcmp(log_record, BENCH_OUTAGE_BACKLOG_MARK, length) == 0;
+        records++;
+        store_advance(&log, length);
+    }
+
+    printf("broker acknowledging nothing for %u s, %d records in the log\n", BENCH_OUTAGE_WITHHELD / 1000, BENCH_OUTAGE_UNACKNOWLEDGED);
+    printf("  after a restart            %zu of them in the log, %zu records in all, %u given up, %u lost\n",
+           kept, records, statistics.unacknowledged, lost);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    return kept != BENCH_OUTAGE_UNACKNOWLEDGED || statistics.unacknowledged == 0 || lost > 0;
+}
+
+int bench_outage(int argc, char **argv)
+{
+    const int gateways = argc > 0 ? atoi(argv[0]) : BENCH_OUTAGE_GATEWAYS;
+    const uint32_t back = (argc > 1 ? atoi(argv[1]) : BENCH_OUTAGE_SECONDS) * 1000;
+
+    // Every gateway gets its own random sequence, as the hardware RNG
+    // gives them.
+    std::vector<uint32_t> handshakes;
+    std::vector<double> delays;
+    for (int gateway = 0; gateway < gateways; gateway++)
+    {
+        srand(gateway + 1);
+        delays.push_back((reconnect(back, handshakes) - back) / 1000.0);
+    }
+    const size_t attempts = handshakes.size();
+    const size_t peak = peak_per_second(handshakes);
+
+    // The old loops retried every 5 s from the moment the link was lost,
+    // every gateway at the same instants, and did not scan meanwhile.
+    const uint32_t lockstep = (back + BENCH_OUTAGE_LOCKSTEP_RETRY - 1) / BENCH_OUTAGE_LOCKSTEP_RETRY * BENCH_OUTAGE_LOCKSTEP_RETRY;
+
+    printf("%d gateways, access point down for %u s\n", gateways, back / 1000);
+    printf("  5 s retry loops            %d handshakes at +%u ms, all at once\n", gateways, lockstep - back);
+    printf("  backoff with jitter        %zu handshakes after recovery, at most %zu in one second\n", attempts, peak);
+    bench_report_distribution("  online after recovery", delays, "s");
+
+    const int failures = loop_through_outage() + live_behind_backlog() + acks_withheld() + (gateways > 1 && peak >= (size_t)gateways);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
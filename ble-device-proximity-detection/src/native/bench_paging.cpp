@@ -0,0 +1,114 @@
+/*
+ * bench_paging.cpp
+ *
+ * Shadow updates and telemetry pages for a crowded ward: a full resync,
+ * then a delta after half of the badges changed zone. The shadow only
+ * takes zone counts, an update stays within SHADOW_UPDATE_BYTES
+ * whatever the number of badges (what it carries is checked by the unit
+ * tests, test/test_shadow); checks that every badge lands in exactly
+ * one telemetry page. Reports pages, sizes and drops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "proximity.h"
+#include "presence.h"
+#include "shadow.h"
+#include "telemetry.h"
+#include "bench.h"
+
+#define BENCH_PAGING_BADGES 500
+
+static presence_table_t presence;
+static StaticJsonDocument<SHADOW_DOCUMENT_SIZE> shadow_document;
+static StaticJsonDocument<TELEMETRY_DOCUMENT_SIZE> telemetry_document;
+static uint8_t buffer[TELEMETRY_BUFFER_SIZE];
+
+// Publishes a shadow update, as publish_shadow() does with a broker that
+// takes everything.
+static void shadow_round(shadow_state_t *shadow, const shadow_detect_t *detect, const bool reset, const char *label)
+{
+    shadow_zones_t zones;
+    shadow_count_zones(&presence, &zones);
+    const int changes = shadow_changes(shadow, &zones);
+
+    shadow_build_update(shadow, detect, &zones, reset, &shadow_document);
+    const size_t length = measureJson(shadow_document);
+    shadow_commit_update(shadow, detect, &zones, reset, hal_millis());
+
+    printf("%-24s room=%u near=%u changes=%d bytes=%zu/%d memory=%zu/%d\n",
+           label, zones.badges[PROXIMITY_IN_ROOM], zones.badges[PROXIMITY_NEAR], changes,
+           length, SHADOW_UPDATE_BYTES, shadow_document.memoryUsage(), (int)SHADOW_UPDATE_SIZE);
+}
+
+static int telemetry_round(const telemetry_format_t format)
+{
+    telemetry_state_t telemetry = {};
+    const int pages = telemetry_pages(&presence);
+    size_t cursor = 0;
+    size_t bytes = 0;
+    size_t largest = 0;
+    int badges = 0;
+
+    for (int page = 1; page <= pages; page++)
+    {
+        const int count = telemetry_build(&telemetry, &presence, HAL_NATIVE_EPOCH_BASE * 1000ULL, hal_millis(), &cursor, page, pages, &telemetry_document);
+        const size_t length = telemetry_serialize(&telemetry_document, format, buffer, sizeof(buffer));
+        if (length == 0)
+        {
+            telemetry.dropped += count;
+            continue;
+        }
+        badges += count;
+        bytes += length;
+        largest = length > largest ? length : largest;
+    }
+
+    printf("telemetry %-14s badges=%d pages=%d bytes=%zu largest=%zu buffer=%d dropped=%lu\n",
+           telemetry_format_name(format), badges, pages, bytes, largest, TELEMETRY_BUFFER_SIZE,
+           (unsigned long)telemetry.dropped);
+    return badges;
+}
+
+int bench_paging(int argc, char **argv)
+{
+    const int count = argc > 0 ? atoi(argv[0]) : BENCH_PAGING_BADGES;
+    const uint32_t now = 600000;
+    int failures = 0;
+
+    hal_native_clock_set(now);
+    bench_fill_presence(&presence, count, now);
+    printf("badges in range          %lu of %d (table rejected %lu)\n",
+           (unsigned long)presence.count, count, (unsigned long)presence.rejected);
+    printf("records per page         telemetry %d\n", (int)TELEMETRY_RECORDS_PER_PAGE);
+
+    shadow_state_t shadow;
+    shadow_detect_t detect = {100, 99, 1, "RHS", -50};
+    shadow_init(&shadow, SHADOW_RESYNC_INTERVAL);
+    shadow_round(&shadow, &detect, true, "shadow resync");
+
+    // Every other badge moves on, near and room swap, the rest go away.
+    size_t cursor = 0;
+    presence_entry_t *entry;
+    int changed = 0;
+    for (int i = 0; (entry = presence_next(&presence, &cursor)) != NULL; i++)
+    {
+        if (i % 2 == 0)
+        {
+            entry->zone = i % 4 == 0 ? PROXIMITY_AWAY : entry->zone == PROXIMITY_NEAR ? PROXIMITY_IN_ROOM : PROXIMITY_NEAR;
+            changed++;
+        }
+    }
+    shadow_round(&shadow, &detect, false, "shadow delta");
+
+    const int present = (int)presence.count - (changed + 1) / 2;
+    failures += telemetry_round(TELEMETRY_FORMAT_JSON) != present;
+    failures += telemetry_round(TELEMETRY_FORMAT_MSGPACK) != present;
+    failures += telemetry_round(TELEMETRY_FORMAT_CBOR) != present;
+
+    printf("%s\n", failures ? "FAILED: badges missing or sent twice" : "ok");
+    return failures ? 1 : 0;
+}
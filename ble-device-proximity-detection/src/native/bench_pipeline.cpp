@@ -0,0 +1,127 @@
+/*
+ * bench_pipeline.cpp
+ *
+ * The gateway loop over a recording with the network stage stalling
+ * every few seconds, as it does in a TLS handshake or a publish stuck
+ * on a weak link. Run twice: with the stages in tasks of their own, the
+ * aggregation stage going on while the network stage stalls, and
+ * serially as loop() used to run them, everything waiting for the
+ * stall. Reports the queue depths and per-stage latencies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "ble_ring.h"
+#include "ble_scan.h"
+#include "outbox.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_PIPELINE_STALL 3000  // ms
+#define BENCH_PIPELINE_PERIOD 5000 // ms between the starts of two stalls
+#define BENCH_PIPELINE_DRAIN 30000 // ms after the recording
+#define BENCH_PIPELINE_ROOT "/tmp/hhcm-bench-pipeline"
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void network_step()
+{
+    if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+    {
+        hal_mqtt_poll();
+    }
+    gateway_network_loop();
+}
+
+// Returns the number of advertisements the scan ring dropped.
+static uint32_t run(const char *path, const uint32_t stall, const bool serial)
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(path))
+    {
+        return 0;
+    }
+
+    // The stall is where the network stage is busy: in its own task
+    // only it is held up, serially the aggregation stage is too.
+    uint32_t drain_until = 0;
+    while (drain_until == 0 || hal_millis() < drain_until)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        const uint32_t now = hal_millis();
+        const bool stalled = now % BENCH_PIPELINE_PERIOD < stall && now < BENCH_PIPELINE_PERIOD * 4;
+        if (!stalled)
+        {
+            network_step();
+        }
+        if (!stalled || !serial)
+        {
+            gateway_loop();
+        }
+        if (drain_until == 0 && hal_native_ble_replay_done())
+        {
+            drain_until = now + BENCH_PIPELINE_DRAIN;
+        }
+    }
+
+    gateway_statistics_t gateway;
+    ble_scan_statistics_t scan;
+    gateway_get_statistics(&gateway);
+    ble_scan_get_statistics(&scan);
+
+    printf("%s, network stage stalled %u of every %u ms\n",
+           serial ? "serial loop" : "pipeline", stall, BENCH_PIPELINE_PERIOD);
+    printf("  scan ring                  %u received, %u dropped, high water %u of %u, wait mean %.1f max %u ms\n",
+           scan.received, scan.dropped, scan.high_water, BLE_RING_CAPACITY,
+           scan.drained ? (double)scan.wait_total / scan.drained : 0.0, scan.wait_max);
+    printf("  aggregation                %u runs, mean %.1f max %u us, %u events and %u telemetry badges dropped\n",
+           gateway.aggregate_runs, gateway.aggregate_runs ? (double)gateway.aggregate_us_total / gateway.aggregate_runs : 0.0,
+           gateway.aggregate_us_max, gateway.events_dropped, gateway.telemetry_dropped);
+    printf("  outbox                     %u queued, %u refused, high water %u of %u, wait mean %.1f max %u ms\n",
+           gateway.outbox_queued, gateway.outbox_refused, gateway.outbox_high_water, OUTBOX_CAPACITY,
+           gateway.taken ? (double)gateway.wait_ms_total / gateway.taken : 0.0, gateway.wait_ms_max);
+    printf("  network                    %u sent, publish mean %.1f max %u us, %u stored, %u replayed\n",
+           gateway.sent, gateway.sent ? (double)gateway.publish_us_total / gateway.sent : 0.0,
+           gateway.publish_us_max, gateway.stored, gateway.replayed);
+    return scan.dropped;
+}
+
+int bench_pipeline(int argc, char **argv)
+{
+    const uint32_t stall = argc > 0 ? atoi(argv[0]) : BENCH_PIPELINE_STALL;
+    const char *path = argc > 1 ? argv[1] : BENCH_DEFAULT_RECORDING;
+    char root[64];
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_PIPELINE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+
+    const uint32_t dropped = run(path, stall, false);
+    run(path, stall, true);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+
+    printf("%s\n", dropped ? "FAILED: the scan ring overflowed behind a stalled network stage" : "ok");
+    return dropped ? 1 : 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * bench_qos.cpp
+ *
+ * QoS 1 publishing over a link that loses publishes and PUBACKs. First
+ * a burst through the HAL alone, stop-and-wait against the in-flight
+ * window: how long until the broker has acknowledged every message.
+ * Then the gateway over the sample recording with an access point
+ * outage, once on a link that loses nothing and once on the lossy one:
+ * every events and telemetry message has to reach the broker, in
+ * sequence without a gap, however often it went out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "inflight.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_QOS_ROUND_TRIP 300 // ms, default
+#define BENCH_QOS_LOSS 10        // percent of publishes and of PUBACKs, default
+#define BENCH_QOS_MESSAGES 200
+#define BENCH_QOS_MESSAGE_BYTES 512
+#define BENCH_QOS_TOPIC "bench/qos"
+#define BENCH_QOS_LIMIT 600000 // ms until a run counts as stuck
+#define BENCH_QOS_RECORDING 20000
+#define BENCH_QOS_DOWN 6000 // access point outage, ms into the recording
+#define BENCH_QOS_BACK 12000
+#define BENCH_QOS_ROOT "/tmp/hhcm-bench-qos"
+
+// What the broker took: copies by message, the burst by its number,
+// the gateway's messages by kind and sequence number.
+static std::map<std::string, uint32_t> received;
+static inflight_t window;
+static uint32_t recording_start = 0;
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    char key[32];
+    if (strcmp(topic, BENCH_QOS_TOPIC) == 0 && length >= sizeof(uint32_t))
+    {
+        uint32_t number;
+        memcpy(&number, payload, sizeof(number));
+        snprintf(key, sizeof(key), "burst %u", number);
+        received[key]++;
+        return;
+    }
+
+    // Telemetry in JSON or MessagePack, CBOR is not counted.
+    const char *kind = strstr(topic, "/events") ? "events" : strstr(topic, "/telemetry/") ? "telemetry" : NULL;
+    if (kind == NULL || strstr(topic, "/cbor"))
+    {
+        return;
+    }
+    StaticJsonDocument<64> filter;
+    DynamicJsonDocument document(1024);
+    filter["seq"] = true;
+    const DeserializationError error = strstr(topic, "/msgpack")
+        ? deserializeMsgPack(document, (const char *)payload, length, DeserializationOption::Filter(filter))
+        : deserializeJson(document, (const char *)payload, length, DeserializationOption::Filter(filter));
+    if (error)
+    {
+        return;
+    }
+    snprintf(key, sizeof(key), "%s %u", kind, document["seq"].as<uint32_t>());
+    received[key]++;
+}
+
+static void on_ack(const uint16_t packet_id)
+{
+    inflight_acknowledge(&window, packet_id, hal_millis());
+}
+
+static uint16_t send(const inflight_message_t *message, const uint16_t retransmit)
+{
+    return hal_mqtt_publish_acknowledged(BENCH_QOS_TOPIC, message->payload, message->length, retransmit);
+}
+
+// BENCH_QOS_MESSAGES queued at once, at most limit of them in flight.
+// Returns the fake clock time until all are acknowledged or given up.
+static uint32_t burst(const uint32_t limit, const bool report)
+{
+    inflight_message_t *message;
+    uint32_t next = 0;
+
+    inflight_init(&window);
+    received.clear();
+    srand(4);
+    const size_t lost = hal_native_mqtt_lost();
+    const uint32_t start = hal_millis();
+    while ((next < BENCH_QOS_MESSAGES || window.count > 0) && hal_millis() - start < BENCH_QOS_LIMIT)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        hal_mqtt_poll();
+        const uint32_t now = hal_millis();
+        while ((message = inflight_due(&window, now)) != NULL)
+        {
+            if (message->attempts >= INFLIGHT_ATTEMPTS)
+            {
+                inflight_give_up(&window, message);
+                continue;
+            }
+            const uint16_t packet_id = send(message, message->packet_id);
+            if (packet_id == 0)
+            {
+                break;
+            }
+            inflight_sent(&window, message, packet_id, now);
+        }
+        while (next < BENCH_QOS_MESSAGES && window.count < limit && (message = inflight_reserve(&window)) != NULL)
+        {
+            memcpy(message->payload, &next, sizeof(next));
+            memset(message->payload + sizeof(next), (uint8_t)next, BENCH_QOS_MESSAGE_BYTES - sizeof(next));
+            message->length = BENCH_QOS_MESSAGE_BYTES;
+            const uint16_t packet_id = send(message, 0);
+            if (packet_id == 0)
+            {
+                break;
+            }
+            inflight_sent(&window, message, packet_id, now);
+            next++;
+        }
+    }
+    const uint32_t elapsed = hal_millis() - start;
+
+    uint32_t copies = 0;
+    for (std::map<std::string, uint32_t>::const_iterator message = received.begin(); message != received.end(); ++message)
+    {
+        copies += message->second - 1;
+    }
+    if (report)
+    {
+        printf("  window of %-2u              %.1f s, %u retransmitted, %zu lost on the link, %zu of %d at the broker, %u copies, %u given up\n",
+               limit, elapsed / 1000.0, window.retransmitted, hal_native_mqtt_lost() - lost, received.size(),
+               BENCH_QOS_MESSAGES, copies, window.given_up);
+    }
+    return elapsed;
+}
+
+static int window_size(const uint32_t round_trip, const unsigned loss)
+{
+    printf("burst of %d messages of %d bytes, %u ms round trip, %u%% of publishes and PUBACKs lost\n",
+           BENCH_QOS_MESSAGES, BENCH_QOS_MESSAGE_BYTES, round_trip, loss);
+    hal_mqtt_set_ack_callback(on_ack);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    hal_native_mqtt_set_connected(true);
+    hal_native_mqtt_set_ack_delay(round_trip);
+
+    hal_native_mqtt_set_loss(0, 0);
+    const uint32_t lossless = burst(1, false);
+    printf("  stop-and-wait, no loss     %.1f s\n", lossless / 1000.0);
+
+    hal_native_mqtt_set_loss(loss, loss);
+    const uint32_t stop_and_wait = burst(1, true);
+    const bool stop_and_wait_ok = received.size() == BENCH_QOS_MESSAGES && window.given_up == 0;
+    const uint32_t windowed = burst(INFLIGHT_WINDOW, true);
+    const bool ok = stop_and_wait_ok && received.size() == BENCH_QOS_MESSAGES && window.given_up == 0 && windowed < stop_and_wait;
+    printf("  speedup                    %.1fx%s\n", (double)stop_and_wait / windowed, ok ? "" : " (FAILED)");
+
+    hal_native_mqtt_set_connected(false);
+    hal_native_mqtt_set_loss(0, 0);
+    return ok ? 0 : 1;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void run(const uint32_t duration, const bool outage)
+{
+    const uint32_t until = hal_millis() + duration;
+    while (hal_millis() < until)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (outage)
+        {
+            const uint32_t elapsed = hal_millis() - recording_start;
+            hal_native_wifi_set_available(elapsed < BENCH_QOS_DOWN || elapsed >= BENCH_QOS_BACK);
+        }
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+    }
+}
+
+// Messages of the kind at the broker, and whether their sequence
+// numbers have a gap.
+static uint32_t count(const char *kind, bool *gap)
+{
+    const std::string prefix = std::string(kind) + " ";
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    uint32_t messages = 0;
+    for (std::map<std::string, uint32_t>::const_iterator message = received.begin(); message != received.end(); ++message)
+    {
+        if (message->first.compare(0, prefix.size(), prefix) == 0)
+        {
+            const uint32_t sequence = strtoul(message->first.c_str() + prefix.size(), NULL, 10);
+            first = sequence < first ? sequence : first;
+            last = sequence > last ? sequence : last;
+            messages++;
+        }
+    }
+    *gap = messages > 0 && last - first + 1 != messages;
+    return messages;
+}
+
+// The recording with the outage, then until nothing is left to send.
+static int gateway_run(const char *label, const char *client_id, const unsigned loss,
+                       uint32_t *events, uint32_t *telemetry, const uint32_t expected_events,
+                       const uint32_t expected_telemetry)
+{
+    gateway_statistics_t statistics;
+    received.clear();
+    hal_native_mqtt_set_loss(loss, loss);
+    srand(5);
+    const size_t lost = hal_native_mqtt_lost();
+    const size_t duplicates = hal_native_mqtt_duplicates();
+    gateway_setup(client_id);
+    hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING);
+    recording_start = hal_millis();
+    run(BENCH_QOS_RECORDING, true);
+    const uint32_t drain = hal_millis();
+    do
+    {
+        run(1000, false);
+        gateway_get_statistics(&statistics);
+    } while ((statistics.inflight > 0 || statistics.outbox_depth > 0 || statistics.replayed < statistics.stored) &&
+             hal_millis() - drain < BENCH_QOS_LIMIT);
+    hal_native_mqtt_set_loss(0, 0);
+
+    bool events_gap;
+    bool telemetry_gap;
+    *events = count("events", &events_gap);
+    *telemetry = count("telemetry", &telemetry_gap);
+    uint32_t copies = 0;
+    for (std::map<std::string, uint32_t>::const_iterator message = received.begin(); message != received.end(); ++message)
+    {
+        copies += message->second - 1;
+    }
+    const bool complete = expected_events == 0 || (*events == expected_events && *telemetry == expected_telemetry);
+    const bool ok = complete && !events_gap && !telemetry_gap && statistics.unacknowledged == 0 && statistics.inflight == 0 && *events > 0;
+
+    printf("  %s\n", label);
+    printf("    at the broker            %u events, %u telemetry messages%s%s, %u copies, drained %.1f s after the recording%s\n",
+           *events, *telemetry, events_gap || telemetry_gap ? ", with gaps" : "", complete ? "" : ", some missing",
+           copies, (hal_millis() - drain) / 1000.0, ok ? "" : " (FAILED)");
+    printf("    link                     %zu publishes lost, %zu duplicates taken\n",
+           hal_native_mqtt_lost() - lost, hal_native_mqtt_duplicates() - duplicates);
+    printf("    window                   %u acknowledged, %u retransmitted, %u given up, high water %u of %d\n",
+           statistics.acknowledged, statistics.retransmitted, statistics.unacknowledged,
+           statistics.inflight_high_water, INFLIGHT_WINDOW);
+    printf("    PUBACK after             mean %.0f ms, max %u ms; %u stored, %u replayed\n",
+           statistics.acknowledged ? (double)statistics.ack_ms_total / statistics.acknowledged : 0.0,
+           statistics.ack_ms_max, statistics.stored, statistics.replayed);
+    return ok ? 0 : 1;
+}
+
+static int gateway(const uint32_t round_trip, const unsigned loss)
+{
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    char root[64];
+    uint32_t events = 0;
+    uint32_t telemetry = 0;
+    uint32_t lossy_events = 0;
+    uint32_t lossy_telemetry = 0;
+    int failures = 0;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_QOS_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_settings_erase();
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    hal_native_mqtt_set_ack_delay(round_trip);
+    connection_setup(&config, hal_millis());
+
+    printf("gateway, access point down from %d to %d s\n", BENCH_QOS_DOWN / 1000, BENCH_QOS_BACK / 1000);
+    failures += gateway_run("no loss", client_id, 0, &events, &telemetry, 0, 0);
+    char label[64];
+    snprintf(label, sizeof(label), "%u%% of publishes and PUBACKs lost", loss);
+    failures += gateway_run(label, client_id, loss, &lossy_events, &lossy_telemetry, events, telemetry);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    hal_native_settings_erase();
+    return failures;
+}
+
+int bench_qos(int argc, char **argv)
+{
+    const uint32_t round_trip = argc > 0 ? strtoul(argv[0], NULL, 10) : BENCH_QOS_ROUND_TRIP;
+    const unsigned loss = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_QOS_LOSS;
+
+    int failures = window_size(round_trip, loss);
+    failures += gateway(round_trip, loss);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * bench_reconfigure.cpp
+ *
+ * Detect settings changed through the device shadow, as an operator
+ * would across a fleet. A get/accepted document holding a large
+ * reported state is parsed as it is read, only the desired detect
+ * settings are kept; then a delta with settings out of range, which
+ * are rejected, and one that changes the scan and the name prefix.
+ * Every change has to reach the scan and be reported back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "shadow.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_RECONFIGURE_BADGES 2000
+#define BENCH_RECONFIGURE_SETTLE 2000 // ms the gateway runs after each message
+#define BENCH_RECONFIGURE_ROOT "/tmp/hhcm-bench-reconfigure"
+
+static char topic_update[GATEWAY_MQTT_TOPIC_SIZE];
+static shadow_detect_t reported; // as the device shadow holds it
+static size_t reports = 0;
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+// Merges the detect settings of every shadow update into reported.
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    StaticJsonDocument<SHADOW_DESIRED_FILTER_SIZE> filter;
+    StaticJsonDocument<SHADOW_DESIRED_DOCUMENT_SIZE> document;
+
+    if (strcmp(topic, topic_update) != 0)
+    {
+        return;
+    }
+    filter["state"]["reported"]["detect"] = true;
+    if (deserializeJson(document, (const char *)payload, length, DeserializationOption::Filter(filter)))
+    {
+        return;
+    }
+    JsonObject detect = document["state"]["reported"]["detect"];
+    if (detect.isNull())
+    {
+        return;
+    }
+    reported.interval = detect["interval"] | reported.interval;
+    reported.window = detect["window"] | reported.window;
+    reported.duration = detect["duration"] | reported.duration;
+    reported.rssi_threshold = detect["rssi_threshold"] | reported.rssi_threshold;
+    const char *name_prefix = detect["name_prefix"];
+    if (name_prefix)
+    {
+        snprintf(reported.name_prefix, sizeof(reported.name_prefix), "%s", name_prefix);
+    }
+    reports++;
+}
+
+static void run(const uint32_t duration)
+{
+    const uint32_t until = hal_millis() + duration;
+    while (hal_millis() < until)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+    }
+}
+
+// Delivers a message to the gateway, returns the time its callback took.
+static double deliver(const char *topic, const std::string &message)
+{
+    hal_native_mqtt_inject(topic, (const uint8_t *)message.data(), message.size());
+    const uint64_t start = bench_now_ns();
+    hal_mqtt_poll();
+    return (bench_now_ns() - start) / 1000.0;
+}
+
+// A get/accepted document as AWS IoT returns it: the desired state, the
+// reported state with the given number of badges, their metadata.
+static std::string get_accepted(const int badges)
+{
+    std::string detected;
+    std::string metadata;
+    char member[96];
+    for (int badge = 0; badge < badges; badge++)
+    {
+        snprintf(member, sizeof(member), "%s\"c4:4f:33:%02x:%02x:%02x\":\"%s\"",
+                 badge ? "," : "", (badge >> 16) & 0xff, (badge >> 8) & 0xff, badge & 0xff, badge % 3 ? "room" : "near");
+        detected += member;
+        snprintf(member, sizeof(member), "%s\"c4:4f:33:%02x:%02x:%02x\":{\"timestamp\":1633046400}",
+                 badge ? "," : "", (badge >> 16) & 0xff, (badge >> 8) & 0xff, badge & 0xff);
+        metadata += member;
+    }
+    return "{\"state\":{\"desired\":{\"detect\":{\"interval\":200,\"window\":150,\"duration\":2,"
+           "\"name_prefix\":\"RHS\",\"rssi_threshold\":-60}},"
+           "\"reported\":{\"detect\":{\"interval\":100,\"window\":99,\"duration\":1,"
+           "\"name_prefix\":\"RHS\",\"rssi_threshold\":-50},\"detected\":{" +
+           detected + "}},"
+           "\"delta\":{\"detect\":{\"interval\":200,\"window\":150,\"duration\":2,\"rssi_threshold\":-60}}},"
+           "\"metadata\":{\"reported\":{\"detected\":{" +
+           metadata + "}}},\"version\":42,\"timestamp\":1633046400}";
+}
+
+// Whether the scan and the reported state both have the settings.
+static int check(const char *label, const int interval, const int window, const int rssi_threshold, const char *name_prefix)
+{
+    int scan_interval;
+    int scan_window;
+    bool scan_active;
+    hal_native_ble_get_configuration(&scan_interval, &scan_window, &scan_active);
+    const bool ok = scan_interval == interval && scan_window == window &&
+                    reported.interval == interval && reported.window == window &&
+                    reported.rssi_threshold == rssi_threshold && strcmp(reported.name_prefix, name_prefix) == 0;
+
+    printf("  %-26s scan %d/%d ms, reported %d/%d ms, %d dBm, \"%s\", %zu reports%s\n",
+           label, scan_interval, scan_window, reported.interval, reported.window,
+           reported.rssi_threshold, reported.name_prefix, reports, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+int bench_reconfigure(int argc, char **argv)
+{
+    const int badges = argc > 0 ? atoi(argv[0]) : BENCH_RECONFIGURE_BADGES;
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    char topic[GATEWAY_MQTT_TOPIC_SIZE];
+    char root[64];
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_RECONFIGURE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    snprintf(topic_update, sizeof(topic_update), "$aws/things/%s/shadow/update", client_id);
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(BENCH_DEFAULT_RECORDING))
+    {
+        return 1;
+    }
+    run(BENCH_RECONFIGURE_SETTLE);
+
+    int failures = 0;
+    size_t seen = reports;
+    const std::string document = get_accepted(badges);
+    snprintf(topic, sizeof(topic), "$aws/things/%s/shadow/get/accepted", client_id);
+    const double parse = deliver(topic, document);
+    run(BENCH_RECONFIGURE_SETTLE);
+    printf("shadow get/accepted, %d badges reported, %zu bytes\n", badges, document.size());
+    printf("  parsed through the filter  %.1f us into %u bytes\n", parse, (unsigned)SHADOW_DESIRED_DOCUMENT_SIZE);
+    failures += check("desired state applied", 200, 150, -60, "RHS") + (reports == seen);
+
+    // Out of range: a window longer than the interval, a threshold below
+    // the room zone, no duration. All rejected, the settings in effect
+    // are reported again.
+    seen = reports;
+    snprintf(topic, sizeof(topic), "$aws/things/%s/shadow/update/delta", client_id);
+    deliver(topic, "{\"version\":43,\"timestamp\":1633046460,"
+                   "\"state\":{\"detect\":{\"window\":500,\"rssi_threshold\":-80,\"duration\":0}},"
+                   "\"metadata\":{\"detect\":{\"window\":{\"timestamp\":1633046460}}}}");
+    run(BENCH_RECONFIGURE_SETTLE);
+    failures += check("invalid delta rejected", 200, 150, -60, "RHS") + (reports == seen);
+
+    seen = reports;
+    deliver(topic, "{\"version\":44,\"timestamp\":1633046520,"
+                   "\"state\":{\"detect\":{\"interval\":400,\"window\":300,\"name_prefix\":\"XYZ\"}}}");
+    run(BENCH_RECONFIGURE_SETTLE);
+    failures += check("delta applied", 400, 300, -60, "XYZ") + (reports == seen);
+
+    gateway_statistics_t gateway;
+    gateway_get_statistics(&gateway);
+    printf("  detect settings            %u messages, %u settings rejected, %u applied\n",
+           gateway.config_received, gateway.config_rejected, gateway.config_applied);
+    failures += gateway.config_received != 3 || gateway.config_rejected != 3 || gateway.config_applied != 3;
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
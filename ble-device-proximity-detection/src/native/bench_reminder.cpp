@@ -0,0 +1,218 @@
+/*
+ * bench_reminder.cpp
+ *
+ * Runs the gateway over a recording with the feedback stage stepping
+ * every REMINDER_TICK ms, before the aggregation stage in the same
+ * tick, so a reminder always waits a whole step to be taken: once with
+ * the access point up and once with it down throughout. Reports the
+ * reminders, the cues they started, and the time from the visit
+ * becoming due to the first LED frame and to the chime being heard from
+ * the speaker stand-in (hal_native.h). Both runs have to cue the same
+ * reminders as fast, every chime heard in one piece and in full. Then
+ * plays the cue alone with the feedback stage late every fourth step,
+ * to show how late it may be before the DMA buffers run dry, and times
+ * a step on the host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "reminder.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_REMINDER_BUDGET 50 // ms from the zone event to the chime
+#define BENCH_REMINDER_AFTER (REMINDER_GRACE + 10000) // ms after the recording: the visits end or run out of grace, the last cue plays out
+#define BENCH_REMINDER_LATE_EVERY 4 // steps
+#define BENCH_REMINDER_CUES 200 // for the host time of a step
+#define BENCH_REMINDER_ROOT "/tmp/hhcm-bench-reminder"
+
+typedef struct
+{
+    uint32_t reminders; // raised by the aggregation stage
+    uint32_t merged;    // into a cue playing or about to start
+    uint32_t cues;
+    size_t bursts;  // heard, one per cue when none had a gap
+    size_t samples; // taken by the speaker
+    std::vector<double> led_ms;
+    std::vector<double> audio_ms;
+} bench_reminder_run_t;
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static bool run(const char *path, const bool online, bench_reminder_run_t *result)
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+    reminder_player_t player;
+    gateway_statistics_t statistics;
+
+    hal_native_clock_set(0);
+    hal_native_wifi_set_available(online);
+    hal_se_get_id(client_id, sizeof(client_id));
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    hal_leds_init();
+    hal_audio_init();
+    reminder_player_init(&player);
+    if (!hal_native_ble_load_recording(path))
+    {
+        return false;
+    }
+    const size_t bursts = hal_native_audio_bursts();
+    const size_t samples = hal_native_audio_samples();
+
+    uint32_t end = 0;
+    while (end == 0 || hal_millis() < end)
+    {
+        hal_native_clock_advance(REMINDER_TICK);
+        const uint32_t now = hal_millis();
+
+        // The feedback stage.
+        uint32_t time;
+        if (gateway_take_reminder(&time))
+        {
+            const size_t frames = hal_native_leds_frames();
+            const size_t heard = hal_native_audio_bursts();
+            reminder_play(&player, time, now);
+            if (hal_native_leds_frames() != frames)
+            {
+                result->led_ms.push_back(hal_native_leds_shown_at() - time);
+            }
+            if (hal_native_audio_bursts() != heard)
+            {
+                result->audio_ms.push_back(hal_native_audio_burst_start() - time);
+            }
+        }
+        else
+        {
+            reminder_step(&player, now);
+        }
+
+        if (connection_step(now) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        if (end == 0 && hal_native_ble_replay_done())
+        {
+            end = now + BENCH_REMINDER_AFTER;
+        }
+    }
+    gateway_get_statistics(&statistics);
+    result->reminders = statistics.reminders;
+    result->merged = statistics.reminders_merged + player.merged;
+    result->cues = player.cues;
+    result->bursts = hal_native_audio_bursts() - bursts;
+    result->samples = hal_native_audio_samples() - samples;
+    return true;
+}
+
+// The cue alone, every BENCH_REMINDER_LATE_EVERY-th step late by the
+// given ms. Returns the bursts it was heard in.
+static size_t play_late(const uint32_t late, std::vector<double> *step_us)
+{
+    reminder_player_t player;
+    const size_t bursts = hal_native_audio_bursts();
+    int steps = 0;
+
+    hal_audio_init();
+    reminder_player_init(&player);
+    reminder_play(&player, hal_millis(), hal_millis());
+    for (;;)
+    {
+        hal_native_clock_advance(REMINDER_TICK + (++steps % BENCH_REMINDER_LATE_EVERY == 0 ? late : 0));
+        const uint64_t start = bench_now_ns();
+        const bool playing = reminder_step(&player, hal_millis());
+        if (step_us != NULL)
+        {
+            step_us->push_back((bench_now_ns() - start) / 1000.0);
+        }
+        if (!playing)
+        {
+            break;
+        }
+    }
+    return hal_native_audio_bursts() - bursts;
+}
+
+static void print_run(const char *label, bench_reminder_run_t *result)
+{
+    printf("%s: %u reminders, %u merged, %u cues, heard in %zu bursts, %zu samples\n",
+           label, (unsigned)result->reminders, (unsigned)result->merged, (unsigned)result->cues,
+           result->bursts, result->samples);
+    bench_report_distribution("  event to LED frame", result->led_ms, "ms");
+    bench_report_distribution("  event to chime heard", result->audio_ms, "ms");
+}
+
+int bench_reminder(int argc, char **argv)
+{
+    const char *path = argc > 0 ? argv[0] : BENCH_DEFAULT_RECORDING;
+    const uint32_t late[] = {0, 5, 10, 20, 40};
+    const int late_count = sizeof(late) / sizeof(late[0]);
+    static bench_reminder_run_t online;
+    static bench_reminder_run_t offline;
+    char root[64];
+    bool ok = true;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_REMINDER_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    printf("recording %s, feedback steps every %u ms, %u ms of chime in DMA buffers of %u ms\n",
+           path, REMINDER_TICK, reminder_cue_samples() * 1000 / HAL_AUDIO_SAMPLE_RATE,
+           HAL_AUDIO_DMA_SAMPLES * 1000 / HAL_AUDIO_SAMPLE_RATE);
+    if (!run(path, true, &online))
+    {
+        return 1;
+    }
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    if (!run(path, false, &offline))
+    {
+        return 1;
+    }
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+
+    print_run("access point up", &online);
+    print_run("access point down", &offline);
+    ok &= online.cues > 0 && online.cues == offline.cues && online.reminders == offline.reminders;
+    ok &= online.audio_ms == offline.audio_ms && online.led_ms == offline.led_ms;
+    ok &= online.bursts == online.cues && online.samples == online.cues * reminder_cue_samples();
+    ok &= online.led_ms.size() == online.cues && online.audio_ms.size() == online.cues;
+    ok &= !online.audio_ms.empty() && online.audio_ms.back() <= BENCH_REMINDER_BUDGET;
+
+    printf("\nfeedback stage late every %d steps\n", BENCH_REMINDER_LATE_EVERY);
+    std::vector<double> step_us;
+    for (int i = 0; i < late_count; i++)
+    {
+        const size_t bursts = play_late(late[i], NULL);
+        printf("  late %2u ms: chime heard in %zu burst%s\n", late[i], bursts, bursts == 1 ? "" : "s, gaps");
+        // Steps due within the DMA buffer queued ahead are in time, those
+        // later than both buffers are not.
+        ok &= REMINDER_TICK + late[i] < HAL_AUDIO_DMA_SAMPLES * 1000 / HAL_AUDIO_SAMPLE_RATE ? bursts == 1 : true;
+        ok &= REMINDER_TICK + late[i] > HAL_AUDIO_DMA_BUFFERS * HAL_AUDIO_DMA_SAMPLES * 1000 / HAL_AUDIO_SAMPLE_RATE ? bursts > 1 : true;
+    }
+    for (int i = 0; i < BENCH_REMINDER_CUES; i++)
+    {
+        play_late(0, &step_us);
+    }
+    bench_report_distribution("feedback step (host)", step_us, "us");
+
+    printf("\n%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,290 @@
+/*
+ * bench_schedule.cpp
+ *
+ * The scan schedule over a ward room at night: empty for minutes, then
+ * a badge comes in, goes to the dispenser and leaves; later two more,
+ * one of them staying on quietly. Advertisements are synthesized, every
+ * badge every 250 ms plus the random advertising delay, and received
+ * only while the radio listens. Run twice, with the detect settings
+ * around the clock and with the adaptive schedule, driving the scan,
+ * the presence table and the zones as gateway_loop() does. Reports the
+ * radio time and how long arrivals and zone changes took to be seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "presence.h"
+#include "proximity.h"
+#include "events.h"
+#include "ble_scan.h"
+#include "scan_schedule.h"
+#include "bench.h"
+
+#define BENCH_SCHEDULE_LENGTH 600000          // ms
+#define BENCH_SCHEDULE_ADVERTISING_INTERVAL 250 // ms, plus 0..10 ms advertising delay
+#define BENCH_SCHEDULE_INTERVAL 100           // ms, the detect settings
+#define BENCH_SCHEDULE_WINDOW 99
+#define BENCH_SCHEDULE_DURATION 1000          // ms between zone evaluations
+#define BENCH_SCHEDULE_BADGES 3
+#define BENCH_SCHEDULE_PATH "/tmp/hhcm-bench-schedule"
+
+typedef struct
+{
+    uint32_t time; // ms
+    int badge;
+    int rssi; // dBm, 0 once the badge left
+} bench_step_t;
+
+static const bench_step_t scenario[] = {
+    {120000, 1, -64}, // comes in
+    {150000, 1, -45}, // at the dispenser
+    {170000, 1, -62},
+    {200000, 1, 0},
+    {330000, 2, -63},
+    {335000, 3, -66},
+    {360000, 2, -46},
+    {380000, 2, -61},
+    {400000, 2, 0},
+    {560000, 3, 0}, // stayed on since 335 s
+};
+#define BENCH_SCHEDULE_STEPS (sizeof(scenario) / sizeof(scenario[0]))
+
+static uint32_t heard[BENCH_SCHEDULE_STEPS]; // first advertisement received after the step
+static uint32_t zoned[BENCH_SCHEDULE_STEPS]; // zone event for the step
+
+static void badge_address(const int badge, uint8_t *address)
+{
+    const uint8_t base[HAL_BLE_ADDRESS_LENGTH] = {0xc4, 0x4f, 0x33, 0x00, 0x00, 0x00};
+    memcpy(address, base, HAL_BLE_ADDRESS_LENGTH);
+    address[HAL_BLE_ADDRESS_LENGTH - 1] = (uint8_t)badge;
+}
+
+// The badge an address belongs to, 0 for anything else.
+static int address_badge(const uint8_t *address)
+{
+    uint8_t expected[HAL_BLE_ADDRESS_LENGTH];
+    const int badge = address[HAL_BLE_ADDRESS_LENGTH - 1];
+    badge_address(badge, expected);
+    return badge >= 1 && badge <= BENCH_SCHEDULE_BADGES && memcmp(address, expected, HAL_BLE_ADDRESS_LENGTH) == 0 ? badge : 0;
+}
+
+// The step a badge is in at the given time, -1 while it is away.
+static int current_step(const int badge, const uint32_t time)
+{
+    int current = -1;
+    for (size_t step = 0; step < BENCH_SCHEDULE_STEPS && scenario[step].time <= time; step++)
+    {
+        if (scenario[step].badge == badge)
+        {
+            current = scenario[step].rssi ? (int)step : -1;
+        }
+    }
+    return current;
+}
+
+// Writes the scenario as a recording, a phone advertising all along.
+static bool write_recording(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        return false;
+    }
+    srand(1);
+    fprintf(file, "# Synthesized by the schedule benchmark\n");
+    std::vector<uint32_t> next(BENCH_SCHEDULE_BADGES + 1);
+    for (int badge = 0; badge <= BENCH_SCHEDULE_BADGES; badge++)
+    {
+        next[badge] = rand() % BENCH_SCHEDULE_ADVERTISING_INTERVAL;
+    }
+    for (uint32_t time = 0; time < BENCH_SCHEDULE_LENGTH; time++)
+    {
+        for (int badge = 0; badge <= BENCH_SCHEDULE_BADGES; badge++)
+        {
+            if (time != next[badge])
+            {
+                continue;
+            }
+            next[badge] += BENCH_SCHEDULE_ADVERTISING_INTERVAL + rand() % 11;
+            if (badge == 0)
+            {
+                fprintf(file, "%u 4e:de:b9:60:d8:8f %d 02011a1aff4c0002152bf6c4f68942acc9e7c1f57b4fd1645400010002c5\n",
+                        time, -70 - rand() % 5);
+                continue;
+            }
+            const int step = current_step(badge, time);
+            if (step < 0)
+            {
+                continue;
+            }
+            fprintf(file, "%u c4:4f:33:00:00:%02x %d 02010609095248532d303030%02x\n",
+                    time, badge, scenario[step].rssi + rand() % 5 - 2, 0x30 + badge);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static void on_delivery(const hal_ble_advertisement_t *advertisement)
+{
+    const int badge = address_badge(advertisement->address);
+    const int step = badge ? current_step(badge, hal_millis()) : -1;
+    if (step >= 0 && heard[step] == 0)
+    {
+        heard[step] = hal_millis();
+    }
+}
+
+// A badge entering the zone of its step is what the step is waiting for.
+static void on_event(const event_t *event, void *context)
+{
+    const int badge = address_badge(event->address);
+    const int step = badge ? current_step(badge, event->time) : -1;
+    if (event->type != EVENT_ENTER || step < 0 || zoned[step] != 0)
+    {
+        return;
+    }
+    const proximity_zone_t zone = scenario[step].rssi >= PROXIMITY_NEAR_ENTER ? PROXIMITY_NEAR : PROXIMITY_IN_ROOM;
+    if (event->zone == zone)
+    {
+        zoned[step] = hal_millis();
+    }
+}
+
+static void configure(const scan_schedule_t *schedule)
+{
+    ble_scan_configure(schedule->parameters.interval, schedule->parameters.window, schedule->parameters.active);
+}
+
+// Zone pass of gateway_loop(): returns the number of zone changes and
+// whether any badge is in range.
+static int update_zones(presence_table_t *presence, const proximity_config_t *config, const uint32_t now, bool *occupied)
+{
+    size_t cursor = 0;
+    presence_entry_t *entry;
+    int changes = 0;
+
+    *occupied = false;
+    while ((entry = presence_next(presence, &cursor)) != NULL)
+    {
+        proximity_zone_t zone = PROXIMITY_AWAY;
+        uint32_t time = entry->last_seen;
+        if (now - entry->last_seen <= PRESENCE_STALE_AFTER)
+        {
+            zone = proximity_classify(config, (proximity_zone_t)entry->zone, entry->rssi_smoothed);
+            time = now;
+        }
+        changes += events_update(entry, zone, time, EVENTS_DWELL_TIME, on_event, NULL);
+        *occupied = *occupied || zone != PROXIMITY_AWAY;
+    }
+    return changes;
+}
+
+static presence_table_t presence;
+
+// Returns the radio time in us, 0 if a badge arriving or changing zone
+// was not seen.
+static uint64_t run(const char *path, const bool adaptive)
+{
+    proximity_config_t config;
+    scan_schedule_t schedule;
+    bool occupied = false;
+
+    memset(heard, 0, sizeof(heard));
+    memset(zoned, 0, sizeof(zoned));
+    hal_native_clock_set(0);
+    presence_init(&presence);
+    proximity_config_init(&config);
+    scan_schedule_init(&schedule, BENCH_SCHEDULE_INTERVAL, BENCH_SCHEDULE_WINDOW, adaptive, 0);
+    ble_scan_init(BENCH_SCHEDULE_INTERVAL, BENCH_SCHEDULE_WINDOW);
+    hal_native_ble_set_delivery_hook(on_delivery);
+    if (!hal_native_ble_load_recording(path))
+    {
+        return 0;
+    }
+    ble_scan_start("RHS", PROXIMITY_RSSI_FLOOR, NULL);
+
+    uint32_t last_zones = 0;
+    while (hal_millis() < BENCH_SCHEDULE_LENGTH)
+    {
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        const uint32_t now = hal_millis();
+        const uint32_t known = presence.count;
+        const int drained = ble_scan_drain(&presence);
+        if (scan_schedule_update(&schedule, occupied, presence.count > known || (drained > 0 && !occupied), now))
+        {
+            configure(&schedule);
+        }
+        if (now - last_zones < BENCH_SCHEDULE_DURATION)
+        {
+            continue;
+        }
+        last_zones = now;
+        if (scan_schedule_update(&schedule, occupied, update_zones(&presence, &config, now, &occupied) > 0, now))
+        {
+            configure(&schedule);
+        }
+        presence_expire(&presence, now, PRESENCE_STALE_AFTER + BENCH_SCHEDULE_DURATION);
+    }
+    ble_scan_stop();
+    hal_native_ble_set_delivery_hook(NULL);
+
+    printf("%s\n", adaptive ? "adaptive schedule" : "detect settings around the clock");
+    printf("  radio time                 %.1f%% scanning, %.1f%% actively, %u mode switches\n",
+           schedule.scan_us / 10.0 / BENCH_SCHEDULE_LENGTH, schedule.active_us / 10.0 / BENCH_SCHEDULE_LENGTH,
+           schedule.switches);
+
+    std::vector<double> arrivals;
+    std::vector<double> zones;
+    size_t missed = 0;
+    for (size_t step = 0; step < BENCH_SCHEDULE_STEPS; step++)
+    {
+        if (scenario[step].rssi == 0)
+        {
+            continue;
+        }
+        if (current_step(scenario[step].badge, scenario[step].time - 1) < 0 && heard[step])
+        {
+            arrivals.push_back((heard[step] - scenario[step].time) / 1000.0);
+        }
+        if (zoned[step])
+        {
+            zones.push_back((zoned[step] - scenario[step].time) / 1000.0);
+        }
+        missed += zoned[step] == 0;
+    }
+    bench_report_distribution("  arrival first heard", arrivals, "s");
+    bench_report_distribution("  zone entered", zones, "s");
+    if (missed)
+    {
+        printf("  %zu arrivals or zone changes not seen\n", missed);
+    }
+    return missed ? 0 : schedule.scan_us;
+}
+
+int bench_schedule(int argc, char **argv)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s-%d.scan", BENCH_SCHEDULE_PATH, (int)getpid());
+    if (!write_recording(path))
+    {
+        return 1;
+    }
+
+    const uint64_t fixed = run(path, false);
+    const uint64_t adaptive = run(path, true);
+    unlink(path);
+
+    const bool failed = fixed == 0 || adaptive == 0 || adaptive >= fixed;
+    if (!failed)
+    {
+        printf("radio time saved             %.1f%%\n", 100.0 - adaptive * 100.0 / fixed);
+    }
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * bench_store.cpp
+ *
+ * Store-and-forward log against the file-backed SD card: the time per
+ * append and per replayed record, offline, after a restart that tore
+ * the last record, and with the card full and the oldest segments
+ * evicted. What is replayed, and in which order, is checked by the unit
+ * tests (test/test_store).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_STORE_RECORDS 2000
+#define BENCH_STORE_ROOT "/tmp/hhcm-bench-store"
+
+static store_t store;
+static uint8_t payload[STORE_RECORD_MAX];
+
+// Payload of record number seq: the number, then bytes derived from it,
+// 64 to 1535 bytes long.
+static size_t fill_payload(const uint32_t seq)
+{
+    const size_t length = 64 + (seq * 7919) % 1472;
+    memcpy(payload, &seq, sizeof(seq));
+    for (size_t i = sizeof(seq); i < length; i++)
+    {
+        payload[i] = (uint8_t)(seq + i);
+    }
+    return length;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void count_file(const char *name, void *context)
+{
+    (*(int *)context)++;
+}
+
+static int segments()
+{
+    int count = 0;
+    hal_storage_list(STORE_DIRECTORY, count_file, &count);
+    return count;
+}
+
+// Appends the records first to end - 1, returns the mean time per append.
+static double append_records(const uint32_t first, const uint32_t end)
+{
+    const uint64_t start = bench_now_ns();
+    for (uint32_t seq = first; seq < end; seq++)
+    {
+        const size_t length = fill_payload(seq);
+        store_append(&store, STORE_KIND_EVENTS, payload, length);
+    }
+    return (bench_now_ns() - start) / 1000.0 / (end - first);
+}
+
+// Replays everything pending; first and last get the sequence numbers
+// seen, count the records. Returns the mean time per record.
+static double replay_records(uint32_t *first, uint32_t *last, uint32_t *count)
+{
+    uint8_t data[STORE_RECORD_MAX];
+    uint8_t kind;
+    size_t length;
+    *count = 0;
+
+    const uint64_t start = bench_now_ns();
+    while ((length = store_peek(&store, &kind, data, sizeof(data))) > 0)
+    {
+        uint32_t seq;
+        memcpy(&seq, data, sizeof(seq));
+        if (*count == 0)
+        {
+            *first = seq;
+        }
+        *last = seq;
+        (*count)++;
+        store_advance(&store, length);
+    }
+    return *count ? (bench_now_ns() - start) / 1000.0 / *count : 0;
+}
+
+int bench_store(int argc, char **argv)
+{
+    const uint32_t count = argc > 0 ? atoi(argv[0]) : BENCH_STORE_RECORDS;
+    char root[64];
+    uint32_t first = 0, last = 0, replayed = 0;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_STORE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_storage_set_capacity(HAL_NATIVE_STORAGE_CAPACITY);
+    hal_storage_init(STORE_DIRECTORY);
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+
+    // Offline: everything goes to the log, then the power fails halfway
+    // through writing a record.
+    store_init(&store);
+    double append = append_records(0, count);
+    printf("offline appends          %lu records, %d segments, %.1f us per append\n",
+           (unsigned long)store.appended, segments(), append);
+
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%08lu.seg", STORE_DIRECTORY, (unsigned long)store.last);
+    const size_t length = fill_payload(count);
+    const uint8_t header[STORE_HEADER_SIZE] = {0xa5, STORE_KIND_EVENTS, (uint8_t)length, (uint8_t)(length >> 8), 1, 2, 3, 4};
+    hal_storage_append(path, header, sizeof(header));
+    hal_storage_append(path, payload, length / 2);
+
+    // After the restart the records before the torn one and those
+    // appended since are replayed, the torn one is skipped.
+    store_init(&store);
+    append_records(count + 1, count + 1 + count / 4);
+    double replay = replay_records(&first, &last, &replayed);
+    printf("replay after restart     %lu records, %lu to %lu, %lu corrupt, %d segments left, %.1f us per record\n",
+           (unsigned long)replayed, (unsigned long)first, (unsigned long)last,
+           (unsigned long)store.corrupt, segments(), replay);
+
+    // A card that holds about eight segments: the oldest go, the newest
+    // are replayed.
+    hal_native_storage_set_capacity(8 * STORE_SEGMENT_SIZE);
+    store_init(&store);
+    append = append_records(0, count * 2);
+    const int full = segments();
+    const uint32_t evicted = store.evicted;
+    replay = replay_records(&first, &last, &replayed);
+    printf("card full                %lu records appended, %lu segments evicted, %lu replayed (%lu to %lu), %d segments at most\n",
+           (unsigned long)store.appended, (unsigned long)evicted, (unsigned long)replayed,
+           (unsigned long)first, (unsigned long)last, full);
+    printf("                         %.1f us per append, %.1f us per record replayed\n", append, replay);
+
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    return 0;
+}
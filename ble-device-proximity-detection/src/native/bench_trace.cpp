@@ -0,0 +1,314 @@
+/*
+ * bench_trace.cpp
+ *
+ * The trace log (trace.h): what a trace of a badge seen costs the scan
+ * against formatting the line as the serial prints did, and the serial
+ * time of either; records of every argument type decoded back to the
+ * expected text; a burst overflowing the ring; producers on several
+ * threads with the drain running, every record accounted for and in
+ * order. Also the host side decoder for captures from the gateway.
+ *
+ * Records are written with trace_write(), past the TRACE_LEVEL filter
+ * of DEBUG_TRACE(): the badge seen is a debug message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "trace.h"
+#include "trace_decode.h"
+#include "bench.h"
+
+#define BENCH_TRACE_RECORDS 1000000
+#define BENCH_TRACE_DRAIN_EVERY 64 // records, keeps the ring from overflowing
+#define BENCH_TRACE_BAUD 115200    // 10 bits per byte on the wire
+#define BENCH_TRACE_BURST 1000
+#define BENCH_TRACE_PRODUCERS 3
+#define BENCH_TRACE_PER_PRODUCER 200000
+
+static const uint8_t badge[HAL_BLE_ADDRESS_LENGTH] = {0xc4, 0x4f, 0x33, 0x0a, 0x91, 0x7e};
+
+static size_t sunk_bytes = 0;
+
+static void count_bytes(const uint8_t *data, size_t length, void *context)
+{
+    sunk_bytes += length;
+}
+
+static void decode_into(const uint8_t *data, size_t length, void *context)
+{
+    trace_decoder_feed((trace_decoder_t *)context, data, length);
+}
+
+static void collect_line(const char *line, void *context)
+{
+    ((std::vector<std::string> *)context)->push_back(line);
+}
+
+// The message of a rendered line, after its time and level.
+static std::string message(const std::string &line)
+{
+    const size_t space = line.find(' ');
+    return space == std::string::npos || space + 3 > line.size() ? line : line.substr(space + 3);
+}
+
+static int check_round_trip()
+{
+    const std::string topic = "$aws/things/0123c0ffee2b94a1ee/shadow/update";
+    const std::string long_topic(100, 't');
+    const char *expected[] = {
+        "TRACE: Started, %u formats",
+        "APP: Found BLE device with matching name and appropriate RSSI: c4:4f:33:0a:91:7e RSSI = -67",
+        "MQTT: Publishing 1234 bytes to '$aws/things/0123c0ffee2b94a1ee/shadow/update'",
+        "STORE: 3 segment(s) to replay, newest holds 250 records and a torn tail.",
+        "PIPELINE: scan mode steady, 7 switches, scanning 58% of the time, 0% actively",
+        "PIPELINE: clock synced, 24 syncs, 1 steps, last error -7 ms, drift -42 ppm",
+        "BLE: Configure BLE scanning, 100/99 ms, active 1",
+    };
+    char started[64];
+    snprintf(started, sizeof(started), expected[0], (unsigned)TRACE_FORMAT_COUNT);
+    expected[0] = started;
+
+    trace_init();
+    trace_write(TRACE_BLE_DEVICE_FOUND, trace_address(badge), -67);
+    trace_write(TRACE_MQTT_PUBLISHING, (size_t)1234, topic.c_str());
+    trace_write(TRACE_STORE_RECOVERED, 3u, 250u, " and a torn tail.");
+    trace_write(TRACE_PIPELINE_SCAN_MODE, "steady", 7u, (unsigned)58, (unsigned)0);
+    trace_write(TRACE_PIPELINE_CLOCK, "synced", 24u, 1u, -7, -42);
+    trace_write(TRACE_BLE_CONFIGURE, 100, 99, true);
+    trace_write(TRACE_MQTT_SUBSCRIBED, long_topic.c_str());
+    trace_write(TRACE_PIPELINE_TRACE, 5000000000ULL, 0u, 1u);
+
+    std::vector<std::string> lines;
+    trace_decoder_t decoder;
+    trace_decoder_init(&decoder, collect_line, &lines);
+    const uint8_t text[] = "APP: Initializing ...\r\n";
+    trace_decoder_feed(&decoder, text, sizeof(text) - 1);
+    trace_drain(decode_into, &decoder, TRACE_RING_SLOTS);
+    trace_decoder_finish(&decoder);
+
+    int failures = 0;
+    const size_t count = sizeof(expected) / sizeof(expected[0]);
+    failures += lines.size() != count + 3 || lines[0] != "APP: Initializing ...";
+    for (size_t i = 0; i < count && i + 1 < lines.size(); i++)
+    {
+        failures += message(lines[i + 1]) != expected[i];
+    }
+    // A topic cut to the record, a 64 bit value.
+    failures += lines.size() < count + 3 ||
+                lines[count + 1].find("[truncated]") == std::string::npos ||
+                lines[count + 2].find("trace 5000000000 written") == std::string::npos;
+    printf("round trip                   %zu records decoded, %zu corrupt%s\n",
+           decoder.frames, decoder.corrupt, failures ? " (FAILED)" : "");
+    for (size_t i = 0; failures && i < lines.size(); i++)
+    {
+        printf("  %s\n", lines[i].c_str());
+    }
+    return failures ? 1 : 0;
+}
+
+// A badge seen: traced, or formatted as text for the serial port.
+static int measure_cost()
+{
+    trace_init();
+    trace_drain(count_bytes, NULL, TRACE_RING_SLOTS);
+    sunk_bytes = 0;
+    uint64_t drain_ns = 0;
+    const uint64_t start = bench_now_ns();
+    for (int record = 0; record < BENCH_TRACE_RECORDS; record++)
+    {
+        trace_write(TRACE_BLE_DEVICE_FOUND, trace_address(badge), -60 - record % 20);
+        if (record % BENCH_TRACE_DRAIN_EVERY == BENCH_TRACE_DRAIN_EVERY - 1)
+        {
+            const uint64_t drain = bench_now_ns();
+            trace_drain(count_bytes, NULL, BENCH_TRACE_DRAIN_EVERY);
+            drain_ns += bench_now_ns() - drain;
+        }
+    }
+    const double trace_ns = (double)(bench_now_ns() - start - drain_ns) / BENCH_TRACE_RECORDS;
+    const double frame_bytes = (double)sunk_bytes / BENCH_TRACE_RECORDS;
+
+    char line[160];
+    size_t text_bytes = 0;
+    const uint64_t format_start = bench_now_ns();
+    for (int record = 0; record < BENCH_TRACE_RECORDS; record++)
+    {
+        char id[18];
+        snprintf(id, sizeof(id), "%02x:%02x:%02x:%02x:%02x:%02x", badge[0], badge[1], badge[2], badge[3], badge[4], (uint8_t)record);
+        text_bytes += snprintf(line, sizeof(line), "APP: Found BLE device with matching name and appropriate RSSI: %s RSSI = %d\r\n",
+                               id, -60 - record % 20);
+    }
+    const double format_ns = (double)(bench_now_ns() - format_start) / BENCH_TRACE_RECORDS;
+    const double line_bytes = (double)text_bytes / BENCH_TRACE_RECORDS;
+
+    printf("badge seen, in the scan      trace %.1f ns, formatting the line %.1f ns\n", trace_ns, format_ns);
+    printf("  drained                    %.1f ns per record\n", (double)drain_ns / BENCH_TRACE_RECORDS);
+    printf("  on the serial port         frame %.1f bytes, %.2f ms; line %.1f bytes, %.2f ms at %d baud\n",
+           frame_bytes, frame_bytes * 10000 / BENCH_TRACE_BAUD, line_bytes, line_bytes * 10000 / BENCH_TRACE_BAUD, BENCH_TRACE_BAUD);
+    return trace_ns < format_ns ? 0 : 1;
+}
+
+// More records than the ring holds before the drain runs.
+static int check_burst()
+{
+    trace_init();
+    for (int record = 0; record < BENCH_TRACE_BURST; record++)
+    {
+        trace_write(TRACE_BLE_SCAN_RETURNED, record);
+    }
+
+    std::vector<std::string> lines;
+    trace_decoder_t decoder;
+    trace_decoder_init(&decoder, collect_line, &lines);
+    while (trace_drain(decode_into, &decoder, TRACE_DRAIN_BUDGET) > 0)
+    {
+    }
+    trace_decoder_finish(&decoder);
+
+    trace_statistics_t statistics;
+    trace_get_statistics(&statistics);
+    char dropped[96];
+    snprintf(dropped, sizeof(dropped), "TRACE: WARNING - %u records dropped, ring full", statistics.dropped);
+    const bool ok = lines.size() == TRACE_RING_SLOTS + 1 &&
+                    statistics.dropped == BENCH_TRACE_BURST + 1 - TRACE_RING_SLOTS &&
+                    message(lines.back()) == dropped;
+    printf("burst of %d                %u queued, %u dropped and reported%s\n",
+           BENCH_TRACE_BURST, statistics.written, statistics.dropped, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+typedef struct
+{
+    std::vector<uint32_t> next; // sequence expected per producer
+    size_t received;
+    size_t reordered;
+    size_t lost_reported;
+} bench_trace_check_t;
+
+// Reads producer and sequence straight off the frame.
+static void check_frame(const uint8_t *frame, size_t length, void *context)
+{
+    bench_trace_check_t *check = (bench_trace_check_t *)context;
+    const uint16_t id = (uint16_t)(frame[2] | frame[3] << 8);
+    uint32_t first;
+    uint32_t second;
+    memcpy(&first, &frame[TRACE_FRAME_HEADER + 1], sizeof(first));
+    if (id == TRACE_DROPPED)
+    {
+        check->lost_reported += first;
+        return;
+    }
+    if (id != TRACE_PIPELINE_SCAN)
+    {
+        return;
+    }
+    memcpy(&second, &frame[TRACE_FRAME_HEADER + 6], sizeof(second));
+    check->received++;
+    if (first >= check->next.size() || second < check->next[first])
+    {
+        check->reordered++;
+        return;
+    }
+    check->next[first] = second + 1;
+}
+
+static void produce(const unsigned producer)
+{
+    for (unsigned sequence = 0; sequence < BENCH_TRACE_PER_PRODUCER; sequence++)
+    {
+        trace_write(TRACE_PIPELINE_SCAN, producer, sequence, 0u, 0u);
+        std::this_thread::yield();
+    }
+}
+
+static int check_producers()
+{
+    bench_trace_check_t check;
+    check.next.assign(BENCH_TRACE_PRODUCERS, 0);
+    check.received = 0;
+    check.reordered = 0;
+    check.lost_reported = 0;
+
+    trace_init();
+    trace_drain(count_bytes, NULL, TRACE_RING_SLOTS);
+    std::vector<std::thread> producers;
+    for (unsigned producer = 0; producer < BENCH_TRACE_PRODUCERS; producer++)
+    {
+        producers.push_back(std::thread(produce, producer));
+    }
+    // Every record is either received or, once the ring ran empty,
+    // reported dropped.
+    const size_t total = BENCH_TRACE_PRODUCERS * BENCH_TRACE_PER_PRODUCER;
+    while (check.received + check.lost_reported < total)
+    {
+        if (trace_drain(check_frame, &check, TRACE_DRAIN_BUDGET) == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    for (size_t producer = 0; producer < producers.size(); producer++)
+    {
+        producers[producer].join();
+    }
+
+    trace_statistics_t statistics;
+    trace_get_statistics(&statistics);
+    const bool ok = check.reordered == 0 && check.lost_reported == statistics.dropped &&
+                    check.received + statistics.dropped == total;
+    printf("%d producers, one drain       %zu received, %u dropped and reported, %zu out of order%s\n",
+           BENCH_TRACE_PRODUCERS, check.received, statistics.dropped, check.reordered, ok ? "" : " (FAILED)");
+    return ok ? 0 : 1;
+}
+
+int bench_trace(int argc, char **argv)
+{
+    int failures = 0;
+    failures += check_round_trip();
+    failures += measure_cost();
+    failures += check_burst();
+    failures += check_producers();
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+static void print_line(const char *line, void *context)
+{
+    printf("%s\n", line);
+}
+
+// Renders a capture of the serial port, "-" for standard input.
+int bench_decode(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        fprintf(stderr, "decode: no capture given\n");
+        return 1;
+    }
+    FILE *file = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "rb");
+    if (!file)
+    {
+        fprintf(stderr, "decode: cannot open %s\n", argv[0]);
+        return 1;
+    }
+
+    trace_decoder_t decoder;
+    uint8_t buffer[4096];
+    size_t length;
+    trace_decoder_init(&decoder, print_line, NULL);
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        trace_decoder_feed(&decoder, buffer, length);
+    }
+    trace_decoder_finish(&decoder);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    fprintf(stderr, "decode: %zu records, %zu corrupt frames\n", decoder.frames, decoder.corrupt);
+    return 0;
+}
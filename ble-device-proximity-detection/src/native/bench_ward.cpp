@@ -0,0 +1,655 @@
+/*
+ * bench_ward.cpp
+ *
+ * A ward at scale, synthesized: rooms on both sides of a corridor, two
+ * beds and a dispenser by the door in each, the gateway at the
+ * dispenser of one room. Staff walk from room to room, using the
+ * dispenser on the way in and out, carrying badges and phones; visitors
+ * sit at a bed with their phones; patients wear wristbands and infusion
+ * pumps stand by the beds. Every device advertises at its own interval
+ * plus the random advertising delay. What the gateway hears follows a
+ * log-distance path loss with wall attenuation, a slowly changing body
+ * shadowing per device and noise per advertisement; advertisements
+ * below the radio's sensitivity or colliding on air with a stronger one
+ * are not heard. The workload is written as a recording (see
+ * bench/README.md) that can be replayed with the other commands.
+ *
+ * The gateway runs the workload for ward sizes of 10 to 1000 devices.
+ * Reports throughput, the high water of every queue and table, what was
+ * dropped where, and the message bytes per minute by topic.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <queue>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+#include "connection.h"
+#include "gateway.h"
+#include "ble_ring.h"
+#include "ble_scan.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "presence.h"
+#include "store.h"
+#include "bench.h"
+
+#define BENCH_WARD_LENGTH 180000        // ms
+#define BENCH_WARD_LOSSLESS 100         // devices, the most that must not lose a detection
+#define BENCH_WARD_COLUMNS 8            // rooms on each side of the corridor
+#define BENCH_WARD_ROOM_WIDTH 6.0       // m
+#define BENCH_WARD_ROOM_DEPTH 6.0       // m
+#define BENCH_WARD_CORRIDOR 3.0         // m
+#define BENCH_WARD_GATEWAY_ROOM 3       // on the north side, the gateway at its dispenser
+#define BENCH_WARD_TX_POWER -59         // dBm at 1 m
+#define BENCH_WARD_PATH_LOSS 2.2        // exponent, indoors with people about
+#define BENCH_WARD_WALL_LOSS 6.0        // dB per wall
+#define BENCH_WARD_SHADOWING 3.0        // dB, per device, changes as its wearer turns
+#define BENCH_WARD_NOISE 2.0            // dB, per advertisement
+#define BENCH_WARD_SENSITIVITY -97      // dBm
+#define BENCH_WARD_PDU_US 376           // an advertising PDU with 31 bytes of data at 1 Mbit/s
+#define BENCH_WARD_CAPTURE 6            // dB a PDU has to be stronger to survive a collision
+#define BENCH_WARD_WALK_SPEED 1.2       // m/s
+#define BENCH_WARD_ROOT "/tmp/hhcm-bench-ward"
+
+typedef enum
+{
+    DEVICE_BADGE = 0, // staff, "RHS-" name
+    DEVICE_PHONE,     // of staff or visitors, Apple manufacturer data
+    DEVICE_WRISTBAND, // patients, iBeacon
+    DEVICE_PUMP,      // infusion pumps by the beds, "PUMP-" name
+    DEVICE_KINDS
+} device_kind_t;
+
+typedef struct
+{
+    double x;
+    double y;
+} point_t;
+
+typedef struct
+{
+    device_kind_t kind;
+    bool visitor;         // sits at a bed instead of making rounds
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    char payload[2 * HAL_BLE_PAYLOAD_MAX_LENGTH + 1];
+    uint32_t interval_us; // advertising interval, without the delay
+    double shadowing;     // dB
+    // Current leg: walks from one point to the next, then stays there.
+    point_t from;
+    point_t to;
+    uint64_t depart_us;
+    uint64_t arrive_us;
+    uint64_t leave_us;
+    int room;
+    int stop; // of the round through the room
+} device_t;
+
+typedef struct
+{
+    uint64_t time_us;
+    size_t device;
+    int rssi;
+} transmission_t;
+
+struct later_first
+{
+    bool operator()(const transmission_t &a, const transmission_t &b) const
+    {
+        return a.time_us > b.time_us;
+    }
+};
+
+typedef struct
+{
+    size_t devices;
+    size_t badges;
+    size_t sent;         // advertisements on air
+    size_t out_of_range; // below the sensitivity
+    size_t collided;
+} workload_t;
+
+typedef struct
+{
+    size_t devices;
+    double offered;   // advertisements written, per second
+    double matched;   // per second
+    double cpu_rate;  // advertisements per second of host CPU
+    uint32_t presence;
+    uint32_t ring;
+    uint32_t outbox;
+    uint32_t dropped;
+    double bytes;     // per minute
+} ward_result_t;
+
+// Ten devices of every twenty are badges and phones of staff, then
+// visitors' phones, wristbands and pumps; spread so that small wards
+// get a bit of everything.
+static const device_kind_t device_mix[] = {
+    DEVICE_BADGE, DEVICE_PHONE, DEVICE_BADGE, DEVICE_WRISTBAND, DEVICE_PHONE,
+    DEVICE_BADGE, DEVICE_PUMP, DEVICE_PHONE, DEVICE_BADGE, DEVICE_PHONE,
+    DEVICE_BADGE, DEVICE_WRISTBAND, DEVICE_PHONE, DEVICE_BADGE, DEVICE_PUMP,
+    DEVICE_PHONE, DEVICE_WRISTBAND, DEVICE_PHONE, DEVICE_PUMP, DEVICE_PUMP};
+#define BENCH_WARD_MIX (sizeof(device_mix) / sizeof(device_mix[0]))
+
+static const size_t ward_sizes[] = {10, 100, 500, 1000};
+#define BENCH_WARD_SIZES (sizeof(ward_sizes) / sizeof(ward_sizes[0]))
+
+static std::vector<device_t> devices;
+
+static char topic_events[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_telemetry[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_metrics[GATEWAY_MQTT_TOPIC_SIZE];
+static char topic_update[GATEWAY_MQTT_TOPIC_SIZE];
+static size_t bytes_events = 0;
+static size_t bytes_telemetry = 0;
+static size_t bytes_shadow = 0;
+static size_t bytes_metrics = 0;
+
+static double uniform()
+{
+    return (rand() + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+// Box-Muller, one of the pair.
+static double gaussian(const double sigma)
+{
+    return sigma * sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+static uint32_t between(const uint32_t low, const uint32_t high)
+{
+    return low + (uint32_t)rand() % (high - low + 1);
+}
+
+static int room_count()
+{
+    return 2 * BENCH_WARD_COLUMNS;
+}
+
+// Rooms 0.. on the north side of the corridor, the rest on the south.
+static double room_center(const int room)
+{
+    return (room % BENCH_WARD_COLUMNS + 0.5) * BENCH_WARD_ROOM_WIDTH;
+}
+
+static bool north(const int room)
+{
+    return room < BENCH_WARD_COLUMNS;
+}
+
+static point_t corridor(const int room)
+{
+    const point_t point = {room_center(room), BENCH_WARD_CORRIDOR / 2};
+    return point;
+}
+
+static point_t dispenser(const int room)
+{
+    const point_t point = {room_center(room), north(room) ? BENCH_WARD_CORRIDOR + 0.5 : -0.5};
+    return point;
+}
+
+static point_t bed(const int room, const int bed)
+{
+    const double y = BENCH_WARD_ROOM_DEPTH - 1.5;
+    const point_t point = {room_center(room) + (bed ? 1.5 : -1.5), north(room) ? BENCH_WARD_CORRIDOR + y : -y};
+    return point;
+}
+
+// Walls the straight line between a and b passes through: the corridor
+// walls, doors aside, and the walls between the rooms on either side.
+static int walls_between(const point_t a, const point_t b)
+{
+    int walls = 0;
+    const double lines[] = {0.0, BENCH_WARD_CORRIDOR};
+    for (size_t i = 0; i < 2; i++)
+    {
+        walls += (a.y < lines[i]) != (b.y < lines[i]);
+    }
+    for (int column = 1; column < BENCH_WARD_COLUMNS; column++)
+    {
+        const double x = column * BENCH_WARD_ROOM_WIDTH;
+        if ((a.x < x) == (b.x < x))
+        {
+            continue;
+        }
+        const double y = a.y + (b.y - a.y) * (x - a.x) / (b.x - a.x);
+        walls += y < 0.0 || y > BENCH_WARD_CORRIDOR;
+    }
+    return walls;
+}
+
+static point_t position(const device_t *device, const uint64_t time_us)
+{
+    if (time_us >= device->arrive_us)
+    {
+        return device->to;
+    }
+    const double progress = (double)(time_us - device->depart_us) / (device->arrive_us - device->depart_us);
+    const point_t point = {device->from.x + (device->to.x - device->from.x) * progress,
+                           device->from.y + (device->to.y - device->from.y) * progress};
+    return point;
+}
+
+// Sets off from where the device is to the point, staying there for
+// the dwell time once arrived.
+static void walk(device_t *device, const uint64_t time_us, const point_t to, const uint32_t dwell_ms)
+{
+    const double distance = hypot(to.x - device->to.x, to.y - device->to.y);
+    device->from = device->to;
+    device->to = to;
+    device->depart_us = time_us;
+    device->arrive_us = time_us + (uint64_t)(distance / BENCH_WARD_WALK_SPEED * 1e6);
+    device->leave_us = device->arrive_us + dwell_ms * 1000ULL;
+}
+
+// The next stop of a round: staff go in past the dispenser to a bed and
+// out past it again, visitors sit at a bed for a long while.
+static void next_stop(device_t *device, const uint64_t time_us)
+{
+    if (device->kind == DEVICE_WRISTBAND || device->kind == DEVICE_PUMP)
+    {
+        device->leave_us = UINT64_MAX;
+        return;
+    }
+    device->stop = (device->stop + 1) % (device->visitor ? 2 : 4);
+    switch (device->stop)
+    {
+    case 0:
+        device->room = rand() % room_count();
+        walk(device, time_us, corridor(device->room), between(0, 2000));
+        break;
+    case 1:
+        if (device->visitor)
+        {
+            walk(device, time_us, bed(device->room, rand() % 2), between(300000, 900000));
+        }
+        else
+        {
+            walk(device, time_us, dispenser(device->room), between(4000, 8000));
+        }
+        break;
+    case 2:
+        walk(device, time_us, bed(device->room, rand() % 2), between(20000, 120000));
+        break;
+    default:
+        walk(device, time_us, dispenser(device->room), between(4000, 8000));
+        break;
+    }
+}
+
+static void hex(char *text, const uint8_t *bytes, const size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        sprintf(&text[2 * i], "%02x", bytes[i]);
+    }
+}
+
+// Advertising data of each kind, as the devices in the recordings send it.
+static void make_payload(device_t *device, const size_t index)
+{
+    char name[16];
+    uint8_t data[HAL_BLE_PAYLOAD_MAX_LENGTH];
+    size_t length = 0;
+
+    switch (device->kind)
+    {
+    case DEVICE_BADGE:
+    case DEVICE_PUMP:
+    {
+        snprintf(name, sizeof(name), device->kind == DEVICE_BADGE ? "RHS-%04u" : "PUMP-%05u", (unsigned)index);
+        const size_t name_length = strlen(name);
+        const uint8_t flags[] = {0x02, 0x01, 0x06, (uint8_t)(name_length + 1), 0x09};
+        memcpy(data, flags, sizeof(flags));
+        memcpy(&data[sizeof(flags)], name, name_length);
+        length = sizeof(flags) + name_length;
+        break;
+    }
+    case DEVICE_PHONE:
+    {
+        const uint8_t nearby[] = {0x02, 0x01, 0x1a, 0x0a, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x03, 0x1c,
+                                  (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand()};
+        memcpy(data, nearby, sizeof(nearby));
+        length = sizeof(nearby);
+        break;
+    }
+    default:
+    {
+        const uint8_t beacon[] = {0x02, 0x01, 0x1a, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+                                  0x2b, 0xf6, 0xc4, 0xf6, 0x89, 0x42, 0xac, 0xc9, 0xe7, 0xc1, 0xf5, 0x7b, 0x4f, 0xd1, 0x64, 0x54,
+                                  0x00, 0x01, (uint8_t)(index >> 8), (uint8_t)index, 0xc5};
+        memcpy(data, beacon, sizeof(beacon));
+        length = sizeof(beacon);
+        break;
+    }
+    }
+    hex(device->payload, data, length);
+}
+
+// Public addresses for badges and pumps, random ones for the rest.
+static void make_address(device_t *device, const size_t index)
+{
+    static const uint8_t prefixes[DEVICE_KINDS][2] = {{0xc4, 0x4f}, {0x4e, 0xde}, {0xe7, 0x52}, {0x00, 0x1a}};
+    device->address[0] = prefixes[device->kind][0];
+    device->address[1] = prefixes[device->kind][1];
+    device->address[2] = (uint8_t)rand();
+    device->address[3] = (uint8_t)rand();
+    device->address[4] = (uint8_t)(index >> 8);
+    device->address[5] = (uint8_t)index;
+}
+
+// Devices start anywhere in their round, the stationary ones at a bed.
+static size_t create_devices(const size_t count)
+{
+    size_t badges = 0;
+    devices.assign(count, device_t());
+    for (size_t i = 0; i < count; i++)
+    {
+        device_t *device = &devices[i];
+        device->kind = device_mix[i % BENCH_WARD_MIX];
+        device->visitor = device->kind == DEVICE_PHONE && rand() % 2;
+        make_address(device, i);
+        make_payload(device, i);
+        badges += device->kind == DEVICE_BADGE;
+
+        static const uint32_t intervals_ms[DEVICE_KINDS] = {250, 0, 500, 1000};
+        device->interval_us = (intervals_ms[device->kind] ? intervals_ms[device->kind] : between(150, 1000)) * 1000;
+        device->shadowing = gaussian(BENCH_WARD_SHADOWING);
+
+        device->room = rand() % room_count();
+        device->to = bed(device->room, rand() % 2);
+        device->stop = device->visitor ? 0 : rand() % 4;
+        if (device->kind == DEVICE_WRISTBAND || device->kind == DEVICE_PUMP)
+        {
+            device->from = device->to;
+            device->leave_us = UINT64_MAX;
+            continue;
+        }
+        next_stop(device, 0);
+        device->leave_us = device->arrive_us + (uint64_t)(uniform() * (device->leave_us - device->arrive_us));
+    }
+    return badges;
+}
+
+// What the gateway hears of a transmission from the device, in dBm.
+// The shadowing drifts: the wearer turns, someone steps in between.
+static int received_rssi(device_t *device, const uint64_t time_us)
+{
+    const point_t gateway = dispenser(BENCH_WARD_GATEWAY_ROOM);
+    const point_t at = position(device, time_us);
+    const double distance = hypot(at.x - gateway.x, at.y - gateway.y);
+    device->shadowing = 0.95 * device->shadowing + gaussian(BENCH_WARD_SHADOWING * 0.31);
+    const double rssi = BENCH_WARD_TX_POWER - 10.0 * BENCH_WARD_PATH_LOSS * log10(distance > 0.5 ? distance : 0.5) -
+                        BENCH_WARD_WALL_LOSS * walls_between(at, gateway) + device->shadowing + gaussian(BENCH_WARD_NOISE);
+    return (int)lround(rssi);
+}
+
+static void write_transmission(FILE *file, const transmission_t *transmission)
+{
+    const device_t *device = &devices[transmission->device];
+    const uint8_t *a = device->address;
+    fprintf(file, "%u %02x:%02x:%02x:%02x:%02x:%02x %d %s\n", (uint32_t)(transmission->time_us / 1000),
+            a[0], a[1], a[2], a[3], a[4], a[5], transmission->rssi, device->payload);
+}
+
+// Transmissions that overlapped on air are lost unless one was
+// BENCH_WARD_CAPTURE dB stronger than every other, that one is heard.
+static void clear_air(FILE *file, std::vector<transmission_t> &on_air, workload_t *workload)
+{
+    if (on_air.empty())
+    {
+        return;
+    }
+    size_t strongest = 0;
+    for (size_t i = 1; i < on_air.size(); i++)
+    {
+        strongest = on_air[i].rssi > on_air[strongest].rssi ? i : strongest;
+    }
+    bool captured = true;
+    for (size_t i = 0; i < on_air.size(); i++)
+    {
+        captured = captured && (i == strongest || on_air[strongest].rssi - on_air[i].rssi >= BENCH_WARD_CAPTURE);
+    }
+    if (captured)
+    {
+        write_transmission(file, &on_air[strongest]);
+    }
+    workload->collided += on_air.size() - captured;
+    on_air.clear();
+}
+
+// Writes the ward as a recording, in the order the transmissions are
+// heard.
+static bool write_workload(const char *path, const size_t count, workload_t *workload)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "ward: cannot write %s\n", path);
+        return false;
+    }
+
+    srand((unsigned)count);
+    memset(workload, 0, sizeof(*workload));
+    workload->devices = count;
+    workload->badges = create_devices(count);
+    fprintf(file, "# Synthesized ward: %zu devices, %zu of them badges, %u s\n", count, workload->badges, BENCH_WARD_LENGTH / 1000);
+    fprintf(file, "# <time ms> <address> <rssi dBm> <advertising data hex | ->\n");
+
+    std::priority_queue<transmission_t, std::vector<transmission_t>, later_first> queue;
+    for (size_t i = 0; i < count; i++)
+    {
+        const transmission_t first = {(uint64_t)between(0, devices[i].interval_us), i, 0};
+        queue.push(first);
+    }
+
+    // Transmissions overlapping the ones before, until the air is clear.
+    std::vector<transmission_t> on_air;
+    uint64_t air_until = 0;
+    while (!queue.empty())
+    {
+        transmission_t transmission = queue.top();
+        queue.pop();
+        if (transmission.time_us >= BENCH_WARD_LENGTH * 1000ULL)
+        {
+            continue;
+        }
+        device_t *device = &devices[transmission.device];
+        while (transmission.time_us >= device->leave_us)
+        {
+            next_stop(device, device->leave_us);
+        }
+        const transmission_t next = {transmission.time_us + device->interval_us + between(0, 10000), transmission.device, 0};
+        queue.push(next);
+
+        workload->sent++;
+        transmission.rssi = received_rssi(device, transmission.time_us);
+        if (transmission.time_us >= air_until)
+        {
+            clear_air(file, on_air, workload);
+        }
+        if (transmission.rssi < BENCH_WARD_SENSITIVITY)
+        {
+            workload->out_of_range++;
+            continue;
+        }
+        on_air.push_back(transmission);
+        air_until = transmission.time_us + BENCH_WARD_PDU_US > air_until ? transmission.time_us + BENCH_WARD_PDU_US : air_until;
+    }
+    clear_air(file, on_air, workload);
+    fclose(file);
+    return true;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void on_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    if (strcmp(topic, topic_events) == 0)
+    {
+        bytes_events += length;
+    }
+    else if (strncmp(topic, topic_telemetry, strlen(topic_telemetry)) == 0)
+    {
+        bytes_telemetry += length;
+    }
+    else if (strcmp(topic, topic_update) == 0)
+    {
+        bytes_shadow += length;
+    }
+    else if (strcmp(topic, topic_metrics) == 0)
+    {
+        bytes_metrics += length;
+    }
+}
+
+// Runs the gateway on the recording, returns false if it did not load.
+static bool run(const char *path, const workload_t *workload, ward_result_t *result)
+{
+    char client_id[GATEWAY_THING_NAME_SIZE];
+    const connection_config_t config = {"ward", "", "localhost", 8883, NULL, gateway_on_connect};
+
+    hal_native_clock_set(0);
+    hal_se_get_id(client_id, sizeof(client_id));
+    snprintf(topic_events, sizeof(topic_events), GATEWAY_EVENT_TOPIC, client_id);
+    snprintf(topic_telemetry, sizeof(topic_telemetry), "hhcm/%s/telemetry/", client_id);
+    snprintf(topic_metrics, sizeof(topic_metrics), METRICS_TOPIC, client_id);
+    snprintf(topic_update, sizeof(topic_update), "$aws/things/%s/shadow/update", client_id);
+    bytes_events = bytes_telemetry = bytes_shadow = bytes_metrics = 0;
+    hal_mqtt_init(client_id, NULL, gateway_message_received);
+    hal_native_mqtt_set_publish_hook(on_publish);
+    gateway_setup(client_id);
+    connection_setup(&config, hal_millis());
+    if (!hal_native_ble_load_recording(path))
+    {
+        return false;
+    }
+
+    uint64_t busy_ns = 0;
+    while (hal_millis() < BENCH_WARD_LENGTH)
+    {
+        // The scan callback runs as the clock moves, in the BLE task.
+        const uint64_t start = bench_now_ns();
+        hal_native_clock_advance(BENCH_DEFAULT_TICK);
+        if (connection_step(hal_millis()) == CONNECTION_ONLINE)
+        {
+            hal_mqtt_poll();
+        }
+        gateway_loop();
+        gateway_network_loop();
+        busy_ns += bench_now_ns() - start;
+    }
+
+    gateway_statistics_t gateway;
+    ble_scan_statistics_t scan;
+    metrics_snapshot_t metrics;
+    gateway_get_statistics(&gateway);
+    ble_scan_get_statistics(&scan);
+    metrics_snapshot(&metrics);
+
+    const double seconds = BENCH_WARD_LENGTH / 1000.0;
+    const size_t replayed = hal_native_ble_replayed();
+    const uint32_t *counters = metrics.counters;
+    const uint32_t dropped = counters[METRIC_ADV_DROPPED] + counters[METRIC_PRESENCE_REJECTED] +
+                             counters[METRIC_EVENTS_DROPPED] + counters[METRIC_TELEMETRY_DROPPED];
+    const size_t bytes = bytes_events + bytes_telemetry + bytes_shadow + bytes_metrics;
+
+    result->devices = workload->devices;
+    result->offered = replayed / seconds;
+    result->matched = counters[METRIC_ADV_MATCHED] / seconds;
+    result->cpu_rate = busy_ns ? counters[METRIC_ADV_SEEN] * 1e9 / busy_ns : 0.0;
+    result->presence = metrics.gauges[METRIC_PRESENCE].max;
+    result->ring = scan.high_water;
+    result->outbox = gateway.outbox_high_water;
+    result->dropped = dropped;
+    result->bytes = bytes * 60.0 / seconds;
+
+    printf("ward of %zu devices, %zu badges, %.0f s\n", workload->devices, workload->badges, seconds);
+    printf("  on air                     %zu advertisements, %zu below %d dBm, %zu lost to collisions\n",
+           workload->sent, workload->out_of_range, BENCH_WARD_SENSITIVITY, workload->collided);
+    printf("  scan                       %zu replayed (%.0f/s), %u heard, %u matched (%.0f/s)\n",
+           replayed, result->offered, counters[METRIC_ADV_SEEN], counters[METRIC_ADV_MATCHED], result->matched);
+    printf("  throughput                 %.0f advertisements per second of host CPU, aggregation mean %.1f max %u us\n",
+           result->cpu_rate, gateway.aggregate_runs ? (double)gateway.aggregate_us_total / gateway.aggregate_runs : 0.0,
+           gateway.aggregate_us_max);
+    printf("  high water                 ring %u of %u, presence %u of %u, outbox %u of %u\n",
+           scan.high_water, BLE_RING_CAPACITY, result->presence, PRESENCE_TABLE_MAX_ENTRIES,
+           gateway.outbox_high_water, OUTBOX_CAPACITY);
+    static const metric_gauge_t documents[] = {METRIC_JSON_EVENTS, METRIC_JSON_SHADOW, METRIC_JSON_TELEMETRY};
+    printf("  JSON documents            ");
+    for (size_t i = 0; i < sizeof(documents) / sizeof(documents[0]); i++)
+    {
+        const metrics_gauge_t *gauge = &metrics.gauges[documents[i]];
+        printf(" %s %u of %u", metrics_gauge_name(documents[i]), gauge->max, gauge->limit);
+    }
+    printf("\n");
+    printf("  dropped                    %u advertisements (ring full), %u (presence table full), %u events, %u telemetry pages%s\n",
+           counters[METRIC_ADV_DROPPED], counters[METRIC_PRESENCE_REJECTED], counters[METRIC_EVENTS_DROPPED],
+           counters[METRIC_TELEMETRY_DROPPED], dropped && workload->devices <= BENCH_WARD_LOSSLESS ? " (FAILED)" : "");
+    printf("  bytes per minute           %.0f events, %.0f telemetry, %.0f shadow, %.0f metrics, %.0f in all\n",
+           bytes_events * 60.0 / seconds, bytes_telemetry * 60.0 / seconds, bytes_shadow * 60.0 / seconds,
+           bytes_metrics * 60.0 / seconds, result->bytes);
+    return true;
+}
+
+int bench_ward(int argc, char **argv)
+{
+    const char *keep = argc > 0 ? argv[0] : NULL;
+    char root[64];
+    ward_result_t results[BENCH_WARD_SIZES];
+    int failures = 0;
+
+    snprintf(root, sizeof(root), "%s-%d", BENCH_WARD_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+
+    for (size_t i = 0; i < BENCH_WARD_SIZES; i++)
+    {
+        char path[128];
+        workload_t workload;
+        if (keep)
+        {
+            snprintf(path, sizeof(path), "%s/ward-%zu.scan", keep, ward_sizes[i]);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s-%zu.scan", root, ward_sizes[i]);
+        }
+        if (!write_workload(path, ward_sizes[i], &workload) || !run(path, &workload, &results[i]))
+        {
+            return 1;
+        }
+        if (!keep)
+        {
+            unlink(path);
+        }
+        failures += results[i].dropped && ward_sizes[i] <= BENCH_WARD_LOSSLESS;
+        hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    }
+
+    printf("devices  offered/s  matched/s  CPU adv/s  presence  ring  outbox  dropped  bytes/min\n");
+    for (size_t i = 0; i < BENCH_WARD_SIZES; i++)
+    {
+        const ward_result_t *result = &results[i];
+        printf("%7zu  %9.0f  %9.0f  %9.0f  %8u  %4u  %6u  %7u  %9.0f\n",
+               result->devices, result->offered, result->matched, result->cpu_rate,
+               result->presence, result->ring, result->outbox, result->dropped, result->bytes);
+    }
+
+    char directory[96];
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,1076 @@
+/*
+ * hal_native.cpp
+ *
+ * Linux stand-ins for the hardware abstraction layer, used by the
+ * native benchmark. Nothing here talks to real hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "hal_native.h"
+
+typedef struct
+{
+    uint32_t time;
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    int rssi;
+    std::vector<uint8_t> payload;
+} recorded_advertisement_t;
+
+typedef struct
+{
+    std::string topic;
+    std::vector<uint8_t> payload;
+} broker_message_t;
+
+typedef struct
+{
+    uint32_t due; // when the PUBACK arrives
+    uint16_t packet_id;
+} broker_ack_t;
+
+typedef struct
+{
+    std::string text;
+    uint16_t foreground;
+    uint16_t background;
+} display_cell_t;
+
+static uint32_t native_millis = 0;
+
+static bool ntp_available = true;
+static int32_t ntp_drift = 0; // ppm
+static int64_t ntp_adjustment = 0;
+static bool ntp_answered = false;
+static uint32_t ntp_answer_millis = 0;
+static uint64_t ntp_answer_time = 0;
+
+static uint32_t heap_free = HAL_NATIVE_HEAP_FREE;
+static uint32_t heap_largest = HAL_NATIVE_HEAP_LARGEST;
+
+static std::vector<recorded_advertisement_t> recording;
+static size_t recording_cursor = 0;
+static uint32_t recording_base = 0;
+static size_t recording_replayed = 0;
+static hal_native_delivery_hook_t delivery_hook = NULL;
+static hal_ble_advertisement_callback_t continuous_callback = NULL;
+static void *continuous_context = NULL;
+static int ble_interval = 0; // ms, 0 until configured: always scanning
+static int ble_window = 0;
+static bool ble_active = false;
+static uint32_t ble_scan_started = 0;
+
+static bool wifi_available = true;
+static bool wifi_joining = false;
+static bool wifi_joined = false;
+static size_t wifi_joins = 0;
+
+static bool mqtt_connected = false;
+static hal_mqtt_connect_result_t mqtt_connect_result = HAL_MQTT_CONNECTED;
+static size_t mqtt_connects = 0;
+static hal_mqtt_message_callback_t mqtt_message_callback = NULL;
+static hal_native_publish_hook_t mqtt_publish_hook = NULL;
+static std::vector<std::string> mqtt_subscriptions;
+static std::vector<broker_message_t> mqtt_pending;
+static broker_message_t mqtt_current;
+static size_t mqtt_current_offset = 0;
+static size_t mqtt_published_messages = 0;
+static size_t mqtt_published_bytes = 0;
+static uint16_t mqtt_packet_id = 0;
+static hal_mqtt_ack_callback_t mqtt_ack_callback = NULL;
+static std::vector<broker_ack_t> mqtt_acks; // in the order the publishes came
+static unsigned mqtt_publish_loss = 0;      // percent
+static unsigned mqtt_ack_loss = 0;
+static uint32_t mqtt_ack_delay = 0; // ms
+static size_t mqtt_lost = 0;
+static size_t mqtt_duplicates = 0;
+
+static hal_tls_handshake_t tls_handshake;
+
+static std::string storage_root = HAL_NATIVE_STORAGE_ROOT;
+static uint64_t storage_capacity = HAL_NATIVE_STORAGE_CAPACITY;
+
+static std::map<std::string, std::vector<uint8_t> > settings;
+static size_t settings_writes = 0;
+
+static std::map<uint32_t, display_cell_t> display_cells; // by y << 16 | x
+static size_t display_pixels = 0;
+static size_t display_writes = 0;
+
+static size_t leds_frames = 0;
+static uint32_t leds_shown_at = 0;
+static uint32_t leds_colors[HAL_LEDS];
+
+static uint32_t audio_started = 0;   // the first DMA buffer starts playing
+static uint64_t audio_queued_to = 0; // samples since, the end of those written
+static size_t audio_samples = 0;
+static size_t audio_bursts = 0;
+static uint32_t audio_burst_start = 0;
+
+static void replay_continuous();
+
+/* Clock
+*/
+
+uint32_t hal_millis()
+{
+    return native_millis;
+}
+
+// Host processing time, unlike the fake clock.
+uint32_t hal_micros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)(now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+bool hal_time_synced()
+{
+    return ntp_available || ntp_answered;
+}
+
+// The server answers on the first call it can and every
+// HAL_NATIVE_NTP_POLL ms after, the answers outdated by nothing.
+bool hal_ntp_time(uint64_t *epoch_ms)
+{
+    if (ntp_available && !ntp_answered)
+    {
+        ntp_answered = true;
+        ntp_answer_millis = native_millis;
+        ntp_answer_time = hal_native_ntp_true_time();
+    }
+    if (!ntp_answered)
+    {
+        return false;
+    }
+    if (ntp_available && native_millis - ntp_answer_millis >= HAL_NATIVE_NTP_POLL)
+    {
+        ntp_answer_millis += (native_millis - ntp_answer_millis) / HAL_NATIVE_NTP_POLL * HAL_NATIVE_NTP_POLL;
+        const uint32_t since = native_millis - ntp_answer_millis;
+        ntp_answer_time = hal_native_ntp_true_time() - since;
+    }
+    *epoch_ms = ntp_answer_time + (native_millis - ntp_answer_millis);
+    return true;
+}
+
+void hal_delay(uint32_t ms)
+{
+    hal_native_clock_advance(ms);
+}
+
+uint32_t hal_random(const uint32_t bound)
+{
+    return bound ? (uint32_t)rand() % bound : 0;
+}
+
+// While a continuous scan runs, moving the clock delivers everything
+// recorded up to the new time, as the BLE stack would in the background.
+void hal_native_clock_set(const uint32_t ms)
+{
+    native_millis = ms;
+    replay_continuous();
+}
+
+void hal_native_clock_advance(const uint32_t ms)
+{
+    hal_native_clock_set(native_millis + ms);
+}
+
+void hal_native_ntp_set(const bool available, const int32_t drift_ppm)
+{
+    ntp_available = available;
+    ntp_drift = drift_ppm;
+    ntp_answered = false;
+}
+
+void hal_native_ntp_adjust(const int32_t ms)
+{
+    ntp_adjustment += ms;
+}
+
+uint64_t hal_native_ntp_true_time()
+{
+    return HAL_NATIVE_EPOCH_BASE * 1000ULL + ntp_adjustment + native_millis + (int64_t)native_millis * ntp_drift / 1000000;
+}
+
+/* Tasks
+*/
+
+// There are no tasks on the host, the benchmarks step the pipeline
+// stages themselves.
+bool hal_task_start(
+    const char *name,
+    hal_task_function_t function,
+    void *context,
+    const uint32_t stack_size,
+    const unsigned priority,
+    const int core)
+{
+    return false;
+}
+
+/* Memory
+*/
+
+void hal_native_heap_set(const uint32_t free, const uint32_t largest_block)
+{
+    heap_free = free;
+    heap_largest = largest_block;
+}
+
+void hal_heap(uint32_t *free, uint32_t *largest_block)
+{
+    *free = heap_free;
+    *largest_block = heap_largest;
+}
+
+/* Secure element
+*/
+
+void hal_se_initialize()
+{
+}
+
+void hal_se_get_id(char *id, size_t size)
+{
+    snprintf(id, size, "%s", HAL_NATIVE_SE_ID);
+}
+
+/* WiFi
+*/
+
+void hal_native_wifi_set_available(const bool available)
+{
+    wifi_available = available;
+    if (!available)
+    {
+        wifi_joined = false;
+        mqtt_connected = false;
+        mqtt_acks.clear();
+    }
+    else if (wifi_joining)
+    {
+        wifi_joined = true;
+        wifi_joining = false;
+    }
+}
+
+size_t hal_native_wifi_joins()
+{
+    return wifi_joins;
+}
+
+// Joins at once while the access point is up, as soon as it comes back
+// otherwise.
+void hal_wifi_begin(const char *ssid, const char *password)
+{
+    wifi_joins++;
+    wifi_joined = wifi_available;
+    wifi_joining = !wifi_available;
+}
+
+void hal_wifi_disconnect()
+{
+    wifi_joining = false;
+    wifi_joined = false;
+    mqtt_connected = false;
+    mqtt_acks.clear();
+}
+
+bool hal_wifi_connected()
+{
+    return wifi_joined;
+}
+
+/* BLE
+*/
+
+static bool parse_address(const char *text, uint8_t *address)
+{
+    unsigned int a[HAL_BLE_ADDRESS_LENGTH];
+    if (sscanf(text, "%2x:%2x:%2x:%2x:%2x:%2x", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) != 6)
+    {
+        return false;
+    }
+    for (int i = 0; i < HAL_BLE_ADDRESS_LENGTH; i++)
+    {
+        address[i] = (uint8_t)a[i];
+    }
+    return true;
+}
+
+static bool parse_payload(const char *text, std::vector<uint8_t> &payload)
+{
+    payload.clear();
+    if (strcmp(text, "-") == 0)
+    {
+        return true;
+    }
+    size_t length = strlen(text);
+    if (length % 2 != 0 || length / 2 > HAL_BLE_PAYLOAD_MAX_LENGTH)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < length; i += 2)
+    {
+        char byte[3] = {text[i], text[i + 1], 0};
+        char *end;
+        payload.push_back((uint8_t)strtoul(byte, &end, 16));
+        if (*end != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hal_native_ble_load_recording(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "BLE: Cannot open recording %s\n", path);
+        return false;
+    }
+
+    recording.clear();
+    recording_cursor = 0;
+    recording_replayed = 0;
+    recording_base = native_millis;
+
+    char line[256];
+    unsigned line_number = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+        {
+            continue;
+        }
+
+        unsigned long time;
+        char address[32];
+        int rssi;
+        char payload[2 * HAL_BLE_PAYLOAD_MAX_LENGTH + 2];
+        recorded_advertisement_t advertisement;
+        if (sscanf(line, "%lu %31s %d %125s", &time, address, &rssi, payload) != 4 ||
+            !parse_address(address, advertisement.address) ||
+            !parse_payload(payload, advertisement.payload))
+        {
+            fprintf(stderr, "BLE: %s:%u: malformed advertisement\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+        advertisement.time = time;
+        advertisement.rssi = rssi;
+        recording.push_back(advertisement);
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool hal_native_ble_replay_done()
+{
+    return recording_cursor >= recording.size();
+}
+
+size_t hal_native_ble_replayed()
+{
+    return recording_replayed;
+}
+
+void hal_native_ble_set_delivery_hook(hal_native_delivery_hook_t hook)
+{
+    delivery_hook = hook;
+}
+
+void hal_ble_init(const bool active_scan)
+{
+}
+
+void hal_native_ble_get_configuration(int *interval, int *window, bool *active)
+{
+    *interval = ble_interval;
+    *window = ble_window;
+    *active = ble_active;
+}
+
+// Like the controller, a continuous scan starts over with the new
+// parameters.
+void hal_ble_configure(const int interval, const int window, const bool active_scan)
+{
+    ble_interval = interval;
+    ble_window = window;
+    ble_active = active_scan;
+    ble_scan_started = native_millis;
+}
+
+// Whether the radio listens at the given time: for the window at the
+// start of every interval since the scan started.
+static bool ble_scanning_at(const uint32_t time)
+{
+    return ble_interval <= 0 || (time - ble_scan_started) % (uint32_t)ble_interval < (uint32_t)ble_window;
+}
+
+static void deliver(
+    const recorded_advertisement_t &recorded,
+    hal_ble_advertisement_callback_t callback,
+    void *context)
+{
+    hal_ble_advertisement_t advertisement;
+    memcpy(advertisement.address, recorded.address, HAL_BLE_ADDRESS_LENGTH);
+    advertisement.rssi = recorded.rssi;
+    advertisement.payload = recorded.payload.data();
+    advertisement.payload_length = recorded.payload.size();
+    if (delivery_hook)
+    {
+        delivery_hook(&advertisement);
+    }
+    callback(&advertisement, context);
+}
+
+// Replays every recorded advertisement that falls into the scan window
+// and advances the clock to its end. Advertisements sent while the radio
+// was not scanning are skipped. Like the ESP32 BLE stack without
+// duplicate reporting, each address is reported once per scan.
+int hal_ble_scan(
+    const int duration,
+    hal_ble_advertisement_callback_t callback,
+    void *context)
+{
+    const uint32_t scan_end = native_millis + duration * 1000;
+    std::set<std::string> reported;
+    int count = 0;
+
+    ble_scan_started = native_millis;
+
+    while (recording_cursor < recording.size() &&
+           recording_base + recording[recording_cursor].time < native_millis)
+    {
+        recording_cursor++;
+        recording_replayed++;
+    }
+
+    while (recording_cursor < recording.size() &&
+           recording_base + recording[recording_cursor].time < scan_end)
+    {
+        const recorded_advertisement_t &recorded = recording[recording_cursor++];
+        recording_replayed++;
+        native_millis = recording_base + recorded.time;
+        if (!ble_scanning_at(native_millis) ||
+            !reported.insert(std::string((const char *)recorded.address, HAL_BLE_ADDRESS_LENGTH)).second)
+        {
+            continue;
+        }
+        deliver(recorded, callback, context);
+        count++;
+    }
+
+    native_millis = scan_end;
+    return count;
+}
+
+static void replay_continuous()
+{
+    if (!continuous_callback)
+    {
+        return;
+    }
+
+    const uint32_t now = native_millis;
+    while (recording_cursor < recording.size() &&
+           recording_base + recording[recording_cursor].time <= now)
+    {
+        const recorded_advertisement_t &recorded = recording[recording_cursor++];
+        recording_replayed++;
+        native_millis = recording_base + recorded.time;
+        if (ble_scanning_at(native_millis))
+        {
+            deliver(recorded, continuous_callback, continuous_context);
+        }
+    }
+    native_millis = now;
+}
+
+// Continuous scan: advertisements are delivered whenever the clock moves,
+// those sent while the radio was not listening are skipped.
+void hal_ble_scan_start(hal_ble_advertisement_callback_t callback, void *context)
+{
+    while (recording_cursor < recording.size() &&
+           recording_base + recording[recording_cursor].time < native_millis)
+    {
+        recording_cursor++;
+        recording_replayed++;
+    }
+    continuous_callback = callback;
+    continuous_context = context;
+    ble_scan_started = native_millis;
+}
+
+void hal_ble_scan_stop()
+{
+    continuous_callback = NULL;
+}
+
+void hal_ble_scan_maintain()
+{
+}
+
+/* Storage
+*/
+
+void hal_native_storage_set_root(const char *root)
+{
+    storage_root = root;
+}
+
+void hal_native_storage_set_capacity(const uint64_t bytes)
+{
+    storage_capacity = bytes;
+}
+
+static std::string storage_path(const char *path)
+{
+    return storage_root + path;
+}
+
+// Creates the root and the directory, one level each.
+bool hal_storage_init(const char *directory)
+{
+    mkdir(storage_root.c_str(), 0755);
+    mkdir(storage_path(directory).c_str(), 0755);
+    struct stat status;
+    return stat(storage_path(directory).c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+bool hal_storage_append(const char *path, const uint8_t *data, const size_t length)
+{
+    if (length > hal_storage_free())
+    {
+        return false;
+    }
+    FILE *file = fopen(storage_path(path).c_str(), "ab");
+    if (!file)
+    {
+        return false;
+    }
+    const size_t written = fwrite(data, 1, length, file);
+    fclose(file);
+    return written == length;
+}
+
+size_t hal_storage_read(const char *path, const uint32_t offset, uint8_t *data, const size_t length)
+{
+    FILE *file = fopen(storage_path(path).c_str(), "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    size_t read = 0;
+    if (fseek(file, offset, SEEK_SET) == 0)
+    {
+        read = fread(data, 1, length, file);
+    }
+    fclose(file);
+    return read;
+}
+
+long hal_storage_size(const char *path)
+{
+    struct stat status;
+    if (stat(storage_path(path).c_str(), &status) != 0)
+    {
+        return -1;
+    }
+    return (long)status.st_size;
+}
+
+bool hal_storage_remove(const char *path)
+{
+    return remove(storage_path(path).c_str()) == 0;
+}
+
+void hal_storage_list(const char *directory, hal_storage_list_callback_t callback, void *context)
+{
+    DIR *dir = opendir(storage_path(directory).c_str());
+    if (!dir)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            callback(entry->d_name, context);
+        }
+    }
+    closedir(dir);
+}
+
+// The capacity less the size of every file below the root.
+uint64_t hal_storage_free()
+{
+    uint64_t used = 0;
+    DIR *root = opendir(storage_root.c_str());
+    if (root)
+    {
+        struct dirent *directory;
+        while ((directory = readdir(root)) != NULL)
+        {
+            if (directory->d_name[0] == '.')
+            {
+                continue;
+            }
+            const std::string path = storage_root + "/" + directory->d_name;
+            DIR *dir = opendir(path.c_str());
+            if (!dir)
+            {
+                continue;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL)
+            {
+                struct stat status;
+                if (entry->d_name[0] != '.' && stat((path + "/" + entry->d_name).c_str(), &status) == 0)
+                {
+                    used += status.st_size;
+                }
+            }
+            closedir(dir);
+        }
+        closedir(root);
+    }
+    return used < storage_capacity ? storage_capacity - used : 0;
+}
+
+/* Display
+*/
+
+size_t hal_native_display_pixels()
+{
+    return display_pixels;
+}
+
+size_t hal_native_display_cells()
+{
+    return display_writes;
+}
+
+// One line per cell drawn, top to bottom and left to right:
+// "<x>,<y> <foreground> <background> <text>".
+size_t hal_native_display_dump(char *buffer, const size_t size)
+{
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (std::map<uint32_t, display_cell_t>::const_iterator cell = display_cells.begin();
+         cell != display_cells.end() && length < size; ++cell)
+    {
+        length += snprintf(buffer + length, size - length, "%u,%u %04x %04x %s\n",
+                           (unsigned)(cell->first & 0xffff), (unsigned)(cell->first >> 16),
+                           cell->second.foreground, cell->second.background, cell->second.text.c_str());
+    }
+    return length < size ? length : size - 1;
+}
+
+void hal_display_init()
+{
+    display_cells.clear();
+    display_pixels += HAL_DISPLAY_WIDTH * HAL_DISPLAY_HEIGHT;
+}
+
+void hal_display_cell(
+    const int x,
+    const int y,
+    const int width,
+    const int height,
+    const char *text,
+    const uint16_t foreground,
+    const uint16_t background)
+{
+    const int fits = (width - HAL_DISPLAY_CHAR_WIDTH / 2) / HAL_DISPLAY_CHAR_WIDTH;
+    display_cell_t *cell = &display_cells[(uint32_t)y << 16 | (uint32_t)x];
+    cell->text.assign(text, strnlen(text, fits > 0 ? fits : 0));
+    cell->foreground = foreground;
+    cell->background = background;
+    display_pixels += width * height;
+    display_writes++;
+}
+
+/* LEDs
+*/
+
+size_t hal_native_leds_frames()
+{
+    return leds_frames;
+}
+
+uint32_t hal_native_leds_shown_at()
+{
+    return leds_shown_at;
+}
+
+void hal_native_leds_get(uint32_t *colors)
+{
+    memcpy(colors, leds_colors, sizeof(leds_colors));
+}
+
+void hal_leds_init()
+{
+    memset(leds_colors, 0, sizeof(leds_colors));
+}
+
+void hal_leds_show(const uint32_t *colors)
+{
+    memcpy(leds_colors, colors, sizeof(leds_colors));
+    leds_shown_at = native_millis;
+    leds_frames++;
+}
+
+/* Speaker
+*/
+
+size_t hal_native_audio_samples()
+{
+    return audio_samples;
+}
+
+size_t hal_native_audio_bursts()
+{
+    return audio_bursts;
+}
+
+uint32_t hal_native_audio_burst_start()
+{
+    return audio_burst_start;
+}
+
+bool hal_audio_init()
+{
+    audio_started = native_millis;
+    audio_queued_to = 0;
+    return true;
+}
+
+// As the I2S driver does, samples go into the buffers after the one
+// playing now. With nothing written for it the next buffer plays
+// silence, and what comes after starts a new burst.
+size_t hal_audio_write(const int16_t *samples, const size_t count)
+{
+    const uint64_t played = (uint64_t)(native_millis - audio_started) * HAL_AUDIO_SAMPLE_RATE / 1000;
+    const uint64_t next = (played / HAL_AUDIO_DMA_SAMPLES + 1) * HAL_AUDIO_DMA_SAMPLES;
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (audio_queued_to < next)
+    {
+        audio_queued_to = next;
+        audio_bursts++;
+        audio_burst_start = audio_started + (uint32_t)(next * 1000 / HAL_AUDIO_SAMPLE_RATE);
+    }
+    const uint64_t room = next + (HAL_AUDIO_DMA_BUFFERS - 1) * HAL_AUDIO_DMA_SAMPLES - audio_queued_to;
+    const size_t taken = count < room ? count : (size_t)room;
+    audio_queued_to += taken;
+    audio_samples += taken;
+    return taken;
+}
+
+/* Settings
+*/
+
+void hal_native_settings_erase()
+{
+    settings.clear();
+}
+
+size_t hal_native_settings_writes()
+{
+    return settings_writes;
+}
+
+size_t hal_settings_read(const char *key, uint8_t *data, const size_t size)
+{
+    std::map<std::string, std::vector<uint8_t> >::const_iterator blob = settings.find(key);
+    if (blob == settings.end() || blob->second.empty() || blob->second.size() > size)
+    {
+        return 0;
+    }
+    memcpy(data, blob->second.data(), blob->second.size());
+    return blob->second.size();
+}
+
+bool hal_settings_write(const char *key, const uint8_t *data, const size_t length)
+{
+    if (strlen(key) > 15 || length > HAL_SETTINGS_BLOB_MAX)
+    {
+        return false;
+    }
+    settings[key].assign(data, data + length);
+    settings_writes++;
+    return true;
+}
+
+/* MQTT
+*/
+
+void hal_native_mqtt_set_publish_hook(hal_native_publish_hook_t hook)
+{
+    mqtt_publish_hook = hook;
+}
+
+// Dropping the connection drops the PUBACKs on their way.
+void hal_native_mqtt_set_connected(const bool connected)
+{
+    mqtt_connected = connected;
+    if (!connected)
+    {
+        mqtt_acks.clear();
+    }
+}
+
+void hal_native_mqtt_set_connect_result(const hal_mqtt_connect_result_t result)
+{
+    mqtt_connect_result = result;
+}
+
+size_t hal_native_mqtt_connects()
+{
+    return mqtt_connects;
+}
+
+void hal_native_mqtt_inject(const char *topic, const uint8_t *payload, const size_t length)
+{
+    broker_message_t message;
+    message.topic = topic;
+    message.payload.assign(payload, payload + length);
+    mqtt_pending.push_back(message);
+}
+
+size_t hal_native_mqtt_published_messages()
+{
+    return mqtt_published_messages;
+}
+
+size_t hal_native_mqtt_published_bytes()
+{
+    return mqtt_published_bytes;
+}
+
+void hal_native_mqtt_set_loss(const unsigned publish_percent, const unsigned ack_percent)
+{
+    mqtt_publish_loss = publish_percent;
+    mqtt_ack_loss = ack_percent;
+}
+
+void hal_native_mqtt_set_ack_delay(const uint32_t ms)
+{
+    mqtt_ack_delay = ms;
+}
+
+size_t hal_native_mqtt_lost()
+{
+    return mqtt_lost;
+}
+
+size_t hal_native_mqtt_duplicates()
+{
+    return mqtt_duplicates;
+}
+
+void hal_mqtt_init(
+    const char *client_id,
+    const char *certificate,
+    hal_mqtt_message_callback_t callback)
+{
+    mqtt_message_callback = callback;
+}
+
+hal_mqtt_connect_result_t hal_mqtt_connect(const char *host, const uint16_t port)
+{
+    mqtt_connects++;
+    mqtt_subscriptions.clear();
+    mqtt_acks.clear();
+    memset(&tls_handshake, 0, sizeof(tls_handshake));
+    if (!wifi_joined || mqtt_connect_result == HAL_MQTT_TRANSPORT_FAILED)
+    {
+        mqtt_connected = false;
+        return HAL_MQTT_TRANSPORT_FAILED;
+    }
+    // Connecting takes no time on the fake clock.
+    tls_handshake.done = true;
+    mqtt_connected = mqtt_connect_result == HAL_MQTT_CONNECTED;
+    return mqtt_connect_result;
+}
+
+void hal_tls_get_handshake(hal_tls_handshake_t *handshake)
+{
+    *handshake = tls_handshake;
+}
+
+bool hal_mqtt_connected()
+{
+    return mqtt_connected;
+}
+
+// PUBACKs that are due first, in order, then the messages.
+void hal_mqtt_poll()
+{
+    size_t due = 0;
+    while (due < mqtt_acks.size() && (int32_t)(native_millis - mqtt_acks[due].due) >= 0)
+    {
+        due++;
+    }
+    std::vector<broker_ack_t> acknowledging(mqtt_acks.begin(), mqtt_acks.begin() + due);
+    mqtt_acks.erase(mqtt_acks.begin(), mqtt_acks.begin() + due);
+    for (size_t i = 0; i < acknowledging.size(); i++)
+    {
+        if (mqtt_ack_callback)
+        {
+            mqtt_ack_callback(acknowledging[i].packet_id);
+        }
+    }
+
+    std::vector<broker_message_t> delivering;
+    delivering.swap(mqtt_pending);
+    for (size_t i = 0; i < delivering.size(); i++)
+    {
+        mqtt_current = delivering[i];
+        mqtt_current_offset = 0;
+        if (mqtt_message_callback)
+        {
+            mqtt_message_callback(mqtt_current.topic.c_str(), mqtt_current.payload.size());
+        }
+    }
+    mqtt_current.payload.clear();
+    mqtt_current_offset = 0;
+}
+
+bool hal_mqtt_subscribe(const char *topic)
+{
+    if (!mqtt_connected)
+    {
+        return false;
+    }
+    mqtt_subscriptions.push_back(topic);
+    return true;
+}
+
+// The shadow service: an update with a client token is answered on
+// update/accepted, {"clientToken": "<token>"}, if the client subscribed.
+static void broker_accept_shadow(const char *topic, const uint8_t *payload, const size_t length)
+{
+    static const char suffix[] = "/shadow/update";
+    static const char key[] = "\"clientToken\":\"";
+    const size_t topic_length = strlen(topic);
+    if (topic_length < sizeof(suffix) - 1 || strcmp(topic + topic_length - (sizeof(suffix) - 1), suffix) != 0)
+    {
+        return;
+    }
+
+    const std::string document((const char *)payload, length);
+    const size_t start = document.find(key);
+    const size_t end = start == std::string::npos ? start : document.find('"', start + sizeof(key) - 1);
+    const std::string accepted = std::string(topic) + "/accepted";
+    for (size_t i = 0; end != std::string::npos && i < mqtt_subscriptions.size(); i++)
+    {
+        if (mqtt_subscriptions[i] == accepted)
+        {
+            const std::string answer = "{" + document.substr(start, end + 1 - start) + "}";
+            hal_native_mqtt_inject(accepted.c_str(), (const uint8_t *)answer.data(), answer.size());
+            break;
+        }
+    }
+}
+
+// The broker takes a publish unless the link loses it, which the client
+// cannot tell. A QoS 1 publish is acknowledged after the delay, unless
+// the link loses the PUBACK.
+static bool broker_publish(
+    const char *topic,
+    const uint8_t *payload,
+    const size_t length,
+    const uint16_t packet_id,
+    const bool duplicate)
+{
+    if (!mqtt_connected)
+    {
+        return false;
+    }
+    if (mqtt_publish_loss && (unsigned)rand() % 100 < mqtt_publish_loss)
+    {
+        mqtt_lost++;
+        return true;
+    }
+
+    mqtt_published_messages++;
+    mqtt_published_bytes += length;
+    mqtt_duplicates += duplicate;
+    if (mqtt_publish_hook)
+    {
+        mqtt_publish_hook(topic, payload, length);
+    }
+
+    for (size_t i = 0; i < mqtt_subscriptions.size(); i++)
+    {
+        if (mqtt_subscriptions[i] == topic)
+        {
+            hal_native_mqtt_inject(topic, payload, length);
+            break;
+        }
+    }
+    broker_accept_shadow(topic, payload, length);
+
+    if (packet_id && !(mqtt_ack_loss && (unsigned)rand() % 100 < mqtt_ack_loss))
+    {
+        const broker_ack_t ack = {native_millis + mqtt_ack_delay, packet_id};
+        mqtt_acks.push_back(ack);
+    }
+    return true;
+}
+
+bool hal_mqtt_publish(const char *topic, const uint8_t *payload, const size_t length)
+{
+    return broker_publish(topic, payload, length, 0, false);
+}
+
+// A retransmission keeps its packet ID, as MQTT has it.
+uint16_t hal_mqtt_publish_acknowledged(const char *topic, const uint8_t *payload, const size_t length, const uint16_t retransmit)
+{
+    if (!mqtt_connected)
+    {
+        return 0;
+    }
+    uint16_t packet_id = retransmit;
+    if (!retransmit)
+    {
+        mqtt_packet_id = mqtt_packet_id == 0xffff ? 1 : mqtt_packet_id + 1;
+        packet_id = mqtt_packet_id;
+    }
+    return broker_publish(topic, payload, length, packet_id, retransmit != 0) ? packet_id : 0;
+}
+
+void hal_mqtt_set_ack_callback(hal_mqtt_ack_callback_t callback)
+{
+    mqtt_ack_callback = callback;
+}
+
+int hal_mqtt_read()
+{
+    if (mqtt_current_offset >= mqtt_current.payload.size())
+    {
+        return -1;
+    }
+    return mqtt_current.payload[mqtt_current_offset++];
+}
@@ -0,0 +1,330 @@
+/*
+ * trace_decode.cpp
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "trace_decode.h"
+
+typedef struct
+{
+    const char *name;
+    int level;
+    const char *format;
+} trace_format_t;
+
+static const trace_format_t trace_formats[] = {
+#define TRACE_FORMAT(name, level, format) {#name, level, format},
+#include "trace_formats.h"
+#undef TRACE_FORMAT
+};
+
+static const char trace_level_letters[] = "-WID";
+
+typedef struct
+{
+    char *line;
+    size_t size;
+    size_t used;
+} trace_line_t;
+
+static void append(trace_line_t *line, const char *format, ...)
+{
+    if (line->used + 1 >= line->size)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    const int written = vsnprintf(line->line + line->used, line->size - line->used, format, args);
+    va_end(args);
+    if (written > 0)
+    {
+        line->used += (size_t)written < line->size - line->used ? (size_t)written : line->size - line->used - 1;
+    }
+}
+
+// Renders one conversion of the format from the next argument. spec is
+// the conversion without its length modifiers and conversion letter.
+static size_t render_argument(trace_line_t *line, const trace_record_t *record, size_t offset, const char *spec, const char conversion)
+{
+    char format[32];
+
+    if (offset >= record->length)
+    {
+        append(line, "<?>");
+        return offset;
+    }
+    const uint8_t type = record->args[offset++];
+    long long value = 0;
+    switch (type)
+    {
+    case TRACE_ARG_INT32:
+    {
+        int32_t word;
+        memcpy(&word, &record->args[offset], sizeof(word));
+        value = conversion == 'd' || conversion == 'i' ? word : (long long)(uint32_t)word;
+        offset += sizeof(word);
+        break;
+    }
+    case TRACE_ARG_UINT32:
+    {
+        uint32_t word;
+        memcpy(&word, &record->args[offset], sizeof(word));
+        value = word;
+        offset += sizeof(word);
+        break;
+    }
+    case TRACE_ARG_INT64:
+    case TRACE_ARG_UINT64:
+    {
+        int64_t word;
+        memcpy(&word, &record->args[offset], sizeof(word));
+        value = word;
+        offset += sizeof(word);
+        break;
+    }
+    case TRACE_ARG_STRING:
+    {
+        const uint8_t length = record->args[offset++];
+        if (conversion == 's')
+        {
+            snprintf(format, sizeof(format), "%s.*s", spec);
+            append(line, format, (int)length, (const char *)&record->args[offset]);
+        }
+        else
+        {
+            append(line, "<%c?>", conversion);
+        }
+        return offset + length;
+    }
+    case TRACE_ARG_ADDRESS:
+    {
+        const uint8_t *address = &record->args[offset];
+        if (conversion == 'A')
+        {
+            append(line, "%02x:%02x:%02x:%02x:%02x:%02x",
+                   address[0], address[1], address[2], address[3], address[4], address[5]);
+        }
+        else
+        {
+            append(line, "<%c?>", conversion);
+        }
+        return offset + 6;
+    }
+    default:
+        // The rest of the arguments cannot be told apart any more.
+        append(line, "<?>");
+        return record->length;
+    }
+
+    if (!strchr("diuxXoc", conversion))
+    {
+        append(line, "<%c?>", conversion);
+        return offset;
+    }
+    if (conversion == 'c')
+    {
+        snprintf(format, sizeof(format), "%sc", spec);
+        append(line, format, (int)value);
+    }
+    else if (conversion == 'd' || conversion == 'i')
+    {
+        snprintf(format, sizeof(format), "%slld", spec);
+        append(line, format, value);
+    }
+    else
+    {
+        snprintf(format, sizeof(format), "%sll%c", spec, conversion);
+        append(line, format, (unsigned long long)value);
+    }
+    return offset;
+}
+
+// Renders the record as "<s.ms> <level> <message>", into a line of at
+// most size - 1 characters. Returns its length.
+size_t trace_render(const trace_record_t *record, char *buffer, const size_t size)
+{
+    trace_line_t line = {buffer, size, 0};
+    buffer[0] = '\0';
+
+    if (record->id >= sizeof(trace_formats) / sizeof(trace_formats[0]))
+    {
+        append(&line, "%u.%03u ? unknown trace message %u", record->time / 1000, record->time % 1000, record->id);
+        return line.used;
+    }
+    const trace_format_t *entry = &trace_formats[record->id];
+    append(&line, "%u.%03u %c ", record->time / 1000, record->time % 1000, trace_level_letters[entry->level]);
+
+    size_t offset = 0;
+    for (const char *p = entry->format; *p; p++)
+    {
+        if (*p != '%')
+        {
+            append(&line, "%c", *p);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            append(&line, "%%");
+            p++;
+            continue;
+        }
+        char spec[16] = "%";
+        size_t spec_length = 1;
+        p++;
+        while (*p && strchr("-+ #0123456789.", *p) && spec_length < sizeof(spec) - 1)
+        {
+            spec[spec_length++] = *p++;
+        }
+        spec[spec_length] = '\0';
+        while (*p && strchr("hlLqjzt", *p))
+        {
+            p++;
+        }
+        if (!*p)
+        {
+            break;
+        }
+        offset = render_argument(&line, record, offset, spec, *p);
+    }
+    if (record->flags & TRACE_FLAG_TRUNCATED)
+    {
+        append(&line, " [truncated]");
+    }
+    if (record->id == TRACE_STARTED && record->length >= 5 && record->args[0] == TRACE_ARG_UINT32)
+    {
+        uint32_t count;
+        memcpy(&count, &record->args[1], sizeof(count));
+        if (count != TRACE_FORMAT_COUNT)
+        {
+            append(&line, " - the decoder has %u, decode with the build the capture was taken from", (unsigned)TRACE_FORMAT_COUNT);
+        }
+    }
+    return line.used;
+}
+
+void trace_decoder_init(trace_decoder_t *decoder, trace_decode_output_t output, void *context)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->output = output;
+    decoder->context = context;
+}
+
+static void text_byte(trace_decoder_t *decoder, const uint8_t byte)
+{
+    if (byte == '\r')
+    {
+        return;
+    }
+    if (byte == '\n' || decoder->text_length == sizeof(decoder->text) - 1)
+    {
+        decoder->text[decoder->text_length] = '\0';
+        decoder->output(decoder->text, decoder->context);
+        decoder->text_length = 0;
+        if (byte == '\n')
+        {
+            return;
+        }
+    }
+    decoder->text[decoder->text_length++] = (char)byte;
+}
+
+// A complete frame: rendered if its check holds, otherwise its first
+// byte is taken for text and the rest searched again.
+static void frame_complete(trace_decoder_t *decoder)
+{
+    const size_t length = decoder->length;
+    uint8_t check = 0;
+    for (size_t i = 2; i < length - 1; i++)
+    {
+        check ^= decoder->frame[i];
+    }
+
+    decoder->length = 0;
+    if (check == decoder->frame[length - 1])
+    {
+        trace_record_t record;
+        char line[TRACE_DECODE_LINE_SIZE];
+        record.id = (uint16_t)(decoder->frame[2] | decoder->frame[3] << 8);
+        record.time = (uint32_t)decoder->frame[4] | (uint32_t)decoder->frame[5] << 8 |
+                      (uint32_t)decoder->frame[6] << 16 | (uint32_t)decoder->frame[7] << 24;
+        record.flags = decoder->frame[8];
+        record.length = (uint8_t)(length - TRACE_FRAME_HEADER - 1);
+        memcpy(record.args, &decoder->frame[TRACE_FRAME_HEADER], record.length);
+
+        // Text cut by the frame comes out first.
+        if (decoder->text_length)
+        {
+            text_byte(decoder, '\n');
+        }
+        trace_render(&record, line, sizeof(line));
+        decoder->output(line, decoder->context);
+        decoder->frames++;
+        return;
+    }
+
+    uint8_t rest[TRACE_FRAME_MAX];
+    memcpy(rest, decoder->frame + 1, length - 1);
+    decoder->corrupt++;
+    text_byte(decoder, decoder->frame[0]);
+    trace_decoder_feed(decoder, rest, length - 1);
+}
+
+void trace_decoder_feed(trace_decoder_t *decoder, const uint8_t *data, const size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        const uint8_t byte = data[i];
+        if (decoder->length == 0)
+        {
+            if (byte == TRACE_FRAME_START)
+            {
+                decoder->frame[decoder->length++] = byte;
+            }
+            else
+            {
+                text_byte(decoder, byte);
+            }
+            continue;
+        }
+
+        decoder->frame[decoder->length++] = byte;
+        if (decoder->length == 2 &&
+            (byte < TRACE_FRAME_HEADER - 2 || byte > TRACE_FRAME_HEADER - 2 + sizeof(((trace_record_t *)0)->args)))
+        {
+            // Not a length a frame can have.
+            decoder->length = 0;
+            decoder->corrupt++;
+            text_byte(decoder, TRACE_FRAME_START);
+            trace_decoder_feed(decoder, &byte, 1);
+            continue;
+        }
+        if (decoder->length >= 2 && decoder->length == (size_t)decoder->frame[1] + 3)
+        {
+            frame_complete(decoder);
+        }
+    }
+}
+
+// The text after the last frame, if it did not end with a newline.
+void trace_decoder_finish(trace_decoder_t *decoder)
+{
+    if (decoder->length)
+    {
+        uint8_t rest[TRACE_FRAME_MAX];
+        const size_t length = decoder->length;
+        memcpy(rest, decoder->frame, length);
+        decoder->length = 0;
+        decoder->corrupt++;
+        text_byte(decoder, rest[0]);
+        trace_decoder_feed(decoder, rest + 1, length - 1);
+        trace_decoder_finish(decoder);
+        return;
+    }
+    if (decoder->text_length)
+    {
+        text_byte(decoder, '\n');
+    }
+}
@@ -0,0 +1,39 @@
+/*
+ * trace_decode.h
+ *
+ * Host side of the trace log (trace.h): finds the frames in what was
+ * captured from the serial port and renders them with the formats of
+ * trace_formats.h, passing the text around them through.
+ */
+
+#ifndef TRACE_DECODE_H
+#define TRACE_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "trace.h"
+
+#define TRACE_DECODE_LINE_SIZE 512
+
+typedef void (*trace_decode_output_t)(
+    const char *line,
+    void *context);
+
+typedef struct
+{
+    uint8_t frame[TRACE_FRAME_MAX];
+    size_t length; // of the frame so far, 0 between frames
+    char text[TRACE_DECODE_LINE_SIZE];
+    size_t text_length;
+    size_t frames;
+    size_t corrupt; // frames failing their check, passed through as text
+    trace_decode_output_t output;
+    void *context;
+} trace_decoder_t;
+
+void trace_decoder_init(trace_decoder_t *decoder, trace_decode_output_t output, void *context);
+void trace_decoder_feed(trace_decoder_t *decoder, const uint8_t *data, const size_t length);
+void trace_decoder_finish(trace_decoder_t *decoder);
+size_t trace_render(const trace_record_t *record, char *line, const size_t size);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * outbox.cpp
+ */
+
+#include <stddef.h>
+#include "outbox.h"
+
+static_assert((OUTBOX_CAPACITY & (OUTBOX_CAPACITY - 1)) == 0, "OUTBOX_CAPACITY must be a power of two");
+
+// Same scheme as ble_ring.cpp: free running head and tail, each written
+// by one side only. A slot handed out by outbox_reserve() belongs to the
+// producer until outbox_commit(), one handed out by outbox_peek() to the
+// consumer until outbox_release().
+
+void outbox_init(outbox_t *outbox)
+{
+    outbox->head.store(0);
+    outbox->tail.store(0);
+    outbox->queued.store(0);
+    outbox->refused.store(0);
+    outbox->high_water.store(0);
+}
+
+// The slot to build the next message in, NULL while the outbox is full.
+outbox_message_t *outbox_reserve(outbox_t *outbox)
+{
+    const uint32_t head = outbox->head.load(std::memory_order_relaxed);
+    const uint32_t tail = outbox->tail.load(std::memory_order_acquire);
+
+    if (head - tail >= OUTBOX_CAPACITY)
+    {
+        outbox->refused.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    return &outbox->messages[head & (OUTBOX_CAPACITY - 1)];
+}
+
+void outbox_commit(outbox_t *outbox, const uint32_t now)
+{
+    const uint32_t head = outbox->head.load(std::memory_order_relaxed);
+    const uint32_t size = head - outbox->tail.load(std::memory_order_acquire) + 1;
+
+    outbox->messages[head & (OUTBOX_CAPACITY - 1)].time = now;
+    outbox->head.store(head + 1, std::memory_order_release);
+    outbox->queued.fetch_add(1, std::memory_order_relaxed);
+    if (size > outbox->high_water.load(std::memory_order_relaxed))
+    {
+        outbox->high_water.store(size, std::memory_order_relaxed);
+    }
+}
+
+// The oldest message, NULL if there is none.
+outbox_message_t *outbox_peek(outbox_t *outbox)
+{
+    const uint32_t tail = outbox->tail.load(std::memory_order_relaxed);
+    const uint32_t head = outbox->head.load(std::memory_order_acquire);
+
+    if (head == tail)
+    {
+        return NULL;
+    }
+    return &outbox->messages[tail & (OUTBOX_CAPACITY - 1)];
+}
+
+void outbox_release(outbox_t *outbox)
+{
+    const uint32_t tail = outbox->tail.load(std::memory_order_relaxed);
+    outbox->tail.store(tail + 1, std::memory_order_release);
+}
+
+uint32_t outbox_size(const outbox_t *outbox)
+{
+    return outbox->head.load(std::memory_order_acquire) - outbox->tail.load(std::memory_order_acquire);
+}
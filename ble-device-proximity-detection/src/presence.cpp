@@ -0,0 +1,169 @@
+/*
+ * presence.cpp
+ */
+
+#include <string.h>
+#include "metrics.h"
+#include "presence.h"
+
+static_assert((PRESENCE_TABLE_CAPACITY & (PRESENCE_TABLE_CAPACITY - 1)) == 0, "PRESENCE_TABLE_CAPACITY must be a power of two");
+
+#define PRESENCE_MASK (PRESENCE_TABLE_CAPACITY - 1)
+
+// Fibonacci hashing, vendor prefixes make the low address bytes the
+// only ones that differ between badges.
+static inline size_t presence_home(const uint64_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 40) & PRESENCE_MASK;
+}
+
+uint64_t presence_key(const uint8_t *address)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < HAL_BLE_ADDRESS_LENGTH; i++)
+    {
+        key = (key << 8) | address[i];
+    }
+    return key;
+}
+
+void presence_address(const uint64_t key, uint8_t *address)
+{
+    for (int i = HAL_BLE_ADDRESS_LENGTH - 1, shift = 0; i >= 0; i--, shift += 8)
+    {
+        address[i] = (uint8_t)(key >> shift);
+    }
+}
+
+void presence_init(presence_table_t *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+// Returns the slot holding key or the empty slot ending its probe run.
+static size_t presence_probe(const presence_table_t *table, const uint64_t key)
+{
+    size_t slot = presence_home(key);
+    while (table->entries[slot].key != 0 && table->entries[slot].key != key)
+    {
+        slot = (slot + 1) & PRESENCE_MASK;
+    }
+    return slot;
+}
+
+presence_entry_t *presence_update(
+    presence_table_t *table,
+    const uint8_t *address,
+    const int rssi,
+    const uint32_t time)
+{
+    const uint64_t key = presence_key(address);
+    if (key == 0)
+    {
+        return NULL;
+    }
+
+    presence_entry_t *entry = &table->entries[presence_probe(table, key)];
+    if (entry->key == 0)
+    {
+        if (table->count >= PRESENCE_TABLE_MAX_ENTRIES)
+        {
+            table->rejected++;
+            metrics_count(METRIC_PRESENCE_REJECTED);
+            return NULL;
+        }
+        entry->key = key;
+        entry->first_seen = time;
+        entry->hits = 0;
+        entry->rssi_min = (int8_t)rssi;
+        entry->rssi_max = (int8_t)rssi;
+        entry->zone = PROXIMITY_AWAY;
+        entry->dwell_reported = false;
+        entry->zone_since = time;
+        if (++table->count > table->high_water)
+        {
+            table->high_water = table->count;
+        }
+    }
+
+    entry->rssi_smoothed = proximity_smooth(entry->rssi_smoothed, rssi, entry->hits == 0);
+    entry->last_seen = time;
+    entry->hits++;
+    entry->rssi_last = (int8_t)rssi;
+    if (rssi < entry->rssi_min)
+    {
+        entry->rssi_min = (int8_t)rssi;
+    }
+    if (rssi > entry->rssi_max)
+    {
+        entry->rssi_max = (int8_t)rssi;
+    }
+    return entry;
+}
+
+presence_entry_t *presence_find(presence_table_t *table, const uint8_t *address)
+{
+    const uint64_t key = presence_key(address);
+    presence_entry_t *entry = &table->entries[presence_probe(table, key)];
+    return entry->key != 0 ? entry : NULL;
+}
+
+// Deletes the entry in slot and shifts later members of its probe run
+// back, so lookups never need tombstones.
+static void presence_remove(presence_table_t *table, size_t slot)
+{
+    size_t next = slot;
+    for (;;)
+    {
+        next = (next + 1) & PRESENCE_MASK;
+        const presence_entry_t *candidate = &table->entries[next];
+        if (candidate->key == 0)
+        {
+            break;
+        }
+        // Move the candidate unless its home lies cyclically in (slot, next].
+        const size_t home = presence_home(candidate->key);
+        if (((next - home) & PRESENCE_MASK) >= ((next - slot) & PRESENCE_MASK))
+        {
+            table->entries[slot] = *candidate;
+            slot = next;
+        }
+    }
+    table->entries[slot].key = 0;
+    table->count--;
+}
+
+// Removes every badge not seen for more than max_age ms.
+uint32_t presence_expire(presence_table_t *table, const uint32_t now, const uint32_t max_age)
+{
+    uint32_t removed = 0;
+    size_t slot = 0;
+    while (slot < PRESENCE_TABLE_CAPACITY)
+    {
+        presence_entry_t *entry = &table->entries[slot];
+        if (entry->key != 0 && now - entry->last_seen > max_age)
+        {
+            // The slot may now hold a shifted entry, look at it again.
+            presence_remove(table, slot);
+            removed++;
+            continue;
+        }
+        slot++;
+    }
+    table->expired += removed;
+    return removed;
+}
+
+// Iterates the occupied slots, start with *cursor = 0.
+presence_entry_t *presence_next(presence_table_t *table, size_t *cursor)
+{
+    while (*cursor < PRESENCE_TABLE_CAPACITY)
+    {
+        presence_entry_t *entry = &table->entries[(*cursor)++];
+        if (entry->key != 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
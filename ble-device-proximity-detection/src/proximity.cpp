@@ -0,0 +1,64 @@
+/*
+ * proximity.cpp
+ */
+
+#include "proximity.h"
+
+#define PROXIMITY_ONE (1 << PROXIMITY_RSSI_FRACTION_BITS)
+
+void proximity_config_init(proximity_config_t *config)
+{
+    config->near_enter = PROXIMITY_NEAR_ENTER;
+    config->near_exit = PROXIMITY_NEAR_EXIT;
+    config->room_enter = PROXIMITY_ROOM_ENTER;
+    config->room_exit = PROXIMITY_ROOM_EXIT;
+}
+
+// One EMA step in fixed point: s += (rssi - s) * 2^-PROXIMITY_EMA_SHIFT.
+// The first sample initializes the average.
+int16_t proximity_smooth(const int16_t smoothed, const int rssi, const bool first)
+{
+    const int32_t sample = rssi * PROXIMITY_ONE;
+    if (first)
+    {
+        return (int16_t)sample;
+    }
+    return (int16_t)(smoothed + ((sample - smoothed) >> PROXIMITY_EMA_SHIFT));
+}
+
+// Smoothed RSSI rounded to whole dBm.
+int proximity_rssi(const int16_t smoothed)
+{
+    return (smoothed + PROXIMITY_ONE / 2) >> PROXIMITY_RSSI_FRACTION_BITS;
+}
+
+proximity_zone_t proximity_classify(
+    const proximity_config_t *config,
+    const proximity_zone_t zone,
+    const int16_t smoothed)
+{
+    if (smoothed >= config->near_enter * PROXIMITY_ONE ||
+        (zone == PROXIMITY_NEAR && smoothed >= config->near_exit * PROXIMITY_ONE))
+    {
+        return PROXIMITY_NEAR;
+    }
+    if (smoothed >= config->room_enter * PROXIMITY_ONE ||
+        (zone != PROXIMITY_AWAY && smoothed >= config->room_exit * PROXIMITY_ONE))
+    {
+        return PROXIMITY_IN_ROOM;
+    }
+    return PROXIMITY_AWAY;
+}
+
+const char *proximity_zone_name(const proximity_zone_t zone)
+{
+    switch (zone)
+    {
+    case PROXIMITY_NEAR:
+        return "near";
+    case PROXIMITY_IN_ROOM:
+        return "room";
+    default:
+        return "away";
+    }
+}
@@ -0,0 +1,310 @@
+/*
+ * reminder.cpp
+ */
+
+#include <string.h>
+#include "metrics.h"
+#include "presence.h"
+#include "reminder.h"
+
+typedef struct
+{
+    uint16_t frequency; // Hz, 0 for a rest
+    uint16_t ms;
+} reminder_note_t;
+
+// Two notes falling a fourth, E6 and B5.
+static const reminder_note_t chime[] = {{1319, 120}, {0, 40}, {988, 240}};
+static const int chime_notes = sizeof(chime) / sizeof(chime[0]);
+
+// A quarter of a sine wave in 64 steps and its end.
+static const int16_t quarter_sine[65] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+    6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767};
+
+void reminder_init(reminder_t *reminder)
+{
+    memset(reminder, 0, sizeof(*reminder));
+}
+
+// The entry of the badge; for one not remembered, a free entry or the
+// one with the oldest event.
+static reminder_badge_t *find_badge(reminder_t *reminder, const uint64_t key)
+{
+    reminder_badge_t *oldest = &reminder->badges[0];
+    for (int i = 0; i < REMINDER_BADGES; i++)
+    {
+        reminder_badge_t *badge = &reminder->badges[i];
+        if (badge->key == key)
+        {
+            return badge;
+        }
+        if (badge->key == 0)
+        {
+            oldest = badge;
+        }
+        else if (oldest->key != 0 && (int32_t)(badge->seen - oldest->seen) < 0)
+        {
+            oldest = badge;
+        }
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->key = key;
+    return oldest;
+}
+
+// Follows the visit of a badge: entering REMINDER_ZONE or nearer starts
+// one, covered by a dwell at the dispenser in the last
+// REMINDER_RUB_VALID ms; a dwell during the visit covers it. A zone
+// change leaves one zone and enters the next with the same update, so
+// a leave only ends the visit if no enter follows it before
+// reminder_due(). Aggregation stage.
+void reminder_event(reminder_t *reminder, const event_t *event)
+{
+    reminder_badge_t *badge = find_badge(reminder, presence_key(event->address));
+    badge->seen = event->time;
+    switch (event->type)
+    {
+    case EVENT_DWELL:
+        badge->rubbed = true;
+        badge->rub_time = event->time;
+        badge->covered = true;
+        break;
+    case EVENT_ENTER:
+        badge->leaving = false;
+        if (!badge->visiting && event->zone >= REMINDER_ZONE)
+        {
+            badge->visiting = true;
+            badge->entered = event->time;
+            badge->covered = badge->rubbed && event->time - badge->rub_time < REMINDER_RUB_VALID;
+        }
+        break;
+    default:
+        badge->leaving = badge->visiting;
+        break;
+    }
+}
+
+// Whether the visit of a badge calls for a reminder: it left, or it has
+// been in the room for REMINDER_GRACE ms, without using the dispenser.
+// time gets the moment it became due: now for a visit that ended, a
+// badge gone quiet leaves as of its last advertisement, long before.
+static bool visit_due(reminder_badge_t *badge, const uint32_t now, uint32_t *time)
+{
+    if (badge->leaving)
+    {
+        badge->visiting = false;
+        badge->leaving = false;
+        *time = now;
+        return !badge->covered;
+    }
+    if (badge->covered || now - badge->entered < REMINDER_GRACE)
+    {
+        return false;
+    }
+    badge->covered = true;
+    *time = badge->entered + REMINDER_GRACE;
+    return true;
+}
+
+// The next visit due a reminder, if any: the address of its badge and
+// the time it became due. A badge reminded in the last
+// REMINDER_REPEAT_AFTER ms is not reminded again. Call after each batch
+// of events until it returns false. Aggregation stage.
+bool reminder_due(reminder_t *reminder, const uint32_t now, uint8_t *address, uint32_t *time)
+{
+    for (int i = 0; i < REMINDER_BADGES; i++)
+    {
+        reminder_badge_t *badge = &reminder->badges[i];
+        if (badge->key == 0 || !badge->visiting || !visit_due(badge, now, time))
+        {
+            continue;
+        }
+        if (badge->reminded && *time - badge->reminded_at < REMINDER_REPEAT_AFTER)
+        {
+            continue;
+        }
+        badge->reminded = true;
+        badge->reminded_at = *time;
+        presence_address(badge->key, address);
+        return true;
+    }
+    return false;
+}
+
+void reminder_player_init(reminder_player_t *player)
+{
+    memset(player, 0, sizeof(*player));
+}
+
+// Samples of the chime.
+uint32_t reminder_cue_samples()
+{
+    uint32_t samples = 0;
+    for (int i = 0; i < chime_notes; i++)
+    {
+        samples += (uint32_t)chime[i].ms * HAL_AUDIO_SAMPLE_RATE / 1000;
+    }
+    return samples;
+}
+
+static int16_t sine(const uint8_t step)
+{
+    const int index = step & 63;
+    switch (step >> 6)
+    {
+    case 0:
+        return quarter_sine[index];
+    case 1:
+        return quarter_sine[64 - index];
+    case 2:
+        return -quarter_sine[index];
+    default:
+        return -quarter_sine[64 - index];
+    }
+}
+
+static void start_note(reminder_player_t *player)
+{
+    player->note_sample = 0;
+    player->phase = 0;
+    if (player->note < chime_notes)
+    {
+        player->increment = (uint32_t)(((uint64_t)chime[player->note].frequency << 32) / HAL_AUDIO_SAMPLE_RATE);
+    }
+}
+
+// The next DMA buffer's worth of the chime, each note faded in and out
+// over REMINDER_RAMP samples so its edges do not click.
+static void render_block(reminder_player_t *player)
+{
+    size_t length = 0;
+    while (length < HAL_AUDIO_DMA_SAMPLES && player->note < chime_notes)
+    {
+        const reminder_note_t *note = &chime[player->note];
+        const uint32_t samples = (uint32_t)note->ms * HAL_AUDIO_SAMPLE_RATE / 1000;
+        int32_t value = 0;
+        if (note->frequency)
+        {
+            const uint32_t to_end = samples - 1 - player->note_sample;
+            uint32_t ramp = player->note_sample < to_end ? player->note_sample : to_end;
+            ramp = ramp < REMINDER_RAMP ? ramp : REMINDER_RAMP;
+            value = (int32_t)sine(player->phase >> 24) * REMINDER_VOLUME / 32767 * (int32_t)ramp / REMINDER_RAMP;
+            player->phase += player->increment;
+        }
+        player->block[length++] = (int16_t)value;
+        if (++player->note_sample == samples)
+        {
+            player->note++;
+            start_note(player);
+        }
+    }
+    player->block_length = length;
+    player->block_offset = 0;
+}
+
+// Hands the speaker what it takes without waiting, rendering a DMA
+// buffer's worth whenever the last one is gone. Returns true while
+// there is more of the chime.
+static bool feed_audio(reminder_player_t *player)
+{
+    for (;;)
+    {
+        if (player->block_offset == player->block_length)
+        {
+            if (player->note >= chime_notes)
+            {
+                return false;
+            }
+            render_block(player);
+        }
+        const size_t wanted = player->block_length - player->block_offset;
+        const size_t taken = hal_audio_write(player->block + player->block_offset, wanted);
+        player->block_offset += taken;
+        if (taken < wanted)
+        {
+            return true;
+        }
+    }
+}
+
+// The side bars at the time since the start: bright at once, fading to
+// dark and back every REMINDER_PULSE ms.
+static void show_frame(reminder_player_t *player, const uint32_t elapsed)
+{
+    uint32_t colors[HAL_LEDS];
+    const uint32_t half = REMINDER_PULSE / 2;
+    const uint32_t t = elapsed % REMINDER_PULSE;
+    const uint32_t level = (t < half ? half - t : t - half) * 255 / half;
+    const uint32_t color = ((REMINDER_COLOR >> 16 & 0xff) * level / 255) << 16 |
+                           ((REMINDER_COLOR >> 8 & 0xff) * level / 255) << 8 |
+                           (REMINDER_COLOR & 0xff) * level / 255;
+    for (int i = 0; i < HAL_LEDS; i++)
+    {
+        colors[i] = color;
+    }
+    hal_leds_show(colors);
+    player->frames++;
+}
+
+// Starts the cue for a reminder raised at time (hal_millis() of the
+// event), the first LED frame and DMA buffer right away. A reminder
+// while a cue plays is merged into it. Feedback stage.
+void reminder_play(reminder_player_t *player, const uint32_t time, const uint32_t now)
+{
+    if (player->playing)
+    {
+        player->merged++;
+        return;
+    }
+    player->playing = true;
+    player->started = now;
+    player->next_frame = now;
+    player->lit = true;
+    player->note = 0;
+    player->block_length = 0;
+    player->block_offset = 0;
+    start_note(player);
+
+    const uint32_t latency = now - time;
+    player->cues++;
+    player->latency_ms_total += latency;
+    player->latency_ms_max = latency > player->latency_ms_max ? latency : player->latency_ms_max;
+    metrics_record(METRIC_REMINDER_US, latency * 1000);
+    reminder_step(player, now);
+}
+
+// The LED frame that is due, frames missed are skipped, and the free
+// DMA buffer. Returns true while the cue plays. Feedback stage.
+bool reminder_step(reminder_player_t *player, const uint32_t now)
+{
+    if (!player->playing)
+    {
+        return false;
+    }
+    const uint32_t elapsed = now - player->started;
+    if (elapsed >= REMINDER_LED_DURATION)
+    {
+        if (player->lit)
+        {
+            const uint32_t dark[HAL_LEDS] = {0};
+            hal_leds_show(dark);
+            player->lit = false;
+        }
+    }
+    else if ((int32_t)(now - player->next_frame) >= 0)
+    {
+        show_frame(player, elapsed);
+        player->next_frame = now - elapsed % REMINDER_FRAME_INTERVAL + REMINDER_FRAME_INTERVAL;
+    }
+    const bool sounding = feed_audio(player);
+    player->playing = player->lit || sounding;
+    return player->playing;
+}
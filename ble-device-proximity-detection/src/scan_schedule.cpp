@@ -0,0 +1,124 @@
+/*
+ * scan_schedule.cpp
+ */
+
+#include <string.h>
+#include "ble_scan.h"
+#include "scan_schedule.h"
+
+// The scan parameters of a mode, the lower duty modes never above the
+// detect settings.
+static void scan_schedule_parameters(const scan_schedule_t *schedule, const scan_mode_t mode, scan_parameters_t *parameters)
+{
+    const scan_parameters_t *full = &schedule->full;
+
+    *parameters = *full;
+    if (mode == SCAN_MODE_STEADY)
+    {
+        parameters->window = full->window * SCAN_SCHEDULE_STEADY_DUTY / 100;
+        parameters->active = false;
+    }
+    else if (mode == SCAN_MODE_IDLE)
+    {
+        parameters->interval = SCAN_SCHEDULE_IDLE_INTERVAL;
+        parameters->window = SCAN_SCHEDULE_IDLE_WINDOW;
+        if ((int64_t)parameters->window * full->interval > (int64_t)full->window * parameters->interval)
+        {
+            parameters->window = (int)((int64_t)full->window * parameters->interval / full->interval);
+        }
+        parameters->active = false;
+    }
+    parameters->window = parameters->window > 0 ? parameters->window : 1;
+}
+
+void scan_schedule_init(
+    scan_schedule_t *schedule,
+    const int interval,
+    const int window,
+    const bool adaptive,
+    const uint32_t now)
+{
+    memset(schedule, 0, sizeof(*schedule));
+    schedule->adaptive = adaptive;
+    schedule->mode = SCAN_MODE_FULL;
+    schedule->last_update = now;
+    schedule->last_activity = now;
+    schedule->last_occupied = now;
+    scan_schedule_configure(schedule, interval, window);
+}
+
+// New detect settings, the current mode scaled to them.
+void scan_schedule_configure(scan_schedule_t *schedule, const int interval, const int window)
+{
+    schedule->full.interval = interval;
+    schedule->full.window = window;
+    schedule->full.active = BLE_SCAN_SETUP_ACTIVE_SCAN;
+    scan_schedule_parameters(schedule, schedule->mode, &schedule->parameters);
+}
+
+// Accounts the radio time since the last update and moves to the mode
+// the badges call for: activity is an arrival or a zone change,
+// occupied whether any badge is in range. Returns whether the scan
+// parameters changed.
+bool scan_schedule_update(
+    scan_schedule_t *schedule,
+    const bool occupied,
+    const bool activity,
+    const uint32_t now)
+{
+    const uint64_t elapsed = now - schedule->last_update;
+    const uint64_t scanning = elapsed * 1000 * schedule->parameters.window / schedule->parameters.interval;
+    schedule->scan_us += scanning;
+    schedule->active_us += schedule->parameters.active ? scanning : 0;
+    schedule->last_update = now;
+
+    if (activity)
+    {
+        schedule->last_activity = now;
+    }
+    if (occupied || activity)
+    {
+        schedule->last_occupied = now;
+    }
+    if (!schedule->adaptive)
+    {
+        return false;
+    }
+
+    scan_mode_t mode = SCAN_MODE_FULL;
+    if (now - schedule->last_occupied >= SCAN_SCHEDULE_IDLE_AFTER)
+    {
+        mode = SCAN_MODE_IDLE;
+    }
+    else if (now - schedule->last_activity >= SCAN_SCHEDULE_STEADY_AFTER)
+    {
+        mode = SCAN_MODE_STEADY;
+    }
+    if (mode == schedule->mode)
+    {
+        return false;
+    }
+
+    schedule->mode = mode;
+    schedule->switches++;
+    scan_parameters_t parameters;
+    scan_schedule_parameters(schedule, mode, &parameters);
+    const bool changed = parameters.interval != schedule->parameters.interval ||
+                         parameters.window != schedule->parameters.window ||
+                         parameters.active != schedule->parameters.active;
+    schedule->parameters = parameters;
+    return changed;
+}
+
+const char *scan_mode_name(const scan_mode_t mode)
+{
+    switch (mode)
+    {
+    case SCAN_MODE_FULL:
+        return "full";
+    case SCAN_MODE_STEADY:
+        return "steady";
+    default:
+        return "idle";
+    }
+}
@@ -0,0 +1,414 @@
+/*
+ * shadow.cpp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proximity.h"
+#include "shadow.h"
+
+static_assert(SHADOW_UPDATE_SIZE <= SHADOW_DOCUMENT_SIZE, "SHADOW_DOCUMENT_SIZE too small for an update");
+static_assert(SHADOW_UPDATE_BYTES < SHADOW_STATE_MAX, "an update must fit the shadow state");
+static_assert(SHADOW_ALLOWLIST_REPORT_SIZE <= SHADOW_DOCUMENT_SIZE, "SHADOW_DOCUMENT_SIZE too small for an allowlist report");
+
+void shadow_init(shadow_state_t *shadow, const uint32_t resync_interval)
+{
+    memset(shadow, 0, sizeof(*shadow));
+    shadow->resync_interval = resync_interval;
+    shadow->sequence = 1; // 0 is no token
+}
+
+bool shadow_resync_due(const shadow_state_t *shadow, const uint32_t now)
+{
+    return !shadow->synced || now - shadow->last_resync >= shadow->resync_interval;
+}
+
+// Starts an update: the client token, and returns state.reported.
+static JsonObject shadow_reported(const shadow_state_t *shadow, JsonDocument *document)
+{
+    char token[SHADOW_CLIENT_TOKEN_SIZE];
+    snprintf(token, sizeof(token), "%lu", (unsigned long)shadow->sequence);
+
+    document->clear();
+    (*document)["clientToken"] = token;
+    return document->createNestedObject("state").createNestedObject("reported");
+}
+
+bool shadow_detect_changed(const shadow_state_t *shadow, const shadow_detect_t *detect)
+{
+    return shadow->detect_stale ||
+           detect->interval != shadow->detect.interval ||
+           detect->window != shadow->detect.window ||
+           detect->duration != shadow->detect.duration ||
+           strcmp(detect->name_prefix, shadow->detect.name_prefix) != 0 ||
+           detect->rssi_threshold != shadow->detect.rssi_threshold;
+}
+
+// The next update carries all detect settings, changed or not: the
+// answer to a desired state, which AWS IoT keeps as a delta until the
+// reported state matches it.
+void shadow_report_detect(shadow_state_t *shadow)
+{
+    shadow->detect_stale = true;
+}
+
+// Counts the badges in range by zone.
+void shadow_count_zones(presence_table_t *presence, shadow_zones_t *zones)
+{
+    size_t cursor = 0;
+    presence_entry_t *entry;
+
+    memset(zones, 0, sizeof(*zones));
+    while ((entry = presence_next(presence, &cursor)) != NULL)
+    {
+        if (entry->zone != PROXIMITY_AWAY && entry->zone < SHADOW_ZONES && zones->badges[entry->zone] < UINT16_MAX)
+        {
+            zones->badges[entry->zone]++;
+        }
+    }
+}
+
+// Returns how far the zone counts are from the ones last published: a
+// badge that came or went counts once, one that moved from zone to zone
+// twice.
+int shadow_changes(const shadow_state_t *shadow, const shadow_zones_t *zones)
+{
+    int changes = 0;
+    for (int zone = PROXIMITY_IN_ROOM; zone < SHADOW_ZONES; zone++)
+    {
+        const int difference = (int)zones->badges[zone] - (int)shadow->zones.badges[zone];
+        changes += difference < 0 ? -difference : difference;
+    }
+    return changes;
+}
+
+// Builds the next update: the detect settings that changed and the zone
+// counts if any changed. A reset carries all of them, and detected set
+// to null to drop the badges earlier versions kept in the shadow.
+void shadow_build_update(
+    const shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    JsonDocument *document)
+{
+    JsonObject reported = shadow_reported(shadow, document);
+
+    // Members of detect are created as they are set.
+    const bool all = reset || shadow->detect_stale;
+    if (all || detect->interval != shadow->detect.interval)
+    {
+        reported["detect"]["interval"] = detect->interval;
+    }
+    if (all || detect->window != shadow->detect.window)
+    {
+        reported["detect"]["window"] = detect->window;
+    }
+    if (all || detect->duration != shadow->detect.duration)
+    {
+        reported["detect"]["duration"] = detect->duration;
+    }
+    if (all || strcmp(detect->name_prefix, shadow->detect.name_prefix) != 0)
+    {
+        reported["detect"]["name_prefix"] = (char *)detect->name_prefix;
+    }
+    if (all || detect->rssi_threshold != shadow->detect.rssi_threshold)
+    {
+        reported["detect"]["rssi_threshold"] = detect->rssi_threshold;
+    }
+
+    if (reset || shadow_changes(shadow, zones) > 0)
+    {
+        JsonObject counts = reported.createNestedObject("zones");
+        for (int zone = PROXIMITY_IN_ROOM; zone < SHADOW_ZONES; zone++)
+        {
+            counts[proximity_zone_name((proximity_zone_t)zone)] = zones->badges[zone];
+        }
+    }
+    if (reset)
+    {
+        reported["detected"] = (const char *)NULL;
+    }
+}
+
+// Records an update as the reported state.
+void shadow_commit_update(
+    shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    const uint32_t now)
+{
+    shadow->detect = *detect;
+    shadow->zones = *zones;
+    if (reset)
+    {
+        shadow->synced = true;
+        shadow->last_resync = now;
+    }
+}
+
+// Records an update as queued, shadow_build_update() having built it:
+// it waits for its answer under the current sequence, the next one
+// gets a new token.
+void shadow_expect(
+    shadow_state_t *shadow,
+    const shadow_detect_t *detect,
+    const shadow_zones_t *zones,
+    const bool reset,
+    const uint32_t now)
+{
+    shadow_pending_t *pending = &shadow->pending;
+    pending->waiting = true;
+    pending->rejected = false;
+    pending->all_detect = reset || shadow->detect_stale;
+    pending->token = shadow->sequence;
+    pending->since = now;
+    pending->detect = *detect;
+    pending->zones = *zones;
+    pending->reset = reset;
+
+    shadow->detect_stale = false;
+    shadow->sequence = shadow->sequence == UINT32_MAX ? 1 : shadow->sequence + 1;
+}
+
+// Gives up on an update: the reported state stays as it was.
+static void shadow_give_up(shadow_state_t *shadow)
+{
+    shadow->pending.waiting = false;
+    shadow->detect_stale = shadow->detect_stale || shadow->pending.all_detect;
+}
+
+// Whether an update still waits for its answer. The timeout runs while
+// online only, an update kept in the log while offline goes out once
+// connected again. Gives up on one rejected or not answered in time.
+bool shadow_waiting(shadow_state_t *shadow, const bool online, const uint32_t now)
+{
+    shadow_pending_t *pending = &shadow->pending;
+    if (!pending->waiting)
+    {
+        return false;
+    }
+    if (!online && !pending->rejected)
+    {
+        pending->since = now;
+        return true;
+    }
+    if (now - pending->since < SHADOW_ANSWER_TIMEOUT)
+    {
+        return true;
+    }
+    if (!pending->rejected)
+    {
+        shadow->unanswered++;
+    }
+    shadow_give_up(shadow);
+    return false;
+}
+
+// Takes the answer to the update with the given client token. Returns 1
+// if it was the update waiting and got accepted, 0 if rejected, -1 for
+// any other token.
+int shadow_answer(shadow_state_t *shadow, const uint32_t token, const bool accepted)
+{
+    shadow_pending_t *pending = &shadow->pending;
+    if (!pending->waiting || pending->rejected || token != pending->token)
+    {
+        return -1;
+    }
+    if (!accepted)
+    {
+        pending->rejected = true;
+        return 0;
+    }
+    pending->waiting = false;
+    shadow_commit_update(shadow, &pending->detect, &pending->zones, pending->reset, pending->since);
+    shadow->accepted++;
+    return 1;
+}
+
+// What deserializeJson() keeps of a delta or get/accepted document.
+void shadow_desired_filter(JsonDocument *filter)
+{
+    filter->clear();
+    (*filter)["state"]["detect"] = true;
+    (*filter)["state"]["desired"]["detect"] = true;
+    (*filter)["state"]["allowlist"] = true;
+    (*filter)["state"]["delta"]["allowlist"] = true;
+}
+
+// Takes an integer member in [min, max], counts it as rejected if it is
+// anything else. Absent and null members are left alone.
+static bool shadow_desired_int(
+    JsonObjectConst desired,
+    const char *key,
+    const int min,
+    const int max,
+    int *value,
+    int *rejected)
+{
+    JsonVariantConst member = desired[key];
+    if (member.isNull())
+    {
+        return false;
+    }
+    if (!member.is<int>() || member.as<int>() < min || member.as<int>() > max)
+    {
+        (*rejected)++;
+        return false;
+    }
+    *value = member.as<int>();
+    return true;
+}
+
+// Takes the valid desired detect settings of a filtered delta or
+// get/accepted document into *detect, the others keep their value.
+// Returns the number of settings rejected, -1 if the document has none.
+int shadow_desired_detect(const JsonDocument *document, shadow_detect_t *detect)
+{
+    JsonObjectConst desired = (*document)["state"]["detect"];
+    if (desired.isNull())
+    {
+        desired = (*document)["state"]["desired"]["detect"];
+    }
+    if (desired.isNull())
+    {
+        return -1;
+    }
+
+    shadow_detect_t next = *detect;
+    int rejected = 0;
+    const bool interval = shadow_desired_int(desired, "interval", SHADOW_DETECT_INTERVAL_MIN, SHADOW_DETECT_INTERVAL_MAX, &next.interval, &rejected);
+    const bool window = shadow_desired_int(desired, "window", SHADOW_DETECT_INTERVAL_MIN, SHADOW_DETECT_INTERVAL_MAX, &next.window, &rejected);
+    shadow_desired_int(desired, "duration", SHADOW_DETECT_DURATION_MIN, SHADOW_DETECT_DURATION_MAX, &next.duration, &rejected);
+    shadow_desired_int(desired, "rssi_threshold", SHADOW_DETECT_RSSI_MIN, SHADOW_DETECT_RSSI_MAX, &next.rssi_threshold, &rejected);
+
+    // A window longer than the interval rejects whichever of the two
+    // was set.
+    if (next.window > next.interval)
+    {
+        rejected += interval + window;
+        next.interval = detect->interval;
+        next.window = detect->window;
+    }
+
+    JsonVariantConst name_prefix = desired["name_prefix"];
+    if (!name_prefix.isNull())
+    {
+        const char *value = name_prefix.as<const char *>();
+        const size_t length = value ? strlen(value) : 0;
+        if (length > 0 && length < sizeof(next.name_prefix))
+        {
+            memcpy(next.name_prefix, value, length + 1);
+        }
+        else
+        {
+            rejected++;
+        }
+    }
+
+    *detect = next;
+    return rejected;
+}
+
+// Takes the allowlist changes of a filtered delta or get/accepted
+// document, at most SHADOW_ALLOWLIST_CHANGES_MAX; more tells whether
+// there are others, truncated that the document was cut short for lack
+// of memory. Members other than an address set to true or false are
+// rejected. Returns the number rejected, -1 if the document has no
+// allowlist.
+int shadow_desired_allowlist(const JsonDocument *document, const bool truncated, shadow_allowlist_t *allowlist)
+{
+    JsonObjectConst desired = (*document)["state"]["allowlist"];
+    if (desired.isNull())
+    {
+        desired = (*document)["state"]["delta"]["allowlist"];
+    }
+    if (desired.isNull())
+    {
+        return -1;
+    }
+
+    int rejected = 0;
+    allowlist->count = 0;
+    allowlist->more = truncated;
+    for (JsonPairConst member : desired)
+    {
+        uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+        if (!member.value().is<bool>() || !allowlist_parse_address(member.key().c_str(), address))
+        {
+            rejected++;
+            continue;
+        }
+        if (allowlist->count == SHADOW_ALLOWLIST_CHANGES_MAX)
+        {
+            allowlist->more = true;
+            continue;
+        }
+        allowlist_change_t *change = &allowlist->changes[allowlist->count++];
+        change->key = presence_key(address);
+        change->add = member.value().as<bool>();
+        change->applied = false;
+    }
+    return rejected;
+}
+
+// The changes applied, as the desired state has them, which clears
+// them from the delta. Without changes "allowlist" is set to null: the
+// shadow reports no badges, the whole desired list becomes the delta.
+void shadow_build_allowlist(const shadow_allowlist_t *allowlist, JsonDocument *document)
+{
+    document->clear();
+    JsonObject reported = document->createNestedObject("state").createNestedObject("reported");
+    if (allowlist == NULL)
+    {
+        reported["allowlist"] = (const char *)NULL;
+        return;
+    }
+
+    JsonObject members = reported.createNestedObject("allowlist");
+    for (size_t i = 0; i < allowlist->count; i++)
+    {
+        const allowlist_change_t *change = &allowlist->changes[i];
+        if (!change->applied)
+        {
+            continue;
+        }
+        uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+        char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+        presence_address(change->key, address);
+        ble_scan_format_address(address, id);
+        members[id] = change->add;
+    }
+}
+
+// What deserializeJson() keeps of an update/rejected document.
+void shadow_response_filter(JsonDocument *filter)
+{
+    filter->clear();
+    (*filter)["code"] = true;
+    (*filter)["message"] = true;
+    (*filter)["clientToken"] = true;
+}
+
+// Takes the response to an update out of a filtered document. A client
+// token other than the decimal sequence shadow_reported() writes is
+// taken as none.
+void shadow_response(const JsonDocument *document, shadow_response_t *response)
+{
+    memset(response, 0, sizeof(*response));
+    JsonVariantConst code = (*document)["code"];
+    response->code = code.is<int>() ? code.as<int>() : 0;
+    const char *message = (*document)["message"].as<const char *>();
+    snprintf(response->message, sizeof(response->message), "%s", message ? message : "");
+
+    const char *token = (*document)["clientToken"].as<const char *>();
+    char *end = NULL;
+    if (token != NULL && *token >= '0' && *token <= '9')
+    {
+        const unsigned long sequence = strtoul(token, &end, 10);
+        response->tokened = *end == '\0';
+        response->token = response->tokened ? (uint32_t)sequence : 0;
+    }
+}
@@ -0,0 +1,249 @@
+/*
+ * store.cpp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug2serial.h"
+#include "hal.h"
+#include "store.h"
+
+#define STORE_MAGIC 0xa5
+
+// Header and payload go to the card with a single write.
+static uint8_t record_buffer[STORE_HEADER_SIZE + STORE_RECORD_MAX];
+
+static void segment_path(char *path, const uint32_t segment)
+{
+    snprintf(path, STORE_PATH_SIZE, "%s/%08lu.seg", STORE_DIRECTORY, (unsigned long)segment);
+}
+
+// Bitwise CRC-32 (IEEE 802.3, reflected), no table to keep in RAM; a
+// record is written and read once.
+uint32_t store_crc32(uint32_t crc, const uint8_t *data, const size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320UL & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// Reads and checks the record at the offset. Returns the payload length,
+// 0 at the end of the segment and -1 for a torn or damaged record.
+static int read_record(const char *path, const uint32_t offset, uint8_t *kind, uint8_t *data, const size_t size)
+{
+    uint8_t header[STORE_HEADER_SIZE];
+    const size_t read = hal_storage_read(path, offset, header, sizeof(header));
+    if (read == 0)
+    {
+        return 0;
+    }
+
+    const size_t length = header[2] | (header[3] << 8);
+    if (read < sizeof(header) || header[0] != STORE_MAGIC || length > STORE_RECORD_MAX || length > size)
+    {
+        return -1;
+    }
+    if (hal_storage_read(path, offset + sizeof(header), data, length) != length)
+    {
+        return -1;
+    }
+
+    const uint32_t crc = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+    if (store_crc32(store_crc32(0, header + 1, 3), data, length) != crc)
+    {
+        return -1;
+    }
+    *kind = header[1];
+    return (int)length;
+}
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+} segment_scan_t;
+
+static void list_segment(const char *name, void *context)
+{
+    segment_scan_t *scan = (segment_scan_t *)context;
+    char *end;
+    const unsigned long segment = strtoul(name, &end, 10);
+    if (end == name || strcmp(end, ".seg") != 0 || segment == 0)
+    {
+        return;
+    }
+    if (scan->count == 0 || segment < scan->first)
+    {
+        scan->first = segment;
+    }
+    if (scan->count == 0 || segment > scan->last)
+    {
+        scan->last = segment;
+    }
+    scan->count++;
+}
+
+// Finds the segments left over from before the restart. The newest may
+// end in a record torn by a reset or power loss: its valid records are
+// counted up to there (replay counts the torn one as corrupt when it
+// gets to it), and appending starts over in a new segment so
+// nothing is ever written after a torn tail.
+bool store_init(store_t *store)
+{
+    memset(store, 0, sizeof(*store));
+    if (!hal_storage_init(STORE_DIRECTORY))
+    {
+        DEBUG_TRACE(STORE_NO_CARD);
+        return false;
+    }
+
+    segment_scan_t scan = {};
+    hal_storage_list(STORE_DIRECTORY, list_segment, &scan);
+    store->first = scan.count ? scan.first : 1;
+    store->last = scan.count ? scan.last + 1 : 1;
+    store->ready = true;
+
+    if (scan.count)
+    {
+        char path[STORE_PATH_SIZE];
+        segment_path(path, scan.last);
+        uint32_t offset = 0;
+        uint32_t records = 0;
+        uint8_t kind;
+        int length;
+        while ((length = read_record(path, offset, &kind, record_buffer, STORE_RECORD_MAX)) > 0)
+        {
+            offset += STORE_HEADER_SIZE + length;
+            records++;
+        }
+
+        DEBUG_TRACE(STORE_RECOVERED, scan.count, records, length < 0 ? " and a torn tail." : ".");
+    }
+    return true;
+}
+
+// Drops the oldest segment and whatever was not replayed from it.
+static void evict(store_t *store)
+{
+    char path[STORE_PATH_SIZE];
+    segment_path(path, store->first);
+    hal_storage_remove(path);
+    store->first++;
+    store->read_offset = 0;
+    store->evicted++;
+    DEBUG_TRACE(STORE_EVICTED);
+}
+
+// Appends a record, starting a new segment when the current one is full
+// and evicting the oldest to make room for it.
+bool store_append(store_t *store, const uint8_t kind, const uint8_t *data, const size_t length)
+{
+    if (!store->ready || length == 0 || length > STORE_RECORD_MAX)
+    {
+        return false;
+    }
+
+    const uint32_t size = STORE_HEADER_SIZE + length;
+    if (store->write_offset > 0 && store->write_offset + size > STORE_SEGMENT_SIZE)
+    {
+        store->last++;
+        store->write_offset = 0;
+    }
+    if (store->write_offset == 0)
+    {
+        while (store->first < store->last &&
+               (store->last - store->first >= STORE_MAX_SEGMENTS || hal_storage_free() < STORE_SEGMENT_SIZE))
+        {
+            evict(store);
+        }
+    }
+
+    uint8_t *header = record_buffer;
+    header[0] = STORE_MAGIC;
+    header[1] = kind;
+    header[2] = length & 0xff;
+    header[3] = length >> 8;
+    const uint32_t crc = store_crc32(store_crc32(0, header + 1, 3), data, length);
+    header[4] = crc & 0xff;
+    header[5] = (crc >> 8) & 0xff;
+    header[6] = (crc >> 16) & 0xff;
+    header[7] = crc >> 24;
+    memcpy(record_buffer + STORE_HEADER_SIZE, data, length);
+
+    char path[STORE_PATH_SIZE];
+    segment_path(path, store->last);
+    if (!hal_storage_append(path, record_buffer, size))
+    {
+        // Whatever made it to the card is a torn record now, the next
+        // append goes to a new segment.
+        store->last++;
+        store->write_offset = 0;
+        return false;
+    }
+    store->write_offset += size;
+    store->appended++;
+    return true;
+}
+
+bool store_pending(const store_t *store)
+{
+    return store->ready && (store->first < store->last || store->read_offset < store->write_offset);
+}
+
+// Copies the oldest record not yet replayed, leaves it in the log.
+// Segments read to the end or to a damaged record are deleted on the
+// way. Returns the payload length, 0 if nothing is pending.
+size_t store_peek(store_t *store, uint8_t *kind, uint8_t *data, const size_t size)
+{
+    char path[STORE_PATH_SIZE];
+
+    while (store_pending(store))
+    {
+        segment_path(path, store->first);
+        const int length = read_record(path, store->read_offset, kind, data, size);
+        if (length > 0)
+        {
+            return length;
+        }
+        if (length < 0)
+        {
+            store->corrupt++;
+        }
+        hal_storage_remove(path);
+        if (store->first == store->last)
+        {
+            // The segment being appended to: start over with a new one.
+            store->last++;
+            store->write_offset = 0;
+        }
+        store->first++;
+        store->read_offset = 0;
+    }
+    return 0;
+}
+
+// Drops the record store_peek() returned, once the broker took it. The
+// log is empty when the last one is gone, its segment is deleted.
+void store_advance(store_t *store, const size_t length)
+{
+    store->read_offset += STORE_HEADER_SIZE + length;
+    store->replayed++;
+    if (store->first == store->last && store->read_offset >= store->write_offset)
+    {
+        char path[STORE_PATH_SIZE];
+        segment_path(path, store->first);
+        hal_storage_remove(path);
+        store->first = ++store->last;
+        store->read_offset = 0;
+        store->write_offset = 0;
+    }
+}
@@ -0,0 +1,136 @@
+/*
+ * telemetry.cpp
+ */
+
+#include "proximity.h"
+#include "cbor.h"
+#include "wallclock.h"
+#include "telemetry.h"
+
+static_assert(TELEMETRY_RECORDS_PER_PAGE > 0, "TELEMETRY_DOCUMENT_SIZE or TELEMETRY_BUFFER_SIZE too small for a single badge");
+
+// Returns the number of messages needed for the badges that are not
+// away, 0 if there are none.
+int telemetry_pages(presence_table_t *presence)
+{
+    size_t cursor = 0;
+    presence_entry_t *entry;
+    int count = 0;
+
+    while ((entry = presence_next(presence, &cursor)) != NULL)
+    {
+        if (entry->zone != PROXIMITY_AWAY)
+        {
+            count++;
+        }
+    }
+
+    return (count + TELEMETRY_RECORDS_PER_PAGE - 1) / TELEMETRY_RECORDS_PER_PAGE;
+}
+
+// Builds page (1 based) of pages with the badges from *cursor on that
+// are not away, as many as fit, and leaves *cursor at the first badge
+// of the next page. time is the epoch time in ms at now (hal_millis()),
+// WALLCLOCK_UNSYNCED while not known. Returns the number of badges.
+int telemetry_build(
+    telemetry_state_t *telemetry,
+    presence_table_t *presence,
+    const uint64_t time,
+    const uint32_t now,
+    size_t *cursor,
+    const int page,
+    const int pages,
+    JsonDocument *document)
+{
+    document->clear();
+    (*document)["seq"] = telemetry->sequence++;
+    (*document)["page"] = page;
+    (*document)["pages"] = pages;
+    if (time != WALLCLOCK_UNSYNCED)
+    {
+        (*document)["time"] = time;
+    }
+    else
+    {
+        (*document)["time"] = (const char *)NULL;
+    }
+    JsonArray badges = document->createNestedArray("badges");
+
+    presence_entry_t *entry;
+    int count = 0;
+
+    while (count < (int)TELEMETRY_RECORDS_PER_PAGE)
+    {
+        const size_t slot = *cursor;
+        if ((entry = presence_next(presence, cursor)) == NULL)
+        {
+            break;
+        }
+        if (entry->zone == PROXIMITY_AWAY)
+        {
+            continue;
+        }
+
+        uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+        char id[BLE_SCAN_ADDRESS_STRING_SIZE];
+        presence_address(entry->key, address);
+        ble_scan_format_address(address, id);
+
+        JsonArray badge = badges.createNestedArray();
+        badge.add(id);
+        badge.add(entry->zone);
+        badge.add(proximity_rssi(entry->rssi_smoothed));
+        badge.add(entry->hits);
+        badge.add(now - entry->last_seen);
+
+        if (document->overflowed())
+        {
+            // Carry the badge over to the next page, or drop and count
+            // one that does not fit a page on its own.
+            badges.remove(badges.size() - 1);
+            if (count > 0)
+            {
+                *cursor = slot;
+            }
+            else
+            {
+                telemetry->dropped++;
+            }
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+// Returns the number of bytes written to buffer, 0 if it is too small.
+size_t telemetry_serialize(
+    const JsonDocument *document,
+    const telemetry_format_t format,
+    uint8_t *buffer,
+    const size_t size)
+{
+    switch (format)
+    {
+    case TELEMETRY_FORMAT_MSGPACK:
+        return measureMsgPack(*document) <= size ? serializeMsgPack(*document, buffer, size) : 0;
+    case TELEMETRY_FORMAT_CBOR:
+        return cbor_serialize(*document, buffer, size);
+    default:
+        return measureJson(*document) < size ? serializeJson(*document, (char *)buffer, size) : 0;
+    }
+}
+
+const char *telemetry_format_name(const telemetry_format_t format)
+{
+    switch (format)
+    {
+    case TELEMETRY_FORMAT_MSGPACK:
+        return "msgpack";
+    case TELEMETRY_FORMAT_CBOR:
+        return "cbor";
+    default:
+        return "json";
+    }
+}
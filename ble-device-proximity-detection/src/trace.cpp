@@ -0,0 +1,250 @@
+/*
+ * trace.cpp
+ */
+
+#include <string.h>
+#include <atomic>
+#include "hal.h"
+#include "trace.h"
+
+static_assert((TRACE_RING_SLOTS & (TRACE_RING_SLOTS - 1)) == 0, "TRACE_RING_SLOTS must be a power of two");
+static_assert(sizeof(trace_record_t) == TRACE_RECORD_SIZE, "trace_record_t is not packed as expected");
+
+// Bounded queue for many producers and one consumer: a producer claims
+// a slot by moving head on, fills it and publishes it through the
+// slot's sequence. A slot is free for position p while its sequence is
+// p, holds the record for p once it is p + 1.
+typedef struct
+{
+    std::atomic<uint32_t> sequence;
+    trace_record_t record;
+} trace_slot_t;
+
+static trace_slot_t slots[TRACE_RING_SLOTS];
+static std::atomic<uint32_t> head(0);
+static std::atomic<uint32_t> tail(0); // moved by the consumer only
+static std::atomic<uint32_t> written(0);
+static std::atomic<uint32_t> dropped(0);
+static std::atomic<uint32_t> high_water(0);
+static uint32_t dropped_reported = 0; // consumer only
+
+// Before any task traces: records the number of formats, which the
+// decoder checks against its own.
+void trace_init()
+{
+    for (uint32_t slot = 0; slot < TRACE_RING_SLOTS; slot++)
+    {
+        slots[slot].sequence.store(slot, std::memory_order_relaxed);
+    }
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    written.store(0, std::memory_order_relaxed);
+    dropped.store(0, std::memory_order_relaxed);
+    high_water.store(0, std::memory_order_relaxed);
+    dropped_reported = 0;
+    trace_write(TRACE_STARTED, (unsigned)TRACE_FORMAT_COUNT);
+}
+
+void trace_begin(trace_record_t *record, const trace_id_t id)
+{
+    record->id = (uint16_t)id;
+    record->length = 0;
+    record->flags = 0;
+    record->time = hal_millis();
+}
+
+// Appends the type and size bytes of the value, returns false and
+// marks the record truncated if they do not fit.
+static bool trace_put(trace_record_t *record, const trace_arg_type_t type, const void *value, const size_t size)
+{
+    if (record->length + 1 + size > sizeof(record->args))
+    {
+        record->flags |= TRACE_FLAG_TRUNCATED;
+        return false;
+    }
+    record->args[record->length++] = (uint8_t)type;
+    memcpy(&record->args[record->length], value, size);
+    record->length += size;
+    return true;
+}
+
+// Integers go out in the byte order of the gateway, little endian on
+// the ESP32 and on the hosts the decoder runs on.
+void trace_add(trace_record_t *record, const int value)
+{
+    const int32_t word = value;
+    trace_put(record, TRACE_ARG_INT32, &word, sizeof(word));
+}
+
+void trace_add(trace_record_t *record, const unsigned value)
+{
+    const uint32_t word = value;
+    trace_put(record, TRACE_ARG_UINT32, &word, sizeof(word));
+}
+
+void trace_add(trace_record_t *record, const long value)
+{
+    trace_add(record, (long long)value);
+}
+
+void trace_add(trace_record_t *record, const unsigned long value)
+{
+    trace_add(record, (unsigned long long)value);
+}
+
+// Values that fit 32 bits are sent as such, whatever the type.
+void trace_add(trace_record_t *record, const long long value)
+{
+    if (value >= INT32_MIN && value <= INT32_MAX)
+    {
+        trace_add(record, (int)value);
+        return;
+    }
+    const int64_t word = value;
+    trace_put(record, TRACE_ARG_INT64, &word, sizeof(word));
+}
+
+void trace_add(trace_record_t *record, const unsigned long long value)
+{
+    if (value <= UINT32_MAX)
+    {
+        trace_add(record, (unsigned)value);
+        return;
+    }
+    const uint64_t word = value;
+    trace_put(record, TRACE_ARG_UINT64, &word, sizeof(word));
+}
+
+// Cut to what is left of the record, the length byte first.
+void trace_add(trace_record_t *record, const char *value)
+{
+    const size_t left = sizeof(record->args) - record->length;
+    size_t length = value ? strlen(value) : 0;
+
+    if (left < 2)
+    {
+        record->flags |= TRACE_FLAG_TRUNCATED;
+        return;
+    }
+    if (length > left - 2)
+    {
+        length = left - 2;
+        record->flags |= TRACE_FLAG_TRUNCATED;
+    }
+    record->args[record->length++] = TRACE_ARG_STRING;
+    record->args[record->length++] = (uint8_t)length;
+    memcpy(&record->args[record->length], value, length);
+    record->length += length;
+}
+
+void trace_add(trace_record_t *record, const trace_address_t value)
+{
+    trace_put(record, TRACE_ARG_ADDRESS, value.address, HAL_BLE_ADDRESS_LENGTH);
+}
+
+// Copies the record into the ring, from any task. Never waits: with
+// the ring full the record is dropped and counted, the drain reports
+// how many were.
+bool trace_commit(const trace_record_t *record)
+{
+    uint32_t position = head.load(std::memory_order_relaxed);
+    trace_slot_t *slot;
+
+    for (;;)
+    {
+        slot = &slots[position & (TRACE_RING_SLOTS - 1)];
+        const int32_t lag = (int32_t)(slot->sequence.load(std::memory_order_acquire) - position);
+        if (lag == 0 && head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        {
+            break;
+        }
+        if (lag < 0)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (lag > 0)
+        {
+            position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    memcpy(&slot->record, record, offsetof(trace_record_t, args) + record->length);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    const uint32_t depth = position + 1 - tail.load(std::memory_order_relaxed);
+    uint32_t seen = high_water.load(std::memory_order_relaxed);
+    while (depth > seen && !high_water.compare_exchange_weak(seen, depth, std::memory_order_relaxed))
+    {
+    }
+    written.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Frames the record for the wire, returns the frame's length.
+size_t trace_frame(const trace_record_t *record, uint8_t *frame)
+{
+    uint8_t *p = frame;
+    *p++ = TRACE_FRAME_START;
+    *p++ = (uint8_t)(TRACE_FRAME_HEADER - 2 + record->length);
+    *p++ = (uint8_t)record->id;
+    *p++ = (uint8_t)(record->id >> 8);
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        *p++ = (uint8_t)(record->time >> shift);
+    }
+    *p++ = record->flags;
+    memcpy(p, record->args, record->length);
+    p += record->length;
+
+    uint8_t check = 0;
+    for (const uint8_t *q = frame + 2; q < p; q++)
+    {
+        check ^= *q;
+    }
+    *p++ = check;
+    return p - frame;
+}
+
+// Consumer side, one task only: hands up to budget records to the sink
+// as frames, oldest first. Once the ring is empty a record of the drops
+// since it last said so follows. Returns the number of records.
+size_t trace_drain(trace_sink_t sink, void *context, const size_t budget)
+{
+    uint8_t frame[TRACE_FRAME_MAX];
+    size_t count = 0;
+
+    while (count < budget)
+    {
+        const uint32_t position = tail.load(std::memory_order_relaxed);
+        trace_slot_t *slot = &slots[position & (TRACE_RING_SLOTS - 1)];
+        if (slot->sequence.load(std::memory_order_acquire) != position + 1)
+        {
+            break;
+        }
+        const size_t length = trace_frame(&slot->record, frame);
+        slot->sequence.store(position + TRACE_RING_SLOTS, std::memory_order_release);
+        tail.store(position + 1, std::memory_order_relaxed);
+        sink(frame, length, context);
+        count++;
+    }
+
+    const uint32_t lost = dropped.load(std::memory_order_relaxed);
+    if (count < budget && lost != dropped_reported)
+    {
+        trace_record_t record;
+        trace_begin(&record, TRACE_DROPPED);
+        trace_add(&record, (unsigned)(lost - dropped_reported));
+        sink(frame, trace_frame(&record, frame), context);
+        dropped_reported = lost;
+        count++;
+    }
+    return count;
+}
+
+void trace_get_statistics(trace_statistics_t *statistics)
+{
+    statistics->written = written.load(std::memory_order_relaxed);
+    statistics->dropped = dropped.load(std::memory_order_relaxed);
+    statistics->high_water = high_water.load(std::memory_order_relaxed);
+}
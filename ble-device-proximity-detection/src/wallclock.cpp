@@ -0,0 +1,92 @@
+/*
+ * wallclock.cpp
+ */
+
+#include <string.h>
+#include "hal.h"
+#include "wallclock.h"
+
+#define WALLCLOCK_NS_PER_MS 1000000LL
+
+void wallclock_init(wallclock_t *clock, const uint32_t now)
+{
+    memset(clock, 0, sizeof(*clock));
+    clock->updated = now;
+    clock->last_sync = now - WALLCLOCK_RETRY_INTERVAL;
+}
+
+static int64_t clamp(const int64_t value, const int64_t limit)
+{
+    return value < -limit ? -limit : value > limit ? limit : value;
+}
+
+// Compares the clock with the system time. The part of the error that
+// is not still being slewed in is drift the correction missed since the
+// last sample; half of it goes into the correction, as SNTP's own
+// updates arrive with some jitter.
+static void wallclock_sync(wallclock_t *clock, const uint32_t now)
+{
+    uint64_t ntp;
+
+    if (!hal_ntp_time(&ntp))
+    {
+        clock->last_sync = now;
+        return;
+    }
+    clock->syncs++;
+    if (!clock->synced)
+    {
+        clock->synced = true;
+        clock->epoch = ntp;
+        clock->last_sync = now;
+        return;
+    }
+
+    const int64_t error = (int64_t)(ntp - clock->epoch);
+    const uint32_t interval = now - clock->last_sync;
+    clock->error = (int32_t)clamp(error, INT32_MAX);
+    clock->last_sync = now;
+    if (error > WALLCLOCK_STEP_THRESHOLD || error < -WALLCLOCK_STEP_THRESHOLD)
+    {
+        clock->epoch = ntp;
+        clock->fraction = 0;
+        clock->slew = 0;
+        clock->steps++;
+        return;
+    }
+    if (interval > 0)
+    {
+        const int64_t missed = error * WALLCLOCK_NS_PER_MS - clock->slew;
+        clock->drift = (int32_t)clamp(clock->drift + missed / interval / 2, WALLCLOCK_DRIFT_MAX);
+    }
+    clock->slew = error * WALLCLOCK_NS_PER_MS;
+}
+
+// Advances the clock to now (hal_millis()), corrected for drift and
+// slewing, and samples the system time when it is due. To be called
+// often, each call slews at most WALLCLOCK_SLEW_PPM of the time since
+// the last one.
+void wallclock_update(wallclock_t *clock, const uint32_t now)
+{
+    const uint32_t elapsed = now - clock->updated;
+    const int64_t slew = clamp(clock->slew, (int64_t)elapsed * WALLCLOCK_SLEW_PPM);
+
+    clock->slew -= slew;
+    clock->fraction += (int64_t)elapsed * clock->drift + slew;
+    const int64_t whole = clock->fraction / WALLCLOCK_NS_PER_MS;
+    clock->fraction -= whole * WALLCLOCK_NS_PER_MS;
+    clock->epoch += elapsed + whole;
+    clock->updated = now;
+
+    if (now - clock->last_sync >= (clock->synced ? WALLCLOCK_SYNC_INTERVAL : WALLCLOCK_RETRY_INTERVAL))
+    {
+        wallclock_sync(clock, now);
+    }
+}
+
+// The epoch time of a hal_millis() timestamp within about 24 days of
+// the last update, WALLCLOCK_UNSYNCED while the time is not known.
+uint64_t wallclock_time(const wallclock_t *clock, const uint32_t millis)
+{
+    return clock->synced ? clock->epoch + (int32_t)(millis - clock->updated) : WALLCLOCK_UNSYNCED;
+}
@@ -0,0 +1,128 @@
+/*
+ * test_main.cpp
+ *
+ * Presence table: lookups after updates, and expiry deleting entries
+ * from the middle of long probe runs without losing the ones behind
+ * them (presence_remove() shifts them back, there are no tombstones).
+ */
+
+#include <string.h>
+#include <unity.h>
+#include "presence.h"
+
+// Fills 9 of 10 of the entries the table takes, probe runs are long and
+// some wrap around the end of the slot array.
+#define TEST_PRESENCE_BADGES (PRESENCE_TABLE_MAX_ENTRIES * 9 / 10)
+
+static presence_table_t table;
+
+// The address of a badge, its number scrambled (one to one) so that
+// homes collide as they do for real addresses; consecutive ones would
+// each get a slot of their own.
+static void badge_address(const uint32_t badge, uint8_t *address)
+{
+    uint32_t bits = badge * 0x9e3779b1UL;
+    bits ^= bits >> 15;
+    bits *= 0x2c1b3c6dUL;
+    bits ^= bits >> 12;
+    const uint8_t scrambled[HAL_BLE_ADDRESS_LENGTH] = {0xc0, 0xff, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits};
+    memcpy(address, scrambled, HAL_BLE_ADDRESS_LENGTH);
+}
+
+// Badges 1 to count, the odd ones seen at time, the even ones at 0.
+static void fill(const uint32_t count, const uint32_t time)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    for (uint32_t badge = 1; badge <= count; badge++)
+    {
+        badge_address(badge, address);
+        TEST_ASSERT_NOT_NULL(presence_update(&table, address, -60, badge % 2 ? time : 0));
+    }
+}
+
+static bool present(const uint32_t badge)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    badge_address(badge, address);
+    presence_entry_t *entry = presence_find(&table, address);
+    return entry != NULL && entry->key == presence_key(address);
+}
+
+void setUp(void)
+{
+    presence_init(&table);
+}
+
+void tearDown(void)
+{
+}
+
+void test_update_finds_the_same_entry(void)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    badge_address(1, address);
+    presence_entry_t *entry = presence_update(&table, address, -70, 100);
+    TEST_ASSERT_EQUAL_PTR(entry, presence_update(&table, address, -50, 200));
+    TEST_ASSERT_EQUAL_PTR(entry, presence_find(&table, address));
+    TEST_ASSERT_EQUAL_UINT32(1, table.count);
+    TEST_ASSERT_EQUAL_UINT32(2, entry->hits);
+    TEST_ASSERT_EQUAL_INT8(-70, entry->rssi_min);
+    TEST_ASSERT_EQUAL_INT8(-50, entry->rssi_max);
+    TEST_ASSERT_EQUAL_UINT32(100, entry->first_seen);
+    TEST_ASSERT_EQUAL_UINT32(200, entry->last_seen);
+}
+
+void test_full_table_rejects_new_badges(void)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    fill(PRESENCE_TABLE_MAX_ENTRIES, 0);
+    badge_address(PRESENCE_TABLE_MAX_ENTRIES + 1, address);
+    TEST_ASSERT_NULL(presence_update(&table, address, -60, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, table.rejected);
+    TEST_ASSERT_TRUE(present(PRESENCE_TABLE_MAX_ENTRIES));
+}
+
+void test_expire_keeps_the_rest_of_each_probe_run(void)
+{
+    fill(TEST_PRESENCE_BADGES, 20000);
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES / 2, presence_expire(&table, 20000, PRESENCE_STALE_AFTER));
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES - TEST_PRESENCE_BADGES / 2, table.count);
+    for (uint32_t badge = 1; badge <= TEST_PRESENCE_BADGES; badge++)
+    {
+        TEST_ASSERT_EQUAL(badge % 2 == 1, present(badge));
+    }
+
+    // Every entry is reachable from its home slot: the ones expired come
+    // back in a slot of their own, nothing is found twice.
+    fill(TEST_PRESENCE_BADGES, 20000);
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES, table.count);
+    size_t cursor = 0;
+    uint32_t entries = 0;
+    while (presence_next(&table, &cursor) != NULL)
+    {
+        entries++;
+    }
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES, entries);
+}
+
+void test_expire_everything_empties_the_table(void)
+{
+    fill(TEST_PRESENCE_BADGES, 0);
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES, presence_expire(&table, PRESENCE_STALE_AFTER + 1, PRESENCE_STALE_AFTER));
+    TEST_ASSERT_EQUAL_UINT32(0, table.count);
+    TEST_ASSERT_EQUAL_UINT32(TEST_PRESENCE_BADGES, table.expired);
+    for (size_t slot = 0; slot < PRESENCE_TABLE_CAPACITY; slot++)
+    {
+        TEST_ASSERT_EQUAL_UINT64(0, table.entries[slot].key);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_update_finds_the_same_entry);
+    RUN_TEST(test_full_table_rejects_new_badges);
+    RUN_TEST(test_expire_keeps_the_rest_of_each_probe_run);
+    RUN_TEST(test_expire_everything_empties_the_table);
+    return UNITY_END();
+}
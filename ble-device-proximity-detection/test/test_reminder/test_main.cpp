@@ -0,0 +1,218 @@
+/*
+ * test_main.cpp
+ *
+ * Compliance reminder decisions of the aggregation stage: which visits
+ * of a badge call for a reminder, and when.
+ */
+
+#include <string.h>
+#include <unity.h>
+#include "reminder.h"
+
+static reminder_t reminder;
+
+static void badge_address(const uint32_t badge, uint8_t *address)
+{
+    const uint8_t prefix[HAL_BLE_ADDRESS_LENGTH] = {0xc0, 0xff, 0xee, (uint8_t)(badge >> 16), (uint8_t)(badge >> 8), (uint8_t)badge};
+    memcpy(address, prefix, HAL_BLE_ADDRESS_LENGTH);
+}
+
+static void badge_event(const uint32_t badge, const event_type_t type, const proximity_zone_t zone, const uint32_t time)
+{
+    event_t event = {};
+    event.type = type;
+    badge_address(badge, event.address);
+    event.zone = zone;
+    event.time = time;
+    reminder_event(&reminder, &event);
+}
+
+// A zone change as events_update() reports it.
+static void badge_moves(const uint32_t badge, const proximity_zone_t from, const proximity_zone_t to, const uint32_t time)
+{
+    if (from != PROXIMITY_AWAY)
+    {
+        badge_event(badge, EVENT_LEAVE, from, time);
+    }
+    if (to != PROXIMITY_AWAY)
+    {
+        badge_event(badge, EVENT_ENTER, to, time);
+    }
+}
+
+// The reminders due at now; badge and time get those of the last.
+static int due(const uint32_t now, uint32_t *badge = NULL, uint32_t *time = NULL)
+{
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH];
+    uint32_t at;
+    int reminders = 0;
+    while (reminder_due(&reminder, now, address, &at))
+    {
+        reminders++;
+        if (badge != NULL)
+        {
+            *badge = (uint32_t)address[3] << 16 | (uint32_t)address[4] << 8 | address[5];
+        }
+        if (time != NULL)
+        {
+            *time = at;
+        }
+    }
+    return reminders;
+}
+
+void setUp(void)
+{
+    reminder_init(&reminder);
+}
+
+void tearDown(void)
+{
+}
+
+void test_entering_alone_does_not_remind(void)
+{
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    TEST_ASSERT_EQUAL_INT(0, due(1000));
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + REMINDER_GRACE - 1));
+}
+
+void test_leaving_without_dispenser_use(void)
+{
+    uint32_t badge = 0, time = 0;
+    badge_moves(7, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    badge_moves(7, REMINDER_ZONE, PROXIMITY_AWAY, 5000);
+    TEST_ASSERT_EQUAL_INT(1, due(5100, &badge, &time));
+    TEST_ASSERT_EQUAL_UINT32(7, badge);
+    TEST_ASSERT_EQUAL_UINT32(5100, time);
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + REMINDER_GRACE));
+}
+
+void test_dispenser_during_visit_covers_it(void)
+{
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    // To the dispenser and back is not leaving the room.
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_NEAR, 3000);
+    TEST_ASSERT_EQUAL_INT(0, due(3000));
+    badge_event(1, EVENT_DWELL, PROXIMITY_NEAR, 3000 + EVENTS_DWELL_TIME);
+    badge_moves(1, PROXIMITY_NEAR, REMINDER_ZONE, 10000);
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + REMINDER_GRACE));
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 1000 + REMINDER_GRACE + 5000);
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + REMINDER_GRACE + 5000));
+}
+
+void test_near_without_dwell_does_not_cover(void)
+{
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_NEAR, 3000);
+    badge_moves(1, PROXIMITY_NEAR, PROXIMITY_AWAY, 4000);
+    TEST_ASSERT_EQUAL_INT(1, due(4000));
+}
+
+void test_grace_runs_out_in_the_room(void)
+{
+    uint32_t time = 0;
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + REMINDER_GRACE - 1));
+    TEST_ASSERT_EQUAL_INT(1, due(1000 + REMINDER_GRACE + 20, NULL, &time));
+    TEST_ASSERT_EQUAL_UINT32(1000 + REMINDER_GRACE, time);
+    // One reminder a visit.
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + 2 * REMINDER_GRACE));
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 1000 + 2 * REMINDER_GRACE);
+    TEST_ASSERT_EQUAL_INT(0, due(1000 + 2 * REMINDER_GRACE));
+}
+
+void test_dispenser_before_entering_covers_it(void)
+{
+    badge_moves(1, PROXIMITY_AWAY, PROXIMITY_NEAR, 1000);
+    badge_event(1, EVENT_DWELL, PROXIMITY_NEAR, 1000 + EVENTS_DWELL_TIME);
+    badge_moves(1, PROXIMITY_NEAR, PROXIMITY_AWAY, 8000);
+    TEST_ASSERT_EQUAL_INT(0, due(8000));
+
+    // Back within REMINDER_RUB_VALID of the dwell, then after it.
+    const uint32_t back = 1000 + EVENTS_DWELL_TIME + REMINDER_RUB_VALID - 1;
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, back);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, back + 1000);
+    TEST_ASSERT_EQUAL_INT(0, due(back + 1000));
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, back + 2000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, back + 3000);
+    TEST_ASSERT_EQUAL_INT(1, due(back + 3000));
+
+    // Another badge's use does not count.
+    badge_moves(2, PROXIMITY_AWAY, REMINDER_ZONE, back + 4000);
+    badge_moves(2, REMINDER_ZONE, PROXIMITY_AWAY, back + 5000);
+    TEST_ASSERT_EQUAL_INT(1, due(back + 5000));
+}
+
+void test_not_reminded_again_right_away(void)
+{
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 2000);
+    TEST_ASSERT_EQUAL_INT(1, due(2000));
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 3000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 2000 + REMINDER_REPEAT_AFTER - 1);
+    TEST_ASSERT_EQUAL_INT(0, due(2000 + REMINDER_REPEAT_AFTER - 1));
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 2000 + REMINDER_REPEAT_AFTER);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 2000 + REMINDER_REPEAT_AFTER + 1000);
+    TEST_ASSERT_EQUAL_INT(1, due(2000 + REMINDER_REPEAT_AFTER + 1000));
+}
+
+void test_every_badge_due_is_reminded(void)
+{
+    for (uint32_t badge = 1; badge <= 5; badge++)
+    {
+        badge_moves(badge, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    }
+    for (uint32_t badge = 1; badge <= 3; badge++)
+    {
+        badge_moves(badge, REMINDER_ZONE, PROXIMITY_AWAY, 2000);
+    }
+    TEST_ASSERT_EQUAL_INT(3, due(2000));
+    TEST_ASSERT_EQUAL_INT(2, due(1000 + REMINDER_GRACE));
+}
+
+void test_oldest_badge_forgotten(void)
+{
+    badge_event(1, EVENT_DWELL, PROXIMITY_NEAR, 1000);
+    for (uint32_t badge = 2; badge <= REMINDER_BADGES; badge++)
+    {
+        badge_event(badge, EVENT_DWELL, PROXIMITY_NEAR, 1000 + badge);
+    }
+    badge_moves(2, PROXIMITY_AWAY, REMINDER_ZONE, 5000);
+    badge_moves(2, REMINDER_ZONE, PROXIMITY_AWAY, 5500);
+    TEST_ASSERT_EQUAL_INT(0, due(5500));
+
+    // One more badge takes the entry of badge 1, its dispenser use is gone.
+    badge_event(REMINDER_BADGES + 1, EVENT_DWELL, PROXIMITY_NEAR, 6000);
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 7000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 8000);
+    TEST_ASSERT_EQUAL_INT(1, due(8000));
+}
+
+void test_time_wraps(void)
+{
+    badge_event(1, EVENT_DWELL, PROXIMITY_NEAR, UINT32_MAX - 1000);
+    badge_moves(1, PROXIMITY_AWAY, REMINDER_ZONE, 1000);
+    badge_moves(1, REMINDER_ZONE, PROXIMITY_AWAY, 2000);
+    TEST_ASSERT_EQUAL_INT(0, due(2000));
+
+    badge_moves(2, PROXIMITY_AWAY, REMINDER_ZONE, UINT32_MAX - 1000);
+    TEST_ASSERT_EQUAL_INT(0, due(REMINDER_GRACE - 1002));
+    TEST_ASSERT_EQUAL_INT(1, due(REMINDER_GRACE - 1001));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_entering_alone_does_not_remind);
+    RUN_TEST(test_leaving_without_dispenser_use);
+    RUN_TEST(test_dispenser_during_visit_covers_it);
+    RUN_TEST(test_near_without_dwell_does_not_cover);
+    RUN_TEST(test_grace_runs_out_in_the_room);
+    RUN_TEST(test_dispenser_before_entering_covers_it);
+    RUN_TEST(test_not_reminded_again_right_away);
+    RUN_TEST(test_every_badge_due_is_reminded);
+    RUN_TEST(test_oldest_badge_forgotten);
+    RUN_TEST(test_time_wraps);
+    return UNITY_END();
+}
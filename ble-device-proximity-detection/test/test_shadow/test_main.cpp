@@ -0,0 +1,211 @@
+/*
+ * test_main.cpp
+ *
+ * Shadow reporting: zone counts, what an update carries, and the update
+ * becoming the reported state only once AWS IoT accepts it.
+ */
+
+#include <string.h>
+#include <unity.h>
+#include "shadow.h"
+
+static shadow_state_t shadow;
+static const shadow_detect_t detect = {100, 99, 1, "RHS", -50};
+static StaticJsonDocument<SHADOW_UPDATE_SIZE> update;
+static StaticJsonDocument<SHADOW_RESPONSE_FILTER_SIZE> filter;
+static StaticJsonDocument<SHADOW_RESPONSE_DOCUMENT_SIZE> response_document;
+
+static shadow_zones_t zones(const uint16_t room, const uint16_t near)
+{
+    shadow_zones_t counts = {};
+    counts.badges[PROXIMITY_IN_ROOM] = room;
+    counts.badges[PROXIMITY_NEAR] = near;
+    return counts;
+}
+
+// Publishes an update and has it accepted.
+static void accept(const shadow_zones_t *counts, const bool reset, const uint32_t now)
+{
+    const uint32_t token = shadow.sequence;
+    shadow_expect(&shadow, &detect, counts, reset, now);
+    TEST_ASSERT_EQUAL_INT(1, shadow_answer(&shadow, token, true));
+}
+
+static void parse_response(const char *json, shadow_response_t *response)
+{
+    shadow_response_filter(&filter);
+    TEST_ASSERT_FALSE(deserializeJson(response_document, json, DeserializationOption::Filter(filter)));
+    shadow_response(&response_document, response);
+}
+
+void setUp(void)
+{
+    shadow_init(&shadow, SHADOW_RESYNC_INTERVAL);
+}
+
+void tearDown(void)
+{
+}
+
+void test_count_zones_skips_badges_away(void)
+{
+    static presence_table_t presence;
+    const proximity_zone_t zone[] = {PROXIMITY_AWAY, PROXIMITY_IN_ROOM, PROXIMITY_NEAR, PROXIMITY_NEAR, PROXIMITY_IN_ROOM, PROXIMITY_NEAR};
+    uint8_t address[HAL_BLE_ADDRESS_LENGTH] = {0xc0, 0xff, 0xee, 0, 0, 0};
+    shadow_zones_t counts;
+
+    presence_init(&presence);
+    for (int i = 0; i < (int)(sizeof(zone) / sizeof(zone[0])); i++)
+    {
+        address[HAL_BLE_ADDRESS_LENGTH - 1] = (uint8_t)(i + 1);
+        presence_update(&presence, address, -60, 0)->zone = zone[i];
+    }
+    shadow_count_zones(&presence, &counts);
+    TEST_ASSERT_EQUAL_UINT16(2, counts.badges[PROXIMITY_IN_ROOM]);
+    TEST_ASSERT_EQUAL_UINT16(3, counts.badges[PROXIMITY_NEAR]);
+}
+
+void test_changes_count_moves_twice(void)
+{
+    const shadow_zones_t before = zones(3, 2);
+    accept(&before, true, 0);
+
+    shadow_zones_t after = zones(4, 2);
+    TEST_ASSERT_EQUAL_INT(1, shadow_changes(&shadow, &after));
+    after = zones(2, 3);
+    TEST_ASSERT_EQUAL_INT(2, shadow_changes(&shadow, &after));
+    TEST_ASSERT_EQUAL_INT(0, shadow_changes(&shadow, &before));
+}
+
+void test_resync_carries_everything(void)
+{
+    const shadow_zones_t counts = zones(3, 2);
+    shadow_build_update(&shadow, &detect, &counts, true, &update);
+
+    TEST_ASSERT_EQUAL_STRING("1", update["clientToken"].as<const char *>());
+    JsonObjectConst reported = update["state"]["reported"].as<JsonObjectConst>();
+    TEST_ASSERT_EQUAL_INT(100, reported["detect"]["interval"].as<int>());
+    TEST_ASSERT_EQUAL_INT(99, reported["detect"]["window"].as<int>());
+    TEST_ASSERT_EQUAL_INT(1, reported["detect"]["duration"].as<int>());
+    TEST_ASSERT_EQUAL_STRING("RHS", reported["detect"]["name_prefix"].as<const char *>());
+    TEST_ASSERT_EQUAL_INT(-50, reported["detect"]["rssi_threshold"].as<int>());
+    TEST_ASSERT_EQUAL_INT(3, reported["zones"]["room"].as<int>());
+    TEST_ASSERT_EQUAL_INT(2, reported["zones"]["near"].as<int>());
+    TEST_ASSERT_TRUE(reported.containsKey("detected"));
+    TEST_ASSERT_TRUE(reported["detected"].isNull());
+    TEST_ASSERT_TRUE(measureJson(update) <= SHADOW_UPDATE_BYTES);
+}
+
+void test_delta_carries_only_what_changed(void)
+{
+    const shadow_zones_t counts = zones(3, 2);
+    accept(&counts, true, 0);
+
+    shadow_build_update(&shadow, &detect, &counts, false, &update);
+    TEST_ASSERT_TRUE(update["state"]["reported"].as<JsonObjectConst>().size() == 0);
+
+    const shadow_zones_t moved = zones(2, 3);
+    shadow_detect_t changed = detect;
+    changed.rssi_threshold = -55;
+    shadow_build_update(&shadow, &changed, &moved, false, &update);
+    JsonObjectConst reported = update["state"]["reported"].as<JsonObjectConst>();
+    TEST_ASSERT_EQUAL_STRING("2", update["clientToken"].as<const char *>());
+    TEST_ASSERT_TRUE(reported["detect"].as<JsonObjectConst>().size() == 1);
+    TEST_ASSERT_EQUAL_INT(-55, reported["detect"]["rssi_threshold"].as<int>());
+    TEST_ASSERT_EQUAL_INT(2, reported["zones"]["room"].as<int>());
+    TEST_ASSERT_EQUAL_INT(3, reported["zones"]["near"].as<int>());
+    TEST_ASSERT_FALSE(reported.containsKey("detected"));
+}
+
+void test_accepted_update_is_reported_state(void)
+{
+    const shadow_zones_t counts = zones(3, 2);
+    TEST_ASSERT_TRUE(shadow_resync_due(&shadow, 0));
+    shadow_expect(&shadow, &detect, &counts, true, 10);
+    TEST_ASSERT_EQUAL_UINT32(1, shadow.pending.token);
+    TEST_ASSERT_EQUAL_UINT32(2, shadow.sequence);
+    TEST_ASSERT_TRUE(shadow_waiting(&shadow, true, 100));
+
+    // Nothing is reported before the answer, and only the answer with
+    // the token of the update counts.
+    TEST_ASSERT_EQUAL_UINT16(0, shadow.zones.badges[PROXIMITY_IN_ROOM]);
+    TEST_ASSERT_EQUAL_INT(-1, shadow_answer(&shadow, 5, true));
+    TEST_ASSERT_EQUAL_INT(1, shadow_answer(&shadow, 1, true));
+    TEST_ASSERT_FALSE(shadow_waiting(&shadow, true, 200));
+    TEST_ASSERT_EQUAL_UINT16(3, shadow.zones.badges[PROXIMITY_IN_ROOM]);
+    TEST_ASSERT_TRUE(shadow.synced);
+    TEST_ASSERT_FALSE(shadow_resync_due(&shadow, 200));
+    TEST_ASSERT_TRUE(shadow_resync_due(&shadow, 10 + SHADOW_RESYNC_INTERVAL));
+    TEST_ASSERT_EQUAL_UINT32(1, shadow.accepted);
+}
+
+void test_rejected_update_leaves_reported_state(void)
+{
+    const shadow_zones_t counts = zones(3, 2);
+    accept(&counts, true, 0);
+
+    const shadow_zones_t more = zones(4, 2);
+    shadow_report_detect(&shadow);
+    shadow_expect(&shadow, &detect, &more, false, 1000);
+    TEST_ASSERT_FALSE(shadow.detect_stale);
+    TEST_ASSERT_EQUAL_INT(0, shadow_answer(&shadow, 2, false));
+    TEST_ASSERT_EQUAL_INT(-1, shadow_answer(&shadow, 2, true));
+
+    // Retried once the timeout passed, all detect settings again.
+    TEST_ASSERT_TRUE(shadow_waiting(&shadow, true, 1000 + SHADOW_ANSWER_TIMEOUT - 1));
+    TEST_ASSERT_FALSE(shadow_waiting(&shadow, true, 1000 + SHADOW_ANSWER_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(0, shadow.unanswered);
+    TEST_ASSERT_TRUE(shadow.detect_stale);
+    TEST_ASSERT_EQUAL_UINT16(3, shadow.zones.badges[PROXIMITY_IN_ROOM]);
+    TEST_ASSERT_EQUAL_INT(1, shadow_changes(&shadow, &more));
+}
+
+void test_unanswered_timeout_runs_online_only(void)
+{
+    const shadow_zones_t counts = zones(3, 2);
+    shadow_expect(&shadow, &detect, &counts, true, 50000);
+    TEST_ASSERT_TRUE(shadow_waiting(&shadow, false, 200000));
+    TEST_ASSERT_TRUE(shadow_waiting(&shadow, true, 200000 + SHADOW_ANSWER_TIMEOUT - 1));
+    TEST_ASSERT_FALSE(shadow_waiting(&shadow, true, 200000 + SHADOW_ANSWER_TIMEOUT));
+    TEST_ASSERT_EQUAL_UINT32(1, shadow.unanswered);
+    TEST_ASSERT_FALSE(shadow.synced);
+}
+
+void test_response_takes_code_message_and_token(void)
+{
+    shadow_response_t response;
+    parse_response("{\"state\":{\"reported\":{}},\"clientToken\":\"42\",\"version\":7}", &response);
+    TEST_ASSERT_TRUE(response.tokened);
+    TEST_ASSERT_EQUAL_UINT32(42, response.token);
+    TEST_ASSERT_EQUAL_INT(0, response.code);
+
+    parse_response("{\"code\":400,\"message\":\"Payload contains invalid json\",\"clientToken\":\"7\"}", &response);
+    TEST_ASSERT_TRUE(response.tokened);
+    TEST_ASSERT_EQUAL_UINT32(7, response.token);
+    TEST_ASSERT_EQUAL_INT(400, response.code);
+    TEST_ASSERT_EQUAL_STRING("Payload contains invalid json", response.message);
+
+    // Tokens the gateway did not write are none.
+    parse_response("{\"clientToken\":\"7a\"}", &response);
+    TEST_ASSERT_FALSE(response.tokened);
+    parse_response("{\"clientToken\":\"-7\"}", &response);
+    TEST_ASSERT_FALSE(response.tokened);
+    parse_response("{\"code\":413,\"message\":\"The payload exceeds the maximum size allowed\"}", &response);
+    TEST_ASSERT_FALSE(response.tokened);
+    TEST_ASSERT_EQUAL_INT(413, response.code);
+    TEST_ASSERT_EQUAL_STRING("The payload exceeds the maximum size allowed", response.message);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_count_zones_skips_badges_away);
+    RUN_TEST(test_changes_count_moves_twice);
+    RUN_TEST(test_resync_carries_everything);
+    RUN_TEST(test_delta_carries_only_what_changed);
+    RUN_TEST(test_accepted_update_is_reported_state);
+    RUN_TEST(test_rejected_update_leaves_reported_state);
+    RUN_TEST(test_unanswered_timeout_runs_online_only);
+    RUN_TEST(test_response_takes_code_message_and_token);
+    return UNITY_END();
+}
@@ -0,0 +1,233 @@
+/*
+ * test_main.cpp
+ *
+ * Store-and-forward log on the file-backed SD card stand-in: CRC-32,
+ * replay in order and at least once, torn and damaged records skipped,
+ * the oldest segments evicted when the card fills up.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <unity.h>
+#include "hal.h"
+#include "hal_native.h"
+#include "store.h"
+
+#define TEST_STORE_ROOT "/tmp/hhcm-test-store"
+
+static char root[64];
+static store_t store;
+static uint8_t payload[STORE_RECORD_MAX];
+static uint8_t data[STORE_RECORD_MAX];
+
+// Payload of record number seq: the number, then bytes derived from it.
+static size_t fill_payload(const uint32_t seq, const size_t length)
+{
+    memcpy(payload, &seq, sizeof(seq));
+    for (size_t i = sizeof(seq); i < length; i++)
+    {
+        payload[i] = (uint8_t)(seq + i);
+    }
+    return length;
+}
+
+static void append(const uint32_t first, const uint32_t end, const size_t length)
+{
+    for (uint32_t seq = first; seq < end; seq++)
+    {
+        TEST_ASSERT_TRUE(store_append(&store, STORE_KIND_EVENTS, payload, fill_payload(seq, length)));
+    }
+}
+
+// Replays everything pending, checking each record and that they come
+// in order. Returns the number replayed, first and last the sequence
+// numbers of the first and last, gaps the places records are missing.
+static uint32_t replay(uint32_t *first, uint32_t *last, uint32_t *gaps = NULL)
+{
+    uint8_t kind;
+    size_t length;
+    uint32_t count = 0;
+    uint32_t missing = 0;
+    while ((length = store_peek(&store, &kind, data, sizeof(data))) > 0)
+    {
+        uint32_t seq;
+        memcpy(&seq, data, sizeof(seq));
+        fill_payload(seq, length);
+        TEST_ASSERT_EQUAL_UINT8(STORE_KIND_EVENTS, kind);
+        TEST_ASSERT_EQUAL_MEMORY(payload, data, length);
+        if (count > 0)
+        {
+            TEST_ASSERT_TRUE(seq > *last);
+            missing += seq != *last + 1;
+        }
+        else
+        {
+            *first = seq;
+        }
+        *last = seq;
+        count++;
+        store_advance(&store, length);
+    }
+    if (gaps != NULL)
+    {
+        *gaps = missing;
+    }
+    else
+    {
+        TEST_ASSERT_EQUAL_UINT32(0, missing);
+    }
+    return count;
+}
+
+static void remove_file(const char *name, void *context)
+{
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", STORE_DIRECTORY, name);
+    hal_storage_remove(path);
+}
+
+static void count_file(const char *name, void *context)
+{
+    (*(uint32_t *)context)++;
+}
+
+static uint32_t segments()
+{
+    uint32_t count = 0;
+    hal_storage_list(STORE_DIRECTORY, count_file, &count);
+    return count;
+}
+
+void setUp(void)
+{
+    snprintf(root, sizeof(root), "%s-%d", TEST_STORE_ROOT, (int)getpid());
+    hal_native_storage_set_root(root);
+    hal_native_storage_set_capacity(HAL_NATIVE_STORAGE_CAPACITY);
+    hal_storage_init(STORE_DIRECTORY);
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    TEST_ASSERT_TRUE(store_init(&store));
+}
+
+void tearDown(void)
+{
+    char directory[96];
+    hal_storage_list(STORE_DIRECTORY, remove_file, NULL);
+    snprintf(directory, sizeof(directory), "%s%s", root, STORE_DIRECTORY);
+    rmdir(directory);
+    rmdir(root);
+}
+
+void test_crc32_check_value(void)
+{
+    TEST_ASSERT_EQUAL_HEX32(0xcbf43926, store_crc32(0, (const uint8_t *)"123456789", 9));
+    // Computed in pieces, as a record's header and payload are.
+    TEST_ASSERT_EQUAL_HEX32(0xcbf43926, store_crc32(store_crc32(0, (const uint8_t *)"123", 3), (const uint8_t *)"456789", 6));
+}
+
+void test_replay_in_order_at_least_once(void)
+{
+    uint8_t kind;
+    uint32_t first = 0, last = 0;
+    append(0, 100, 300);
+    TEST_ASSERT_TRUE(store_pending(&store));
+
+    // Not advanced, the broker did not take it: the same record again.
+    TEST_ASSERT_EQUAL_UINT32(300, store_peek(&store, &kind, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_UINT32(300, store_peek(&store, &kind, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_UINT32(100, replay(&first, &last));
+    TEST_ASSERT_EQUAL_UINT32(0, first);
+    TEST_ASSERT_EQUAL_UINT32(99, last);
+    TEST_ASSERT_FALSE(store_pending(&store));
+    TEST_ASSERT_EQUAL_UINT32(0, segments());
+}
+
+void test_torn_tail_skipped_after_restart(void)
+{
+    uint32_t first = 0, last = 0, gaps = 0;
+    append(0, 10, 300);
+
+    // The power fails halfway through the next record.
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%08lu.seg", STORE_DIRECTORY, (unsigned long)store.last);
+    const uint8_t header[STORE_HEADER_SIZE] = {0xa5, STORE_KIND_EVENTS, 300 & 0xff, 300 >> 8, 1, 2, 3, 4};
+    TEST_ASSERT_TRUE(hal_storage_append(path, header, sizeof(header)));
+    TEST_ASSERT_TRUE(hal_storage_append(path, payload, 150));
+
+    TEST_ASSERT_TRUE(store_init(&store));
+    append(11, 20, 300);
+    TEST_ASSERT_EQUAL_UINT32(19, replay(&first, &last, &gaps));
+    TEST_ASSERT_EQUAL_UINT32(0, first);
+    TEST_ASSERT_EQUAL_UINT32(19, last);
+    TEST_ASSERT_EQUAL_UINT32(1, gaps);
+    TEST_ASSERT_EQUAL_UINT32(1, store.corrupt);
+    TEST_ASSERT_FALSE(store_pending(&store));
+}
+
+void test_damaged_record_skips_rest_of_segment(void)
+{
+    uint32_t first = 0, last = 0;
+    append(0, 10, 300);
+
+    // A bit flips in the payload of the fifth record: the CRC no longer
+    // matches, the records behind it in the segment cannot be trusted.
+    char path[STORE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%08lu.seg", STORE_DIRECTORY, (unsigned long)store.last);
+    const uint32_t offset = 4 * (STORE_HEADER_SIZE + 300) + STORE_HEADER_SIZE + 100;
+    uint8_t segment[10 * (STORE_HEADER_SIZE + 300)];
+    TEST_ASSERT_EQUAL_UINT32(sizeof(segment), hal_storage_read(path, 0, segment, sizeof(segment)));
+    segment[offset] ^= 0x10;
+    TEST_ASSERT_TRUE(hal_storage_remove(path));
+    TEST_ASSERT_TRUE(hal_storage_append(path, segment, sizeof(segment)));
+
+    TEST_ASSERT_EQUAL_UINT32(4, replay(&first, &last));
+    TEST_ASSERT_EQUAL_UINT32(3, last);
+    TEST_ASSERT_EQUAL_UINT32(1, store.corrupt);
+    TEST_ASSERT_FALSE(store_pending(&store));
+
+    // Appending goes on in a new segment.
+    append(10, 12, 300);
+    TEST_ASSERT_EQUAL_UINT32(2, replay(&first, &last));
+    TEST_ASSERT_EQUAL_UINT32(10, first);
+}
+
+void test_eviction_beyond_max_segments(void)
+{
+    uint32_t first = 0, last = 0;
+    const uint32_t per_segment = STORE_SEGMENT_SIZE / (STORE_HEADER_SIZE + STORE_RECORD_MAX);
+    const uint32_t records = (STORE_MAX_SEGMENTS + 4) * per_segment;
+    append(0, records, STORE_RECORD_MAX);
+
+    TEST_ASSERT_TRUE(store.evicted > 0);
+    TEST_ASSERT_TRUE(segments() <= STORE_MAX_SEGMENTS);
+    const uint32_t replayed = replay(&first, &last);
+    TEST_ASSERT_EQUAL_UINT32(records - 1, last);
+    TEST_ASSERT_EQUAL_UINT32(records - first, replayed);
+    TEST_ASSERT_EQUAL_UINT32(store.evicted * per_segment, first);
+}
+
+void test_eviction_when_card_full(void)
+{
+    uint32_t first = 0, last = 0;
+    const uint32_t per_segment = STORE_SEGMENT_SIZE / (STORE_HEADER_SIZE + STORE_RECORD_MAX);
+    hal_native_storage_set_capacity(8 * STORE_SEGMENT_SIZE);
+    append(0, 20 * per_segment, STORE_RECORD_MAX);
+
+    TEST_ASSERT_TRUE(store.evicted >= 12);
+    TEST_ASSERT_TRUE(segments() <= 8);
+    replay(&first, &last);
+    TEST_ASSERT_EQUAL_UINT32(20 * per_segment - 1, last);
+    TEST_ASSERT_EQUAL_UINT32(store.evicted * per_segment, first);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_crc32_check_value);
+    RUN_TEST(test_replay_in_order_at_least_once);
+    RUN_TEST(test_torn_tail_skipped_after_restart);
+    RUN_TEST(test_damaged_record_skips_rest_of_segment);
+    RUN_TEST(test_eviction_beyond_max_segments);
+    RUN_TEST(test_eviction_when_card_full);
+    return UNITY_END();
+}